@@ -0,0 +1,890 @@
+// Copyright 2020 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+// Measures the throughput of the DER encoders, in bytes and nodes (encoded
+// protobuf messages) per second, on inputs generated from fixed seeds.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <random>
+#include <string>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+#include <google/protobuf/message.h>
+#include <google/protobuf/text_format.h>
+
+#include "asn1_pdu.pb.h"
+#include "asn1_pdu_to_der.h"
+#include "asn1_universal_types.pb.h"
+#include "asn1_universal_types_to_der.h"
+#include "common.h"
+#include "der_dedupe.h"
+#include "der_mutator.h"
+#include "encoding_cache.h"
+#include "flat_der_tree.h"
+#include "incremental_pdu_to_der.h"
+#include "stream_writer.h"
+#include "x509_certificate.pb.h"
+#include "x509_certificate_to_der.h"
+
+namespace {
+
+using asn1_pdu::PDU;
+using google::protobuf::FieldDescriptor;
+using google::protobuf::Message;
+using google::protobuf::Reflection;
+
+// Returns the number of messages in |message|, including itself.
+size_t CountNodes(const Message& message) {
+  size_t num_nodes = 0;
+  // Nested PDUs may be deeper than the native stack allows to recurse.
+  std::vector<const Message*> stack = {&message};
+  while (!stack.empty()) {
+    const Message* m = stack.back();
+    stack.pop_back();
+    ++num_nodes;
+    const Reflection* reflection = m->GetReflection();
+    std::vector<const FieldDescriptor*> fields;
+    reflection->ListFields(*m, &fields);
+    for (const FieldDescriptor* field : fields) {
+      if (field->cpp_type() != FieldDescriptor::CPPTYPE_MESSAGE) {
+        continue;
+      }
+      if (field->is_repeated()) {
+        for (int i = 0; i < reflection->FieldSize(*m, field); ++i) {
+          stack.push_back(&reflection->GetRepeatedMessage(*m, field, i));
+        }
+      } else {
+        stack.push_back(&reflection->GetMessage(*m, field));
+      }
+    }
+  }
+  return num_nodes;
+}
+
+// Reports the throughput of encoding |message| to |size| bytes on every
+// iteration of |state|.
+void SetThroughput(benchmark::State& state,
+                   const Message& message,
+                   size_t size) {
+  state.SetBytesProcessed(state.iterations() * size);
+  state.counters["nodes"] = benchmark::Counter(
+      state.iterations() * CountNodes(message), benchmark::Counter::kIsRate);
+}
+
+std::string RandomBytes(std::mt19937& rng, size_t len) {
+  std::string bytes(len, '\0');
+  for (char& byte : bytes) {
+    byte = static_cast<char>(rng());
+  }
+  return bytes;
+}
+
+// Sets |pdu| to a PDU with a random identifier and length form, whose value is
+// |val_bits| if it is not empty.
+void SetRandomHeader(std::mt19937& rng, const std::string& val_bits, PDU* pdu) {
+  asn1_pdu::Identifier* id = pdu->mutable_id();
+  id->set_id_class(static_cast<asn1_pdu::Class>(rng() % 4));
+  id->set_encoding(val_bits.empty() ? asn1_pdu::Constructed
+                                    : asn1_pdu::Primitive);
+  id->mutable_tag_num()->set_low_tag_num(
+      static_cast<asn1_pdu::LowTagNumber>(rng() % 31));
+  if (rng() % 8 == 0) {
+    id->mutable_tag_num()->set_high_tag_num(31 + rng() % 100000);
+  }
+  pdu->mutable_len();
+  if (val_bits.empty() && rng() % 8 == 0) {
+    pdu->mutable_len()->set_indefinite_form(true);
+  }
+  if (!val_bits.empty()) {
+    pdu->mutable_val()->add_val_array()->set_val_bits(val_bits);
+  }
+}
+
+// A PDU with |num_children| primitive children.
+PDU FlatPDU(size_t num_children) {
+  std::mt19937 rng(1);
+  PDU pdu;
+  SetRandomHeader(rng, std::string(), &pdu);
+  for (size_t i = 0; i < num_children; ++i) {
+    PDU* child = pdu.mutable_val()->add_val_array()->mutable_pdu();
+    SetRandomHeader(rng, RandomBytes(rng, 1 + rng() % 16), child);
+  }
+  return pdu;
+}
+
+// A chain of |depth| PDUs, each nested in the one before it.
+PDU DeepPDU(size_t depth) {
+  std::mt19937 rng(2);
+  PDU pdu;
+  PDU* current = &pdu;
+  for (size_t i = 1; i < depth; ++i) {
+    SetRandomHeader(rng, std::string(), current);
+    current = current->mutable_val()->add_val_array()->mutable_pdu();
+  }
+  SetRandomHeader(rng, RandomBytes(rng, 8), current);
+  return pdu;
+}
+
+// A tree of PDUs |depth| levels deep, where each constructed PDU has |width|
+// children.
+PDU WidePDU(size_t width, size_t depth) {
+  std::mt19937 rng(3);
+  PDU pdu;
+  std::vector<std::pair<PDU*, size_t>> stack = {{&pdu, 1}};
+  while (!stack.empty()) {
+    PDU* current = stack.back().first;
+    size_t level = stack.back().second;
+    stack.pop_back();
+    if (level == depth) {
+      SetRandomHeader(rng, RandomBytes(rng, 1 + rng() % 16), current);
+      continue;
+    }
+    SetRandomHeader(rng, std::string(), current);
+    for (size_t i = 0; i < width; ++i) {
+      stack.push_back(
+          {current->mutable_val()->add_val_array()->mutable_pdu(), level + 1});
+    }
+  }
+  return pdu;
+}
+
+// A PDU with a few children holding |value_len| byte values each.
+PDU LargeValuePDU(size_t value_len) {
+  std::mt19937 rng(4);
+  PDU pdu;
+  SetRandomHeader(rng, std::string(), &pdu);
+  for (size_t i = 0; i < 4; ++i) {
+    PDU* child = pdu.mutable_val()->add_val_array()->mutable_pdu();
+    SetRandomHeader(rng, RandomBytes(rng, value_len), child);
+  }
+  return pdu;
+}
+
+// Like |LargeValuePDU|, but the values are a 16 byte pattern repeated to
+// |value_len| bytes, in a |RepeatedBytes|.
+PDU RepeatedValuePDU(size_t value_len) {
+  std::mt19937 rng(4);
+  PDU pdu;
+  SetRandomHeader(rng, std::string(), &pdu);
+  for (size_t i = 0; i < 4; ++i) {
+    PDU* child = pdu.mutable_val()->add_val_array()->mutable_pdu();
+    SetRandomHeader(rng, RandomBytes(rng, 16), child);
+    asn1_pdu::ValueElement* element =
+        child->mutable_val()->mutable_val_array(0);
+    element->set_val_bits(std::string());
+    element->mutable_repeated_bits()->set_pattern(RandomBytes(rng, 16));
+    element->mutable_repeated_bits()->set_count(value_len / 16);
+  }
+  return pdu;
+}
+
+void SetObjectIdentifier(std::mt19937& rng,
+                         asn1_universal_types::ObjectIdentifier* oid) {
+  oid->set_root(asn1_universal_types::RN_VAL_1);
+  oid->set_small_identifier(
+      static_cast<asn1_universal_types::SmallIdentifier>(rng() % 40));
+  for (size_t i = 0; i < 6; ++i) {
+    oid->add_subidentifier(rng() % (1 << (7 * (1 + i % 4))));
+  }
+}
+
+void SetTimestamp(std::mt19937& rng, google::protobuf::Timestamp* timestamp) {
+  // Between 1950 and 2050, with a fraction that is encoded (see
+  // |EncodeTimestamp|).
+  timestamp->set_seconds(-631152000 + static_cast<int64_t>(rng() % 3155760000));
+  timestamp->set_nanos(1 + rng() % 999999);
+}
+
+void SetAlgorithmIdentifier(
+    std::mt19937& rng,
+    x509_certificate::AlgorithmIdentifierSequence* alg) {
+  SetRandomHeader(rng, RandomBytes(rng, 9), alg->mutable_object_identifier());
+  SetRandomHeader(rng, std::string(1, '\0'), alg->mutable_parameters());
+}
+
+// A certificate with |num_extensions| extensions, of every kind.
+x509_certificate::X509Certificate Certificate(size_t num_extensions) {
+  std::mt19937 rng(5);
+  x509_certificate::X509Certificate cert;
+  x509_certificate::TBSCertificateSequence* tbs =
+      cert.mutable_tbs_certificate()->mutable_value();
+  tbs->mutable_version()->set_value(x509_certificate::v3);
+  tbs->mutable_serial_number()->mutable_value()->set_val(RandomBytes(rng, 20));
+  SetAlgorithmIdentifier(rng,
+                         tbs->mutable_signature_algorithm()->mutable_value());
+  *tbs->mutable_issuer()->mutable_value() = WidePDU(4, 3);
+  *tbs->mutable_subject()->mutable_value() = WidePDU(4, 3);
+  SetTimestamp(rng, tbs->mutable_validity()
+                        ->mutable_value()
+                        ->mutable_not_before()
+                        ->mutable_value()
+                        ->mutable_utc_time()
+                        ->mutable_time_stamp());
+  SetTimestamp(rng, tbs->mutable_validity()
+                        ->mutable_value()
+                        ->mutable_not_after()
+                        ->mutable_value()
+                        ->mutable_generalized_time()
+                        ->mutable_time_stamp());
+  x509_certificate::SubjectPublicKeyInfoSequence* spki =
+      tbs->mutable_subject_public_key_info()->mutable_value();
+  SetAlgorithmIdentifier(rng, spki->mutable_algorithm_identifier());
+  spki->mutable_subject_public_key()->mutable_value()->set_val(
+      RandomBytes(rng, 256));
+
+  x509_certificate::ExtensionSequence* extensions =
+      tbs->mutable_extensions()->mutable_value();
+  for (size_t i = 0; i < num_extensions; ++i) {
+    x509_certificate::Extension* extension =
+        i == 0 ? extensions->mutable_extension() : extensions->add_extensions();
+    extension->mutable_critical()->set_val(rng() % 2);
+    x509_certificate::RawExtension* raw = extension->mutable_raw_extension();
+    SetObjectIdentifier(rng, raw->mutable_extn_id());
+    raw->mutable_extn_value()->set_val(RandomBytes(rng, 16));
+    switch (i % 6) {
+      case 0:
+        extension->mutable_authority_key_identifier()
+            ->mutable_key_identifier()
+            ->set_val(RandomBytes(rng, 20));
+        break;
+      case 1:
+        extension->mutable_subject_key_identifier()
+            ->mutable_key_identifier()
+            ->set_val(RandomBytes(rng, 20));
+        break;
+      case 2:
+        extension->mutable_key_usage()->set_digital_signature(true);
+        extension->mutable_key_usage()->set_key_cert_sign(true);
+        break;
+      case 3:
+        extension->mutable_basic_constraints()->mutable_ca()->set_val(true);
+        break;
+      case 4:
+        SetObjectIdentifier(rng, extension->mutable_extended_key_usage()
+                                     ->mutable_key_purpose_id());
+        break;
+      default:
+        // Leaves the raw extension.
+        break;
+    }
+  }
+
+  SetAlgorithmIdentifier(rng,
+                         cert.mutable_signature_algorithm()->mutable_value());
+  cert.mutable_signature_value()->mutable_value()->set_val(
+      RandomBytes(rng, 256));
+  return cert;
+}
+
+// Encodes |pdu| with the vector API, as a fuzz target that encodes one input at
+// a time does.
+void BenchmarkPDUToDER(benchmark::State& state, const PDU& pdu) {
+  asn1_pdu::ASN1PDUToDER encoder;
+  size_t size = 0;
+  for (auto _ : state) {
+    std::vector<uint8_t> der = encoder.PDUToDER(pdu);
+    size = der.size();
+    benchmark::DoNotOptimize(der.data());
+  }
+  SetThroughput(state, pdu, size);
+}
+
+// Encodes |pdu| into a |DERWriter| that is reused between iterations, which
+// leaves out the allocation and copy of the vector API.
+void BenchmarkPDUToDERWriter(benchmark::State& state, const PDU& pdu) {
+  asn1_pdu::ASN1PDUToDER encoder;
+  DERWriter der;
+  for (auto _ : state) {
+    encoder.PDUToDER(pdu, der);
+    benchmark::DoNotOptimize(der.data());
+  }
+  SetThroughput(state, pdu, der.size());
+}
+
+void BM_PDUToDER_Flat(benchmark::State& state) {
+  BenchmarkPDUToDER(state, FlatPDU(state.range(0)));
+}
+BENCHMARK(BM_PDUToDER_Flat)->Arg(16)->Arg(1024);
+
+void BM_PDUToDER_Deep(benchmark::State& state) {
+  BenchmarkPDUToDER(state, DeepPDU(state.range(0)));
+}
+BENCHMARK(BM_PDUToDER_Deep)->Arg(16)->Arg(200)->Arg(10000);
+
+void BM_PDUToDER_Wide(benchmark::State& state) {
+  BenchmarkPDUToDER(state, WidePDU(state.range(0), 3));
+}
+BENCHMARK(BM_PDUToDER_Wide)->Arg(8)->Arg(64);
+
+void BM_PDUToDER_LargeValues(benchmark::State& state) {
+  BenchmarkPDUToDER(state, LargeValuePDU(state.range(0)));
+}
+BENCHMARK(BM_PDUToDER_LargeValues)->Arg(1 << 10)->Arg(1 << 20);
+
+void BM_PDUToDERWriter_Flat(benchmark::State& state) {
+  BenchmarkPDUToDERWriter(state, FlatPDU(state.range(0)));
+}
+BENCHMARK(BM_PDUToDERWriter_Flat)->Arg(16)->Arg(1024);
+
+void BM_PDUToDERWriter_Deep(benchmark::State& state) {
+  BenchmarkPDUToDERWriter(state, DeepPDU(state.range(0)));
+}
+BENCHMARK(BM_PDUToDERWriter_Deep)->Arg(16)->Arg(200)->Arg(10000);
+
+void BM_PDUToDERWriter_Wide(benchmark::State& state) {
+  BenchmarkPDUToDERWriter(state, WidePDU(state.range(0), 3));
+}
+BENCHMARK(BM_PDUToDERWriter_Wide)->Arg(8)->Arg(64);
+
+void BM_PDUToDERWriter_LargeValues(benchmark::State& state) {
+  BenchmarkPDUToDERWriter(state, LargeValuePDU(state.range(0)));
+}
+BENCHMARK(BM_PDUToDERWriter_LargeValues)->Arg(1 << 10)->Arg(1 << 20);
+
+// Encodes a |RepeatedValuePDU| into segments, with a |DERWriter| that copies
+// the repetitions if the second argument is 0, and references a tile of them
+// if it is 1. Compare with |BM_PDUToDERWriter_LargeValues|.
+void BM_PDUToDERWriter_RepeatedValues(benchmark::State& state) {
+  PDU pdu = RepeatedValuePDU(state.range(0));
+  asn1_pdu::ASN1PDUToDER encoder;
+  DERWriter der;
+  der.set_reference_values(state.range(1));
+  std::vector<struct iovec> segments;
+  for (auto _ : state) {
+    encoder.PDUToDER(pdu, der);
+    segments.clear();
+    der.AppendSegmentsTo(segments);
+    benchmark::DoNotOptimize(segments.data());
+  }
+  SetThroughput(state, pdu, der.size());
+}
+BENCHMARK(BM_PDUToDERWriter_RepeatedValues)
+    ->ArgsProduct({{64 << 10, static_cast<int64_t>(asn1_pdu::kMaxRepeatedLen)},
+                   {0, 1}});
+
+// Returns the number of bytes of |segments|.
+size_t SegmentsSize(const std::vector<struct iovec>& segments) {
+  size_t size = 0;
+  for (const struct iovec& segment : segments) {
+    size += segment.iov_len;
+  }
+  return size;
+}
+
+// Encodes a |LargeValuePDU| into segments that reference its values. Compare
+// with |BM_PDUToDERWriter_LargeValues|, which copies them.
+void BM_PDUToSegments_LargeValues(benchmark::State& state) {
+  PDU pdu = LargeValuePDU(state.range(0));
+  std::vector<struct iovec> segments;
+  for (auto _ : state) {
+    asn1_pdu::PDUToSegments(pdu, segments);
+    benchmark::DoNotOptimize(segments.data());
+  }
+  SetThroughput(state, pdu, SegmentsSize(segments));
+}
+BENCHMARK(BM_PDUToSegments_LargeValues)->Arg(1 << 10)->Arg(1 << 20);
+
+// Encodes |pdu| like |BenchmarkPDUToDERWriter|, and also records its TLVs in a
+// |TLVIndex| if the second argument is 1.
+void BM_PDUToDERWriter_TLVIndex(benchmark::State& state) {
+  PDU pdu = WidePDU(state.range(0), 3);
+  asn1_pdu::ASN1PDUToDER encoder;
+  DERWriter der;
+  TLVIndex index;
+  if (state.range(1)) {
+    der.set_tlv_index(&index);
+  }
+  for (auto _ : state) {
+    encoder.PDUToDER(pdu, der);
+    if (state.range(1)) {
+      index.Finish(der.size());
+    }
+    benchmark::DoNotOptimize(der.data());
+  }
+  SetThroughput(state, pdu, der.size());
+}
+BENCHMARK(BM_PDUToDERWriter_TLVIndex)->ArgsProduct({{8, 64}, {0, 1}});
+
+// Encodes a |WidePDU| of width |state.range(0)|, whose encoding takes 710 bytes
+// at width 8 and 43 KiB at width 64, with an |EncodingBudget| of 512 bytes if
+// the second argument is 1, and without a budget otherwise. Encoding with the
+// budget stops once it is exceeded.
+void BM_PDUToDERWriter_Budget(benchmark::State& state) {
+  PDU pdu = WidePDU(state.range(0), 3);
+  asn1_pdu::ASN1PDUToDER encoder;
+  DERWriter der;
+  if (state.range(1)) {
+    EncodingBudget budget;
+    budget.max_size = 512;
+    der.set_budget(budget);
+  }
+  for (auto _ : state) {
+    encoder.PDUToDER(pdu, der);
+    benchmark::DoNotOptimize(der.data());
+  }
+  state.counters["execs"] =
+      benchmark::Counter(state.iterations(), benchmark::Counter::kIsRate);
+}
+BENCHMARK(BM_PDUToDERWriter_Budget)->ArgsProduct({{8, 64}, {0, 1}});
+
+// Encodes a |WidePDU| through a |FlatDERTree|: builds the tree and encodes it
+// every iteration if the second argument is 0, as an input encoded once
+// would, and only encodes it if it is 1, as an input encoded many times would.
+// Compare with |BM_PDUToDERWriter_Wide|.
+void BM_FlatDERTree_PDU(benchmark::State& state) {
+  PDU pdu = WidePDU(state.range(0), 3);
+  FlatDERTree tree;
+  tree.Build(pdu);
+  DERWriter der;
+  for (auto _ : state) {
+    if (!state.range(1)) {
+      tree.Build(pdu);
+    }
+    der.Clear();
+    tree.Encode(der);
+    benchmark::DoNotOptimize(der.data());
+  }
+  SetThroughput(state, pdu, der.size());
+}
+BENCHMARK(BM_FlatDERTree_PDU)->ArgsProduct({{8, 64}, {0, 1}});
+
+// A |StreamWriter::WriteFn| that drops the bytes, as a sink that is never the
+// bottleneck.
+bool DiscardBytes(void* /* context */, const uint8_t* data, size_t /* size */) {
+  benchmark::DoNotOptimize(data);
+  return true;
+}
+
+// Streams a |WidePDU| in BER if the second argument is 0, and in CER if it is
+// 1. Compare with |BM_PDUToDERWriter_Wide|, which needs the whole encoding in
+// memory.
+void BM_StreamPDU(benchmark::State& state) {
+  PDU pdu = WidePDU(state.range(0), 3);
+  StreamWriter out(state.range(1) ? StreamWriter::kCER : StreamWriter::kBER,
+                   DiscardBytes, nullptr);
+  uint64_t start = 0;
+  for (auto _ : state) {
+    start = out.size();
+    asn1_pdu::StreamPDU(pdu, out);
+  }
+  out.Flush();
+  SetThroughput(state, pdu, out.size() - start);
+}
+BENCHMARK(BM_StreamPDU)->ArgsProduct({{8, 64}, {0, 1}});
+
+// Encodes |t| with the |asn1_universal_types::Encode| overload for |T|.
+template <typename T>
+void BenchmarkUniversalType(benchmark::State& state, const T& t) {
+  std::vector<uint8_t> der;
+  for (auto _ : state) {
+    der.clear();
+    asn1_universal_types::Encode(t, der);
+    benchmark::DoNotOptimize(der.data());
+  }
+  SetThroughput(state, t, der.size());
+}
+
+void BM_Encode_Boolean(benchmark::State& state) {
+  asn1_universal_types::Boolean boolean;
+  boolean.set_val(true);
+  BenchmarkUniversalType(state, boolean);
+}
+BENCHMARK(BM_Encode_Boolean);
+
+void BM_Encode_Integer(benchmark::State& state) {
+  std::mt19937 rng(6);
+  asn1_universal_types::Integer integer;
+  integer.set_val(RandomBytes(rng, state.range(0)));
+  BenchmarkUniversalType(state, integer);
+}
+BENCHMARK(BM_Encode_Integer)->Arg(8)->Arg(512);
+
+void BM_Encode_BitString(benchmark::State& state) {
+  std::mt19937 rng(7);
+  asn1_universal_types::BitString bit_string;
+  bit_string.set_val(RandomBytes(rng, state.range(0)));
+  BenchmarkUniversalType(state, bit_string);
+}
+BENCHMARK(BM_Encode_BitString)->Arg(8)->Arg(1 << 16);
+
+void BM_Encode_OctetString(benchmark::State& state) {
+  std::mt19937 rng(8);
+  asn1_universal_types::OctetString octet_string;
+  octet_string.set_val(RandomBytes(rng, state.range(0)));
+  BenchmarkUniversalType(state, octet_string);
+}
+BENCHMARK(BM_Encode_OctetString)->Arg(8)->Arg(1 << 16);
+
+void BM_Encode_ObjectIdentifier(benchmark::State& state) {
+  std::mt19937 rng(9);
+  asn1_universal_types::ObjectIdentifier oid;
+  SetObjectIdentifier(rng, &oid);
+  BenchmarkUniversalType(state, oid);
+}
+BENCHMARK(BM_Encode_ObjectIdentifier);
+
+void BM_Encode_UTCTime(benchmark::State& state) {
+  std::mt19937 rng(10);
+  asn1_universal_types::UTCTime utc_time;
+  SetTimestamp(rng, utc_time.mutable_time_stamp());
+  BenchmarkUniversalType(state, utc_time);
+}
+BENCHMARK(BM_Encode_UTCTime);
+
+void BM_Encode_GeneralizedTime(benchmark::State& state) {
+  std::mt19937 rng(11);
+  asn1_universal_types::GeneralizedTime generalized_time;
+  SetTimestamp(rng, generalized_time.mutable_time_stamp());
+  BenchmarkUniversalType(state, generalized_time);
+}
+BENCHMARK(BM_Encode_GeneralizedTime);
+
+void BM_X509CertificateToDER(benchmark::State& state) {
+  x509_certificate::X509Certificate cert = Certificate(state.range(0));
+  size_t size = 0;
+  for (auto _ : state) {
+    std::vector<uint8_t> der = x509_certificate::X509CertificateToDER(cert);
+    size = der.size();
+    benchmark::DoNotOptimize(der.data());
+  }
+  SetThroughput(state, cert, size);
+}
+BENCHMARK(BM_X509CertificateToDER)->Arg(1)->Arg(16)->Arg(256);
+
+// Like |BM_X509CertificateToDER|, into segments that reference the bytes
+// fields of the certificate.
+void BM_X509CertificateToSegments(benchmark::State& state) {
+  x509_certificate::X509Certificate cert = Certificate(state.range(0));
+  std::vector<struct iovec> segments;
+  for (auto _ : state) {
+    x509_certificate::X509CertificateToSegments(cert, segments);
+    benchmark::DoNotOptimize(segments.data());
+  }
+  SetThroughput(state, cert, SegmentsSize(segments));
+}
+BENCHMARK(BM_X509CertificateToSegments)->Arg(1)->Arg(16)->Arg(256);
+
+// Like |BM_FlatDERTree_PDU|, for a certificate with |state.range(0)|
+// extensions. Compare with |BM_X509CertificateToDER|.
+void BM_FlatDERTree_X509Certificate(benchmark::State& state) {
+  x509_certificate::X509Certificate cert = Certificate(state.range(0));
+  FlatDERTree tree;
+  tree.Build(cert);
+  DERWriter der;
+  for (auto _ : state) {
+    if (!state.range(1)) {
+      tree.Build(cert);
+    }
+    der.Clear();
+    tree.Encode(der);
+    benchmark::DoNotOptimize(der.data());
+  }
+  SetThroughput(state, cert, der.size());
+}
+BENCHMARK(BM_FlatDERTree_X509Certificate)
+    ->ArgsProduct({{1, 16, 256}, {0, 1}});
+
+// Streams a certificate with |state.range(0)| extensions in CER, which encodes
+// it to DER and transcodes it. Compare with |BM_X509CertificateToDER|.
+void BM_StreamX509Certificate(benchmark::State& state) {
+  x509_certificate::X509Certificate cert = Certificate(state.range(0));
+  StreamWriter out(StreamWriter::kCER, DiscardBytes, nullptr);
+  uint64_t start = 0;
+  for (auto _ : state) {
+    start = out.size();
+    x509_certificate::StreamX509Certificate(cert, out);
+  }
+  out.Flush();
+  SetThroughput(state, cert, out.size() - start);
+}
+BENCHMARK(BM_StreamX509Certificate)->Arg(1)->Arg(16)->Arg(256);
+
+// Mutates the DER of a certificate with |state.range(0)| extensions with
+// |DERMutator|, which is all der_mutator_fuzzer does between executions.
+void BM_DERMutator_X509Certificate(benchmark::State& state) {
+  std::vector<uint8_t> input =
+      x509_certificate::X509CertificateToDER(Certificate(state.range(0)));
+  std::vector<uint8_t> der(2 * input.size());
+  DERMutator mutator;
+  unsigned seed = 0;
+  for (auto _ : state) {
+    std::copy(input.begin(), input.end(), der.begin());
+    size_t size = mutator.Mutate(der.data(), input.size(), der.size(), seed++);
+    benchmark::DoNotOptimize(size);
+  }
+  state.counters["execs"] =
+      benchmark::Counter(state.iterations(), benchmark::Counter::kIsRate);
+}
+BENCHMARK(BM_DERMutator_X509Certificate)->Arg(1)->Arg(16)->Arg(256);
+
+// What x509_certificate_fuzzer does between executions, besides mutating the
+// protobuf: libprotobuf-mutator parses the input to mutate it, serializes it
+// back, and parses it again for the harness, which encodes it to DER. Like
+// libprotobuf-mutator, it accepts messages that lack required fields, which
+// the certificates of |Certificate| do.
+void BM_ProtobufRoundTrip_X509Certificate(benchmark::State& state) {
+  std::string input;
+  google::protobuf::TextFormat::PrintToString(Certificate(state.range(0)),
+                                              &input);
+  google::protobuf::TextFormat::Parser parser;
+  parser.AllowPartialMessage(true);
+  x509_certificate::X509Certificate cert;
+  DERWriter der;
+  for (auto _ : state) {
+    std::string output;
+    if (!parser.ParseFromString(input, &cert) ||
+        !google::protobuf::TextFormat::PrintToString(cert, &output) ||
+        !parser.ParseFromString(output, &cert)) {
+      state.SkipWithError("The certificate doesn't parse back");
+      break;
+    }
+    x509_certificate::X509CertificateToDER(cert, der);
+    benchmark::DoNotOptimize(der.data());
+  }
+  state.counters["execs"] =
+      benchmark::Counter(state.iterations(), benchmark::Counter::kIsRate);
+}
+BENCHMARK(BM_ProtobufRoundTrip_X509Certificate)->Arg(1)->Arg(16)->Arg(256);
+
+// Changes the serial number of a certificate with |state.range(0)| extensions
+// before encoding it, as a mutator changes one field of an input at a time,
+// with an |EncodingCache| if |state.range(1)| is set, and without otherwise.
+// Reports the hit rate of the cache.
+void BM_X509CertificateToDER_Cached(benchmark::State& state) {
+  x509_certificate::X509Certificate cert = Certificate(state.range(0));
+  std::string* serial_number = cert.mutable_tbs_certificate()
+                                   ->mutable_value()
+                                   ->mutable_serial_number()
+                                   ->mutable_value()
+                                   ->mutable_val();
+  EncodingCache cache;
+  EncodingCache* previous_cache =
+      x509_certificate::SetEncodingCache(state.range(1) ? &cache : nullptr);
+  DERWriter der;
+  uint8_t serial_number_byte = 0;
+  for (auto _ : state) {
+    (*serial_number)[0] = serial_number_byte++;
+    x509_certificate::X509CertificateToDER(cert, der);
+    benchmark::DoNotOptimize(der.data());
+  }
+  x509_certificate::SetEncodingCache(previous_cache);
+  state.counters["hit_rate"] = cache.hit_rate();
+  SetThroughput(state, cert, der.size());
+}
+BENCHMARK(BM_X509CertificateToDER_Cached)
+    ->ArgsProduct({{1, 16, 256}, {0, 1}});
+
+// Changes the value of one leaf of a |WidePDU| per iteration, as a mutator
+// does, and encodes the PDU again: all of it if the second argument is 0, and
+// only what changed with |IncrementalPDUToDER| otherwise.
+void BM_IncrementalPDUToDER(benchmark::State& state) {
+  const size_t width = state.range(0);
+  const bool incremental = state.range(1);
+  PDU pdu = WidePDU(width, 3);
+  std::mt19937 rng(6);
+  asn1_pdu::ASN1PDUToDER encoder;
+  asn1_pdu::IncrementalPDUToDER incremental_encoder;
+  incremental_encoder.PDUToDER(pdu);
+  DERWriter der;
+  for (auto _ : state) {
+    size_t path[2] = {rng() % width, rng() % width};
+    PDU* leaf = pdu.mutable_val()
+                    ->mutable_val_array(path[0])
+                    ->mutable_pdu()
+                    ->mutable_val()
+                    ->mutable_val_array(path[1])
+                    ->mutable_pdu();
+    leaf->mutable_val()->mutable_val_array(0)->set_val_bits(
+        RandomBytes(rng, 1 + rng() % 16));
+    if (incremental) {
+      incremental_encoder.Update(pdu, path, 2);
+      benchmark::DoNotOptimize(incremental_encoder.data());
+    } else {
+      encoder.PDUToDER(pdu, der);
+      benchmark::DoNotOptimize(der.data());
+    }
+  }
+  state.counters["execs"] =
+      benchmark::Counter(state.iterations(), benchmark::Counter::kIsRate);
+}
+BENCHMARK(BM_IncrementalPDUToDER)->ArgsProduct({{8, 64}, {0, 1}});
+
+// Encodes |num_inputs| copies of |input| at once with |encode_batch|, which
+// leaves out the setup and output vector of a call per input. Reports the
+// executions per second, i.e. the inputs encoded.
+template <typename T>
+void BenchmarkBatch(benchmark::State& state,
+                    const T& input,
+                    void (*encode_batch)(const T* const*, size_t, DERBatch&)) {
+  std::vector<T> copies(state.range(0), input);
+  std::vector<const T*> inputs;
+  for (const T& copy : copies) {
+    inputs.push_back(&copy);
+  }
+  DERBatch batch;
+  for (auto _ : state) {
+    encode_batch(inputs.data(), inputs.size(), batch);
+    benchmark::DoNotOptimize(batch.data());
+  }
+  state.SetBytesProcessed(state.iterations() * batch.size());
+  state.counters["execs"] = benchmark::Counter(
+      state.iterations() * inputs.size(), benchmark::Counter::kIsRate);
+}
+
+void BM_EncodeBatch_PDU(benchmark::State& state) {
+  BenchmarkBatch<PDU>(state, FlatPDU(16), asn1_pdu::EncodeBatch);
+}
+BENCHMARK(BM_EncodeBatch_PDU)->Arg(1)->Arg(64)->Arg(4096);
+
+void BM_EncodeBatch_X509Certificate(benchmark::State& state) {
+  BenchmarkBatch<x509_certificate::X509Certificate>(
+      state, Certificate(1), x509_certificate::EncodeBatch);
+}
+BENCHMARK(BM_EncodeBatch_X509Certificate)->Arg(1)->Arg(64)->Arg(4096);
+
+// Encodes |input| with |encode| on every thread of the benchmark, each with its
+// own |DERWriter|, as an engine that runs inputs on many threads does. Reports
+// the executions per second of all threads together, which should scale with
+// the number of threads as long as there are cores for them.
+template <typename T>
+void BenchmarkThreads(benchmark::State& state,
+                      const T& input,
+                      void (*encode)(const T&, DERWriter&)) {
+  DERWriter der;
+  for (auto _ : state) {
+    encode(input, der);
+    benchmark::DoNotOptimize(der.data());
+  }
+  state.counters["execs"] =
+      benchmark::Counter(state.iterations(), benchmark::Counter::kIsRate);
+  SetThroughput(state, input, der.size());
+}
+
+void BM_PDUToDER_Threads(benchmark::State& state) {
+  // Shared by the threads, which only read it.
+  static const PDU* pdu = new PDU(WidePDU(8, 3));
+  BenchmarkThreads<PDU>(state, *pdu, asn1_pdu::PDUToDER);
+}
+BENCHMARK(BM_PDUToDER_Threads)->ThreadRange(1, 64)->UseRealTime();
+
+void BM_X509CertificateToDER_Threads(benchmark::State& state) {
+  // Shared by the threads, which only read it.
+  static const x509_certificate::X509Certificate* cert =
+      new x509_certificate::X509Certificate(Certificate(16));
+  BenchmarkThreads<x509_certificate::X509Certificate>(
+      state, *cert, x509_certificate::X509CertificateToDER);
+}
+BENCHMARK(BM_X509CertificateToDER_Threads)->ThreadRange(1, 64)->UseRealTime();
+
+void BM_HashDER(benchmark::State& state) {
+  std::mt19937 rng(state.range(0));
+  std::string der = RandomBytes(rng, state.range(0));
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(HashDER(
+        reinterpret_cast<const uint8_t*>(der.data()), der.size()));
+  }
+  state.SetBytesProcessed(state.iterations() * der.size());
+}
+BENCHMARK(BM_HashDER)->Arg(64)->Arg(1 << 10)->Arg(1 << 20);
+
+// Inserts into a set shared by the threads, as the harnesses of an engine that
+// runs inputs on many threads do. Every thread inserts its own hashes, each one
+// twice, so that half of the insertions are duplicates.
+void BM_DERDedupeSet_Insert(benchmark::State& state) {
+  static DERDedupeSet* set = new DERDedupeSet();
+  uint64_t i = static_cast<uint64_t>(state.thread_index()) << 40;
+  for (auto _ : state) {
+    uint64_t key = (i++ >> 1) * 0x9E3779B97F4A7C15;
+    benchmark::DoNotOptimize(set->Insert({{key, key * 0xBF58476D1CE4E5B9}}));
+  }
+  state.counters["inserts"] =
+      benchmark::Counter(state.iterations(), benchmark::Counter::kIsRate);
+}
+BENCHMARK(BM_DERDedupeSet_Insert)->ThreadRange(1, 64)->UseRealTime();
+
+// Encodes only the part of a certificate returned by |get_part|, to break
+// |X509CertificateToDER| down into the phases that encode each part.
+template <typename T>
+void BenchmarkCertificatePart(
+    benchmark::State& state,
+    const T& (*get_part)(const x509_certificate::X509Certificate&)) {
+  x509_certificate::X509Certificate cert = Certificate(state.range(0));
+  const T& part = get_part(cert);
+  DERWriter der;
+  for (auto _ : state) {
+    der.Clear();
+    x509_certificate::Encode(part, der);
+    benchmark::DoNotOptimize(der.data());
+  }
+  SetThroughput(state, part, der.size());
+}
+
+const x509_certificate::TBSCertificate& GetTBSCertificate(
+    const x509_certificate::X509Certificate& cert) {
+  return cert.tbs_certificate();
+}
+
+const x509_certificate::Name& GetIssuer(
+    const x509_certificate::X509Certificate& cert) {
+  return cert.tbs_certificate().value().issuer();
+}
+
+const x509_certificate::Validity& GetValidity(
+    const x509_certificate::X509Certificate& cert) {
+  return cert.tbs_certificate().value().validity();
+}
+
+const x509_certificate::SubjectPublicKeyInfo& GetSubjectPublicKeyInfo(
+    const x509_certificate::X509Certificate& cert) {
+  return cert.tbs_certificate().value().subject_public_key_info();
+}
+
+const x509_certificate::Extensions& GetExtensions(
+    const x509_certificate::X509Certificate& cert) {
+  return cert.tbs_certificate().value().extensions();
+}
+
+void BM_X509Phase_TBSCertificate(benchmark::State& state) {
+  BenchmarkCertificatePart(state, GetTBSCertificate);
+}
+BENCHMARK(BM_X509Phase_TBSCertificate)->Arg(16);
+
+void BM_X509Phase_Name(benchmark::State& state) {
+  BenchmarkCertificatePart(state, GetIssuer);
+}
+BENCHMARK(BM_X509Phase_Name)->Arg(16);
+
+void BM_X509Phase_Validity(benchmark::State& state) {
+  BenchmarkCertificatePart(state, GetValidity);
+}
+BENCHMARK(BM_X509Phase_Validity)->Arg(16);
+
+void BM_X509Phase_SubjectPublicKeyInfo(benchmark::State& state) {
+  BenchmarkCertificatePart(state, GetSubjectPublicKeyInfo);
+}
+BENCHMARK(BM_X509Phase_SubjectPublicKeyInfo)->Arg(16);
+
+void BM_X509Phase_Extensions(benchmark::State& state) {
+  BenchmarkCertificatePart(state, GetExtensions);
+}
+BENCHMARK(BM_X509Phase_Extensions)->Arg(1)->Arg(16)->Arg(256);
+
+}  // namespace
+
+BENCHMARK_MAIN();
@@ -0,0 +1,64 @@
+// Copyright 2020 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+// Fuzz harness that encodes fuzzer generated PDUs to DER, and passes them to
+// |TestOneDERInput|.
+
+#include "asn1_pdu.pb.h"
+#include "asn1_pdu_to_der.h"
+#include "common.h"
+#include "der_dedupe.h"
+#include "der_fuzzer.h"
+#include "src/libfuzzer/libfuzzer_macro.h"
+
+DEFINE_PROTO_FUZZER(const asn1_pdu::PDU& pdu) {
+#ifdef ASN1_PDU_FUZZER_STATS
+  der_fuzzer::RecordExecution();
+#endif
+  // Kept between inputs, so that encoding stops allocating once |der| has grown
+  // to fit them, and per thread, for engines that run inputs on many threads.
+  static thread_local DERWriter der;
+  der_fuzzer::SetBudget(der);
+  asn1_pdu::PDUToDER(pdu, der);
+  if (der.over_budget()) {
+    return;
+  }
+#ifdef ASN1_PDU_DER_DEDUPE
+  // Shared by all threads, and never destroyed, since the stats may report it
+  // at exit.
+  static DERDedupeSet* seen = [] {
+    DERDedupeSet* seen = new DERDedupeSet();
+#ifdef ASN1_PDU_FUZZER_STATS
+    der_fuzzer::AddDERDedupeSet(seen);
+#endif
+    return seen;
+  }();
+  // Inputs that encode to DER that was already passed on would run the
+  // parser the same way again. libFuzzer runs an input again right after it,
+  // to confirm a leak, so the DER of the last input of the thread is passed on
+  // again.
+  static thread_local DERHash last_hash;
+  static thread_local bool has_last_hash = false;
+  DERHash hash = HashDER(der);
+  bool repeat = has_last_hash && hash == last_hash;
+  last_hash = hash;
+  has_last_hash = true;
+  if (!repeat && !seen->Insert(hash)) {
+    return;
+  }
+#endif
+  TestOneDERInput(der.data(), der.size());
+}
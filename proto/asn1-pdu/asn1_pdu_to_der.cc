@@ -20,123 +20,242 @@
 
 #include <limits.h>
 
+#include <algorithm>
+
+#include "encoder_stats.h"
+
 namespace asn1_pdu {
 
-// The maximum level of recursion allowed. Values greater than this will just
-// fail.
-static constexpr size_t kRecursionLimit = 200;
-
-void ASN1PDUToDER::EncodeOverrideLength(const std::string& raw_len,
-                                        size_t len_pos) {
-  der_.insert(der_.begin() + len_pos, raw_len.begin(), raw_len.end());
-}
-
-void ASN1PDUToDER::EncodeIndefiniteLength(size_t len_pos) {
-  der_.insert(der_.begin() + len_pos, 0x80);
-  // The PDU's value is from |len_pos| to the end of |der_|, so just add an
-  // EOC marker to the end.
-  der_.push_back(0x00);
-  der_.push_back(0x00);
-}
-
-void ASN1PDUToDER::EncodeDefiniteLength(size_t actual_len, size_t len_pos) {
-  InsertVariableIntBase256(actual_len, len_pos, der_);
-  // X.690 (2015), 8.1.3.3: The long-form is used when the length is
-  // larger than 127.
-  // Note: |len_num_bytes| is not checked here, because it will equal
-  // 1 for values [128..255], but those require the long-form length.
-  if (actual_len > 127) {
-    // See X.690 (2015) 8.1.3.5.
-    // Long-form length is encoded as a byte with the high-bit set to indicate
-    // the long-form, while the remaining bits indicate how many bytes are used
-    // to encode the length.
-    size_t len_num_bytes = GetVariableIntLen(actual_len, 256);
-    der_.insert(der_.begin() + len_pos, (0x80 | len_num_bytes));
+uint32_t GetTagNum(const Identifier& id) {
+  return id.tag_num().has_high_tag_num()
+             ? id.tag_num().high_tag_num()
+             : static_cast<uint32_t>(id.tag_num().low_tag_num());
+}
+
+uint8_t GetFirstIdentifierByte(const Identifier& id) {
+  // The class comprises the 7th and 8th bit of the identifier (X.690
+  // (2015), 8.1.2).
+  uint8_t id_class = static_cast<uint8_t>(id.id_class()) << 6;
+  // The encoding comprises the 6th bit of the identifier (X.690 (2015), 8.1.2).
+  uint8_t encoding = static_cast<uint8_t>(id.encoding()) << 5;
+  uint32_t tag_num = GetTagNum(id);
+  // High tag numbers set the lower 5 bits to 1 (X.690 (2015), 8.1.2.4.1).
+  return id_class | encoding | (tag_num >= 31 ? 0x1F : tag_num);
+}
+
+void PrependIdentifier(const Identifier& id, DERWriter& der) {
+  uint32_t tag_num = GetTagNum(id);
+  // When the tag number is greater than or equal to 31, encode with a single
+  // byte; otherwise, use the high-tag-number form (X.690 (2015), 8.1.2).
+  if (tag_num >= 31) {
+    // The high-tag-number form base 128 encodes |tag_num| after the first
+    // byte (X.690 (2015), 8.1.2.4.2).
+    der.PrependVariableIntBase128(tag_num);
   }
+  der.Prepend(GetFirstIdentifierByte(id));
 }
 
-void ASN1PDUToDER::EncodeLength(const Length& len,
-                                size_t actual_len,
-                                size_t len_pos) {
+void PrependLength(const Length& len, size_t value_len, DERWriter& der) {
   if (len.has_length_override()) {
-    EncodeOverrideLength(len.length_override(), len_pos);
+    der.Prepend(len.length_override());
   } else if (len.has_indefinite_form() && len.indefinite_form()) {
-    EncodeIndefiniteLength(len_pos);
+    // The indefinite-length indicator (X.690 (2015), 8.1.3.6). The
+    // End-of-Contents (EOC) marker was written before the value.
+    der.Prepend(0x80);
   } else {
-    EncodeDefiniteLength(actual_len, len_pos);
+    // The definite-form length (X.690 (2015), 8.1.3-8.1.5 & 10.1).
+    der.PrependDefiniteLength(value_len);
   }
 }
 
-void ASN1PDUToDER::EncodeValue(const Value& val) {
-  for (const auto& val_ele : val.val_array()) {
-    if (recursion_exceeded_) {
-      // If the message exceeds the recursion limit, abort processing the
-      // protobuf in order to limit uninteresting work.
-      return;
-    }
-    if (val_ele.has_pdu()) {
-      EncodePDU(val_ele.pdu());
-    } else {
-      der_.insert(der_.end(), val_ele.val_bits().begin(),
-                  val_ele.val_bits().end());
-    }
+bool HasIndefiniteLength(const Length& len) {
+  return !len.has_length_override() && len.has_indefinite_form() &&
+         len.indefinite_form();
+}
+
+size_t GetRepeatCount(const RepeatedBytes& repeated) {
+  size_t pattern_len = repeated.pattern().size();
+  if (pattern_len == 0) {
+    return 0;
   }
+  return std::min<size_t>(repeated.count(), kMaxRepeatedLen / pattern_len);
 }
 
-void ASN1PDUToDER::EncodeHighTagNumberForm(uint8_t id_class,
-                                           uint8_t encoding,
-                                           uint32_t tag_num) {
-  // High-tag-number form requires the lower 5 bits of the identifier to be set
-  // to 1 (X.690 (2015), 8.1.2.4.1).
-  der_.push_back(id_class | encoding | 0x1F);
-  // The high-tag-number form base 128 encodes |tag_num| (X.690 (2015), 8.1.2).
-  InsertVariableIntBase128(tag_num, der_.size(), der_);
+void PrependRepeated(const RepeatedBytes& repeated, DERWriter& der) {
+  der.PrependRepeated(
+      reinterpret_cast<const uint8_t*>(repeated.pattern().data()),
+      repeated.pattern().size(), GetRepeatCount(repeated));
 }
 
-void ASN1PDUToDER::EncodeIdentifier(const Identifier& id) {
-  // The class comprises the 7th and 8th bit of the identifier (X.690
-  // (2015), 8.1.2).
-  uint8_t id_class = static_cast<uint8_t>(id.id_class()) << 6;
-  // The encoding comprises the 6th bit of the identifier (X.690 (2015), 8.1.2).
-  uint8_t encoding = static_cast<uint8_t>(id.encoding()) << 5;
+size_t GetValueBitsLen(const ValueElement& element) {
+  size_t len = element.val_bits().size();
+  if (element.has_repeated_bits()) {
+    len += element.repeated_bits().pattern().size() *
+           GetRepeatCount(element.repeated_bits());
+  }
+  return len;
+}
 
-  uint32_t tag_num = id.tag_num().has_high_tag_num()
-                         ? id.tag_num().high_tag_num()
-                         : id.tag_num().low_tag_num();
-  // When the tag number is greater than or equal to 31, encode with a single
-  // byte; otherwise, use the high-tag-number form (X.690 (2015), 8.1.2).
-  if (tag_num >= 31) {
-    EncodeHighTagNumberForm(id_class, encoding, tag_num);
-  } else {
-    der_.push_back(static_cast<uint8_t>(id_class | encoding | tag_num));
+void PrependValueBits(const ValueElement& element, DERWriter& der) {
+  if (element.has_repeated_bits()) {
+    PrependRepeated(element.repeated_bits(), der);
   }
+  der.PrependReference(element.val_bits());
 }
 
-void ASN1PDUToDER::EncodePDU(const PDU& pdu) {
-  // Artifically limit the stack depth to avoid stack overflow.
-  if (depth_ > kRecursionLimit) {
-    recursion_exceeded_ = true;
-    return;
+ASN1PDUToDER::ASN1PDUToDER(size_t depth_limit)
+    : der_(nullptr), depth_limit_(depth_limit), depth_limit_exceeded_(false) {}
+
+bool ASN1PDUToDER::ChargePDU(const PDU& pdu) {
+  return der_->ChargeNode() &&
+         (!HasIndefiniteLength(pdu.len()) || der_->ChargeSize(2));
+}
+
+void ASN1PDUToDER::BeginPDU(const PDU& pdu) {
+  if (HasIndefiniteLength(pdu.len())) {
+    // The PDU's value ends with an EOC marker, so write it before the value.
+    der_->Prepend(0x00);
+    der_->Prepend(0x00);
+    ASN1_PDU_STATS_ADD(indefinite_lengths, 1);
+  } else if (pdu.len().has_length_override()) {
+    ASN1_PDU_STATS_ADD(length_overrides, 1);
   }
-  ++depth_;
-  EncodeIdentifier(pdu.id());
-  size_t len_pos = der_.size();
-  EncodeValue(pdu.val());
-  EncodeLength(pdu.len(), der_.size() - len_pos, len_pos);
-  --depth_;
+  stack_.push_back({&pdu, pdu.val().val_array_size(), der_->size()});
+  ASN1_PDU_STATS_ADD(pdus_encoded, 1);
+  ASN1_PDU_STATS_MAX(max_depth, stack_.size());
 }
 
-std::vector<uint8_t> ASN1PDUToDER::PDUToDER(const PDU& pdu) {
+void ASN1PDUToDER::EndPDU() {
+  const Frame& frame = stack_.back();
+  const PDU& pdu = *frame.pdu;
+  size_t value_start = der_->size();
+  size_t value_len = value_start - frame.value_pos;
+  PrependLength(pdu.len(), value_len, *der_);
+  PrependIdentifier(pdu.id(), *der_);
+  if (TLVIndex* index = der_->tlv_index()) {
+    // The EOC marker of an indefinite length ends the TLV.
+    size_t eoc_len = HasIndefiniteLength(pdu.len()) ? 2 : 0;
+    index->Add(der_->size(), der_->size() - value_start, value_len + eoc_len,
+               GetFirstIdentifierByte(pdu.id()), GetTagNum(pdu.id()));
+  }
+  stack_.pop_back();
+}
+
+void ASN1PDUToDER::Encode(const PDU& pdu, DERWriter& der) {
+  ASN1_PDU_STATS_TIME_PHASE(ASN1_PDU_PHASE_PDU);
   // Reset the previous state.
-  der_.clear();
-  depth_ = 0;
-  recursion_exceeded_ = false;
+  der_ = &der;
+  stack_.clear();
+  depth_limit_exceeded_ = false;
 
-  EncodePDU(pdu);
-  if (recursion_exceeded_) {
-    der_.clear();
+  if (depth_limit_ == 0) {
+    depth_limit_exceeded_ = true;
+    ASN1_PDU_STATS_ADD(depth_limit_aborts, 1);
+    return;
+  }
+  if (der.over_budget() || !ChargePDU(pdu)) {
+    return;
+  }
+  BeginPDU(pdu);
+  while (!stack_.empty()) {
+    Frame& frame = stack_.back();
+    // Once over budget, the elements left are left out.
+    if (frame.num_elements_left == 0 || der_->over_budget()) {
+      EndPDU();
+      continue;
+    }
+    const auto& val_ele =
+        frame.pdu->val().val_array(--frame.num_elements_left);
+    if (!val_ele.has_pdu()) {
+      if (der_->ChargeSize(GetValueBitsLen(val_ele))) {
+        PrependValueBits(val_ele, *der_);
+      }
+    } else if (stack_.size() < depth_limit_) {
+      if (ChargePDU(val_ele.pdu())) {
+        BeginPDU(val_ele.pdu());
+      }
+    } else {
+      depth_limit_exceeded_ = true;
+    }
   }
-  return der_;
+  if (depth_limit_exceeded_) {
+    ASN1_PDU_STATS_ADD(depth_limit_aborts, 1);
+  }
+}
+
+void ASN1PDUToDER::PDUToDER(const PDU& pdu, DERWriter& der) {
+  der.Clear();
+  Encode(pdu, der);
+  der.FinishBudget();
+}
+
+size_t ASN1PDUToDER::PDUToDER(const PDU& pdu,
+                              uint8_t* buffer,
+                              size_t capacity) {
+  return EncodeToBuffer([this, &pdu](DERWriter& der) { Encode(pdu, der); },
+                        buffer, capacity);
+}
+
+std::vector<uint8_t> ASN1PDUToDER::PDUToDER(const PDU& pdu) {
+  DERWriter der;
+  PDUToDER(pdu, der);
+  return std::vector<uint8_t>(der.data(), der.data() + der.size());
+}
+
+void ASN1PDUToDER::EncodeBatch(const PDU* const* pdus,
+                               size_t num_pdus,
+                               DERBatch& batch) {
+  bool depth_limit_exceeded = false;
+  batch.Encode(num_pdus, [this, pdus, &depth_limit_exceeded](size_t i,
+                                                              DERWriter& der) {
+    // The PDUs are encoded last to first, so start loading the one encoded
+    // next while this one is encoded.
+    if (i != 0) {
+      __builtin_prefetch(pdus[i - 1]);
+    }
+    Encode(*pdus[i], der);
+    depth_limit_exceeded = depth_limit_exceeded || depth_limit_exceeded_;
+  });
+  depth_limit_exceeded_ = depth_limit_exceeded;
+}
+
+namespace {
+
+// Returns the encoder of the calling thread, which the thread-safe functions
+// use. Its stack of PDUs keeps its memory between calls, and is never shared.
+ASN1PDUToDER& ThreadEncoder() {
+  static thread_local ASN1PDUToDER encoder;
+  return encoder;
+}
+
+}  // namespace
+
+std::vector<uint8_t> PDUToDER(const PDU& pdu) {
+  return ThreadEncoder().PDUToDER(pdu);
+}
+
+void PDUToDER(const PDU& pdu, DERWriter& der) {
+  ThreadEncoder().PDUToDER(pdu, der);
+}
+
+size_t PDUToDER(const PDU& pdu, uint8_t* buffer, size_t capacity) {
+  return ThreadEncoder().PDUToDER(pdu, buffer, capacity);
+}
+
+void EncodePDU(const PDU& pdu, DERWriter& der) {
+  ThreadEncoder().Encode(pdu, der);
+}
+
+void PDUToSegments(const PDU& pdu, std::vector<struct iovec>& segments) {
+  static thread_local DERWriter der;
+  der.set_reference_values(true);
+  ThreadEncoder().PDUToDER(pdu, der);
+  segments.clear();
+  der.AppendSegmentsTo(segments);
+}
+
+void EncodeBatch(const PDU* const* pdus, size_t num_pdus, DERBatch& batch) {
+  ThreadEncoder().EncodeBatch(pdus, num_pdus, batch);
 }
 
 }  // namespace asn1_pdu
\ No newline at end of file
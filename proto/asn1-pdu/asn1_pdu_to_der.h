@@ -23,62 +23,168 @@
 #include <vector>
 
 #include "asn1_pdu.pb.h"
+#include "common.h"
 
 namespace asn1_pdu {
 
+// Encodes PDUs to DER, reusing its scratch memory between calls.
+// An |ASN1PDUToDER| must not be used by more than one thread at a time. Threads
+// can each keep their own, or use the functions below the class, which do so
+// for them.
 class ASN1PDUToDER {
  public:
-  // Encodes |pdu| to DER, returning the encoded bytes of the PDU in
-  // |der_|.
+  // The default for the maximum depth of nested PDUs that are encoded.
+  static constexpr size_t kDefaultDepthLimit = 1 << 16;
+
+  // PDUs nested more than |depth_limit| deep, counting the outermost PDU as
+  // depth 1, are left out of the encoding. The PDUs around them are still
+  // encoded, with lengths that match what was encoded.
+  explicit ASN1PDUToDER(size_t depth_limit = kDefaultDepthLimit);
+
+  // Encodes |pdu| to DER, returning the encoded bytes of the PDU.
   std::vector<uint8_t> PDUToDER(const PDU& pdu);
 
+  // Encodes |pdu| to DER into |der|, replacing its contents.
+  // |der| keeps its memory between calls, so a fuzz target that keeps one
+  // |DERWriter| for the whole process stops allocating to encode once |der|
+  // has grown to fit its inputs. If |der| has an |EncodingBudget|, encoding
+  // stops once it is exceeded, which |der.budget_exceeded()| reports, and the
+  // encoding is left as its policy says.
+  void PDUToDER(const PDU& pdu, DERWriter& der);
+
+  // Encodes |pdu| to DER into the start of |buffer|, which can hold |capacity|
+  // bytes, and returns the encoded size. If the returned size is larger than
+  // |capacity|, the encoding didn't fit, and the contents of |buffer| are
+  // unspecified (see |EncodeToBuffer|).
+  size_t PDUToDER(const PDU& pdu, uint8_t* buffer, size_t capacity);
+
+  // Encodes |pdu| to DER in front of the bytes already written to |der|.
+  // Stops adding values once the |EncodingBudget| of |der| is exceeded, but
+  // leaves applying its policy to the caller (see |DERWriter::FinishBudget|).
+  void Encode(const PDU& pdu, DERWriter& der);
+
+  // Encodes the |num_pdus| PDUs at |pdus| to DER into |batch|, replacing its
+  // contents, so that the |i|th encoding of |batch| is that of |pdus[i]|.
+  // Encoding many PDUs at once avoids the setup and the output vector of a
+  // call per PDU. |depth_limit_exceeded()| reports whether PDUs were left out
+  // of any of the encodings.
+  void EncodeBatch(const PDU* const* pdus, size_t num_pdus, DERBatch& batch);
+
+  // Whether the last encoding left out PDUs nested deeper than the depth
+  // limit.
+  bool depth_limit_exceeded() const { return depth_limit_exceeded_; }
+
+  // Replaces the depth limit for the encodings that follow, so that one
+  // encoder can encode PDUs nested at different depths of an input.
+  void set_depth_limit(size_t depth_limit) { depth_limit_ = depth_limit; }
+
  private:
-  std::vector<uint8_t> der_;
-
-  // Encodes |pdu| to DER and tracks |depth_| to avoid stack overflow
-  // for nested pdu's.
-  void EncodePDU(const PDU& pdu);
-
-  // Encodes |id| to DER according to X.690 (2015), 8.1.2.
-  void EncodeIdentifier(const Identifier& id);
-
-  // Concatinates |id_class|, |encoding|, and |tag| according to DER
-  // high-tag-number form rules (X.690 (2015), 8.1.2.4).
-  void EncodeHighTagNumberForm(uint8_t id_class,
-                               uint8_t encoding,
-                               uint32_t tag);
-
-  // Encodes the length to DER.
-  // |len| can be used to affect the encoding, in order to produce
-  // invalid lengths. |actual_len| is the correct length of the PDU,
-  // and is used when |len| is not. |len_pos| contains the offset in |der_|
-  // where the length should be encoded.
-  // To correctly call this, the tag must already be encoded immediately prior
-  // to |len_pos|, and the remainder of |der_| represents the encoded value.
-  void EncodeLength(const Length& len, size_t actual_len, size_t len_pos);
-
-  // Writes |raw_len| to |der_| at |len_pos|.
-  void EncodeOverrideLength(const std::string& raw_len, size_t len_pos);
-
-  // Encodes the indefinite-length indicator (X.690 (2015), 8.1.3.6) at
-  // |len_pos|, and appends an End-of-Contents (EOC) marker at the end of
-  // |der_|.
-  void EncodeIndefiniteLength(size_t len_pos);
-
-  // Encodes the length in |actual_len| using the definite-form length (X.690
-  // (2015), 8.1.3-8.1.5 & 10.1) into |der_| at |len_pos|.
-  void EncodeDefiniteLength(size_t actual_len, size_t len_pos);
-
-  // Extracts bytes from |val| and inserts them into |enocder_|.
-  void EncodeValue(const Value& val);
-
-  // Tracks recursion depth to avoid stack exhaustion.
-  size_t depth_;
-
-  // Whether |depth_| exceeded the recursion limit, causing an early return.
-  bool recursion_exceeded_;
+  // A PDU that is being encoded. Since |der_| is written back to front, the
+  // elements of its value are encoded last to first, followed by the length
+  // and the identifier.
+  struct Frame {
+    const PDU* pdu;
+    // The number of elements of the value that are left to encode.
+    int num_elements_left;
+    // The size of |der_| before the value was encoded.
+    size_t value_pos;
+  };
+
+  // Counts the TLV of |pdu|, and the EOC marker of an indefinite length,
+  // against the budget of |der_|, and returns whether they fit.
+  bool ChargePDU(const PDU& pdu);
+
+  // Pushes a frame for |pdu| onto |stack_|, to encode its value next.
+  void BeginPDU(const PDU& pdu);
+
+  // Encodes the length and identifier of the PDU of the frame on top of
+  // |stack_|, whose value has been encoded, and pops the frame.
+  void EndPDU();
+
+  DERWriter* der_;
+
+  // The PDUs being encoded, outermost first. It replaces recursion, so that
+  // deeply nested PDUs can't overflow the stack, and keeps its memory between
+  // calls.
+  std::vector<Frame> stack_;
+
+  size_t depth_limit_;
+
+  // Whether PDUs deeper than |depth_limit_| were left out.
+  bool depth_limit_exceeded_;
 };
 
+// Returns the tag number of |id|, which is encoded in the high-tag-number form
+// if it is 31 or more (X.690 (2015), 8.1.2.4).
+uint32_t GetTagNum(const Identifier& id);
+
+// Returns the first byte of the encoding of |id|, which holds its class,
+// encoding, and low tag number, or 0x1F for a high tag number (X.690 (2015),
+// 8.1.2).
+uint8_t GetFirstIdentifierByte(const Identifier& id);
+
+// Prepends |id| to |der| according to X.690 (2015), 8.1.2.
+void PrependIdentifier(const Identifier& id, DERWriter& der);
+
+// Prepends the length of a value of |value_len| bytes to |der|, which is
+// written in front of the value. |len| can be used to affect the encoding, in
+// order to produce invalid lengths. The correct length of the value is used
+// when |len| is not.
+void PrependLength(const Length& len, size_t value_len, DERWriter& der);
+
+// Whether |len| encodes the indefinite-length indicator, in which case an
+// End-of-Contents (EOC) marker follows the value.
+bool HasIndefiniteLength(const Length& len);
+
+// The most bytes that the encoders repeat the pattern of a |RepeatedBytes| to,
+// so that a mutated |count| can't make an input encode to gigabytes. 1 MiB by
+// default, enough for the large-input paths of parsers; CMakeLists.txt sets it
+// from its ASN1_PDU_MAX_REPEATED_LEN cache variable. The cap is per
+// |RepeatedBytes|, so an input with many of them can still encode to much
+// more; an |EncodingBudget| caps the whole encoding, as the fuzz harnesses do
+// (see der_fuzzer.h).
+#ifndef ASN1_PDU_MAX_REPEATED_LEN
+#define ASN1_PDU_MAX_REPEATED_LEN (1 << 20)
+#endif
+constexpr size_t kMaxRepeatedLen = ASN1_PDU_MAX_REPEATED_LEN;
+
+// Returns the number of repetitions of the pattern of |repeated| that the
+// encoders write: |count|, or as many as fit in |kMaxRepeatedLen| bytes.
+size_t GetRepeatCount(const RepeatedBytes& repeated);
+
+// Prepends the repetitions of |repeated| to |der|, which references them if
+// it references values (see |DERWriter::PrependRepeated|).
+void PrependRepeated(const RepeatedBytes& repeated, DERWriter& der);
+
+// Returns the size of the value of |element|, which isn't a PDU: its
+// |val_bits|, followed by the repetitions of its |repeated_bits|.
+size_t GetValueBitsLen(const ValueElement& element);
+
+// Prepends the value of |element|, which isn't a PDU, to |der|.
+void PrependValueBits(const ValueElement& element, DERWriter& der);
+
+// Like the methods of |ASN1PDUToDER|, with the default depth limit, where
+// |EncodePDU| is |ASN1PDUToDER::Encode|. It has another name, so that
+// argument-dependent lookup doesn't pick it over the |Encode| templates of
+// encoders in other namespaces for PDU fields.
+// These are thread-safe: any number of threads can call them concurrently, as
+// long as each call writes to its own |der| or |buffer|. Each thread encodes
+// with its own |ASN1PDUToDER|, so threads don't share scratch memory, or
+// contend for it in the allocator.
+std::vector<uint8_t> PDUToDER(const PDU& pdu);
+void PDUToDER(const PDU& pdu, DERWriter& der);
+size_t PDUToDER(const PDU& pdu, uint8_t* buffer, size_t capacity);
+void EncodePDU(const PDU& pdu, DERWriter& der);
+void EncodeBatch(const PDU* const* pdus, size_t num_pdus, DERBatch& batch);
+
+// Encodes |pdu| like |PDUToDER| into memory of the calling thread that
+// references the values of |pdu| instead of copying them, and replaces
+// |segments| with the encoding (see |DERWriter::set_reference_values|), e.g.
+// for |writev| or a parser that takes chained buffers. The segments are valid
+// until the next call on the same thread, as long as |pdu| doesn't change.
+// This is thread-safe, like |PDUToDER|.
+void PDUToSegments(const PDU& pdu, std::vector<struct iovec>& segments);
+
 }  // namespace asn1_pdu
 
 #endif  // PROTO_ASN1_PDU_ASN1_PDU_TO_DER_H_
\ No newline at end of file
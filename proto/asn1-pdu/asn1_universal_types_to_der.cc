@@ -19,152 +19,307 @@
 #include <algorithm>
 
 #include <google/protobuf/util/time_util.h>
+#include "asn1_pdu_to_der.h"
 #include "common.h"
 
 namespace asn1_universal_types {
 
-void Encode(const Boolean& boolean, std::vector<uint8_t>& der) {
-  der.push_back(kAsn1Boolean);
-  // The contents octets shall consist of a single octet (X.690 (2015), 8.2.1).
-  // Therefore, length is always 1.
-  der.push_back(0x01);
+namespace {
+
+// Returns the size of the bytes of |string|, an |OctetString| or |BitString|:
+// its |val|, followed by the repetitions of its |repeated_val|.
+template <typename T>
+size_t GetStringLen(const T& string) {
+  size_t len = string.val().size();
+  if (string.has_repeated_val()) {
+    len += string.repeated_val().pattern().size() *
+           asn1_pdu::GetRepeatCount(string.repeated_val());
+  }
+  return len;
+}
+
+// Prepends the bytes of |string| to |der|.
+template <typename T>
+void PrependString(const T& string, DERWriter& der) {
+  if (string.has_repeated_val()) {
+    asn1_pdu::PrependRepeated(string.repeated_val(), der);
+  }
+  der.PrependReference(string.val());
+}
+
+// The maximum number of bytes written by |FormatTimestamp|.
+constexpr size_t kMaxTimestampLen = 15;
+
+// Writes the |num_digits| least significant decimal digits of |value| to |out|.
+void FormatDigits(uint32_t value, size_t num_digits, uint8_t* out) {
+  for (size_t i = num_digits; i != 0; --i) {
+    out[i - 1] = '0' + value % 10;
+    value /= 10;
+  }
+}
+
+// Writes |timestamp| to |out| as encoded by |EncodeTimestamp|, and returns the
+// number of bytes written, or returns zero if |timestamp| cannot be encoded.
+size_t FormatTimestamp(const google::protobuf::Timestamp& timestamp,
+                       bool use_two_digit_year,
+                       uint8_t out[kMaxTimestampLen]) {
+  using google::protobuf::util::TimeUtil;
+  int64_t seconds = timestamp.seconds();
+  int32_t nanos = timestamp.nanos();
+  if (seconds < TimeUtil::kTimestampMinSeconds ||
+      seconds > TimeUtil::kTimestampMaxSeconds || nanos < 0 ||
+      nanos > 999999999) {
+    return 0;
+  }
+  // Timestamps used to be formatted with |TimeUtil::ToString|, and only those
+  // that it formatted with more than three fractional digits were encoded. The
+  // fraction is still not encoded, but the same timestamps are left out, to
+  // keep the encodings of existing inputs.
+  if (nanos % 1000000 == 0) {
+    return 0;
+  }
+
+  // Converts days since 1970-01-01 to a date in the proleptic Gregorian
+  // calendar, counting 400 year eras from 0000-03-01 so that leap days fall at
+  // the end of a year.
+  int64_t days = seconds / 86400;
+  int64_t seconds_of_day = seconds % 86400;
+  if (seconds_of_day < 0) {
+    seconds_of_day += 86400;
+    --days;
+  }
+  days += 719468;
+  int64_t era = (days >= 0 ? days : days - 146096) / 146097;
+  uint32_t day_of_era = static_cast<uint32_t>(days - era * 146097);
+  uint32_t year_of_era =
+      (day_of_era - day_of_era / 1460 + day_of_era / 36524 -
+       day_of_era / 146096) /
+      365;
+  uint32_t day_of_year =
+      day_of_era - (365 * year_of_era + year_of_era / 4 - year_of_era / 100);
+  uint32_t month_from_march = (5 * day_of_year + 2) / 153;
+  uint32_t day = day_of_year - (153 * month_from_march + 2) / 5 + 1;
+  uint32_t month =
+      month_from_march < 10 ? month_from_march + 3 : month_from_march - 9;
+  uint32_t year = static_cast<uint32_t>(year_of_era + era * 400) +
+                  (month <= 2 ? 1 : 0);
+
+  // See X.690 (2015), 11.7.5: GeneralizedTime also includes the thousands digit
+  // and hundreds digit of the year to support dates after 2050 by representing
+  // the year with four digits.
+  // See X.690 (2015), 11.8.3: UTCTime represents dates between 1950 and 2050,
+  // so need only use tens and ones digit of the year.
+  // Partitioning the year ensure always valid encodings, i.e. if
+  // 1850 is being encoded as a UTCTime, it will be encoded as
+  // '50' for the year, rather than an error.
+  size_t year_len = use_two_digit_year ? 2 : 4;
+  FormatDigits(year, year_len, out);
+  uint8_t* time = out + year_len;
+  FormatDigits(month, 2, time);
+  FormatDigits(day, 2, time + 2);
+  FormatDigits(seconds_of_day / 3600, 2, time + 4);     // Hour
+  FormatDigits(seconds_of_day / 60 % 60, 2, time + 6);  // Minute
+  FormatDigits(seconds_of_day % 60, 2, time + 8);       // Seconds
+  // See X.690 (2015), 11.7.1 & 11.8.1: Encoding terminates with "Z".
+  time[10] = 'Z';
+  return year_len + 11;
+}
 
+// Encodes |timestamp| with |tag_byte|, unless |timestamp| cannot be encoded.
+void EncodeTime(uint8_t tag_byte,
+                const google::protobuf::Timestamp& timestamp,
+                bool use_two_digit_year,
+                DERWriter& der) {
+  uint8_t time[kMaxTimestampLen];
+  size_t time_len = FormatTimestamp(timestamp, use_two_digit_year, time);
+  // Check if encoding was successful.
+  if (time_len == 0) {
+    return;
+  }
+  der.Prepend(time, time_len);
+  der.PrependTagAndLength(tag_byte, time_len);
+}
+
+template <typename T>
+void EncodeToVector(const T& t, std::vector<uint8_t>& der) {
+  DERWriter writer;
+  Encode(t, writer);
+  writer.AppendTo(der);
+}
+
+template <typename T>
+size_t EncodeToArray(const T& t, uint8_t* buffer, size_t capacity) {
+  return EncodeToBuffer([&t](DERWriter& der) { Encode(t, der); }, buffer,
+                        capacity);
+}
+
+}  // namespace
+
+void Encode(const Boolean& boolean, DERWriter& der) {
   if (boolean.val()) {
     // If the boolean value is TRUE, the octet shall have any non-zero value
     // (X.690 (2015), 8.2.2).
-    der.push_back(0xFF);
+    der.Prepend(0xFF);
   } else {
     // If the boolean value is FALSE, the octet shall be zero (X.690
     // (2015), 8.2.2).
-    der.push_back(0x00);
+    der.Prepend(0x00);
   }
+  // The contents octets shall consist of a single octet (X.690 (2015), 8.2.1).
+  // Therefore, length is always 1.
+  der.PrependTagAndLength(kAsn1Boolean, 0x01);
 }
 
-void Encode(const Integer& integer, std::vector<uint8_t>& der) {
-  EncodeTagAndLength(kAsn1Integer,
-                     std::min<size_t>(0x01u, integer.val().size()), der.size(),
-                     der);
-
+void Encode(const Integer& integer, DERWriter& der) {
+  if (!der.ChargeSize(integer.val().size())) {
+    return;
+  }
   if (!integer.val().empty()) {
-    der.insert(der.end(), integer.val().begin(), integer.val().end());
+    der.PrependReference(integer.val());
   } else {
     // Cannot have an empty integer, so use the value 0.
-    der.push_back(0x00);
+    der.Prepend(0x00);
   }
-}
 
-void Encode(const OctetString& octet_string, std::vector<uint8_t>& der) {
-  EncodeTagAndLength(kAsn1OctetString, octet_string.val().size(), der.size(),
-                     der);
+  der.PrependTagAndLength(kAsn1Integer,
+                          std::min<size_t>(0x01u, integer.val().size()));
+}
 
+void Encode(const OctetString& octet_string, DERWriter& der) {
   // X.690 (2015), 8.7.2: The primitive encoding contains zero, one or more
   // contents octets.
-  der.insert(der.end(), octet_string.val().begin(), octet_string.val().end());
-}
+  size_t len = GetStringLen(octet_string);
+  if (!der.ChargeSize(len)) {
+    return;
+  }
+  PrependString(octet_string, der);
 
-void Encode(const BitString& bit_string, std::vector<uint8_t>& der) {
-  EncodeTagAndLength(kAsn1BitString, bit_string.val().size() + 1, der.size(),
-                     der);
+  der.PrependTagAndLength(kAsn1OctetString, len);
+}
 
-  if (!bit_string.val().empty()) {
-    der.push_back(bit_string.unused_bits());
-    der.insert(der.end(), bit_string.val().begin(), bit_string.val().end());
+void Encode(const BitString& bit_string, DERWriter& der) {
+  size_t len = GetStringLen(bit_string);
+  if (!der.ChargeSize(len)) {
+    return;
+  }
+  if (len != 0) {
+    PrependString(bit_string, der);
+    der.Prepend(bit_string.unused_bits());
   } else {
     // If the bitstring is empty, there shall be no subsequent octets,
     // and the initial octet shall be zero (X.690 (2015), 8.6.2.3).
-    der.push_back(0x00);
+    der.Prepend(0x00);
   }
+
+  der.PrependTagAndLength(kAsn1BitString, len + 1);
 }
 
-void Encode(const ObjectIdentifier& object_identifier,
-            std::vector<uint8_t>& der) {
+void Encode(const ObjectIdentifier& object_identifier, DERWriter& der) {
   // Save the current size in |tag_len_pos| to place tag and length
   // after the value is encoded.
   const size_t tag_len_pos = der.size();
 
   uint8_t root = object_identifier.root();
   uint8_t small_identifier = object_identifier.small_identifier();
-  auto subidentifier = object_identifier.subidentifier();
+  const auto& subidentifier = object_identifier.subidentifier();
+  int num_subidentifiers = subidentifier.size();
 
   // (X.690 (2015) 8.19.4): Only 39 subsequent values from nodes reached by X =
   // 0 and X = 1. Therefore, use |small_identifier| for |root| 0 or 1, and when
-  // |root| is 2, use first integer in |subidentifier| to obtain
+  // |root| is 2, use last integer in |subidentifier| to obtain
   // potentially higher values.
   size_t identifier = (root * 40) + small_identifier;
-  if (root == 2 && !subidentifier.empty()) {
-    identifier += *subidentifier.rbegin();
-    subidentifier.RemoveLast();
+  if (root == 2 && num_subidentifiers != 0) {
+    identifier += subidentifier.Get(--num_subidentifiers);
   }
-  InsertVariableIntBase128(identifier, der.size(), der);
 
-  for (const auto& value : subidentifier) {
+  for (int i = num_subidentifiers - 1; i >= 0; --i) {
     // The subidentifier is base 128 encoded (X.690 (2015), 8.19.2).
-    InsertVariableIntBase128(value, der.size(), der);
+    der.PrependVariableIntBase128(subidentifier.Get(i));
   }
+  der.PrependVariableIntBase128(identifier);
 
-  EncodeTagAndLength(kAsn1ObjectIdentifier, der.size() - tag_len_pos,
-                     tag_len_pos, der);
+  der.PrependTagAndLength(kAsn1ObjectIdentifier, der.size() - tag_len_pos);
 }
 
-void Encode(const UTCTime& utc_time, std::vector<uint8_t>& der) {
-  // Save the current size in |tag_len_pos| to place tag and length
-  // after the value is encoded.
-  const size_t tag_len_pos = der.size();
+void Encode(const UTCTime& utc_time, DERWriter& der) {
+  EncodeTime(kAsn1UTCTime, utc_time.time_stamp(), true, der);
+}
+
+void Encode(const GeneralizedTime& generalized_time, DERWriter& der) {
+  EncodeTime(kAsn1Generalizedtime, generalized_time.time_stamp(), false, der);
+}
 
-  EncodeTimestamp(utc_time.time_stamp(), true, der);
+void Encode(const Boolean& boolean, std::vector<uint8_t>& der) {
+  EncodeToVector(boolean, der);
+}
 
-  // Check if encoding was successful.
-  if (der.size() != tag_len_pos) {
-    EncodeTagAndLength(kAsn1UTCTime, der.size() - tag_len_pos, tag_len_pos,
-                       der);
-  }
+void Encode(const Integer& integer, std::vector<uint8_t>& der) {
+  EncodeToVector(integer, der);
+}
+
+void Encode(const OctetString& octet_string, std::vector<uint8_t>& der) {
+  EncodeToVector(octet_string, der);
+}
+
+void Encode(const BitString& bit_string, std::vector<uint8_t>& der) {
+  EncodeToVector(bit_string, der);
+}
+
+void Encode(const ObjectIdentifier& object_identifier,
+            std::vector<uint8_t>& der) {
+  EncodeToVector(object_identifier, der);
+}
+
+void Encode(const UTCTime& utc_time, std::vector<uint8_t>& der) {
+  EncodeToVector(utc_time, der);
 }
 
 void Encode(const GeneralizedTime& generalized_time,
             std::vector<uint8_t>& der) {
-  // Save the current size in |tag_len_pos| to place tag and length
-  // after the value is encoded.
-  const size_t tag_len_pos = der.size();
+  EncodeToVector(generalized_time, der);
+}
 
-  EncodeTimestamp(generalized_time.time_stamp(), false, der);
+size_t Encode(const Boolean& boolean, uint8_t* buffer, size_t capacity) {
+  return EncodeToArray(boolean, buffer, capacity);
+}
 
-  // Check if encoding was successful.
-  if (der.size() != tag_len_pos) {
-    EncodeTagAndLength(kAsn1Generalizedtime, der.size() - tag_len_pos,
-                       tag_len_pos, der);
-  }
+size_t Encode(const Integer& integer, uint8_t* buffer, size_t capacity) {
+  return EncodeToArray(integer, buffer, capacity);
+}
+
+size_t Encode(const OctetString& octet_string,
+              uint8_t* buffer,
+              size_t capacity) {
+  return EncodeToArray(octet_string, buffer, capacity);
+}
+
+size_t Encode(const BitString& bit_string, uint8_t* buffer, size_t capacity) {
+  return EncodeToArray(bit_string, buffer, capacity);
+}
+
+size_t Encode(const ObjectIdentifier& object_identifier,
+              uint8_t* buffer,
+              size_t capacity) {
+  return EncodeToArray(object_identifier, buffer, capacity);
+}
+
+size_t Encode(const UTCTime& utc_time, uint8_t* buffer, size_t capacity) {
+  return EncodeToArray(utc_time, buffer, capacity);
+}
+
+size_t Encode(const GeneralizedTime& generalized_time,
+              uint8_t* buffer,
+              size_t capacity) {
+  return EncodeToArray(generalized_time, buffer, capacity);
 }
 
 void EncodeTimestamp(const google::protobuf::Timestamp& timestamp,
                      bool use_two_digit_year,
                      std::vector<uint8_t>& der) {
-  std::string iso_date = google::protobuf::util::TimeUtil::ToString(timestamp);
-  if (iso_date.size() < 25) {
-    return;
-  }
-
-  std::string time_str;
-  // See X.690 (2015), 11.7.5: GeneralizedTime also includes the thousands digit
-  // and hundreds digit of the year to support dates after 2050 by representing
-  // the year with four digits.
-  // See X.690 (2015), 11.8.3: UTCTime represents dates between 1950 and 2050,
-  // so need only use tens and ones digit of the year.
-  // Partitioning the year ensure always valid encodings, i.e. if
-  // 1850 is being encoded as a UTCTime, it will be encoded as
-  // '50' for the year, rather than an error.
-  time_str += use_two_digit_year ? iso_date.substr(2, 2)
-                                 : iso_date.substr(0, 4);  // Year
-  time_str += iso_date.substr(5, 2);                       // Month
-  time_str += iso_date.substr(8, 2);                       // Day
-  time_str += iso_date.substr(11, 2);                      // Hour
-  time_str += iso_date.substr(14, 2);                      // Minute
-  time_str += iso_date.substr(17, 2);                      // Seconds
-  // See X.690 (2015), 11.7.1 & 11.8.1: Encoding terminates with "Z".
-  time_str += "Z";
-
-  der.reserve(der.size() + time_str.size());
-  std::transform(time_str.begin(), time_str.end(), std::back_inserter(der),
-                 [](char c) -> size_t { return c; });
+  uint8_t time[kMaxTimestampLen];
+  size_t time_len = FormatTimestamp(timestamp, use_two_digit_year, time);
+  der.insert(der.end(), time, time + time_len);
 }
 
-}  // namespace asn1_universal_types
\ No newline at end of file
+}  // namespace asn1_universal_types
@@ -22,6 +22,7 @@
 #include <vector>
 
 #include "asn1_universal_types.pb.h"
+#include "common.h"
 
 namespace asn1_universal_types {
 
@@ -54,6 +55,36 @@ void Encode(const UTCTime& utc_time, std::vector<uint8_t>& der);
 // Appends encoded |generalized_time| to |der|.
 void Encode(const GeneralizedTime& generalized_time, std::vector<uint8_t>& der);
 
+// The overloads below encode the same types as above in front of the bytes
+// already written to |der|, so that they can be part of a larger encoding.
+// Integers, bit strings and octet strings whose values don't fit the
+// |EncodingBudget| of |der| are left out.
+void Encode(const Boolean& boolean, DERWriter& der);
+void Encode(const Integer& integer, DERWriter& der);
+void Encode(const BitString& bit_string, DERWriter& der);
+void Encode(const OctetString& octet_string, DERWriter& der);
+void Encode(const ObjectIdentifier& object_identifier, DERWriter& der);
+void Encode(const UTCTime& utc_time, DERWriter& der);
+void Encode(const GeneralizedTime& generalized_time, DERWriter& der);
+
+// The overloads below encode the same types as above into the start of
+// |buffer|, which can hold |capacity| bytes, and return the encoded size.
+// If the returned size is larger than |capacity|, the encoding didn't fit, and
+// the contents of |buffer| are unspecified (see |EncodeToBuffer|).
+size_t Encode(const Boolean& boolean, uint8_t* buffer, size_t capacity);
+size_t Encode(const Integer& integer, uint8_t* buffer, size_t capacity);
+size_t Encode(const BitString& bit_string, uint8_t* buffer, size_t capacity);
+size_t Encode(const OctetString& octet_string,
+              uint8_t* buffer,
+              size_t capacity);
+size_t Encode(const ObjectIdentifier& object_identifier,
+              uint8_t* buffer,
+              size_t capacity);
+size_t Encode(const UTCTime& utc_time, uint8_t* buffer, size_t capacity);
+size_t Encode(const GeneralizedTime& generalized_time,
+              uint8_t* buffer,
+              size_t capacity);
+
 // Converts |timestamp| to a DER-encoded string (i.e. as used by UTCTime and
 // GeneralizedTime), according to X.690 (2015), 11.7 / 11.8.
 // |use_two_digit_year| controls whether two or four digits will be used for the
@@ -0,0 +1,154 @@
+// Copyright 2020 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+// Checks that |EncodeTimestamp| formats days across the range of
+// google.protobuf.Timestamp, every day around the ends of February and of the
+// months at the turns of centuries, and every second around the edges of the
+// range and the epoch, exactly like the formatter it replaced, which cut up
+// the string of |TimeUtil::ToString|.
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include <google/protobuf/timestamp.pb.h>
+#include <google/protobuf/util/time_util.h>
+
+#include "asn1_universal_types_to_der.h"
+#include "test_checker.h"
+
+namespace {
+
+using google::protobuf::Timestamp;
+using google::protobuf::util::TimeUtil;
+
+constexpr int64_t kSecondsPerDay = 86400;
+
+// The formatter that |EncodeTimestamp| replaced. Timestamps that |ToString|
+// formats with at most three fractional digits, or not at all, are left out.
+std::vector<uint8_t> ReferenceEncodeTimestamp(const Timestamp& timestamp,
+                                              bool use_two_digit_year) {
+  std::string iso_date = TimeUtil::ToString(timestamp);
+  if (iso_date.size() < 25) {
+    return {};
+  }
+  std::string time_str;
+  time_str += use_two_digit_year ? iso_date.substr(2, 2)
+                                 : iso_date.substr(0, 4);  // Year
+  time_str += iso_date.substr(5, 2);                       // Month
+  time_str += iso_date.substr(8, 2);                       // Day
+  time_str += iso_date.substr(11, 2);                      // Hour
+  time_str += iso_date.substr(14, 2);                      // Minute
+  time_str += iso_date.substr(17, 2);                      // Seconds
+  time_str += "Z";
+  return std::vector<uint8_t>(time_str.begin(), time_str.end());
+}
+
+// Compares both formats of the timestamp of |seconds| and |nanos|.
+void CheckTimestamp(int64_t seconds,
+                    int32_t nanos,
+                    test_checker::Checker& checker) {
+  Timestamp timestamp;
+  timestamp.set_seconds(seconds);
+  timestamp.set_nanos(nanos);
+  std::vector<uint8_t> encoded;
+  for (bool use_two_digit_year : {true, false}) {
+    asn1_universal_types::EncodeTimestamp(timestamp, use_two_digit_year,
+                                          encoded);
+    checker.Expect(
+        encoded == ReferenceEncodeTimestamp(timestamp, use_two_digit_year),
+        "mismatch: seconds %lld, nanos %d, %s year",
+        static_cast<long long>(seconds), nanos,
+        use_two_digit_year ? "two-digit" : "four-digit");
+    encoded.clear();
+  }
+}
+
+// Returns whether the day that starts at |seconds| since the epoch is the
+// 28th of February to the 1st of March, which has a leap day between them in
+// leap years, or is within a day of the end of a month in the years either
+// side of the turn of a century.
+bool IsBoundary(int64_t seconds) {
+  // The civil date of the day, from the days since 0000-03-01, so that leap
+  // days end the 400, 100 and 4 year cycles.
+  int64_t days = seconds / kSecondsPerDay + 719468;
+  int64_t era = (days >= 0 ? days : days - 146096) / 146097;
+  int64_t day_of_era = days - era * 146097;
+  int64_t year_of_era = (day_of_era - day_of_era / 1460 + day_of_era / 36524 -
+                         day_of_era / 146096) /
+                        365;
+  int64_t day_of_year = day_of_era - (365 * year_of_era + year_of_era / 4 -
+                                      year_of_era / 100);
+  // 0 is March, and 11 is February.
+  int64_t month = (5 * day_of_year + 2) / 153;
+  int64_t day_of_month = day_of_year - (153 * month + 2) / 5 + 1;
+  int64_t year = year_of_era + era * 400 + (month >= 10);
+  if ((month == 11 && day_of_month >= 28) ||
+      (month == 0 && day_of_month == 1)) {
+    return true;
+  }
+  bool month_end = day_of_month == 1 || day_of_month >= 28;
+  int64_t year_of_century = (year % 100 + 100) % 100;
+  return month_end && (year_of_century <= 1 || year_of_century == 99);
+}
+
+}  // namespace
+
+int main() {
+  // Two days past each end of the range, which neither formatter encodes.
+  const int64_t kMinSeconds =
+      TimeUtil::kTimestampMinSeconds - 2 * kSecondsPerDay;
+  const int64_t kMaxSeconds =
+      TimeUtil::kTimestampMaxSeconds + 2 * kSecondsPerDay;
+  // Nanos that are encoded, that are whole milliseconds and left out, and
+  // that are out of range.
+  const int32_t kNanos[] = {0,         1,         999,       1000,
+                            500000,    1000000,   2000000,   123456789,
+                            999000000, 999999999, 1000000000, -1};
+  const int64_t kSecondsOfDay[] = {0,    1,    59,    60,
+                                   3599, 3600, 43210, kSecondsPerDay - 1};
+
+  test_checker::Checker checker("timestamps");
+  // Every 97th day of the range and every boundary day, at times of day that
+  // roll over every field, with nanos that are never whole milliseconds.
+  for (int64_t day = kMinSeconds; day <= kMaxSeconds; day += kSecondsPerDay) {
+    int64_t day_number = (day - kMinSeconds) / kSecondsPerDay;
+    if (day_number % 97 != 0 && !IsBoundary(day)) {
+      continue;
+    }
+    for (int64_t second_of_day : kSecondsOfDay) {
+      int32_t nanos = 1 + day_number % 999999;
+      CheckTimestamp(day + second_of_day, nanos, checker);
+    }
+  }
+  // Every nanos class, a day either side of the edges of the range and the
+  // epoch, in steps of 7 seconds so that every second of the minute is hit.
+  const int64_t kEdges[] = {kMinSeconds + kSecondsPerDay,
+                            TimeUtil::kTimestampMinSeconds, 0,
+                            TimeUtil::kTimestampMaxSeconds,
+                            kMaxSeconds - kSecondsPerDay};
+  for (int64_t edge : kEdges) {
+    for (int64_t seconds = edge - kSecondsPerDay;
+         seconds <= edge + kSecondsPerDay; seconds += 7) {
+      for (int32_t nanos : kNanos) {
+        CheckTimestamp(seconds, nanos, checker);
+      }
+    }
+  }
+
+  return checker.Finish();
+}
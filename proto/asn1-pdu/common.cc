@@ -17,60 +17,106 @@
 #include "common.h"
 
 #include <limits.h>
-#include <math.h>
-
-uint8_t GetVariableIntLen(uint64_t value, size_t base) {
-  uint8_t base_bits = log2(base);
-  for (uint8_t num_bits = (sizeof(value) - 1) * CHAR_BIT; num_bits >= base_bits;
-       num_bits -= base_bits) {
-    if (value >> num_bits) {
-      return ceil(static_cast<double>(num_bits) / base_bits) + 1;
-    }
+#include <string.h>
+
+#include <algorithm>
+
+namespace {
+
+// Writes |value| to |out| as |len| base 128 digits, most significant first.
+// All but the last byte have the high bit set to 1 (X.690 (2015), 8.1.2.4.2).
+void WriteVariableIntBase128(uint64_t value, uint8_t len, uint8_t* out) {
+  for (uint8_t i = len - 1; i != 0; --i) {
+    *out++ = (0x01 << 7) | ((value >> (i * 7)) & 0x7F);
+  }
+  *out = value & 0x7F;
+}
+
+// Writes |value| to |out| as |len| base 256 digits, most significant first.
+void WriteVariableIntBase256(uint64_t value, uint8_t len, uint8_t* out) {
+  for (uint8_t shift = len; shift != 0; --shift) {
+    *out++ = (value >> ((shift - 1) * CHAR_BIT)) & 0xFF;
+  }
+}
+
+}  // namespace
+
+void WriteDefiniteLength(size_t len, uint8_t* out) {
+  // X.690 (2015), 8.1.3.3: The long-form is used when the length is
+  // larger than 127.
+  // Note: the number of bytes of |len| is not checked here, because it will
+  // equal 1 for values [128..255], but those require the long-form length.
+  if (len > 127) {
+    // See X.690 (2015) 8.1.3.5.
+    // Long-form length is encoded as a byte with the high-bit set to indicate
+    // the long-form, while the remaining bits indicate how many bytes are used
+    // to encode the length.
+    uint8_t len_num_bytes = GetVariableIntLen(len, 256);
+    *out++ = 0x80 | len_num_bytes;
+    WriteVariableIntBase256(len, len_num_bytes, out);
+  } else {
+    *out = len;
+  }
+}
+
+size_t RoundUpToPowerOfTwo(size_t value) {
+  // Doubling past the largest power of two would overflow to 0, and never end.
+  constexpr size_t kMaxPower = ~(SIZE_MAX >> 1);
+  if (value > kMaxPower) {
+    return kMaxPower;
+  }
+  size_t power = 1;
+  while (power < value) {
+    power <<= 1;
+  }
+  return power;
+}
+
+void WriteRepeated(const uint8_t* pattern,
+                   size_t pattern_len,
+                   size_t count,
+                   uint8_t* out) {
+  size_t len = pattern_len * count;
+  if (len == 0) {
+    return;
+  }
+  memcpy(out, pattern, pattern_len);
+  // The repetitions written so far are copied after themselves, so a value of
+  // megabytes takes a few dozen copies.
+  for (size_t written = pattern_len; written != len;) {
+    size_t n = std::min(written, len - written);
+    memcpy(out + written, out, n);
+    written += n;
   }
-  // Special-case: zero requires one, not zero bytes.
-  return 1;
 }
 
 void InsertVariableIntBase128(uint64_t value,
                               size_t pos,
                               std::vector<uint8_t>& der) {
-  std::vector<uint8_t> variable_int;
-  for (uint8_t i = GetVariableIntLen(value, 128) - 1; i != 0; --i) {
-    // If it's not the last byte, the high bit is set to 1.
-    variable_int.push_back((0x01 << 7) | ((value >> (i * 7)) & 0x7F));
-  }
-  variable_int.push_back(value & 0x7F);
-  der.insert(der.begin() + pos, variable_int.begin(), variable_int.end());
+  uint8_t variable_int[kMaxVariableIntLen];
+  uint8_t len = GetVariableIntLen(value, 128);
+  WriteVariableIntBase128(value, len, variable_int);
+  der.insert(der.begin() + pos, variable_int, variable_int + len);
 }
 
 void InsertVariableIntBase256(uint64_t value,
                               size_t pos,
                               std::vector<uint8_t>& der) {
-  std::vector<uint8_t> variable_int;
-  for (uint8_t shift = GetVariableIntLen(value, 256); shift != 0; --shift) {
-    variable_int.push_back((value >> ((shift - 1) * CHAR_BIT)) & 0xFF);
-  }
-  der.insert(der.begin() + pos, variable_int.begin(), variable_int.end());
+  uint8_t variable_int[sizeof(value)];
+  uint8_t len = GetVariableIntLen(value, 256);
+  WriteVariableIntBase256(value, len, variable_int);
+  der.insert(der.begin() + pos, variable_int, variable_int + len);
 }
 
 void EncodeTagAndLength(uint8_t tag_byte,
                         size_t len,
                         size_t pos,
                         std::vector<uint8_t>& der) {
-  InsertVariableIntBase256(len, pos, der);
-  // X.690 (2015), 8.1.3.3: The long-form is used when the length is
-  // larger than 127.
-  // Note: |len_num_bytes| is not checked here, because it will equal
-  // 1 for values [128..255], but those require the long-form length.
-  if (len > 127) {
-    // See X.690 (2015) 8.1.3.5.
-    // Long-form length is encoded as a byte with the high-bit set to indicate
-    // the long-form, while the remaining bits indicate how many bytes are used
-    // to encode the length.
-    size_t len_num_bytes = GetVariableIntLen(len, 256);
-    der.insert(der.begin() + pos, (0x80 | len_num_bytes));
-  }
-  der.insert(der.begin() + pos, tag_byte);
+  uint8_t tag_and_len[1 + GetDefiniteLengthLen(SIZE_MAX)];
+  tag_and_len[0] = tag_byte;
+  WriteDefiniteLength(len, tag_and_len + 1);
+  der.insert(der.begin() + pos, tag_and_len,
+             tag_and_len + 1 + GetDefiniteLengthLen(len));
 }
 
 void ReplaceTag(uint8_t tag_byte,
@@ -89,4 +135,383 @@ void ReplaceTag(uint8_t tag_byte,
     start = der.erase(start, end);
   }
   *start = tag_byte;
-}
\ No newline at end of file
+}
+
+bool ParseTLVHeader(const uint8_t* data, size_t size, TLVHeader& header) {
+  if (size == 0) {
+    return false;
+  }
+  size_t pos = 0;
+  header.identifier = data[pos++];
+  header.tag_num = header.identifier & 0x1F;
+  if (header.tag_num == 0x1F) {
+    // The high-tag-number form base 128 encodes the tag number in the
+    // subsequent octets (X.690 (2015), 8.1.2.4.2).
+    uint64_t tag_num = 0;
+    do {
+      if (pos == size || tag_num > (UINT32_MAX >> 7)) {
+        return false;
+      }
+      tag_num = (tag_num << 7) | (data[pos] & 0x7F);
+    } while (data[pos++] & 0x80);
+    header.tag_num = tag_num;
+  }
+  header.identifier_len = pos;
+
+  if (pos == size) {
+    return false;
+  }
+  uint8_t first = data[pos++];
+  header.indefinite = first == 0x80;
+  header.value_len = first;
+  if (first & 0x80 && !header.indefinite) {
+    // The long form (X.690 (2015), 8.1.3.5), where 0xFF is reserved.
+    size_t num_bytes = first & 0x7F;
+    if (first == 0xFF || num_bytes > sizeof(size_t) ||
+        num_bytes > size - pos) {
+      return false;
+    }
+    header.value_len = 0;
+    for (size_t i = 0; i < num_bytes; ++i) {
+      header.value_len = (header.value_len << 8) | data[pos++];
+    }
+  } else if (header.indefinite) {
+    header.value_len = 0;
+  }
+  header.length_len = pos - header.identifier_len;
+  return true;
+}
+
+void TLVIndex::Truncate(size_t size) {
+  while (!tlvs_.empty() && tlvs_.back().offset > size) {
+    tlvs_.pop_back();
+  }
+}
+
+void TLVIndex::ReplaceTag(size_t pos,
+                          size_t num_removed,
+                          uint8_t identifier,
+                          uint32_t tag_num) {
+  if (tlvs_.empty() || tlvs_.back().offset != pos + num_removed) {
+    return;
+  }
+  TLV& tlv = tlvs_.back();
+  tlv.offset = pos;
+  tlv.header_len -= num_removed;
+  tlv.identifier = identifier;
+  tlv.tag_num = tag_num;
+}
+
+void TLVIndex::Finish(size_t size) {
+  // The TLVs were recorded as their identifiers were written, back to front,
+  // so reversing them orders them by offset, with every TLV before the ones
+  // nested in it.
+  std::reverse(tlvs_.begin(), tlvs_.end());
+  // The ends of the TLVs that contain the current one, innermost last.
+  std::vector<size_t> ends;
+  for (TLV& tlv : tlvs_) {
+    tlv.offset = size - tlv.offset;
+    while (!ends.empty() && ends.back() <= tlv.offset) {
+      ends.pop_back();
+    }
+    tlv.depth = ends.size();
+    ends.push_back(tlv.offset + tlv.header_len + tlv.value_len);
+  }
+}
+
+void TLVIndex::Parse(const uint8_t* data, size_t size) {
+  tlvs_.clear();
+  open_.clear();
+  size_t pos = 0;
+  while (true) {
+    size_t end = open_.empty() ? size : open_.back().end;
+    if (!open_.empty() && open_.back().indefinite && end - pos >= 2 &&
+        data[pos] == 0x00 && data[pos + 1] == 0x00) {
+      // The EOC marker ends the value (X.690 (2015), 8.1.5).
+      TLV& tlv = tlvs_[open_.back().index];
+      pos += 2;
+      tlv.value_len = pos - tlv.offset - tlv.header_len;
+      open_.pop_back();
+      continue;
+    }
+
+    TLVHeader header;
+    if (pos == end || !ParseTLVHeader(data + pos, end - pos, header) ||
+        header.value_len > end - pos - header.identifier_len -
+                               header.length_len) {
+      if (open_.empty()) {
+        break;
+      }
+      // The rest of the value isn't made of TLVs, or the value ended.
+      if (open_.back().indefinite) {
+        TLV& tlv = tlvs_[open_.back().index];
+        tlv.value_len = end - tlv.offset - tlv.header_len;
+      }
+      pos = end;
+      open_.pop_back();
+      continue;
+    }
+
+    size_t header_len = header.identifier_len + header.length_len;
+    tlvs_.push_back({static_cast<uint32_t>(pos),
+                     static_cast<uint32_t>(header_len),
+                     static_cast<uint32_t>(header.value_len),
+                     static_cast<uint32_t>(open_.size()), header.tag_num,
+                     header.identifier});
+    if (header.indefinite) {
+      // Nested TLVs are parsed to find the EOC marker, which sets the length.
+      open_.push_back({tlvs_.size() - 1, end, true});
+      pos += header_len;
+    } else if (header.identifier & kAsn1Constructed) {
+      open_.push_back(
+          {tlvs_.size() - 1, pos + header_len + header.value_len, false});
+      pos += header_len;
+    } else {
+      pos += header_len + header.value_len;
+    }
+  }
+}
+
+DERWriter::DERWriter(uint8_t* buffer, size_t capacity)
+    : buffer_(buffer),
+      capacity_(capacity),
+      begin_(capacity),
+      fixed_capacity_(true) {}
+
+void DERWriter::Clear() {
+  begin_ = capacity_;
+  num_dropped_ = 0;
+  references_.clear();
+  num_referenced_ = 0;
+  num_tiles_ = 0;
+  if (tlv_index_) {
+    tlv_index_->Clear();
+  }
+  budget_start_ = 0;
+  num_nodes_ = 0;
+  budget_exceeded_ = EncodingBudget::kNone;
+}
+
+void DERWriter::Truncate(size_t size) {
+  if (tlv_index_) {
+    tlv_index_->Truncate(size);
+  }
+  // The references written since, which end at or after |size|.
+  while (!references_.empty() &&
+         references_.back().num_following + num_referenced_ -
+                 references_.back().len >=
+             size) {
+    num_referenced_ -= references_.back().len;
+    references_.pop_back();
+  }
+  size -= num_referenced_;
+  size_t num_written = capacity_ - begin_;
+  if (size > num_written) {
+    num_dropped_ = size - num_written;
+    return;
+  }
+  begin_ = capacity_ - size;
+  num_dropped_ = 0;
+}
+
+void DERWriter::set_budget(const EncodingBudget& budget) {
+  budget_ = budget;
+  budget_start_ = size();
+  num_nodes_ = 0;
+  budget_exceeded_ = EncodingBudget::kNone;
+}
+
+void DERWriter::FinishBudget() {
+  if (!over_budget() && size() - budget_start_ > budget_.max_size) {
+    budget_exceeded_ = EncodingBudget::kSize;
+  }
+  if (over_budget() && budget_.policy == EncodingBudget::kEmpty) {
+    Truncate(budget_start_);
+  }
+}
+
+template <typename SegmentFn>
+void DERWriter::ForEachSegment(SegmentFn fn) const {
+  // The bytes of |buffer_| in front of each reference, the reference, and the
+  // bytes of |buffer_| after the first one written.
+  const uint8_t* pos = data();
+  for (auto it = references_.rbegin(); it != references_.rend(); ++it) {
+    const uint8_t* end = buffer_ + capacity_ - it->num_following;
+    if (end != pos) {
+      fn(pos, end - pos);
+    }
+    fn(it->bytes, it->len);
+    pos = end;
+  }
+  if (pos != buffer_ + capacity_) {
+    fn(pos, buffer_ + capacity_ - pos);
+  }
+}
+
+void DERWriter::AppendTo(std::vector<uint8_t>& der) const {
+  if (references_.empty()) {
+    der.insert(der.end(), data(), data() + size());
+    return;
+  }
+  der.reserve(der.size() + size());
+  ForEachSegment([&der](const uint8_t* bytes, size_t len) {
+    der.insert(der.end(), bytes, bytes + len);
+  });
+}
+
+void DERWriter::AppendSegmentsTo(std::vector<struct iovec>& segments) const {
+  ForEachSegment([&segments](const uint8_t* bytes, size_t len) {
+    segments.push_back({const_cast<uint8_t*>(bytes), len});
+  });
+}
+
+uint8_t* DERWriter::PrependUninitialized(size_t len) {
+  if (num_dropped_ != 0 || (begin_ < len && fixed_capacity_)) {
+    num_dropped_ += len;
+    return nullptr;
+  }
+  if (begin_ < len) {
+    // Double the capacity, and move the bytes written so far to the end of the
+    // new buffer, so that prepending stays amortized constant time.
+    size_t size = capacity_ - begin_;
+    size_t capacity = std::max<size_t>({capacity_ * 2, size + len, 256});
+    std::unique_ptr<uint8_t[]> buffer(new uint8_t[capacity]);
+    if (size != 0) {
+      memcpy(buffer.get() + capacity - size, data(), size);
+    }
+    ASN1_PDU_STATS_ADD(allocations, 1);
+    ASN1_PDU_STATS_ADD(bytes_moved, size);
+    owned_buffer_ = std::move(buffer);
+    buffer_ = owned_buffer_.get();
+    capacity_ = capacity;
+    begin_ = capacity - size;
+  }
+  begin_ -= len;
+  return buffer_ + begin_;
+}
+
+void DERWriter::Prepend(uint8_t byte) {
+  uint8_t* out = PrependUninitialized(1);
+  if (out) {
+    *out = byte;
+  }
+}
+
+void DERWriter::Prepend(const uint8_t* bytes, size_t len) {
+  uint8_t* out = PrependUninitialized(len);
+  if (out && len != 0) {
+    memcpy(out, bytes, len);
+  }
+}
+
+void DERWriter::Prepend(const std::string& bytes) {
+  Prepend(reinterpret_cast<const uint8_t*>(bytes.data()), bytes.size());
+}
+
+constexpr size_t DERWriter::kMinReferenceLen;
+
+void DERWriter::PrependReference(const uint8_t* bytes, size_t len) {
+  if (!reference_values_ || fixed_capacity_ || len < kMinReferenceLen) {
+    Prepend(bytes, len);
+    return;
+  }
+  references_.push_back({capacity_ - begin_, bytes, len});
+  num_referenced_ += len;
+}
+
+void DERWriter::PrependReference(const std::string& bytes) {
+  PrependReference(reinterpret_cast<const uint8_t*>(bytes.data()),
+                   bytes.size());
+}
+
+void DERWriter::PrependRepeated(const uint8_t* pattern,
+                                size_t pattern_len,
+                                size_t count) {
+  size_t len = pattern_len * count;
+  if (!reference_values_ || fixed_capacity_ || len <= kRepeatTileSize) {
+    uint8_t* out = PrependUninitialized(len);
+    if (out) {
+      WriteRepeated(pattern, pattern_len, count, out);
+    }
+    return;
+  }
+  size_t repeats_per_tile = GetRepeatsPerTile(pattern_len);
+  const uint8_t* tile = pattern;
+  if (repeats_per_tile != 1) {
+    if (num_tiles_ == tiles_.size()) {
+      tiles_.emplace_back(new uint8_t[kRepeatTileSize]);
+    }
+    uint8_t* new_tile = tiles_[num_tiles_++].get();
+    WriteRepeated(pattern, pattern_len, repeats_per_tile, new_tile);
+    tile = new_tile;
+  }
+  // Every repetition is the same, so those that don't fill a tile go first.
+  PrependReference(tile, count % repeats_per_tile * pattern_len);
+  for (size_t i = count / repeats_per_tile; i != 0; --i) {
+    PrependReference(tile, repeats_per_tile * pattern_len);
+  }
+}
+
+void DERWriter::PrependVariableIntBase128(uint64_t value) {
+  uint8_t len = GetVariableIntLen(value, 128);
+  uint8_t* out = PrependUninitialized(len);
+  if (out) {
+    WriteVariableIntBase128(value, len, out);
+  }
+}
+
+void DERWriter::PrependVariableIntBase256(uint64_t value) {
+  uint8_t len = GetVariableIntLen(value, 256);
+  uint8_t* out = PrependUninitialized(len);
+  if (out) {
+    WriteVariableIntBase256(value, len, out);
+  }
+}
+
+void DERWriter::PrependDefiniteLength(size_t len) {
+  uint8_t* out = PrependUninitialized(GetDefiniteLengthLen(len));
+  if (out) {
+    WriteDefiniteLength(len, out);
+  }
+}
+
+void DERWriter::PrependTagAndLength(uint8_t tag_byte, size_t len) {
+  uint8_t* out = PrependUninitialized(1 + GetDefiniteLengthLen(len));
+  if (out) {
+    *out = tag_byte;
+    WriteDefiniteLength(len, out + 1);
+  }
+  ChargeNode();
+  if (tlv_index_) {
+    tlv_index_->Add(size(), 1 + GetDefiniteLengthLen(len), len, tag_byte,
+                    tag_byte & 0x1F);
+  }
+}
+
+void DERWriter::ReplaceTag(uint8_t tag_byte, size_t size) {
+  // The tag can't be replaced if it was dropped, in which case |size()| may
+  // overestimate the size by the bytes of a high tag number. Only values are
+  // referenced, so if the bytes written last were, no tag follows them.
+  if (this->size() <= size || truncated() ||
+      (!references_.empty() &&
+       references_.back().num_following == capacity_ - begin_)) {
+    return;
+  }
+  uint8_t* start = buffer_ + begin_;
+  // Check to see if it's a high tag (multi-byte)
+  if ((*start & 0x1F) == 0x1F) {
+    // High-tag will have 0x80 set if there is >1 byte remaining
+    uint8_t* end = start + 1;
+    while (end != buffer_ + capacity_ && (*end & 0x80))
+      ++end;
+    begin_ += end - start;
+    if (tlv_index_) {
+      tlv_index_->ReplaceTag(this->size(), end - start, tag_byte,
+                             tag_byte & 0x1F);
+    }
+    start = end;
+  } else if (tlv_index_) {
+    tlv_index_->ReplaceTag(this->size(), 0, tag_byte, tag_byte & 0x1F);
+  }
+  *start = tag_byte;
+}
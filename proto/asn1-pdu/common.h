@@ -17,10 +17,18 @@
 #ifndef PROTO_ASN1_PDU_COMMON_H_
 #define PROTO_ASN1_PDU_COMMON_H_
 
+#include <limits.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <string.h>
+#include <sys/uio.h>
 
+#include <memory>
+#include <string>
 #include <vector>
 
+#include "encoder_stats.h"
+
 constexpr uint8_t kAsn1Constructed = 0x20u;
 constexpr uint8_t kAsn1Universal = 0u;
 constexpr uint8_t kAsn1Application = 0x40u;
@@ -52,9 +60,68 @@ constexpr uint8_t kAsn1Generalizedtime = kAsn1Universal | 0x18u;
 // consctructed (X.690 (2015), 8.9.1).
 constexpr uint8_t kAsn1Sequence = kAsn1Universal | kAsn1Constructed | 0x10u;
 
+// The maximum number of bytes of a base 128 encoded 64-bit integer.
+constexpr uint8_t kMaxVariableIntLen = 10;
+
 // Returns the number of bytes needed to |base| encode |value| into a
-// variable-length unsigned integer with no leading zeros.
-uint8_t GetVariableIntLen(uint64_t value, size_t base);
+// variable-length unsigned integer with no leading zeros. |base| must be a
+// power of two, such as 128 or 256.
+// The length is computed from the number of leading zero bits of |value|,
+// so it can be evaluated at compile time for constant values. It uses the
+// bit-counting builtins of GCC and Clang, the only compilers supported (see
+// CMakeLists.txt).
+constexpr uint8_t GetVariableIntLen(uint64_t value, size_t base) {
+  // |value| | 1 has at least one significant bit, because zero requires one,
+  // not zero bytes.
+  return (sizeof(value) * CHAR_BIT - __builtin_clzll(value | 1) +
+          (__builtin_ctzll(base) - 1)) /
+         __builtin_ctzll(base);
+}
+
+// Returns the number of bytes needed to encode |len| using the definite-form
+// length (X.690 (2015), 8.1.3.3-8.1.3.5 & 10.1).
+constexpr uint8_t GetDefiniteLengthLen(size_t len) {
+  // X.690 (2015), 8.1.3.3: The long-form is used when the length is larger
+  // than 127, and prefixes the length with a byte holding its size.
+  return len > 127 ? 1 + GetVariableIntLen(len, 256) : 1;
+}
+
+// Writes |len| to |out| using the definite-form length (X.690 (2015),
+// 8.1.3.3-8.1.3.5 & 10.1), which takes |GetDefiniteLengthLen(len)| bytes.
+void WriteDefiniteLength(size_t len, uint8_t* out);
+
+// The finalizer of MurmurHash3, which makes every bit of |value| affect every
+// bit of the result. The hashes of the encodings and of the PDUs finish with
+// it.
+inline uint64_t Mix(uint64_t value) {
+  value ^= value >> 33;
+  value *= 0xff51afd7ed558ccd;
+  value ^= value >> 33;
+  value *= 0xc4ceb9fe1a85ec53;
+  return value ^ (value >> 33);
+}
+
+// Returns the smallest power of two that is at least |value|, or the largest
+// power of two a size_t holds if |value| is larger than that.
+size_t RoundUpToPowerOfTwo(size_t value);
+
+// Writes |count| repetitions of the |pattern_len| bytes at |pattern| to |out|,
+// which must hold all of them, doubling the repetitions written with every
+// copy.
+void WriteRepeated(const uint8_t* pattern,
+                   size_t pattern_len,
+                   size_t count,
+                   uint8_t* out);
+
+// Writers that don't copy every repetition of a pattern copy as many as fit in
+// a tile of |kRepeatTileSize| bytes, once, and write the tile again and again.
+constexpr size_t kRepeatTileSize = 16 << 10;
+
+// Returns the number of repetitions of a pattern of |pattern_len| bytes that
+// fit in a tile, which is 1 for patterns larger than a tile.
+constexpr size_t GetRepeatsPerTile(size_t pattern_len) {
+  return pattern_len < kRepeatTileSize ? kRepeatTileSize / pattern_len : 1;
+}
 
 // Converts |value| to a base 128, variable-length, big-endian representation
 // and inserts the result into into |der| at |pos|.
@@ -82,4 +149,428 @@ void EncodeTagAndLength(uint8_t tag_byte,
 // that |der| remains a valid DER encoding.
 void ReplaceTag(uint8_t tag_byte, size_t pos_of_tag, std::vector<uint8_t>& der);
 
+// A TLV (the identifier, length and value of an encoded value) in an
+// encoding, as recorded in a |TLVIndex|.
+struct TLV {
+  // The offset of the identifier from the start of the encoding.
+  uint32_t offset;
+  // The size of the identifier and length.
+  uint32_t header_len;
+  // The size of the value that follows the header, including the EOC marker
+  // of an indefinite length. For a PDU with a length override, this is the
+  // size of the value that was encoded, not the size in the override.
+  uint32_t value_len;
+  // The number of TLVs whose values contain this one.
+  uint32_t depth;
+  // The tag number, including high tag numbers (X.690 (2015), 8.1.2.4).
+  uint32_t tag_num;
+  // The first byte of the identifier, which holds the class and whether the
+  // encoding is constructed (X.690 (2015), 8.1.2).
+  uint8_t identifier;
+};
+
+// The identifier and length of a TLV, as parsed by |ParseTLVHeader|.
+struct TLVHeader {
+  uint8_t identifier;
+  uint32_t tag_num;
+  size_t identifier_len;
+  size_t length_len;
+  // The length of the value, unless the length is indefinite.
+  size_t value_len;
+  bool indefinite;
+};
+
+// Parses the identifier and length at the start of the |size| bytes at |data|
+// into |header| (X.690 (2015), 8.1.2-8.1.3). Lengths that aren't minimally
+// encoded are accepted, as BER does. Returns false if they don't fit in
+// |size| bytes, or are invalid, such as the reserved length 0xFF.
+bool ParseTLVHeader(const uint8_t* data, size_t size, TLVHeader& header);
+
+// The TLVs of an encoding, in the order they appear in it, which encoders
+// record as they write them when a |TLVIndex| is attached to their
+// |DERWriter|, or which |Parse| finds in an encoding. This lets byte-level
+// mutators, coverage attribution and minimizers work on whole TLVs without
+// parsing the encoding again.
+// Encoders already know where each TLV is, so recording it costs a store per
+// TLV, and only a check of the attached index when none is.
+class TLVIndex {
+ public:
+  TLVIndex() = default;
+  TLVIndex(const TLVIndex&) = delete;
+  TLVIndex& operator=(const TLVIndex&) = delete;
+
+  // Returns the TLVs, ordered by offset, once |Finish| was called.
+  const std::vector<TLV>& tlvs() const { return tlvs_; }
+
+  void Clear() { tlvs_.clear(); }
+
+  // Records a TLV that was written to a |DERWriter| whose |size()| is |pos|
+  // afterwards.
+  void Add(size_t pos,
+           size_t header_len,
+           size_t value_len,
+           uint8_t identifier,
+           uint32_t tag_num) {
+    tlvs_.push_back({static_cast<uint32_t>(pos),
+                     static_cast<uint32_t>(header_len),
+                     static_cast<uint32_t>(value_len), 0, tag_num,
+                     identifier});
+  }
+
+  // Drops the TLVs written after |size()| of the writer returned |size|.
+  void Truncate(size_t size);
+
+  // Replaces the identifier of the TLV written last, if the writer's |size()|
+  // is |pos| since, after a |DERWriter::ReplaceTag| that removed |num_removed|
+  // bytes of a high tag number.
+  void ReplaceTag(size_t pos,
+                  size_t num_removed,
+                  uint8_t identifier,
+                  uint32_t tag_num);
+
+  // Converts the recorded positions to offsets into the complete encoding of
+  // |size| bytes, and computes the depths of the TLVs. Must be called once
+  // after encoding, before |tlvs()| is read.
+  void Finish(size_t size);
+
+  // Replaces the index with the TLVs of the |size| bytes at |data|. The values
+  // of constructed TLVs, and of TLVs with indefinite lengths, are parsed for
+  // nested TLVs. Bytes of a value that don't parse as TLVs, or that run past
+  // the end of the value, are left as they are, like the bytes of a primitive
+  // value; the value of an indefinite length without an EOC marker runs to
+  // the end of the TLV that contains it. Trailing bytes after the last TLV
+  // that parses are left out.
+  void Parse(const uint8_t* data, size_t size);
+
+ private:
+  // Until |Finish|, the offsets are the sizes of the writer after each TLV
+  // was written, which are in decreasing order.
+  std::vector<TLV> tlvs_;
+
+  // The TLVs whose values are being parsed, outermost first, kept between
+  // calls to |Parse|.
+  struct OpenTLV {
+    size_t index;
+    size_t end;
+    bool indefinite;
+  };
+  std::vector<OpenTLV> open_;
+};
+
+// Caps on the encoding of an input into a |DERWriter|, so that inputs that would
+// encode to megabytes, such as a PDU with a huge |val_bits| or |val_array|,
+// stop encoding early instead of slowing down a fuzz target that would discard
+// them anyway. Once a cap is hit, the encoders stop adding values, and only
+// finish the TLVs they started, with lengths that match what was encoded.
+struct EncodingBudget {
+  // Which cap an encoding hit.
+  enum Exceeded : uint8_t {
+    kNone,
+    kSize,
+    kNodes,
+  };
+
+  // What is left of an encoding that hit a cap.
+  enum Policy : uint8_t {
+    // Nothing.
+    kEmpty,
+    // The values encoded before the cap was hit, in the TLVs around them,
+    // like PDUs beyond the depth limit are left out. The encoders write back
+    // to front, so these are the last values of the input: a suffix of a
+    // |val_array| that was cut short, and the last fields of a certificate.
+    // The headers of those TLVs may exceed |max_size|.
+    kTruncate,
+  };
+
+  // The maximum number of bytes of the encoding.
+  size_t max_size = SIZE_MAX;
+  // The maximum number of TLVs of the encoding.
+  size_t max_nodes = SIZE_MAX;
+  Policy policy = kEmpty;
+};
+
+// Builds DER back to front: a value is written before the tag and length in
+// front of it, so that every length is known when it is written, and nothing
+// already written has to be shifted.
+// Since the output grows towards the front, |size()| can be saved before
+// encoding a value and subtracted afterwards to obtain the value's length, the
+// same way an offset into a vector would be.
+// A |DERWriter| must not be used by more than one thread at a time.
+class DERWriter {
+ public:
+  // Creates a writer that allocates and grows its own memory.
+  DERWriter() = default;
+
+  // Creates a writer that writes to the end of |buffer|, which can hold
+  // |capacity| bytes and is never grown. Writes that don't fit are dropped,
+  // and |truncated()| reports it.
+  DERWriter(uint8_t* buffer, size_t capacity);
+
+  DERWriter(const DERWriter&) = delete;
+  DERWriter& operator=(const DERWriter&) = delete;
+
+  // Returns the number of bytes written so far, including those referenced.
+  // If the writer is truncated,
+  // this includes the dropped bytes, and is at least the capacity needed to
+  // write everything.
+  size_t size() const {
+    return capacity_ - begin_ + num_referenced_ + num_dropped_;
+  }
+
+  // Returns the bytes written so far, which are contiguous. Only meaningful if
+  // the writer is not truncated, and has no references.
+  const uint8_t* data() const { return buffer_ + begin_; }
+
+  // Whether writes were dropped because they didn't fit a fixed capacity.
+  bool truncated() const { return num_dropped_ != 0; }
+
+  // Discards everything written, but keeps the memory for reuse.
+  void Clear();
+
+  // Discards everything written since |size()| returned |size|.
+  void Truncate(size_t size);
+
+  // Appends the bytes written so far to |der|.
+  void AppendTo(std::vector<uint8_t>& der) const;
+
+  // Appends the encoding to |segments| as the runs of bytes that were copied
+  // and the bytes that were referenced between them, first to last, e.g. for
+  // |writev|. Only meaningful if the writer is not truncated.
+  void AppendSegmentsTo(std::vector<struct iovec>& segments) const;
+
+  // Makes the writer reference large values, such as the bytes fields of the
+  // protobufs and the repetitions of |PrependRepeated|, instead of copying
+  // them, so that the encoding is the segments of |AppendSegmentsTo|: the
+  // headers and small values copied to the writer, and the values in between
+  // where they are, e.g. in the protobuf. |data()| is then only meaningful if
+  // |has_references()| is false. Referenced bytes must outlive the encoding
+  // and not change. A writer with a fixed capacity copies all values.
+  void set_reference_values(bool reference_values) {
+    reference_values_ = reference_values;
+  }
+  bool reference_values() const { return reference_values_; }
+
+  // Whether the encoding references bytes that weren't copied.
+  bool has_references() const { return !references_.empty(); }
+
+  void Prepend(uint8_t byte);
+  void Prepend(const uint8_t* bytes, size_t len);
+  void Prepend(const std::string& bytes);
+
+  // Prepends the |len| bytes at |bytes| by reference, if the writer references
+  // values, and the bytes are at least |kMinReferenceLen| long. Otherwise, the
+  // bytes are copied, since a segment costs more than copying a few bytes.
+  void PrependReference(const uint8_t* bytes, size_t len);
+  void PrependReference(const std::string& bytes);
+  static constexpr size_t kMinReferenceLen = 64;
+
+  // Prepends |count| repetitions of the |pattern_len| bytes at |pattern|. If
+  // the writer references values, and the repetitions are longer than
+  // |kRepeatTileSize|, they are copied to a tile kept until |Clear|, or for
+  // patterns larger than a tile, not at all, and the tile is referenced as
+  // many times as needed, so that a value of megabytes takes a few segments.
+  void PrependRepeated(const uint8_t* pattern,
+                       size_t pattern_len,
+                       size_t count);
+
+  // Prepends |value| as a base 128, variable-length, big-endian integer.
+  void PrependVariableIntBase128(uint64_t value);
+
+  // Prepends |value| as a base 256, variable-length, big-endian integer.
+  void PrependVariableIntBase256(uint64_t value);
+
+  // Prepends |len| using the definite-form length (X.690 (2015),
+  // 8.1.3.3-8.1.3.5 & 10.1).
+  void PrependDefiniteLength(size_t len);
+
+  // Prepends |tag_byte| and |len| according to X.690 (2015), 8.1.2-8.1.5.
+  void PrependTagAndLength(uint8_t tag_byte, size_t len);
+
+  // Updates the tag written last to a single byte tag, |tag_byte|, unless
+  // nothing was written since |size()| returned |size|. Like |ReplaceTag|,
+  // a high tag number is collapsed into the single byte.
+  void ReplaceTag(uint8_t tag_byte, size_t size);
+
+  // Attaches |index|, which then records the TLVs written to this writer, or
+  // detaches the index if |index| is nullptr. |Clear| and |Truncate| apply to
+  // the index as well. Encoders that write a TLV with more than
+  // |PrependTagAndLength| record it with |tlv_index()->Add|.
+  void set_tlv_index(TLVIndex* index) { tlv_index_ = index; }
+  TLVIndex* tlv_index() const { return tlv_index_; }
+
+  // Limits the encodings written to this writer after this call, or after
+  // |Clear|, to |budget|. The encoders check the budget as they write, and
+  // the functions that encode an input into a |DERWriter|, replacing its
+  // contents, apply its policy when they are done (see |FinishBudget|).
+  void set_budget(const EncodingBudget& budget);
+  const EncodingBudget& budget() const { return budget_; }
+
+  // Whether the budget caps anything.
+  bool has_budget() const {
+    return budget_.max_size != SIZE_MAX || budget_.max_nodes != SIZE_MAX;
+  }
+
+  // Which cap of the budget the encoding hit, if any.
+  EncodingBudget::Exceeded budget_exceeded() const { return budget_exceeded_; }
+
+  // Whether the encoding hit a cap, after which encoders stop adding values.
+  bool over_budget() const {
+    return budget_exceeded_ != EncodingBudget::kNone;
+  }
+
+  // Whether a value of |len| bytes fits in the budget. Encoders call this
+  // before writing a value that can be large; if it doesn't fit, the budget is
+  // exceeded, and the value must not be written. Once the budget is exceeded,
+  // no value fits.
+  bool ChargeSize(size_t len) {
+    if (over_budget()) {
+      return false;
+    }
+    size_t used = size() - budget_start_;
+    if (used > budget_.max_size || len > budget_.max_size - used) {
+      budget_exceeded_ = EncodingBudget::kSize;
+      return false;
+    }
+    return true;
+  }
+
+  // Counts a TLV against the budget, and returns whether it fits. Encoders
+  // that can leave a TLV out call this before encoding its value. The TLVs
+  // that |PrependTagAndLength| writes are counted as it writes their headers,
+  // after their values: one that doesn't fit is still written, and the
+  // encoders leave out the TLVs in front of it.
+  bool ChargeNode() {
+    if (++num_nodes_ > budget_.max_nodes) {
+      budget_exceeded_ = EncodingBudget::kNodes;
+      return false;
+    }
+    return true;
+  }
+
+  // Applies the policy of the budget to the encoding once it is complete:
+  // marks the budget as exceeded if the headers of the TLVs took the encoding
+  // over |max_size|, and discards the encoding if the budget is exceeded and
+  // the policy is |kEmpty|.
+  void FinishBudget();
+
+ private:
+  // Returns |len| bytes in front of the bytes written so far, growing
+  // |buffer_| if needed. Returns nullptr if the bytes must be dropped instead.
+  uint8_t* PrependUninitialized(size_t len);
+
+  // Calls |fn| with the pointer and size of every segment of the encoding,
+  // first to last.
+  template <typename SegmentFn>
+  void ForEachSegment(SegmentFn fn) const;
+
+  // The written bytes are |buffer_[begin_, capacity_)|, and |references_|.
+  uint8_t* buffer_ = nullptr;
+  size_t capacity_ = 0;
+  size_t begin_ = 0;
+
+  // Owns |buffer_|, unless the writer has a fixed capacity.
+  std::unique_ptr<uint8_t[]> owned_buffer_;
+  bool fixed_capacity_ = false;
+
+  // The number of bytes dropped in front of |buffer_[begin_]|. Once a write is
+  // dropped, everything written in front of it is dropped as well, so that the
+  // bytes that were written stay contiguous.
+  size_t num_dropped_ = 0;
+
+  // Bytes that are part of the encoding without being copied to |buffer_|, in
+  // the order they were written, which is last to first.
+  struct Reference {
+    // The number of bytes of |buffer_| that follow the referenced bytes.
+    size_t num_following;
+    const uint8_t* bytes;
+    size_t len;
+  };
+  bool reference_values_ = false;
+  std::vector<Reference> references_;
+  size_t num_referenced_ = 0;
+  // The tiles of |PrependRepeated|, of |kRepeatTileSize| bytes each, of which
+  // the first |num_tiles_| are in use.
+  std::vector<std::unique_ptr<uint8_t[]>> tiles_;
+  size_t num_tiles_ = 0;
+
+  TLVIndex* tlv_index_ = nullptr;
+
+  EncodingBudget budget_;
+  // The |size()| when the budget was set, and the TLVs counted since.
+  size_t budget_start_ = 0;
+  size_t num_nodes_ = 0;
+  EncodingBudget::Exceeded budget_exceeded_ = EncodingBudget::kNone;
+};
+
+// Encodes with |encode|, a callable taking a |DERWriter&|, into the start of
+// |buffer|, which can hold |capacity| bytes. Returns the size of the encoding.
+// If that is larger than |capacity|, the encoding was truncated, the contents
+// of |buffer| are unspecified, and the returned size is at least the capacity
+// needed to encode without truncation.
+template <typename EncodeFn>
+size_t EncodeToBuffer(EncodeFn encode, uint8_t* buffer, size_t capacity) {
+  DERWriter der(buffer, capacity);
+  encode(der);
+  if (!der.truncated() && der.size() != 0) {
+    // |der| fills |buffer| from its end, so move the encoding to the start.
+    memmove(buffer, der.data(), der.size());
+    ASN1_PDU_STATS_ADD(bytes_moved, der.size());
+  }
+  return der.size();
+}
+
+// The encodings of a batch of inputs, stored back to back in one buffer, with
+// a table of their offsets.
+// Encoding a batch writes all of its inputs to the same |DERWriter|, last to
+// first, so that they end up in order without being copied, and the memory of
+// the batch is kept for the next one. A |DERBatch| must not be used by more
+// than one thread at a time.
+class DERBatch {
+ public:
+  DERBatch() = default;
+  DERBatch(const DERBatch&) = delete;
+  DERBatch& operator=(const DERBatch&) = delete;
+
+  // Returns the number of encodings in the batch.
+  size_t num_encodings() const { return offsets_.size() - 1; }
+
+  // Returns the encoding of the |i|th input.
+  const uint8_t* encoding(size_t i) const { return der_.data() + offsets_[i]; }
+  size_t encoding_size(size_t i) const {
+    return offsets_[i + 1] - offsets_[i];
+  }
+
+  // Returns the encodings of all inputs, back to back.
+  const uint8_t* data() const { return der_.data(); }
+  size_t size() const { return der_.size(); }
+
+  // Returns |num_encodings() + 1| offsets into |data()|: the |i|th encoding
+  // starts at the |i|th offset, and ends at the next one.
+  const std::vector<size_t>& offsets() const { return offsets_; }
+
+  // Replaces the batch with the encodings of |num_inputs| inputs. |encode| is
+  // a callable taking the index of an input and a |DERWriter&|, which encodes
+  // that input in front of the bytes already written. It is called for the
+  // last input first.
+  template <typename EncodeFn>
+  void Encode(size_t num_inputs, EncodeFn encode) {
+    der_.Clear();
+    offsets_.resize(num_inputs + 1);
+    // Records the offsets from the end of the batch, which don't change as
+    // the inputs in front are encoded.
+    for (size_t i = num_inputs; i != 0; --i) {
+      offsets_[i] = der_.size();
+      encode(i - 1, der_);
+    }
+    offsets_[0] = der_.size();
+    for (size_t& offset : offsets_) {
+      offset = der_.size() - offset;
+    }
+  }
+
+ private:
+  DERWriter der_;
+  std::vector<size_t> offsets_ = {0};
+};
+
 #endif  // PROTO_ASN1_PDU_COMMON_H_
\ No newline at end of file
@@ -0,0 +1,960 @@
+// Copyright 2020 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+// Converts a corpus between protobufs and DER, in either direction, or
+// collapses a corpus of protobufs to those with unique DER, or minimizes it, on
+// all cores:
+//
+//   der_corpus_converter [flags] to-der|to-proto|dedupe|minimize <input_dir>
+//       <output_dir>
+//
+// Every regular file under <input_dir> is converted into a file at the same
+// path relative to <output_dir>, or to one of its shard directories. Files that
+// fail to convert are counted and skipped. See |kUsage| for the flags.
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include <google/protobuf/arena.h>
+#include <google/protobuf/io/zero_copy_stream_impl_lite.h>
+#include <google/protobuf/message.h>
+#include <google/protobuf/text_format.h>
+
+#include "asn1_pdu.pb.h"
+#include "asn1_pdu_to_der.h"
+#include "common.h"
+#include "der_dedupe.h"
+#include "der_to_asn1_pdu.h"
+#include "der_to_x509_certificate.h"
+#include "x509_certificate.pb.h"
+#include "x509_certificate_to_der.h"
+
+namespace {
+
+using google::protobuf::Arena;
+using google::protobuf::FieldDescriptor;
+using google::protobuf::Message;
+using google::protobuf::Reflection;
+
+const char kUsage[] =
+    "Usage: der_corpus_converter [flags] to-der|to-proto|dedupe|minimize "
+    "<input_dir>\n"
+    "       <output_dir>\n"
+    "\n"
+    "  to-der    converts protobufs to DER.\n"
+    "  to-proto  converts DER to protobufs.\n"
+    "  dedupe    copies the protobufs whose DER differs from that of every\n"
+    "            protobuf copied before.\n"
+    "  minimize  keeps the smallest protobuf of every DER encoding whose DER\n"
+    "            signature (see der_dedupe.h) has features that smaller ones\n"
+    "            lack, and removes the fields that don't change its\n"
+    "            signature.\n"
+    "\n"
+    "Flags:\n"
+    "  --type=x509|pdu        the protobuf, X509Certificate or PDU (default "
+    "x509).\n"
+    "  --format=text|binary   the protobuf format (default text, as read by\n"
+    "                         DEFINE_PROTO_FUZZER).\n"
+    "  --threads=N            the number of worker threads (default: one per\n"
+    "                         core).\n"
+    "  --shards=N             splits the output into N directories,\n"
+    "                         shard-00000 to shard-<N-1>, by file path "
+    "(default 1,\n"
+    "                         i.e. no shard directories).\n";
+
+// Protobufs nested deeper than this can't be parsed back, e.g. by
+// libprotobuf-mutator, since it's the default recursion limit of protobuf's
+// parsers.
+constexpr int kMaxMessageDepth = 100;
+
+// The number of slots of the set of |Command::kDedupe|, which takes 128 MiB,
+// and holds the hashes of millions of encodings before it evicts any.
+constexpr size_t kDedupeNumSlots = 1 << 24;
+
+// The most encodings of a protobuf that |Command::kMinimize| tries while
+// removing its fields, so that huge inputs can't hold up a worker for long.
+constexpr size_t kMaxShrinkTrials = 1 << 12;
+
+enum class Command { kToDER, kToProto, kDedupe, kMinimize };
+
+struct Options {
+  Command command;
+  bool x509 = true;
+  bool text = true;
+  size_t num_threads = 0;
+  size_t num_shards = 1;
+  std::string input_dir;
+  std::string output_dir;
+};
+
+// Counters updated by all workers, and reported by |Reporter|.
+struct Stats {
+  std::atomic<uint64_t> num_files{0};
+  std::atomic<uint64_t> num_failed{0};
+  std::atomic<uint64_t> num_too_deep{0};
+  std::atomic<uint64_t> bytes_read{0};
+  std::atomic<uint64_t> bytes_written{0};
+  // The files analyzed by the first pass of |Command::kMinimize|, and the
+  // fields it removed.
+  std::atomic<uint64_t> num_analyzed{0};
+  std::atomic<uint64_t> num_fields_removed{0};
+};
+
+// An input, as the first pass of |Command::kMinimize| found it.
+struct Entry {
+  std::string path;
+  size_t size;
+  DERHash hash;
+  std::vector<uint32_t> signature;
+};
+
+// Distributes the paths found by the directory walk to the workers. Each
+// worker takes paths from the back of its own deque, and steals from the front
+// of the others' once it runs out, so that workers that got large files don't
+// hold up the rest.
+class WorkQueue {
+ public:
+  explicit WorkQueue(size_t num_workers) {
+    for (size_t i = 0; i < num_workers; ++i) {
+      deques_.emplace_back(new Deque);
+    }
+  }
+
+  // Adds |path| to the deques in turn, and wakes up a waiting worker.
+  void Push(std::string path) {
+    Deque& deque = *deques_[next_deque_++ % deques_.size()];
+    {
+      std::lock_guard<std::mutex> lock(deque.mutex);
+      deque.paths.push_back(std::move(path));
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      ++num_queued_;
+    }
+    ready_.notify_one();
+  }
+
+  // Marks that no more paths will be pushed, and wakes up all workers.
+  void Close() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      closed_ = true;
+    }
+    ready_.notify_all();
+  }
+
+  // Takes a path for |worker|, waiting until one is pushed. Returns false once
+  // the queue is closed and all paths were taken.
+  bool Pop(size_t worker, std::string* path) {
+    while (true) {
+      if (TryPop(worker, path)) {
+        return true;
+      }
+      std::unique_lock<std::mutex> lock(mutex_);
+      ready_.wait(lock, [this] { return num_queued_ != 0 || closed_; });
+      if (num_queued_ == 0 && closed_) {
+        return false;
+      }
+    }
+  }
+
+ private:
+  struct Deque {
+    std::mutex mutex;
+    std::deque<std::string> paths;
+  };
+
+  bool TryPop(size_t worker, std::string* path) {
+    for (size_t i = 0; i < deques_.size(); ++i) {
+      Deque& deque = *deques_[(worker + i) % deques_.size()];
+      std::lock_guard<std::mutex> lock(deque.mutex);
+      if (deque.paths.empty()) {
+        continue;
+      }
+      if (i == 0) {
+        *path = std::move(deque.paths.back());
+        deque.paths.pop_back();
+      } else {
+        *path = std::move(deque.paths.front());
+        deque.paths.pop_front();
+      }
+      std::lock_guard<std::mutex> queued_lock(mutex_);
+      --num_queued_;
+      return true;
+    }
+    return false;
+  }
+
+  std::vector<std::unique_ptr<Deque>> deques_;
+  std::atomic<size_t> next_deque_{0};
+
+  // Guards |num_queued_| and |closed_|, which |ready_| waits on.
+  std::mutex mutex_;
+  std::condition_variable ready_;
+  size_t num_queued_ = 0;
+  bool closed_ = false;
+};
+
+// A read-only mapping of a whole file.
+class MappedFile {
+ public:
+  MappedFile() = default;
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+  ~MappedFile() {
+    if (size_ != 0) {
+      munmap(const_cast<uint8_t*>(data_), size_);
+    }
+  }
+
+  bool Open(const std::string& path) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      return false;
+    }
+    struct stat st;
+    bool ok = fstat(fd, &st) == 0;
+    if (ok && st.st_size != 0) {
+      void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      ok = data != MAP_FAILED;
+      if (ok) {
+        data_ = static_cast<const uint8_t*>(data);
+        size_ = st.st_size;
+      }
+    }
+    close(fd);
+    return ok;
+  }
+
+  const uint8_t* data() const { return data_; }
+  size_t size() const { return size_; }
+
+ private:
+  const uint8_t* data_ = nullptr;
+  size_t size_ = 0;
+};
+
+bool WriteFile(const std::string& path, const uint8_t* data, size_t size) {
+  int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    return false;
+  }
+  while (size != 0) {
+    ssize_t written = write(fd, data, size);
+    if (written < 0) {
+      close(fd);
+      return false;
+    }
+    data += written;
+    size -= written;
+  }
+  return close(fd) == 0;
+}
+
+// Creates the directories of |path| that follow its first |existing_len|
+// characters, which name a directory that exists. Directories that other
+// threads create at the same time are fine.
+bool MakeParentDirectories(const std::string& path, size_t existing_len) {
+  for (size_t pos = path.find('/', existing_len + 1);
+       pos != std::string::npos; pos = path.find('/', pos + 1)) {
+    if (mkdir(path.substr(0, pos).c_str(), 0755) != 0 && errno != EEXIST) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Returns whether |message| has messages nested more than |max_depth| deep,
+// counting itself as depth 1.
+bool IsDeeperThan(const Message& message, int max_depth) {
+  // Decoded PDUs may be deeper than the native stack allows to recurse.
+  std::vector<std::pair<const Message*, int>> stack = {{&message, 1}};
+  std::vector<const FieldDescriptor*> fields;
+  while (!stack.empty()) {
+    const Message* m = stack.back().first;
+    int depth = stack.back().second;
+    stack.pop_back();
+    if (depth > max_depth) {
+      return true;
+    }
+    const Reflection* reflection = m->GetReflection();
+    fields.clear();
+    reflection->ListFields(*m, &fields);
+    for (const FieldDescriptor* field : fields) {
+      if (field->cpp_type() != FieldDescriptor::CPPTYPE_MESSAGE) {
+        continue;
+      }
+      if (field->is_repeated()) {
+        for (int i = 0; i < reflection->FieldSize(*m, field); ++i) {
+          stack.emplace_back(&reflection->GetRepeatedMessage(*m, field, i),
+                             depth + 1);
+        }
+      } else {
+        stack.emplace_back(&reflection->GetMessage(*m, field), depth + 1);
+      }
+    }
+  }
+  return false;
+}
+
+// Converts files for one worker. Its arena, encoders and buffers are reused
+// for every file, so that converting stops allocating once they have grown to
+// fit the corpus. |seen| is the set of the DER of the protobufs copied, which
+// all workers share, for |Command::kDedupe|.
+// |Command::kMinimize| takes two passes over the corpus: |Analyze| records an
+// |Entry| for every file, from which |SelectInputs| picks the files to keep,
+// and |Convert| removes the fields of those.
+class Converter {
+ public:
+  Converter(const Options& options, Stats* stats, DERDedupeSet* seen)
+      : options_(options), stats_(stats), seen_(seen) {}
+
+  void Convert(const std::string& path) {
+    MappedFile input;
+    bool ok = input.Open(path);
+    bool duplicate = false;
+    if (ok) {
+      stats_->bytes_read += input.size();
+      switch (options_.command) {
+        case Command::kToDER:
+          ok = ToDER(input.data(), input.size());
+          break;
+        case Command::kToProto:
+          ok = ToProto(input.data(), input.size());
+          break;
+        case Command::kDedupe:
+          ok = Dedupe(input.data(), input.size(), &duplicate);
+          break;
+        case Command::kMinimize:
+          ok = Minimize(input.data(), input.size());
+          break;
+      }
+    }
+    if (ok && !duplicate) {
+      ok = WriteOutput(OutputPath(path));
+      if (ok) {
+        stats_->bytes_written += output_.size();
+      }
+    }
+    if (!ok) {
+      ++stats_->num_failed;
+    }
+    ++stats_->num_files;
+    arena_.Reset();
+  }
+
+  // Records the size, DER hash and signature of the protobuf at |path| in
+  // |entries()|.
+  void Analyze(const std::string& path) {
+    MappedFile input;
+    Message* message = nullptr;
+    if (input.Open(path)) {
+      stats_->bytes_read += input.size();
+      message = Parse(input.data(), input.size());
+    }
+    if (message) {
+      Encode(*message);
+      entries_.push_back({path, input.size(), HashDER(der_), {}});
+      GetDERSignature(der_.data(), der_.size(), index_,
+                      entries_.back().signature);
+    } else {
+      ++stats_->num_failed;
+    }
+    ++stats_->num_analyzed;
+    arena_.Reset();
+  }
+
+  std::vector<Entry>& entries() { return entries_; }
+
+ private:
+  Message* NewMessage() {
+    if (options_.x509) {
+      return Arena::CreateMessage<x509_certificate::X509Certificate>(&arena_);
+    }
+    return Arena::CreateMessage<asn1_pdu::PDU>(&arena_);
+  }
+
+  // Returns the protobuf of |size| bytes at |data|, or null if it doesn't
+  // parse.
+  Message* Parse(const uint8_t* data, size_t size) {
+    Message* message = NewMessage();
+    // Like libprotobuf-mutator, accepts messages that lack required fields.
+    if (options_.text) {
+      google::protobuf::io::ArrayInputStream input(data, size);
+      google::protobuf::TextFormat::Parser parser;
+      parser.AllowPartialMessage(true);
+      if (!parser.Parse(&input, message)) {
+        return nullptr;
+      }
+    } else if (!message->ParsePartialFromArray(data, size)) {
+      return nullptr;
+    }
+    return message;
+  }
+
+  // Encodes |message| to |der_|.
+  void Encode(const Message& message) {
+    if (options_.x509) {
+      x509_certificate::X509CertificateToDER(
+          static_cast<const x509_certificate::X509Certificate&>(message),
+          der_);
+    } else {
+      pdu_to_der_.PDUToDER(static_cast<const asn1_pdu::PDU&>(message), der_);
+    }
+  }
+
+  // Writes |message| to |output_| in the protobuf format.
+  bool Serialize(const Message& message) {
+    if (options_.text) {
+      return google::protobuf::TextFormat::PrintToString(message, &output_);
+    }
+    return message.SerializePartialToString(&output_);
+  }
+
+  // Parses the protobuf of |size| bytes at |data|, and encodes it to |der_|.
+  bool Encode(const uint8_t* data, size_t size) {
+    Message* message = Parse(data, size);
+    if (!message) {
+      return false;
+    }
+    Encode(*message);
+    return true;
+  }
+
+  bool ToDER(const uint8_t* data, size_t size) {
+    if (!Encode(data, size)) {
+      return false;
+    }
+    output_.assign(reinterpret_cast<const char*>(der_.data()), der_.size());
+    return true;
+  }
+
+  // Copies the protobuf of |size| bytes at |data| as it is, unless its DER was
+  // seen before, in which case |*duplicate| is set instead. Of protobufs with
+  // the same DER, the one that a worker gets to first is copied.
+  bool Dedupe(const uint8_t* data, size_t size, bool* duplicate) {
+    if (!Encode(data, size)) {
+      return false;
+    }
+    *duplicate = !seen_->Insert(der_);
+    if (!*duplicate) {
+      output_.assign(reinterpret_cast<const char*>(data), size);
+    }
+    return true;
+  }
+
+  bool ToProto(const uint8_t* data, size_t size) {
+    Message* message = NewMessage();
+    bool decoded =
+        options_.x509
+            ? x509_certificate::DERToX509Certificate(
+                  data, size,
+                  static_cast<x509_certificate::X509Certificate*>(message))
+            : der_to_pdu_.Decode(data, size,
+                                 static_cast<asn1_pdu::PDU*>(message));
+    if (!decoded) {
+      return false;
+    }
+    // Printing and serializing recurse, and the output couldn't be parsed
+    // back anyway.
+    if (IsDeeperThan(*message, kMaxMessageDepth)) {
+      ++stats_->num_too_deep;
+      return false;
+    }
+    return Serialize(*message);
+  }
+
+  // Writes the protobuf of |size| bytes at |data| to |output_| with the fields
+  // removed whose removal keeps the signature of its DER.
+  bool Minimize(const uint8_t* data, size_t size) {
+    Message* message = Parse(data, size);
+    if (!message) {
+      return false;
+    }
+    Encode(*message);
+    GetDERSignature(der_.data(), der_.size(), index_, signature_);
+    Shrink(message);
+    return Serialize(*message);
+  }
+
+  // Removes the fields of |root| whose removal keeps its signature, in
+  // |signature_|. Fields are tried outermost first, so that a message whose
+  // removal keeps the signature goes at once, and the fields of one that
+  // doesn't are tried next. Elements of repeated fields are tried one at a
+  // time, last to first, keeping the order of the rest, which DER depends on.
+  // Stops after |kMaxShrinkTrials| encodings.
+  void Shrink(Message* root) {
+    size_t num_trials = 0;
+    // Protobufs that parse are at most |kMaxMessageDepth| deep, so the stack
+    // stays small.
+    std::vector<Message*> stack = {root};
+    std::vector<const FieldDescriptor*> fields;
+    while (!stack.empty() && num_trials < kMaxShrinkTrials) {
+      Message* message = stack.back();
+      stack.pop_back();
+      const Reflection* reflection = message->GetReflection();
+      Message* saved = message->New(&arena_);
+      fields.clear();
+      reflection->ListFields(*message, &fields);
+      for (const FieldDescriptor* field : fields) {
+        bool repeated = field->is_repeated();
+        for (int i = repeated ? reflection->FieldSize(*message, field) : 1;
+             i-- != 0 && num_trials != kMaxShrinkTrials; ++num_trials) {
+          TryRemove(root, message, saved, field, repeated ? i : -1);
+        }
+      }
+      // The fields of the messages that are left.
+      fields.clear();
+      reflection->ListFields(*message, &fields);
+      for (const FieldDescriptor* field : fields) {
+        if (field->cpp_type() != FieldDescriptor::CPPTYPE_MESSAGE) {
+          continue;
+        }
+        if (!field->is_repeated()) {
+          stack.push_back(reflection->MutableMessage(message, field));
+          continue;
+        }
+        for (int i = 0; i < reflection->FieldSize(*message, field); ++i) {
+          stack.push_back(
+              reflection->MutableRepeatedMessage(message, field, i));
+        }
+      }
+    }
+  }
+
+  // Clears |field| of |message|, a message in |root|, or if |index| isn't -1,
+  // removes its element |index|, and puts it back unless the signature of
+  // |root| stays the same. |saved| is a message of the same type, in
+  // |arena_|, to save |message| to.
+  void TryRemove(Message* root,
+                 Message* message,
+                 Message* saved,
+                 const FieldDescriptor* field,
+                 int index) {
+    const Reflection* reflection = message->GetReflection();
+    saved->CopyFrom(*message);
+    if (index == -1) {
+      reflection->ClearField(message, field);
+    } else {
+      int size = reflection->FieldSize(*message, field);
+      for (int i = index; i + 1 < size; ++i) {
+        reflection->SwapElements(message, field, i, i + 1);
+      }
+      reflection->RemoveLast(message, field);
+    }
+    Encode(*root);
+    GetDERSignature(der_.data(), der_.size(), index_, trial_signature_);
+    if (trial_signature_ == signature_) {
+      ++stats_->num_fields_removed;
+    } else {
+      reflection->Swap(message, saved);
+    }
+  }
+
+  // Returns the path in the output directory for the input file at |path|,
+  // which keeps its path relative to the input directory, so that files of
+  // the same name in different subdirectories don't overwrite each other.
+  // Shards are picked by a hash of the relative path, so that the same input
+  // is always converted into the same shard.
+  std::string OutputPath(const std::string& path) const {
+    // |WalkDirectory| pushes paths under the input directory, joined with a
+    // '/'.
+    std::string name = path.substr(options_.input_dir.size() + 1);
+    std::string output_path = options_.output_dir + '/';
+    if (options_.num_shards > 1) {
+      // FNV-1a.
+      uint64_t hash = 0xcbf29ce484222325;
+      for (char c : name) {
+        hash = (hash ^ static_cast<uint8_t>(c)) * 0x100000001b3;
+      }
+      char shard[32];
+      snprintf(shard, sizeof(shard), "shard-%05llu/",
+               static_cast<unsigned long long>(hash % options_.num_shards));
+      output_path += shard;
+    }
+    return output_path + name;
+  }
+
+  // Writes |output_| to |output_path|, first creating the directories that
+  // mirror the subdirectories of the input directory, if they don't exist
+  // yet.
+  bool WriteOutput(const std::string& output_path) {
+    const uint8_t* data = reinterpret_cast<const uint8_t*>(output_.data());
+    if (WriteFile(output_path, data, output_.size())) {
+      return true;
+    }
+    return errno == ENOENT &&
+           MakeParentDirectories(output_path, options_.output_dir.size()) &&
+           WriteFile(output_path, data, output_.size());
+  }
+
+  const Options& options_;
+  Stats* stats_;
+  DERDedupeSet* seen_;
+  Arena arena_;
+  DERWriter der_;
+  asn1_pdu::ASN1PDUToDER pdu_to_der_;
+  asn1_pdu::DERToASN1PDU der_to_pdu_;
+  std::string output_;
+
+  // The entries of |Analyze|, and the signatures of |Minimize|.
+  std::vector<Entry> entries_;
+  TLVIndex index_;
+  std::vector<uint32_t> signature_;
+  std::vector<uint32_t> trial_signature_;
+};
+
+// Pushes every regular file under |dir| to |queue| as it's found, without
+// recursing, so that the workers can start on a large corpus right away.
+// Returns false if a directory couldn't be read.
+bool WalkDirectory(const std::string& dir, WorkQueue* queue) {
+  bool ok = true;
+  std::vector<std::string> dirs = {dir};
+  while (!dirs.empty()) {
+    std::string current = std::move(dirs.back());
+    dirs.pop_back();
+    DIR* handle = opendir(current.c_str());
+    if (handle == nullptr) {
+      fprintf(stderr, "der_corpus_converter: cannot read %s: %s\n",
+              current.c_str(), strerror(errno));
+      ok = false;
+      continue;
+    }
+    while (struct dirent* entry = readdir(handle)) {
+      if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+        continue;
+      }
+      std::string path = current + '/' + entry->d_name;
+      unsigned char type = entry->d_type;
+      if (type == DT_UNKNOWN) {
+        struct stat st;
+        if (lstat(path.c_str(), &st) != 0) {
+          continue;
+        }
+        type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : 0;
+      }
+      if (type == DT_DIR) {
+        dirs.push_back(std::move(path));
+      } else if (type == DT_REG) {
+        queue->Push(std::move(path));
+      }
+    }
+    closedir(handle);
+  }
+  return ok;
+}
+
+// Prints the progress of the conversion to stderr every second, and once more
+// when stopped, with the duplicates found in |seen|, unless it is null.
+class Reporter {
+ public:
+  Reporter(const Stats& stats, const DERDedupeSet* seen)
+      : stats_(stats),
+        seen_(seen),
+        start_time_(std::chrono::steady_clock::now()),
+        thread_(&Reporter::Run, this) {}
+
+  void Stop() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopped_ = true;
+    }
+    stop_.notify_one();
+    thread_.join();
+    Report();
+  }
+
+ private:
+  void Run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!stop_.wait_for(lock, std::chrono::seconds(1),
+                           [this] { return stopped_; })) {
+      Report();
+    }
+  }
+
+  void Report() const {
+    std::chrono::duration<double> seconds =
+        std::chrono::steady_clock::now() - start_time_;
+    double num_files = stats_.num_files.load();
+    fprintf(stderr,
+            "der_corpus_converter: %.0f files (%llu failed, %llu too deep), "
+            "%.0f files/s, %.1f MB/s read, %.1f MB/s written",
+            num_files, static_cast<unsigned long long>(stats_.num_failed),
+            static_cast<unsigned long long>(stats_.num_too_deep),
+            num_files / seconds.count(),
+            stats_.bytes_read / seconds.count() / 1e6,
+            stats_.bytes_written / seconds.count() / 1e6);
+    if (stats_.num_analyzed != 0) {
+      fprintf(stderr, ", %llu analyzed, %llu fields removed",
+              static_cast<unsigned long long>(stats_.num_analyzed),
+              static_cast<unsigned long long>(stats_.num_fields_removed));
+    }
+    if (seen_ != nullptr) {
+      // Evicted hashes let duplicates through, so a corpus with evictions may
+      // be deduped again.
+      DERDedupeSet::Stats stats = seen_->stats();
+      fprintf(stderr, ", %llu duplicates, %llu evictions",
+              static_cast<unsigned long long>(stats.duplicates),
+              static_cast<unsigned long long>(stats.evictions));
+    }
+    fprintf(stderr, "\n");
+  }
+
+  const Stats& stats_;
+  const DERDedupeSet* const seen_;
+  const std::chrono::steady_clock::time_point start_time_;
+  std::mutex mutex_;
+  std::condition_variable stop_;
+  bool stopped_ = false;
+  // Started last, since it uses the members above.
+  std::thread thread_;
+};
+
+// Parses the value of the flag |name| from |arg| into |value|, if |arg| is
+// that flag.
+bool ParseFlag(const char* arg, const char* name, std::string* value) {
+  size_t name_len = strlen(name);
+  if (strncmp(arg, name, name_len) != 0 || arg[name_len] != '=') {
+    return false;
+  }
+  *value = arg + name_len + 1;
+  return true;
+}
+
+bool ParseCount(const std::string& value, size_t* count) {
+  char* end;
+  unsigned long long parsed = strtoull(value.c_str(), &end, 10);
+  if (value.empty() || *end != '\0' || parsed == 0) {
+    return false;
+  }
+  *count = parsed;
+  return true;
+}
+
+bool ParseOptions(int argc, char** argv, Options* options) {
+  std::vector<std::string> positional;
+  for (int i = 1; i < argc; ++i) {
+    std::string value;
+    if (strncmp(argv[i], "--", 2) != 0) {
+      positional.push_back(argv[i]);
+    } else if (ParseFlag(argv[i], "--type", &value)) {
+      if (value != "x509" && value != "pdu") {
+        return false;
+      }
+      options->x509 = value == "x509";
+    } else if (ParseFlag(argv[i], "--format", &value)) {
+      if (value != "text" && value != "binary") {
+        return false;
+      }
+      options->text = value == "text";
+    } else if (ParseFlag(argv[i], "--threads", &value)) {
+      if (!ParseCount(value, &options->num_threads)) {
+        return false;
+      }
+    } else if (ParseFlag(argv[i], "--shards", &value)) {
+      if (!ParseCount(value, &options->num_shards)) {
+        return false;
+      }
+    } else {
+      return false;
+    }
+  }
+  if (positional.size() != 3) {
+    return false;
+  }
+  if (positional[0] == "to-der") {
+    options->command = Command::kToDER;
+  } else if (positional[0] == "to-proto") {
+    options->command = Command::kToProto;
+  } else if (positional[0] == "dedupe") {
+    options->command = Command::kDedupe;
+  } else if (positional[0] == "minimize") {
+    options->command = Command::kMinimize;
+  } else {
+    return false;
+  }
+  options->input_dir = positional[1];
+  options->output_dir = positional[2];
+  if (options->num_threads == 0) {
+    options->num_threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  return true;
+}
+
+// Runs |work| on a worker per converter, for every path pushed to the queue by
+// |push_paths|, until it returns.
+template <typename PushPaths>
+void RunWorkers(const std::vector<std::unique_ptr<Converter>>& converters,
+                void (Converter::*work)(const std::string&),
+                PushPaths push_paths) {
+  WorkQueue queue(converters.size());
+  std::vector<std::thread> workers;
+  for (size_t i = 0; i < converters.size(); ++i) {
+    workers.emplace_back([&converters, &queue, work, i] {
+      std::string path;
+      while (queue.Pop(i, &path)) {
+        (converters[i].get()->*work)(path);
+      }
+    });
+  }
+  push_paths(&queue);
+  queue.Close();
+  for (std::thread& worker : workers) {
+    worker.join();
+  }
+}
+
+// Returns the paths of the inputs that |Command::kMinimize| keeps, from the
+// entries of all |converters|: the smallest input of every encoding, and of
+// those, smallest first, the ones whose signature has features that the ones
+// kept before lack, like libFuzzer's merge keeps the inputs that add
+// coverage. Ties in size are broken by path, so that a corpus is always
+// minimized the same way. Sets |*num_encodings| to the number of distinct
+// encodings.
+std::vector<std::string> SelectInputs(
+    const std::vector<std::unique_ptr<Converter>>& converters,
+    size_t* num_encodings) {
+  std::vector<Entry> entries;
+  for (const std::unique_ptr<Converter>& converter : converters) {
+    std::vector<Entry>& converter_entries = converter->entries();
+    std::move(converter_entries.begin(), converter_entries.end(),
+              std::back_inserter(entries));
+    converter_entries.clear();
+  }
+  auto smaller = [](const Entry* a, const Entry* b) {
+    return a->size != b->size ? a->size < b->size : a->path < b->path;
+  };
+  std::vector<Entry*> sorted;
+  for (Entry& entry : entries) {
+    sorted.push_back(&entry);
+  }
+  std::sort(sorted.begin(), sorted.end(),
+            [&smaller](const Entry* a, const Entry* b) {
+              if (a->hash != b->hash) {
+                return a->hash.hash[0] != b->hash.hash[0]
+                           ? a->hash.hash[0] < b->hash.hash[0]
+                           : a->hash.hash[1] < b->hash.hash[1];
+              }
+              return smaller(a, b);
+            });
+  std::vector<Entry*> unique;
+  for (Entry* entry : sorted) {
+    if (unique.empty() || unique.back()->hash != entry->hash) {
+      unique.push_back(entry);
+    }
+  }
+  *num_encodings = unique.size();
+
+  std::sort(unique.begin(), unique.end(), smaller);
+  std::unordered_set<uint32_t> covered;
+  std::vector<std::string> kept;
+  for (Entry* entry : unique) {
+    bool adds_features = false;
+    for (uint32_t feature : entry->signature) {
+      adds_features |= covered.insert(feature).second;
+    }
+    if (adds_features) {
+      kept.push_back(std::move(entry->path));
+    }
+  }
+  return kept;
+}
+
+bool MakeDirectory(const std::string& dir) {
+  if (mkdir(dir.c_str(), 0755) == 0 || errno == EEXIST) {
+    return true;
+  }
+  fprintf(stderr, "der_corpus_converter: cannot create %s: %s\n", dir.c_str(),
+          strerror(errno));
+  return false;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  Options options;
+  if (!ParseOptions(argc, argv, &options)) {
+    fputs(kUsage, stderr);
+    return 2;
+  }
+  if (!MakeDirectory(options.output_dir)) {
+    return 1;
+  }
+  for (size_t i = 0; options.num_shards > 1 && i < options.num_shards; ++i) {
+    char shard[32];
+    snprintf(shard, sizeof(shard), "/shard-%05zu", i);
+    if (!MakeDirectory(options.output_dir + shard)) {
+      return 1;
+    }
+  }
+
+  Stats stats;
+  std::unique_ptr<DERDedupeSet> seen;
+  if (options.command == Command::kDedupe) {
+    seen.reset(new DERDedupeSet(kDedupeNumSlots));
+  }
+  Reporter reporter(stats, seen.get());
+  std::vector<std::unique_ptr<Converter>> converters;
+  for (size_t i = 0; i < options.num_threads; ++i) {
+    converters.emplace_back(new Converter(options, &stats, seen.get()));
+  }
+  bool walked = true;
+  auto walk = [&options, &walked](WorkQueue* queue) {
+    walked = WalkDirectory(options.input_dir, queue);
+  };
+  if (options.command != Command::kMinimize) {
+    RunWorkers(converters, &Converter::Convert, walk);
+  } else {
+    RunWorkers(converters, &Converter::Analyze, walk);
+    size_t num_encodings;
+    std::vector<std::string> kept = SelectInputs(converters, &num_encodings);
+    fprintf(stderr,
+            "der_corpus_converter: keeping %zu inputs of %zu distinct "
+            "encodings\n",
+            kept.size(), num_encodings);
+    RunWorkers(converters, &Converter::Convert, [&kept](WorkQueue* queue) {
+      for (std::string& path : kept) {
+        queue->Push(std::move(path));
+      }
+    });
+  }
+  reporter.Stop();
+  return walked && stats.num_failed == 0 ? 0 : 1;
+}
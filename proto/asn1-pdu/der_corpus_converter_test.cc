@@ -0,0 +1,258 @@
+// Copyright 2020 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+// Runs `der_corpus_converter minimize`, whose path is the only argument, on
+// corpora of random PDUs and certificates, with copies of some inputs and
+// larger protobufs of the same DER, and checks that:
+//   - every protobuf it writes has the DER signature of the input it was
+//     shrunk from, and is no larger,
+//   - it keeps the same inputs, shrunk the same way, on 1 and on 4 threads.
+// Also checks that |GetDERSignature| only takes 2 bytes at the end of a value
+// for an EOC marker if the length is indefinite.
+
+#include <dirent.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <google/protobuf/text_format.h>
+
+#include "asn1_pdu.pb.h"
+#include "asn1_pdu_to_der.h"
+#include "common.h"
+#include "der_dedupe.h"
+#include "random_inputs.h"
+#include "test_checker.h"
+#include "x509_certificate.pb.h"
+#include "x509_certificate_to_der.h"
+
+namespace {
+
+using asn1_pdu::PDU;
+using google::protobuf::Message;
+using x509_certificate::X509Certificate;
+
+constexpr size_t kNumInputs = 64;
+
+bool ReadFile(const std::string& path, std::string* contents) {
+  FILE* file = fopen(path.c_str(), "rb");
+  if (!file) {
+    return false;
+  }
+  contents->clear();
+  char buffer[4096];
+  size_t len;
+  while ((len = fread(buffer, 1, sizeof(buffer), file)) != 0) {
+    contents->append(buffer, len);
+  }
+  bool ok = !ferror(file);
+  fclose(file);
+  return ok;
+}
+
+bool WriteFile(const std::string& path, const std::string& contents) {
+  FILE* file = fopen(path.c_str(), "wb");
+  if (!file) {
+    return false;
+  }
+  bool ok = fwrite(contents.data(), 1, contents.size(), file) ==
+            contents.size();
+  return fclose(file) == 0 && ok;
+}
+
+// Returns the names and contents of the files in |dir|.
+std::map<std::string, std::string> ReadDirectory(const std::string& dir) {
+  std::map<std::string, std::string> files;
+  DIR* d = opendir(dir.c_str());
+  if (!d) {
+    return files;
+  }
+  while (struct dirent* entry = readdir(d)) {
+    std::string name = entry->d_name;
+    if (name != "." && name != "..") {
+      ReadFile(dir + '/' + name, &files[name]);
+    }
+  }
+  closedir(d);
+  return files;
+}
+
+// Returns the DER signature of the protobuf in the text format in |text|, of
+// a certificate if |x509|, or of a PDU, or an empty signature if it doesn't
+// parse.
+std::vector<uint32_t> GetSignature(const std::string& text, bool x509) {
+  X509Certificate cert;
+  PDU pdu;
+  Message* message = x509 ? static_cast<Message*>(&cert) : &pdu;
+  google::protobuf::TextFormat::Parser parser;
+  parser.AllowPartialMessage(true);
+  std::vector<uint32_t> signature;
+  if (!parser.ParseFromString(text, message)) {
+    return signature;
+  }
+  std::vector<uint8_t> der = x509 ? x509_certificate::X509CertificateToDER(cert)
+                                  : asn1_pdu::PDUToDER(pdu);
+  TLVIndex index;
+  GetDERSignature(der.data(), der.size(), index, signature);
+  return signature;
+}
+
+// Writes a random corpus of |kNumInputs| protobufs, of certificates if |x509|,
+// or of PDUs, to |dir|. Some are copies of others, and some are others with an
+// empty value added, which doesn't change their DER.
+bool WriteCorpus(std::mt19937& rng, const std::string& dir, bool x509) {
+  std::vector<std::string> texts;
+  for (size_t i = 0; i < kNumInputs; ++i) {
+    std::string text;
+    if (!texts.empty() && rng() % 8 == 0) {
+      text = texts[rng() % texts.size()];
+    } else if (x509) {
+      X509Certificate cert = random_inputs::RandomCertificate(rng);
+      if (rng() % 4 == 0) {
+        cert.mutable_tbs_certificate()
+            ->mutable_value()
+            ->mutable_issuer()
+            ->mutable_value()
+            ->mutable_val()
+            ->add_val_array()
+            ->set_val_bits(std::string());
+      }
+      google::protobuf::TextFormat::PrintToString(cert, &text);
+    } else {
+      PDU pdu;
+      random_inputs::SetRandomPDU(rng, 1 + rng() % 5, &pdu);
+      if (rng() % 4 == 0) {
+        pdu.mutable_val()->add_val_array()->set_val_bits(std::string());
+      }
+      google::protobuf::TextFormat::PrintToString(pdu, &text);
+    }
+    texts.push_back(text);
+    char name[32];
+    snprintf(name, sizeof(name), "/input-%03zu", i);
+    if (!WriteFile(dir + name, text)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool MakeDirectory(const std::string& dir) {
+  return system(("mkdir -p " + dir).c_str()) == 0;
+}
+
+// Minimizes a random corpus of |type| with |converter| on 1 and on 4 threads
+// in |dir|, and compares the outputs with each other and with the inputs.
+void CheckMinimize(std::mt19937& rng,
+                   const char* converter,
+                   const std::string& dir,
+                   const char* type,
+                   test_checker::Checker& checker) {
+  bool x509 = std::string(type) == "x509";
+  std::string input_dir = dir + "/input-" + type;
+  std::string output_dirs[2] = {dir + "/output-1-" + type,
+                                dir + "/output-4-" + type};
+  if (!checker.Expect(MakeDirectory(input_dir) &&
+                          WriteCorpus(rng, input_dir, x509),
+                      "%s: can't write the corpus", type)) {
+    return;
+  }
+  for (int i = 0; i < 2; ++i) {
+    std::string command = std::string(converter) + " --type=" + type +
+                          " --threads=" + (i == 0 ? "1" : "4") + " minimize " +
+                          input_dir + ' ' + output_dirs[i] + " 2>/dev/null";
+    if (!checker.Expect(system(command.c_str()) == 0,
+                        "%s: der_corpus_converter failed", type)) {
+      return;
+    }
+  }
+
+  std::map<std::string, std::string> inputs = ReadDirectory(input_dir);
+  std::map<std::string, std::string> outputs = ReadDirectory(output_dirs[0]);
+  checker.Expect(outputs == ReadDirectory(output_dirs[1]),
+                 "%s: outputs differ between 1 and 4 threads", type);
+  checker.Expect(!outputs.empty() && outputs.size() < inputs.size(),
+                 "%s: no inputs, or no duplicates, were left out", type);
+  for (const auto& output : outputs) {
+    const std::string& input = inputs[output.first];
+    std::vector<uint32_t> signature = GetSignature(input, x509);
+    checker.Check();
+    if (signature.empty() || GetSignature(output.second, x509) != signature) {
+      checker.Mismatch("%s: signature changed", output.first.c_str());
+    } else if (output.second.size() > input.size()) {
+      checker.Mismatch("%s: grew", output.first.c_str());
+    } else {
+      checker.Tally("shrunk", output.second.size() < input.size());
+    }
+  }
+}
+
+// Returns whether the |size| bytes at |a| and at |b| have the same signature.
+bool SameSignature(const uint8_t* a, size_t a_size,
+                   const uint8_t* b, size_t b_size) {
+  TLVIndex index;
+  std::vector<uint32_t> a_signature;
+  std::vector<uint32_t> b_signature;
+  GetDERSignature(a, a_size, index, a_signature);
+  GetDERSignature(b, b_size, index, b_signature);
+  return a_signature == b_signature;
+}
+
+// Checks that 2 bytes that don't parse as a TLV at the end of a definite
+// length are a gap, like 3 bytes are, and that the EOC marker of an
+// indefinite length isn't.
+void CheckEOC(test_checker::Checker& checker) {
+  const uint8_t two_bytes[] = {0x30, 0x05, 0x04, 0x01, 0xAA, 0x12, 0x34};
+  const uint8_t three_bytes[] = {0x30, 0x06, 0x04, 0x01,
+                                 0xAA, 0x12, 0x34, 0x56};
+  const uint8_t eoc[] = {0x30, 0x80, 0x04, 0x01, 0xAA, 0x00, 0x00};
+  TLVIndex index;
+  std::vector<uint32_t> signature;
+  GetDERSignature(eoc, sizeof(eoc), index, signature);
+  checker.Expect(SameSignature(two_bytes, sizeof(two_bytes), three_bytes,
+                               sizeof(three_bytes)) &&
+                     signature.size() == 2,
+                 "gaps at the end of values aren't told from EOC markers");
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  if (argc != 2) {
+    fprintf(stderr, "Usage: %s <der_corpus_converter>\n", argv[0]);
+    return 2;
+  }
+  char dir[] = "/tmp/der_corpus_converter_test.XXXXXX";
+  if (!mkdtemp(dir)) {
+    perror("mkdtemp");
+    return 1;
+  }
+
+  std::mt19937 rng;
+  test_checker::Checker checker("inputs");
+  CheckMinimize(rng, argv[1], dir, "pdu", checker);
+  CheckMinimize(rng, argv[1], dir, "x509", checker);
+  CheckEOC(checker);
+  system((std::string("rm -rf ") + dir).c_str());
+
+  checker.Expect(checker.tally("shrunk") != 0, "no input shrunk");
+  return checker.Finish();
+}
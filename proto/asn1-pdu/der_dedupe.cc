@@ -0,0 +1,385 @@
+// Copyright 2020 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include "der_dedupe.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+
+// ASN1_PDU_NO_SIMD builds the code for other CPUs on x86 too, so that a test
+// can check that it hashes like the SSE2 code.
+#if defined(__SSE2__) && !defined(ASN1_PDU_NO_SIMD)
+#define ASN1_PDU_DER_HASHER_SSE2
+#include <emmintrin.h>
+#endif
+
+#include <algorithm>
+#include <new>
+#include <vector>
+
+namespace {
+
+// Keys for the lanes, from SplitMix64. Stripe |i| of a block is keyed with
+// |kSecret[i % kStripesPerBlock]| onwards, so that stripes that trade places
+// hash differently, and the keys after those of the stripes scramble and
+// finish the lanes.
+constexpr uint64_t kSecret[32] = {
+    0x1ac046dda8e86e2a, 0xbe2c3b00b1d348c8, 0x9b1a66a95412ff75,
+    0xc448c2b1f05f7e4c, 0xc111ca6b8f6e73c4, 0xb54861920d05b01d,
+    0x8d61500f4a7bbe16, 0x5e0c25471f89e02e, 0x48105a3d28f0e221,
+    0x2169f8846b637746, 0x3d628782e0c0d863, 0xa5ddb2216078aa40,
+    0xc8119d17f0571101, 0x98e2e2eb8f33280f, 0x8cd1e28860679cc4,
+    0x9dca6189c923aef3, 0x9d8d3071ba4f04c4, 0x5d395ada34220c26,
+    0xe6de42a441a1e28e, 0x308fbf68cc864f59, 0x216a3c81332862f9,
+    0xbaceca0a77f3132e, 0xdf2a2215339ca69c, 0x3e4c11a103a5d859,
+    0x6d0f173ffec5f603, 0x0bf4bc630d193bb6, 0x5f76c4ad104b57fd,
+    0x99ca459f4e93f651, 0x4751799d68cf88a0, 0xa6b1639e3b42b61c,
+    0x278b01031924ea35, 0x430253eb7e993605,
+};
+
+#if !defined(ASN1_PDU_DER_HASHER_SSE2)
+uint64_t Load64(const uint8_t* data) {
+  uint64_t value;
+  memcpy(&value, data, sizeof(value));
+  return value;
+}
+#endif
+
+}  // namespace
+
+constexpr size_t DERHasher::kNumLanes;
+constexpr size_t DERHasher::kStripeSize;
+constexpr size_t DERHasher::kStripesPerBlock;
+
+DERHasher::DERHasher() {
+  memcpy(lanes_, kSecret + kStripesPerBlock, sizeof(lanes_));
+}
+
+void DERHasher::AddStripes(const uint8_t* data, size_t num_stripes) {
+  // Every lane adds the product of the low and high 32 bits of its keyed
+  // value, and the value of its neighbor in the pair, so that a product of
+  // zero doesn't lose the value. After every block, the lanes are scrambled,
+  // which mixes their high bits, which the products leave alone, into the low
+  // ones. The lanes and the stripe count are kept in locals, since the
+  // compiler would otherwise have to assume that storing to them changes the
+  // bytes at |data|.
+  uint64_t lanes[kNumLanes];
+  memcpy(lanes, lanes_, sizeof(lanes));
+  size_t stripe = num_stripes_;
+  auto scramble = [&lanes] {
+    for (size_t i = 0; i < kNumLanes; ++i) {
+      uint64_t lane = lanes[i];
+      lane ^= lane >> 47;
+      lane ^= kSecret[kStripesPerBlock + i];
+      lanes[i] = lane * 0x9E3779B1;
+    }
+  };
+#if defined(ASN1_PDU_DER_HASHER_SSE2)
+  // A pair of lanes per vector, and a 32-bit multiply of both its lanes per
+  // |_mm_mul_epu32|.
+  __m128i pairs[kNumLanes / 2];
+  memcpy(pairs, lanes, sizeof(pairs));
+  for (; num_stripes != 0; --num_stripes, data += kStripeSize) {
+    const uint64_t* secret = kSecret + stripe % kStripesPerBlock;
+    for (size_t i = 0; i < kNumLanes / 2; ++i) {
+      __m128i values = _mm_loadu_si128(
+          reinterpret_cast<const __m128i*>(data) + i);
+      __m128i keyed = _mm_xor_si128(
+          values,
+          _mm_loadu_si128(reinterpret_cast<const __m128i*>(secret + 2 * i)));
+      // The high 32 bits of each lane, moved to its low 32 bits.
+      __m128i keyed_high = _mm_shuffle_epi32(keyed, _MM_SHUFFLE(0, 3, 0, 1));
+      __m128i product = _mm_mul_epu32(keyed, keyed_high);
+      // The values of the lanes, swapped within the pair.
+      __m128i neighbors = _mm_shuffle_epi32(values, _MM_SHUFFLE(1, 0, 3, 2));
+      pairs[i] = _mm_add_epi64(pairs[i], _mm_add_epi64(product, neighbors));
+    }
+    if (++stripe % kStripesPerBlock == 0) {
+      memcpy(lanes, pairs, sizeof(lanes));
+      scramble();
+      memcpy(pairs, lanes, sizeof(pairs));
+    }
+  }
+  memcpy(lanes, pairs, sizeof(lanes));
+#else
+  // The same arithmetic on every pair of lanes, which compilers may
+  // vectorize.
+  for (; num_stripes != 0; --num_stripes, data += kStripeSize) {
+    const uint64_t* secret = kSecret + stripe % kStripesPerBlock;
+    for (size_t i = 0; i < kNumLanes; i += 2) {
+      uint64_t value0 = Load64(data + i * sizeof(uint64_t));
+      uint64_t value1 = Load64(data + (i + 1) * sizeof(uint64_t));
+      uint64_t keyed0 = value0 ^ secret[i];
+      uint64_t keyed1 = value1 ^ secret[i + 1];
+      lanes[i] += value1 + (keyed0 & 0xFFFFFFFF) * (keyed0 >> 32);
+      lanes[i + 1] += value0 + (keyed1 & 0xFFFFFFFF) * (keyed1 >> 32);
+    }
+    if (++stripe % kStripesPerBlock == 0) {
+      scramble();
+    }
+  }
+#endif
+  memcpy(lanes_, lanes, sizeof(lanes));
+  num_stripes_ = stripe;
+}
+
+void DERHasher::Update(const uint8_t* data, size_t size) {
+  // |data| may be null if |size| is 0, e.g. for an empty |DERWriter|.
+  if (size == 0) {
+    return;
+  }
+  size_ += size;
+  if (num_pending_ != 0) {
+    size_t len = std::min(size, kStripeSize - num_pending_);
+    memcpy(pending_ + num_pending_, data, len);
+    num_pending_ += len;
+    data += len;
+    size -= len;
+    if (num_pending_ != kStripeSize) {
+      return;
+    }
+    AddStripes(pending_, 1);
+    num_pending_ = 0;
+  }
+  size_t num_stripes = size / kStripeSize;
+  AddStripes(data, num_stripes);
+  data += num_stripes * kStripeSize;
+  size -= num_stripes * kStripeSize;
+  memcpy(pending_, data, size);
+  num_pending_ = size;
+}
+
+DERHash DERHasher::Finish() const {
+  static_assert(kStripesPerBlock + 2 * kNumLanes <=
+                    sizeof(kSecret) / sizeof(kSecret[0]),
+                "kSecret must key the stripes, the scrambles and the finish");
+  // The last stripe is padded with zeros, which the size tells apart from
+  // bytes that are zero.
+  DERHasher last = *this;
+  if (num_pending_ != 0) {
+    memset(last.pending_ + num_pending_, 0, kStripeSize - num_pending_);
+    last.AddStripes(last.pending_, 1);
+  }
+  const uint64_t* secret = kSecret + kStripesPerBlock + kNumLanes;
+  uint64_t a = size_ * 0x9E3779B185EBCA87;
+  uint64_t b = ~size_ * 0xC2B2AE3D27D4EB4F;
+  for (size_t i = 0; i < kNumLanes; ++i) {
+    a = (a ^ Mix(last.lanes_[i] ^ secret[i])) * 0x9E3779B97F4A7C15;
+    b = (b + Mix(last.lanes_[i] + secret[kNumLanes - 1 - i])) *
+        0xBF58476D1CE4E5B9;
+  }
+  return {{Mix(a ^ (b >> 29)), Mix(b + a)}};
+}
+
+DERHash HashDER(const uint8_t* data, size_t size) {
+  DERHasher hasher;
+  hasher.Update(data, size);
+  return hasher.Finish();
+}
+
+DERHash HashDER(const DERWriter& der) {
+  if (!der.has_references()) {
+    return HashDER(der.data(), der.size());
+  }
+  // Kept between calls, like the writers of the harnesses.
+  static thread_local std::vector<struct iovec> segments;
+  segments.clear();
+  der.AppendSegmentsTo(segments);
+  DERHasher hasher;
+  for (const struct iovec& segment : segments) {
+    hasher.Update(static_cast<const uint8_t*>(segment.iov_base),
+                  segment.iov_len);
+  }
+  return hasher.Finish();
+}
+
+namespace {
+
+// The size class of a length, which is its number of significant bits.
+uint64_t GetLengthClass(size_t len) {
+  return len == 0 ? 0 : 64 - __builtin_clzll(len);
+}
+
+// Returns a key for the identifier of |tlv|.
+uint64_t GetIdentifierKey(const TLV& tlv) {
+  return static_cast<uint64_t>(tlv.tag_num) << 8 | tlv.identifier;
+}
+
+// Returns the feature of bytes that don't parse as TLVs in the value of
+// |parent|, or at the top level if it is null.
+uint32_t GetGapFeature(const TLV* parent) {
+  return static_cast<uint32_t>(
+      Mix((parent ? GetIdentifierKey(*parent) + 1 : 0) ^ 0x6761702d6b6579));
+}
+
+}  // namespace
+
+void GetDERSignature(const uint8_t* data,
+                     size_t size,
+                     TLVIndex& index,
+                     std::vector<uint32_t>& signature) {
+  signature.clear();
+  index.Parse(data, size);
+  const std::vector<TLV>& tlvs = index.tlvs();
+  // The TLVs that contain the current one, and the offset where the next TLV
+  // in the value of each, or at the top level, is expected to start.
+  struct Parent {
+    const TLV* tlv;
+    size_t next;
+    bool indefinite;
+  };
+  std::vector<Parent> parents = {{nullptr, 0, false}};
+  // Pops the parents that don't contain a TLV at |depth|, and adds a feature
+  // for each whose value doesn't end where its last TLV does.
+  auto close_parents = [&](size_t depth) {
+    while (parents.size() > depth + 1) {
+      const TLV& tlv = *parents.back().tlv;
+      size_t end = tlv.offset + tlv.header_len + tlv.value_len;
+      size_t next = parents.back().next;
+      bool indefinite = parents.back().indefinite;
+      parents.pop_back();
+      // The value of an indefinite length includes its EOC marker, which
+      // |TLVIndex::Parse| doesn't record as a TLV.
+      bool eoc = indefinite && next + 2 == end && data[next] == 0x00 &&
+                 data[next + 1] == 0x00;
+      if (next != end && !eoc) {
+        signature.push_back(GetGapFeature(&tlv));
+      }
+    }
+  };
+  for (const TLV& tlv : tlvs) {
+    close_parents(tlv.depth);
+    Parent& parent = parents.back();
+    if (tlv.offset != parent.next) {
+      signature.push_back(GetGapFeature(parent.tlv));
+    }
+    parent.next = tlv.offset + tlv.header_len + tlv.value_len;
+
+    TLVHeader header;
+    ParseTLVHeader(data + tlv.offset, size - tlv.offset, header);
+    uint64_t form;
+    if (header.indefinite) {
+      form = 0;
+    } else if (header.length_len != GetDefiniteLengthLen(header.value_len)) {
+      form = 1;
+    } else {
+      form = header.length_len == 1 ? 2 : 3;
+    }
+    // High tag numbers that could have been low ones, or have leading zeros.
+    size_t identifier_len =
+        tlv.tag_num < 31 ? 1 : 1 + GetVariableIntLen(tlv.tag_num, 128);
+    form |= (header.identifier_len != identifier_len) << 2;
+    uint64_t feature =
+        Mix((parent.tlv ? GetIdentifierKey(*parent.tlv) + 1 : 0) *
+                0x9E3779B97F4A7C15 ^
+            GetIdentifierKey(tlv)) ^
+        (std::min<uint64_t>(tlv.depth, 63) | form << 6 |
+         GetLengthClass(tlv.value_len) << 9);
+    if (!(tlv.identifier & kAsn1Constructed) && !header.indefinite &&
+        tlv.value_len <= kMaxSignatureValueLen) {
+      uint64_t value[2] = {0, 0};
+      memcpy(value, data + tlv.offset + tlv.header_len, tlv.value_len);
+      feature = Mix(feature ^ value[0]) * 0xBF58476D1CE4E5B9 ^ value[1];
+    }
+    signature.push_back(static_cast<uint32_t>(Mix(feature)));
+    if (tlv.identifier & kAsn1Constructed || header.indefinite) {
+      parents.push_back(
+          {&tlv, tlv.offset + tlv.header_len, header.indefinite});
+    }
+  }
+  close_parents(0);
+  if (parents.back().next != size) {
+    signature.push_back(GetGapFeature(nullptr));
+  }
+  std::sort(signature.begin(), signature.end());
+  signature.erase(std::unique(signature.begin(), signature.end()),
+                  signature.end());
+}
+
+constexpr size_t DERDedupeSet::kDefaultNumSlots;
+constexpr size_t DERDedupeSet::kMaxProbes;
+constexpr size_t DERDedupeSet::kNumCounterShards;
+constexpr size_t DERDedupeSet::kCacheLineSize;
+
+void* DERDedupeSet::operator new(size_t size) {
+  void* set;
+  if (posix_memalign(&set, alignof(DERDedupeSet), size) != 0) {
+    throw std::bad_alloc();
+  }
+  return set;
+}
+
+void DERDedupeSet::operator delete(void* set) {
+  free(set);
+}
+
+DERDedupeSet::DERDedupeSet(size_t num_slots)
+    : mask_(RoundUpToPowerOfTwo(num_slots) - 1) {
+  slots_.reset(new std::atomic<uint64_t>[mask_ + 1]);
+  Clear();
+}
+
+bool DERDedupeSet::Insert(const DERHash& hash) {
+  // An empty slot holds 0, so a hash whose low bits are 0 is held as 1.
+  uint64_t key = hash.hash[0] != 0 ? hash.hash[0] : 1;
+  size_t first_slot = hash.hash[1];
+  // Only the keys are shared between threads, so relaxed atomics suffice.
+  CounterShard& counters = counters_[key % kNumCounterShards];
+  counters.insertions.fetch_add(1, std::memory_order_relaxed);
+  for (size_t i = 0; i < kMaxProbes; ++i) {
+    std::atomic<uint64_t>& slot = slots_[(first_slot + i) & mask_];
+    uint64_t held = slot.load(std::memory_order_relaxed);
+    if (held == 0 &&
+        slot.compare_exchange_strong(held, key, std::memory_order_relaxed)) {
+      return true;
+    }
+    // |held| is the key of the thread that took the slot first, if any.
+    if (held == key) {
+      counters.duplicates.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+  }
+  // The key picks the slot to replace, since the high bits of the hash picked
+  // the first one.
+  slots_[(first_slot + (key >> 32) % kMaxProbes) & mask_].store(
+      key, std::memory_order_relaxed);
+  counters.evictions.fetch_add(1, std::memory_order_relaxed);
+  return true;
+}
+
+void DERDedupeSet::Clear() {
+  for (size_t i = 0; i <= mask_; ++i) {
+    slots_[i].store(0, std::memory_order_relaxed);
+  }
+}
+
+DERDedupeSet::Stats DERDedupeSet::stats() const {
+  Stats stats = {0, 0, 0};
+  for (const CounterShard& counters : counters_) {
+    stats.insertions += counters.insertions.load(std::memory_order_relaxed);
+    stats.duplicates += counters.duplicates.load(std::memory_order_relaxed);
+    stats.evictions += counters.evictions.load(std::memory_order_relaxed);
+  }
+  return stats;
+}
+
+double DERDedupeSet::duplicate_rate() const {
+  Stats stats = this->stats();
+  return stats.insertions == 0
+             ? 0
+             : static_cast<double>(stats.duplicates) / stats.insertions;
+}
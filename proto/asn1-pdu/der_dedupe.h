@@ -0,0 +1,173 @@
+// Copyright 2020 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef PROTO_ASN1_PDU_DER_DEDUPE_H_
+#define PROTO_ASN1_PDU_DER_DEDUPE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#include "common.h"
+
+// A 128-bit hash of an encoding. It is not cryptographic, but makes accidental
+// collisions between encodings negligible.
+struct DERHash {
+  uint64_t hash[2];
+};
+
+inline bool operator==(const DERHash& a, const DERHash& b) {
+  return a.hash[0] == b.hash[0] && a.hash[1] == b.hash[1];
+}
+inline bool operator!=(const DERHash& a, const DERHash& b) {
+  return !(a == b);
+}
+
+// Hashes bytes that arrive in pieces, such as the segments of a |DERWriter|,
+// to the same |DERHash| as the concatenation of the pieces.
+// The bytes are hashed in stripes of 64, in the style of XXH3: every stripe is
+// multiplied into 8 lanes of 64 bits, two lanes at a time with SSE2 on x86, so
+// that long encodings hash at close to the speed they are read. Other CPUs
+// compute the same hash one lane at a time.
+class DERHasher {
+ public:
+  DERHasher();
+
+  void Update(const uint8_t* data, size_t size);
+
+  // Returns the hash of the bytes added so far.
+  DERHash Finish() const;
+
+ private:
+  static constexpr size_t kNumLanes = 8;
+  static constexpr size_t kStripeSize = kNumLanes * sizeof(uint64_t);
+  // The lanes are scrambled after every block of this many stripes.
+  static constexpr size_t kStripesPerBlock = 16;
+
+  // Adds the |num_stripes| stripes at |data| to the lanes.
+  void AddStripes(const uint8_t* data, size_t num_stripes);
+
+  uint64_t lanes_[kNumLanes];
+  size_t num_stripes_ = 0;
+  uint64_t size_ = 0;
+  // The bytes of the stripe that aren't complete yet.
+  uint8_t pending_[kStripeSize];
+  size_t num_pending_ = 0;
+};
+
+// Returns the hash of the |size| bytes at |data|.
+DERHash HashDER(const uint8_t* data, size_t size);
+
+// Returns the hash of the encoding written to |der|, which is the hash of its
+// bytes whether or not it references values.
+DERHash HashDER(const DERWriter& der);
+
+// Primitive values up to this size are features of a signature.
+constexpr size_t kMaxSignatureValueLen = 16;
+
+// Replaces |signature| with the features of the |size| bytes at |data|, as
+// |index| parses them into TLVs, sorted and without repeats. Every TLV is a
+// feature of its identifier, the identifier of the TLV that contains it, its
+// depth, the form and size class of its length, and for primitive TLVs of at
+// most |kMaxSignatureValueLen| bytes, its value. Bytes that don't parse as
+// TLVs are a feature of the TLV that contains them. Features are 32-bit
+// hashes, like the coverage features of fuzzing engines.
+// The signature is what a DER parser's coverage mostly depends on, so inputs
+// with the same signature are expected to exercise a parser the same way, and
+// a minimizer can shrink an input as long as its signature stays the same.
+void GetDERSignature(const uint8_t* data,
+                     size_t size,
+                     TLVIndex& index,
+                     std::vector<uint32_t>& signature);
+
+// A bounded set of the hashes of encodings seen, which any number of threads
+// can insert into at the same time, without locks. It holds the 64 low bits of
+// every hash, at a slot picked by the 64 high bits, or one of the few slots
+// after it. Once those are all taken, the hash replaces one of them, so the
+// memory of the set is fixed at 8 bytes per slot, and an evicted hash counts
+// as new if it is seen again.
+class DERDedupeSet {
+ public:
+  static constexpr size_t kDefaultNumSlots = 1 << 20;
+
+  // Counters of the insertions into a set.
+  struct Stats {
+    uint64_t insertions;
+    // Insertions of hashes that the set held already.
+    uint64_t duplicates;
+    // Insertions that replaced another hash.
+    uint64_t evictions;
+  };
+
+  // Creates a set of |num_slots| slots, rounded up to a power of two.
+  explicit DERDedupeSet(size_t num_slots = kDefaultNumSlots);
+
+  DERDedupeSet(const DERDedupeSet&) = delete;
+  DERDedupeSet& operator=(const DERDedupeSet&) = delete;
+
+  // Allocates sets at the alignment of their counters, which |new| only
+  // respects by itself from C++17.
+  static void* operator new(size_t size);
+  static void operator delete(void* set);
+
+  size_t num_slots() const { return mask_ + 1; }
+
+  // Adds |hash| to the set, and returns true if it wasn't in the set.
+  bool Insert(const DERHash& hash);
+
+  // Hashes the |size| bytes at |data|, or the encoding of |der|, and inserts
+  // the hash.
+  bool Insert(const uint8_t* data, size_t size) {
+    return Insert(HashDER(data, size));
+  }
+  bool Insert(const DERWriter& der) { return Insert(HashDER(der)); }
+
+  // Empties the set, and keeps the counters. Must not be called while other
+  // threads insert.
+  void Clear();
+
+  Stats stats() const;
+
+  // Returns the fraction of insertions that were duplicates, or 0 if there
+  // were none.
+  double duplicate_rate() const;
+
+ private:
+  // The number of slots a hash may take, starting at the one its high bits
+  // pick.
+  static constexpr size_t kMaxProbes = 8;
+
+  // The counters are spread over this many cache lines, picked by the hash,
+  // so that threads that insert at the same time rarely update the same line.
+  static constexpr size_t kNumCounterShards = 16;
+  static constexpr size_t kCacheLineSize = 64;
+
+  struct alignas(kCacheLineSize) CounterShard {
+    std::atomic<uint64_t> insertions{0};
+    std::atomic<uint64_t> duplicates{0};
+    std::atomic<uint64_t> evictions{0};
+  };
+
+  std::unique_ptr<std::atomic<uint64_t>[]> slots_;
+  const size_t mask_;
+
+  CounterShard counters_[kNumCounterShards];
+};
+
+#endif  // PROTO_ASN1_PDU_DER_DEDUPE_H_
@@ -0,0 +1,74 @@
+// Copyright 2020 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef PROTO_ASN1_PDU_DER_FUZZER_H_
+#define PROTO_ASN1_PDU_DER_FUZZER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "common.h"
+
+// Passes the DER encoding of a fuzzer generated protobuf, |size| bytes at
+// |data|, to the parser under test.
+// The fuzz harnesses (asn1_pdu_fuzzer.cc and x509_certificate_fuzzer.cc) call
+// this for every input, and a fuzz target that links a harness defines it.
+extern "C" void TestOneDERInput(const uint8_t* data, size_t size);
+
+class DERDedupeSet;
+class EncodingCache;
+
+namespace der_fuzzer {
+
+// The most bytes of DER that the protobuf harnesses pass on, 4 MiB by default;
+// CMakeLists.txt sets it from its ASN1_PDU_FUZZER_MAX_DER_SIZE cache variable.
+#ifndef ASN1_PDU_FUZZER_MAX_DER_SIZE
+#define ASN1_PDU_FUZZER_MAX_DER_SIZE (4 << 20)
+#endif
+constexpr size_t kMaxDERSize = ASN1_PDU_FUZZER_MAX_DER_SIZE;
+
+// Gives |der| the budget of the harnesses: the encoders stop as soon as an
+// encoding reaches |kMaxDERSize| bytes, and discard it. The per-value cap of
+// |RepeatedBytes| still lets an input with many of them encode to gigabytes,
+// which would slow the fuzzer down, and grow the writer that a harness keeps
+// for good.
+inline void SetBudget(DERWriter& der) {
+  EncodingBudget budget;
+  budget.max_size = kMaxDERSize;
+  budget.policy = EncodingBudget::kEmpty;
+  der.set_budget(budget);
+}
+
+// Counts an execution of the harness, and periodically reports the number of
+// executions per second and allocations per execution to stderr, followed by
+// the counters of the encoders if they are built with ASN1_PDU_ENCODER_STATS
+// (see encoder_stats.h).
+// Only defined if the harnesses are built with ASN1_PDU_FUZZER_STATS.
+void RecordExecution();
+
+// Adds the hit rate of |cache| to the reports of |RecordExecution|, which sum
+// the counters of all caches added. |cache| must never be destroyed.
+// Only defined if the harnesses are built with ASN1_PDU_FUZZER_STATS.
+void AddEncodingCache(const EncodingCache* cache);
+
+// Adds the duplicate rate of |set| to the reports of |RecordExecution|. |set|
+// must never be destroyed.
+// Only defined if the harnesses are built with ASN1_PDU_FUZZER_STATS.
+void AddDERDedupeSet(const DERDedupeSet* set);
+
+}  // namespace der_fuzzer
+
+#endif  // PROTO_ASN1_PDU_DER_FUZZER_H_
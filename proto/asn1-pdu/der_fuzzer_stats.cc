@@ -0,0 +1,136 @@
+// Copyright 2020 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include "der_fuzzer.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <vector>
+
+#include "der_dedupe.h"
+#include "encoder_stats.h"
+#include "encoding_cache.h"
+
+// Provided by the sanitizer runtime, if the fuzz target is built with one
+// (e.g. -fsanitize=fuzzer,address). Allocations can only be counted if it is.
+extern "C" int __sanitizer_install_malloc_and_free_hooks(
+    void (*malloc_hook)(const volatile void*, size_t),
+    void (*free_hook)(const volatile void*)) __attribute__((weak));
+
+namespace der_fuzzer {
+
+namespace {
+
+// Reports are printed when the number of executions reaches a power of two,
+// starting at |kFirstReport|, and at exit.
+constexpr uint64_t kFirstReport = 1 << 10;
+
+// Executions may be recorded by many threads at once.
+std::atomic<uint64_t> num_executions(0);
+std::once_flag started;
+std::chrono::steady_clock::time_point start_time;
+
+// Counts every allocation of the process since the first execution, which
+// includes those of the mutator and the parser under test.
+bool counting_allocations = false;
+std::atomic<uint64_t> num_allocations(0);
+
+// The caches of the harness threads, which are added once per thread.
+std::mutex encoding_caches_mutex;
+std::vector<const EncodingCache*> encoding_caches;
+
+// The dedupe set of the harness, which is shared by its threads.
+std::atomic<const DERDedupeSet*> der_dedupe_set(nullptr);
+
+void CountAllocation(const volatile void*, size_t) {
+  num_allocations.fetch_add(1, std::memory_order_relaxed);
+}
+
+void IgnoreFree(const volatile void*) {}
+
+void Report() {
+  std::chrono::duration<double> seconds =
+      std::chrono::steady_clock::now() - start_time;
+  uint64_t executions = num_executions.load();
+  fprintf(stderr, "der_fuzzer: %llu execs, %.0f exec/s",
+          static_cast<unsigned long long>(executions),
+          executions / seconds.count());
+  if (counting_allocations) {
+    fprintf(stderr, ", %.1f allocs/exec",
+            static_cast<double>(num_allocations.load()) / executions);
+  }
+  std::lock_guard<std::mutex> lock(encoding_caches_mutex);
+  if (!encoding_caches.empty()) {
+    uint64_t lookups = 0;
+    uint64_t hits = 0;
+    uint64_t evictions = 0;
+    for (const EncodingCache* cache : encoding_caches) {
+      EncodingCache::Stats stats = cache->stats();
+      lookups += stats.lookups;
+      hits += stats.hits;
+      evictions += stats.evictions;
+    }
+    fprintf(stderr,
+            ", encoding cache: %.1f%% hits of %llu lookups, %llu evictions",
+            lookups == 0 ? 0 : 100.0 * hits / lookups,
+            static_cast<unsigned long long>(lookups),
+            static_cast<unsigned long long>(evictions));
+  }
+  if (const DERDedupeSet* set = der_dedupe_set.load()) {
+    DERDedupeSet::Stats stats = set->stats();
+    fprintf(stderr, ", DER dedupe: %.1f%% duplicates of %llu, %llu evictions",
+            100.0 * set->duplicate_rate(),
+            static_cast<unsigned long long>(stats.insertions),
+            static_cast<unsigned long long>(stats.evictions));
+  }
+  fprintf(stderr, "\n");
+  if (ASN1PDUEncoderStatsEnabled()) {
+    ASN1PDUPrintEncoderStats(stderr);
+  }
+}
+
+}  // namespace
+
+void RecordExecution() {
+  std::call_once(started, [] {
+    start_time = std::chrono::steady_clock::now();
+    if (__sanitizer_install_malloc_and_free_hooks) {
+      counting_allocations =
+          __sanitizer_install_malloc_and_free_hooks(CountAllocation,
+                                                    IgnoreFree) != 0;
+    }
+    atexit(Report);
+  });
+  uint64_t executions = ++num_executions;
+  if (executions >= kFirstReport && (executions & (executions - 1)) == 0) {
+    Report();
+  }
+}
+
+void AddEncodingCache(const EncodingCache* cache) {
+  std::lock_guard<std::mutex> lock(encoding_caches_mutex);
+  encoding_caches.push_back(cache);
+}
+
+void AddDERDedupeSet(const DERDedupeSet* set) {
+  der_dedupe_set.store(set);
+}
+
+}  // namespace der_fuzzer
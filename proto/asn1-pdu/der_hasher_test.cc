@@ -0,0 +1,98 @@
+// Copyright 2020 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+// Checks that |DERHasher| hashes inputs of lengths around its stripes and
+// blocks to golden hashes, which the SSE2 code and the code for other CPUs
+// must both compute (CMakeLists.txt builds this check with each), and that
+// |Update| hashes the same bytes to the same hash however they are split.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "der_dedupe.h"
+#include "random_inputs.h"
+#include "test_checker.h"
+
+namespace {
+
+struct Golden {
+  size_t len;
+  DERHash hash;
+};
+
+// The hashes of the first |len| bytes of |GoldenInput|: less than a stripe, a
+// stripe of 64 bytes and around it, and a block of 16 stripes and around it.
+constexpr Golden kGoldens[] = {
+    {0, {{0xfb3410ec08474aaf, 0xb587cf6f7c391ab5}}},
+    {1, {{0x6c1441ffa58af0cf, 0x4805df839df9e7a3}}},
+    {7, {{0x57a11b30780e4871, 0x22b3809178b6d314}}},
+    {63, {{0x376837a7f368dd5a, 0x9503390874b241cb}}},
+    {64, {{0x409149ad81f0dc78, 0x52b3984dca57b5db}}},
+    {65, {{0x9dba2d7ecde1d246, 0x3cef472be7c08840}}},
+    {1023, {{0xfcbce9f562a1535c, 0x7800277a3c4adc10}}},
+    {1024, {{0x96f9c8f4ab25a6e5, 0x11d4e5ecdce8a136}}},
+    {1025, {{0x1bcacddc7ad510a0, 0x56cccef293a7b04e}}},
+    {4196, {{0x6e38402e271acbaf, 0x43380770f1b561a1}}},
+};
+
+std::vector<uint8_t> GoldenInput(size_t len) {
+  std::vector<uint8_t> bytes(len);
+  for (size_t i = 0; i < len; ++i) {
+    bytes[i] = static_cast<uint8_t>(i * 131 + (i >> 8) * 7 + 1);
+  }
+  return bytes;
+}
+
+}  // namespace
+
+int main() {
+#if defined(__SSE2__) && !defined(ASN1_PDU_NO_SIMD)
+  test_checker::Checker checker("SSE2 hashes");
+#else
+  test_checker::Checker checker("portable hashes");
+#endif
+  for (const Golden& golden : kGoldens) {
+    std::vector<uint8_t> input = GoldenInput(golden.len);
+    DERHash hash = HashDER(input.data(), input.size());
+    checker.Expect(hash == golden.hash, "%zu bytes: hash 0x%016llx%016llx",
+                   golden.len, static_cast<unsigned long long>(hash.hash[0]),
+                   static_cast<unsigned long long>(hash.hash[1]));
+  }
+
+  // Splits random inputs into random pieces, some of them empty or shorter
+  // than a stripe.
+  std::mt19937 rng;
+  for (int i = 0; i < 1000; ++i) {
+    std::string input = random_inputs::RandomBytes(rng, rng() % 3000);
+    const uint8_t* data = reinterpret_cast<const uint8_t*>(input.data());
+    DERHasher hasher;
+    for (size_t pos = 0; pos < input.size();) {
+      size_t len = std::min<size_t>(
+          input.size() - pos, rng() % 2 == 0 ? rng() % 70 : rng() % 2000);
+      hasher.Update(data + pos, len);
+      pos += len;
+    }
+    checker.Expect(hasher.Finish() == HashDER(data, input.size()),
+                   "%zu bytes: split hash mismatch", input.size());
+  }
+
+  return checker.Finish();
+}
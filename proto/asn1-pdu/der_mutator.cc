@@ -0,0 +1,443 @@
+// Copyright 2020 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include "der_mutator.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+namespace {
+
+// The number of mutations tried before giving up on an input, e.g. because
+// they don't fit its maximum size.
+constexpr int kMaxAttempts = 8;
+
+// Tag numbers of the universal types that parsers of X.509 and other
+// protocols expect (X.680 (2015), 8.6, Table 1): BOOLEAN, INTEGER, BIT
+// STRING, OCTET STRING, NULL, OBJECT IDENTIFIER, ENUMERATED, UTF8String,
+// SEQUENCE, SET, PrintableString, T61String, IA5String, UTCTime,
+// GeneralizedTime, UniversalString and BMPString.
+constexpr uint8_t kUniversalTagNums[] = {1,  2,  3,  4,  5,  6,  10, 12, 16,
+                                         17, 19, 20, 22, 23, 24, 28, 30};
+
+// High tag numbers at the boundaries of their number of base 128 digits.
+constexpr uint32_t kHighTagNums[] = {31,      127,      128,       16383,
+                                     16384,   2097151,  2097152,   UINT32_MAX};
+
+// Returns the size of the TLV of |tlv|.
+size_t TLVSize(const TLV& tlv) {
+  return tlv.header_len + tlv.value_len;
+}
+
+// Writes |len| to |out| as a definite length of |length_len| bytes if it fits,
+// or else with the minimal encoding, and returns the size of the length.
+size_t WriteLength(size_t len, size_t length_len, uint8_t* out) {
+  if (length_len > 1 && length_len - 1 <= sizeof(len) &&
+      GetVariableIntLen(len, 256) <= length_len - 1) {
+    // The long form with leading zeros (X.690 (2015), 8.1.3.5).
+    out[0] = 0x80 | (length_len - 1);
+    for (size_t i = length_len - 1; i != 0; --i) {
+      out[i] = len & 0xFF;
+      len >>= 8;
+    }
+    return length_len;
+  }
+  WriteDefiniteLength(len, out);
+  return GetDefiniteLengthLen(len);
+}
+
+}  // namespace
+
+constexpr size_t DERMutator::kNoTLV;
+
+DERMutator::DERMutator(MutateBytesFn mutate_bytes)
+    : mutate_bytes_(mutate_bytes) {}
+
+size_t DERMutator::Mutate(uint8_t* data,
+                          size_t size,
+                          size_t max_size,
+                          unsigned seed) {
+  rng_.seed(seed);
+  index_.Parse(data, size);
+  if (index_.tlvs().empty()) {
+    return 0;
+  }
+  for (int attempt = 0; attempt < kMaxAttempts; ++attempt) {
+    der_.assign(data, data + size);
+    // TLVs are inserted from the input itself.
+    if (MutateOnce(data, index_, false) && !der_.empty() &&
+        der_.size() <= max_size) {
+      memcpy(data, der_.data(), der_.size());
+      return der_.size();
+    }
+  }
+  return 0;
+}
+
+size_t DERMutator::CrossOver(const uint8_t* data1,
+                             size_t size1,
+                             const uint8_t* data2,
+                             size_t size2,
+                             uint8_t* out,
+                             size_t max_out_size,
+                             unsigned seed) {
+  rng_.seed(seed);
+  index_.Parse(data1, size1);
+  donor_index_.Parse(data2, size2);
+  if (index_.tlvs().empty() || donor_index_.tlvs().empty()) {
+    return 0;
+  }
+  for (int attempt = 0; attempt < kMaxAttempts; ++attempt) {
+    der_.assign(data1, data1 + size1);
+    if (MutateOnce(data2, donor_index_, true) && !der_.empty() &&
+        der_.size() <= max_out_size) {
+      memcpy(out, der_.data(), der_.size());
+      return der_.size();
+    }
+  }
+  return 0;
+}
+
+size_t DERMutator::Parent(size_t i) const {
+  const std::vector<TLV>& tlvs = index_.tlvs();
+  if (tlvs[i].depth == 0) {
+    return kNoTLV;
+  }
+  // The TLVs are in the order they appear, so the parent is the closest TLV
+  // before this one that is one level up.
+  uint32_t depth = tlvs[i].depth;
+  while (tlvs[--i].depth >= depth) {
+  }
+  return i;
+}
+
+bool DERMutator::MutateOnce(const uint8_t* donor,
+                            const TLVIndex& donor_index,
+                            bool cross_over) {
+  size_t i = Rand(index_.tlvs().size());
+  if (cross_over) {
+    // A cross over inserts a TLV of the other input, or replaces one with it.
+    const TLV& tlv = donor_index.tlvs()[Rand(donor_index.tlvs().size())];
+    scratch_.assign(donor + tlv.offset, donor + tlv.offset + TLVSize(tlv));
+    return Rand(2) ? ReplaceTLV(i, scratch_.data(), scratch_.size())
+                   : InsertTLV(i, scratch_.data(), scratch_.size());
+  }
+
+  // Most of the coverage is behind the values, so mutate them the most.
+  static const Mutation kMutations[] = {
+      kDeleteTLV, kDuplicateTLV, kInsertTLV,   kSwapTLV,
+      kRetagTLV,  kBreakLength,  kMutateValue, kMutateValue};
+  if ((mutations_ & kAllMutations) == 0) {
+    return false;
+  }
+  Mutation mutation;
+  do {
+    mutation = kMutations[Rand(sizeof(kMutations) / sizeof(kMutations[0]))];
+  } while (!(mutations_ & mutation));
+
+  switch (mutation) {
+    case kDeleteTLV:
+      return DeleteTLV(i);
+    case kDuplicateTLV:
+      return DuplicateTLV(i);
+    case kInsertTLV: {
+      const TLV& tlv = donor_index.tlvs()[Rand(donor_index.tlvs().size())];
+      scratch_.assign(donor + tlv.offset, donor + tlv.offset + TLVSize(tlv));
+      return InsertTLV(i, scratch_.data(), scratch_.size());
+    }
+    case kSwapTLV:
+      return SwapTLV(i);
+    case kRetagTLV:
+      return RetagTLV(i);
+    case kBreakLength:
+      return BreakLength(i);
+    default:
+      return MutateValue(i);
+  }
+}
+
+bool DERMutator::ParseHeader(size_t i, TLVHeader& header) const {
+  const TLV& tlv = index_.tlvs()[i];
+  return ParseTLVHeader(der_.data() + tlv.offset, der_.size() - tlv.offset,
+                        header) &&
+         header.identifier_len + header.length_len == tlv.header_len;
+}
+
+bool DERMutator::DeleteTLV(size_t i) {
+  const TLV& tlv = index_.tlvs()[i];
+  size_t size = TLVSize(tlv);
+  der_.erase(der_.begin() + tlv.offset, der_.begin() + tlv.offset + size);
+  return FixLengths(Parent(i), -static_cast<ptrdiff_t>(size));
+}
+
+bool DERMutator::DuplicateTLV(size_t i) {
+  const TLV& tlv = index_.tlvs()[i];
+  scratch_.assign(der_.begin() + tlv.offset,
+                  der_.begin() + tlv.offset + TLVSize(tlv));
+  Splice(tlv.offset + TLVSize(tlv), 0, scratch_.data(), scratch_.size());
+  return FixLengths(Parent(i), scratch_.size());
+}
+
+bool DERMutator::InsertTLV(size_t i, const uint8_t* tlv, size_t tlv_size) {
+  const TLV& target = index_.tlvs()[i];
+  switch (Rand(3)) {
+    case 0:
+      // Before |target|.
+      Splice(target.offset, 0, tlv, tlv_size);
+      return FixLengths(Parent(i), tlv_size);
+    case 1:
+      // After |target|.
+      Splice(target.offset + TLVSize(target), 0, tlv, tlv_size);
+      return FixLengths(Parent(i), tlv_size);
+    default:
+      // At the start of the value of |target|, even if it's primitive.
+      Splice(target.offset + target.header_len, 0, tlv, tlv_size);
+      return FixLengths(i, tlv_size);
+  }
+}
+
+bool DERMutator::ReplaceTLV(size_t i, const uint8_t* tlv, size_t tlv_size) {
+  const TLV& target = index_.tlvs()[i];
+  size_t size = TLVSize(target);
+  Splice(target.offset, size, tlv, tlv_size);
+  return FixLengths(Parent(i), static_cast<ptrdiff_t>(tlv_size) -
+                                   static_cast<ptrdiff_t>(size));
+}
+
+bool DERMutator::SwapTLV(size_t i) {
+  // Swaps |i| with its next sibling, which keeps the size of their parent.
+  const std::vector<TLV>& tlvs = index_.tlvs();
+  size_t j = i + 1;
+  while (j < tlvs.size() && tlvs[j].depth > tlvs[i].depth) {
+    ++j;
+  }
+  if (j == tlvs.size() || tlvs[j].depth != tlvs[i].depth) {
+    return false;
+  }
+  // |der_[first, last)| holds |i|, the bytes between them, and |j|, which
+  // are rotated so that |j| comes first, and |i| last.
+  size_t first = tlvs[i].offset;
+  size_t middle = tlvs[j].offset;
+  size_t last = middle + TLVSize(tlvs[j]);
+  std::rotate(der_.begin() + first, der_.begin() + middle,
+              der_.begin() + last);
+  // Now |j| is first, followed by |i| and the bytes between them.
+  size_t between = first + (last - middle);
+  std::rotate(der_.begin() + between, der_.begin() + between + TLVSize(tlvs[i]),
+              der_.begin() + last);
+  return true;
+}
+
+bool DERMutator::RetagTLV(size_t i) {
+  const TLV& tlv = index_.tlvs()[i];
+  TLVHeader header;
+  if (!ParseHeader(i, header)) {
+    return false;
+  }
+
+  // The class and encoding bits (X.690 (2015), 8.1.2).
+  uint8_t id = tlv.identifier & 0xE0;
+  // The low tag number, or 0x1F for the high-tag-number form.
+  uint8_t low_tag_num = tlv.identifier & 0x1F;
+  // At most the high-tag-number form of a 32-bit tag number.
+  uint8_t identifier[1 + 5];
+  size_t identifier_len = 1;
+  switch (Rand(4)) {
+    case 0:
+      identifier[0] =
+          id | kUniversalTagNums[Rand(sizeof(kUniversalTagNums))];
+      break;
+    case 1:
+      // The other encoding, so primitive values are parsed as TLVs, and
+      // constructed ones as bytes.
+      if (header.identifier_len > sizeof(identifier)) {
+        return false;
+      }
+      identifier[0] = (id ^ kAsn1Constructed) | low_tag_num;
+      identifier_len = header.identifier_len;
+      memcpy(identifier + 1, der_.data() + tlv.offset + 1,
+             identifier_len - 1);
+      break;
+    case 2:
+      // Another class, e.g. the context-specific tag of an implicitly tagged
+      // field (X.680 (2015), 31.2.7).
+      identifier[0] = (id & kAsn1Constructed) | (Rand(4) << 6) |
+                      (Rand(2) && low_tag_num != 0x1F ? low_tag_num : Rand(4));
+      break;
+    default: {
+      // The high-tag-number form (X.690 (2015), 8.1.2.4), which is invalid
+      // in DER for tag numbers below 31.
+      uint32_t tag_num =
+          Rand(2) ? kHighTagNums[Rand(sizeof(kHighTagNums) /
+                                      sizeof(kHighTagNums[0]))]
+                  : tlv.tag_num;
+      identifier[0] = id | 0x1F;
+      identifier_len += GetVariableIntLen(tag_num, 128);
+      // Base 128 digits, where all but the last have the high bit set.
+      for (size_t j = identifier_len - 1; j != 0; --j) {
+        identifier[j] = tag_num & 0x7F;
+        if (j != identifier_len - 1) {
+          identifier[j] |= 0x80;
+        }
+        tag_num >>= 7;
+      }
+      break;
+    }
+  }
+  Splice(tlv.offset, header.identifier_len, identifier, identifier_len);
+  return FixLengths(Parent(i),
+                    static_cast<ptrdiff_t>(identifier_len) -
+                        static_cast<ptrdiff_t>(header.identifier_len));
+}
+
+bool DERMutator::BreakLength(size_t i) {
+  const TLV& tlv = index_.tlvs()[i];
+  TLVHeader header;
+  if (!ParseHeader(i, header)) {
+    return false;
+  }
+  size_t length_pos = tlv.offset + header.identifier_len;
+
+  // At most the long form of a 64-bit length with leading zeros.
+  uint8_t length[1 + 2 * sizeof(uint64_t)];
+  size_t length_len;
+  // The EOC marker added for an indefinite length.
+  size_t eoc_len = 0;
+  switch (Rand(4)) {
+    case 0:
+      if (header.indefinite) {
+        // The definite length of the value, which covers the EOC marker.
+        length_len = WriteLength(tlv.value_len, 0, length);
+      } else {
+        // The indefinite length (X.690 (2015), 8.1.3.6), with an EOC marker
+        // after the value.
+        static const uint8_t kEOC[2] = {0x00, 0x00};
+        Splice(tlv.offset + TLVSize(tlv), 0, kEOC, sizeof(kEOC));
+        eoc_len = sizeof(kEOC);
+        length[0] = 0x80;
+        length_len = 1;
+      }
+      break;
+    case 1:
+      // A long form with leading zeros, which is not the minimal encoding
+      // that DER requires (X.690 (2015), 10.1).
+      length_len = WriteLength(
+          tlv.value_len,
+          std::min<size_t>(1 + GetVariableIntLen(tlv.value_len, 256) + 1 +
+                               Rand(3),
+                           1 + sizeof(size_t)),
+          length);
+      break;
+    case 2: {
+      // A length that doesn't match the value.
+      static const size_t kLengths[] = {0, 1, 127, 128, 255, 256, 65535,
+                                        UINT32_MAX, SIZE_MAX};
+      size_t len = Rand(2) ? tlv.value_len + Rand(3) - 1
+                           : kLengths[Rand(sizeof(kLengths) /
+                                           sizeof(kLengths[0]))];
+      length_len = WriteLength(len, 0, length);
+      break;
+    }
+    default: {
+      // Invalid lengths: the reserved 0xFF (X.690 (2015), 8.1.3.5 c), too
+      // many bytes, and a missing length.
+      static const uint8_t kInvalid[][10] = {
+          {0xFF}, {0x89, 0x01, 0, 0, 0, 0, 0, 0, 0, 0}, {0x80}};
+      static const size_t kInvalidLens[] = {1, 10, 0};
+      size_t k = Rand(3);
+      length_len = kInvalidLens[k];
+      memcpy(length, kInvalid[k], length_len);
+      break;
+    }
+  }
+  Splice(length_pos, header.length_len, length, length_len);
+  return FixLengths(Parent(i),
+                    static_cast<ptrdiff_t>(length_len + eoc_len) -
+                        static_cast<ptrdiff_t>(header.length_len));
+}
+
+bool DERMutator::MutateValue(size_t i) {
+  const TLV& tlv = index_.tlvs()[i];
+  if (tlv.identifier & kAsn1Constructed) {
+    // Constructed values change through their TLVs.
+    return false;
+  }
+  size_t value_pos = tlv.offset + tlv.header_len;
+  scratch_.assign(der_.begin() + value_pos,
+                  der_.begin() + value_pos + tlv.value_len);
+  size_t value_len = scratch_.size();
+  if (mutate_bytes_) {
+    // Leaves room for the value to grow, as libFuzzer does for inputs.
+    scratch_.resize(2 * value_len + 16);
+    value_len = mutate_bytes_(scratch_.data(), value_len, scratch_.size());
+  } else if (value_len == 0) {
+    scratch_.push_back(Rand(256));
+    value_len = 1;
+  } else {
+    switch (Rand(3)) {
+      case 0:
+        scratch_[Rand(value_len)] ^= 1 << Rand(8);
+        break;
+      case 1:
+        scratch_[Rand(value_len)] = Rand(2) ? 0x00 : 0xFF;
+        break;
+      default:
+        value_len = Rand(value_len);
+        break;
+    }
+  }
+  Splice(value_pos, tlv.value_len, scratch_.data(), value_len);
+  return FixLengths(i, static_cast<ptrdiff_t>(value_len) -
+                           static_cast<ptrdiff_t>(tlv.value_len));
+}
+
+void DERMutator::Splice(size_t pos,
+                        size_t old_size,
+                        const uint8_t* bytes,
+                        size_t new_size) {
+  if (new_size > old_size) {
+    der_.insert(der_.begin() + pos + old_size, new_size - old_size, 0);
+  } else if (new_size < old_size) {
+    der_.erase(der_.begin() + pos + new_size, der_.begin() + pos + old_size);
+  }
+  if (new_size != 0) {
+    memcpy(der_.data() + pos, bytes, new_size);
+  }
+}
+
+bool DERMutator::FixLengths(size_t i, ptrdiff_t size_change) {
+  // Changing a length only moves the bytes after it, so the TLVs that contain
+  // this one, whose lengths come before it, are still where |index_| has them.
+  for (; i != kNoTLV && size_change != 0; i = Parent(i)) {
+    const TLV& tlv = index_.tlvs()[i];
+    TLVHeader header;
+    if (!ParseHeader(i, header)) {
+      return false;
+    }
+    if (header.indefinite) {
+      continue;
+    }
+    uint8_t length[1 + 2 * sizeof(uint64_t)];
+    size_t length_len =
+        WriteLength(header.value_len + size_change, header.length_len, length);
+    Splice(tlv.offset + header.identifier_len, header.length_len, length,
+           length_len);
+    size_change += static_cast<ptrdiff_t>(length_len) -
+                   static_cast<ptrdiff_t>(header.length_len);
+  }
+  return true;
+}
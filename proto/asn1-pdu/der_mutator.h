@@ -0,0 +1,154 @@
+// Copyright 2020 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef PROTO_ASN1_PDU_DER_MUTATOR_H_
+#define PROTO_ASN1_PDU_DER_MUTATOR_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <random>
+#include <vector>
+
+#include "common.h"
+
+// Mutates DER, or BER, as bytes, but a whole TLV at a time: TLVs are deleted,
+// duplicated, inserted, swapped with a sibling, given another tag, or given a
+// value mutated as bytes, and the lengths of the TLVs around them are fixed
+// up in place, so the result still parses the same way around the change.
+// It also breaks lengths in the ways |Length| can, with indefinite lengths,
+// lengths that aren't minimally encoded, and invalid lengths.
+// This skips the parsing and serializing of a protobuf for every mutation
+// that libprotobuf-mutator does, which costs more than running many parsers.
+// The TLVs are found with |TLVIndex::Parse|, so they are the same as those
+// the encoders write.
+// A |DERMutator| must not be used by more than one thread at a time.
+class DERMutator {
+ public:
+  // Mutates the |size| bytes at |data| in place, in a buffer of |max_size|
+  // bytes, and returns the new size, like |LLVMFuzzerMutate|.
+  using MutateBytesFn = size_t (*)(uint8_t* data,
+                                   size_t size,
+                                   size_t max_size);
+
+  // |mutate_bytes| mutates the values of primitive TLVs, which are flipped
+  // bits and bytes otherwise. A fuzz target passes |LLVMFuzzerMutate|.
+  explicit DERMutator(MutateBytesFn mutate_bytes = nullptr);
+
+  DERMutator(const DERMutator&) = delete;
+  DERMutator& operator=(const DERMutator&) = delete;
+
+  // The kinds of mutations of |Mutate|.
+  enum Mutation : uint32_t {
+    kDeleteTLV = 1 << 0,
+    kDuplicateTLV = 1 << 1,
+    kInsertTLV = 1 << 2,
+    kSwapTLV = 1 << 3,
+    kRetagTLV = 1 << 4,
+    kBreakLength = 1 << 5,
+    kMutateValue = 1 << 6,
+    kAllMutations = (1 << 7) - 1,
+  };
+
+  // Restricts |Mutate| to the kinds of mutations in |mutations|, a mask of
+  // |Mutation|s, e.g. to leave out |kBreakLength| for a parser that rejects
+  // invalid lengths before anything else. All are enabled by default.
+  void set_mutations(uint32_t mutations) { mutations_ = mutations; }
+
+  // Mutates the |size| bytes at |data|, in a buffer of |max_size| bytes, with
+  // randomness from |seed|, and returns the new size. Returns 0 if |data|
+  // holds no TLV, or no mutation fit in |max_size| bytes. This has the
+  // signature of |LLVMFuzzerCustomMutator|.
+  size_t Mutate(uint8_t* data, size_t size, size_t max_size, unsigned seed);
+
+  // Writes a mix of the |size1| bytes at |data1| and the |size2| bytes at
+  // |data2| to |out|, which can hold |max_out_size| bytes: a TLV of |data2|
+  // replaces one of |data1|, or is inserted into it. Returns the size of the
+  // mix, or 0 if either input holds no TLV, or no mix fit. This has the
+  // signature of |LLVMFuzzerCustomCrossOver|.
+  size_t CrossOver(const uint8_t* data1,
+                   size_t size1,
+                   const uint8_t* data2,
+                   size_t size2,
+                   uint8_t* out,
+                   size_t max_out_size,
+                   unsigned seed);
+
+ private:
+  // Marks the lack of a parent of an outermost TLV.
+  static constexpr size_t kNoTLV = SIZE_MAX;
+
+  // Returns a random number below |n|, which must not be 0.
+  size_t Rand(size_t n) { return rng_() % n; }
+
+  // Returns the index of the TLV of |index_| whose value holds the |i|th one,
+  // or |kNoTLV|.
+  size_t Parent(size_t i) const;
+
+  // Applies a random mutation to |der_|, whose TLVs are |index_|. A TLV
+  // inserted into it is copied from |donor|, whose TLVs are |donor_index|. If
+  // |cross_over|, the mutation is one that inserts such a TLV, or replaces a
+  // TLV with it. Returns false if the mutation didn't apply.
+  bool MutateOnce(const uint8_t* donor,
+                  const TLVIndex& donor_index,
+                  bool cross_over);
+
+  // Parses the header of the |i|th TLV of |index_| in |der_| into |header|.
+  // |index_| only holds TLVs whose headers parsed, and a mutation only changes
+  // the header of the TLV it mutates, after parsing it, and bytes after the
+  // headers of the TLVs around it, so this only fails if that is broken.
+  bool ParseHeader(size_t i, TLVHeader& header) const;
+
+  // Mutations of the |i|th TLV of |index_|, which return false if they don't
+  // apply to it.
+  bool DeleteTLV(size_t i);
+  bool DuplicateTLV(size_t i);
+  bool InsertTLV(size_t i, const uint8_t* tlv, size_t tlv_size);
+  bool ReplaceTLV(size_t i, const uint8_t* tlv, size_t tlv_size);
+  bool SwapTLV(size_t i);
+  bool RetagTLV(size_t i);
+  bool BreakLength(size_t i);
+  bool MutateValue(size_t i);
+
+  // Replaces the |old_size| bytes at |pos| of |der_| with the |new_size| bytes
+  // at |bytes|, which must not point into |der_|.
+  void Splice(size_t pos,
+              size_t old_size,
+              const uint8_t* bytes,
+              size_t new_size);
+
+  // Changes the definite lengths of the TLV at |i| and the TLVs that contain
+  // it by |size_change|, innermost first, after its value changed size.
+  // Lengths keep their number of bytes if the new length fits in them, so
+  // lengths that aren't minimally encoded stay that way; indefinite lengths
+  // don't change. Returns false if a header didn't parse.
+  bool FixLengths(size_t i, ptrdiff_t size_change);
+
+  const MutateBytesFn mutate_bytes_;
+  uint32_t mutations_ = kAllMutations;
+  std::minstd_rand rng_;
+
+  // The input being mutated, and its TLVs, which are not updated as it
+  // changes, so only one mutation is applied to them.
+  std::vector<uint8_t> der_;
+  TLVIndex index_;
+  TLVIndex donor_index_;
+
+  // Bytes copied out of |der_|, kept between calls.
+  std::vector<uint8_t> scratch_;
+};
+
+#endif  // PROTO_ASN1_PDU_DER_MUTATOR_H_
@@ -0,0 +1,69 @@
+// Copyright 2020 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+// Fuzz harness that passes DER inputs to |TestOneDERInput| as they are, and
+// mutates them with |DERMutator|, a TLV at a time, instead of mutating
+// protobufs that are encoded to DER. Seed it with DER files, e.g. those that
+// der_corpus_converter encodes from a corpus of protobufs.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "der_fuzzer.h"
+#include "der_mutator.h"
+
+extern "C" size_t LLVMFuzzerMutate(uint8_t* data, size_t size, size_t max_size);
+
+namespace {
+
+// Kept between inputs, so that mutating stops allocating once its buffers have
+// grown to fit them, and per thread, for engines that run inputs on many
+// threads.
+DERMutator& ThreadMutator() {
+  static thread_local DERMutator mutator(LLVMFuzzerMutate);
+  return mutator;
+}
+
+}  // namespace
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+#ifdef ASN1_PDU_FUZZER_STATS
+  der_fuzzer::RecordExecution();
+#endif
+  TestOneDERInput(data, size);
+  return 0;
+}
+
+extern "C" size_t LLVMFuzzerCustomMutator(uint8_t* data,
+                                          size_t size,
+                                          size_t max_size,
+                                          unsigned int seed) {
+  size_t new_size = ThreadMutator().Mutate(data, size, max_size, seed);
+  // Inputs without TLVs, such as the empty input that libFuzzer starts from
+  // without seeds, are mutated as bytes until they have some.
+  return new_size != 0 ? new_size : LLVMFuzzerMutate(data, size, max_size);
+}
+
+extern "C" size_t LLVMFuzzerCustomCrossOver(const uint8_t* data1,
+                                            size_t size1,
+                                            const uint8_t* data2,
+                                            size_t size2,
+                                            uint8_t* out,
+                                            size_t max_out_size,
+                                            unsigned int seed) {
+  return ThreadMutator().CrossOver(data1, size1, data2, size2, out,
+                                   max_out_size, seed);
+}
@@ -0,0 +1,201 @@
+// Copyright 2020 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+// Checks that the mutations of |DERMutator|, other than |kBreakLength|, keep
+// the definite lengths of the TLVs around the mutated one consistent: after
+// mutating an encoding whose TLVs all parse, the TLVs of every constructed
+// value, and of the whole encoding, still follow each other exactly from its
+// start to its end, as |TLVIndex::Parse| finds them. Mutations that break
+// lengths are run as well, for the sanitizers.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <random>
+#include <vector>
+
+#include "asn1_pdu.pb.h"
+#include "asn1_pdu_to_der.h"
+#include "common.h"
+#include "der_mutator.h"
+#include "random_inputs.h"
+#include "test_checker.h"
+#include "x509_certificate.pb.h"
+#include "x509_certificate_to_der.h"
+
+namespace {
+
+using asn1_pdu::PDU;
+
+constexpr size_t kNumInputs = 256;
+// Every input is mutated, and crossed over with the next one, this many
+// times.
+constexpr unsigned kNumMutations = 64;
+
+// Makes the lengths of |pdu| and the PDUs nested in it definite, and clears
+// the values of primitive PDUs if |empty_primitives| is set.
+void MakeDefinite(PDU* pdu, bool empty_primitives) {
+  pdu->mutable_len()->clear_indefinite_form();
+  bool primitive = pdu->id().encoding() == asn1_pdu::Primitive;
+  for (asn1_pdu::ValueElement& element :
+       *pdu->mutable_val()->mutable_val_array()) {
+    if (element.has_pdu()) {
+      MakeDefinite(element.mutable_pdu(), empty_primitives);
+    } else if (primitive && empty_primitives) {
+      element.clear_val_bits();
+    }
+  }
+}
+
+// Whether every TLV that |index| finds in the |size| bytes at |data| has a
+// definite length, and the TLVs of the encoding, and of every constructed
+// value, follow each other from its start to its end.
+bool IsConsistent(const uint8_t* data, size_t size, TLVIndex& index) {
+  index.Parse(data, size);
+  const std::vector<TLV>& tlvs = index.tlvs();
+  // The end of the last TLV at each depth, for the TLVs containing the
+  // current one, and the ends of their values.
+  std::vector<size_t> next = {0};
+  std::vector<size_t> ends = {size};
+  for (const TLV& tlv : tlvs) {
+    // Closes the values that end before this TLV, which must have been
+    // filled.
+    while (ends.size() > tlv.depth + 1) {
+      if (next.back() != ends.back()) {
+        return false;
+      }
+      next.pop_back();
+      ends.pop_back();
+    }
+    TLVHeader header;
+    if (tlv.offset != next.back() ||
+        !ParseTLVHeader(data + tlv.offset, size - tlv.offset, header) ||
+        header.indefinite) {
+      return false;
+    }
+    size_t end = size_t{tlv.offset} + tlv.header_len + tlv.value_len;
+    next.back() = end;
+    if (tlv.identifier & kAsn1Constructed) {
+      next.push_back(tlv.offset + tlv.header_len);
+      ends.push_back(end);
+    }
+  }
+  for (; !ends.empty(); next.pop_back(), ends.pop_back()) {
+    if (next.back() != ends.back()) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Mutates |input| with |mutator|, and crosses it over with |donor|,
+// |kNumMutations| times each. The results are checked to be consistent if
+// |check_consistency| is set, and only run otherwise.
+void CheckMutations(DERMutator& mutator,
+                    const std::vector<uint8_t>& input,
+                    const std::vector<uint8_t>& donor,
+                    bool check_consistency,
+                    test_checker::Checker& checker) {
+  static TLVIndex index;
+  std::vector<uint8_t> buffer;
+  for (unsigned seed = 0; seed < kNumMutations; ++seed) {
+    buffer = input;
+    buffer.resize(2 * input.size() + 64);
+    for (bool cross_over : {false, true}) {
+      size_t size =
+          cross_over
+              ? mutator.CrossOver(input.data(), input.size(), donor.data(),
+                                  donor.size(), buffer.data(), buffer.size(),
+                                  seed)
+              : mutator.Mutate(buffer.data(), input.size(), buffer.size(),
+                               seed);
+      if (size == 0) {
+        continue;
+      }
+      if (!check_consistency) {
+        checker.Tally("with broken lengths run");
+        continue;
+      }
+      checker.Check();
+      if (!IsConsistent(buffer.data(), size, index)) {
+        checker.Mismatch("inconsistent: %s",
+                         test_checker::Hex(buffer.data(), size).c_str());
+      }
+    }
+  }
+}
+
+}  // namespace
+
+int main() {
+  std::mt19937 rng;
+  TLVIndex index;
+  // Encodings whose TLVs all parse, and those of PDUs with empty primitive
+  // values, which stay consistent when a primitive TLV is retagged as
+  // constructed.
+  std::vector<std::vector<uint8_t>> inputs;
+  std::vector<std::vector<uint8_t>> empty_primitive_inputs;
+  PDU pdu;
+  for (size_t i = 0; i < kNumInputs; ++i) {
+    pdu.Clear();
+    random_inputs::SetRandomPDU(rng, 2 + i % 6, &pdu);
+    MakeDefinite(&pdu, i % 2 == 0);
+    std::vector<uint8_t> der = asn1_pdu::PDUToDER(pdu);
+    if (i % 2 == 0) {
+      empty_primitive_inputs.push_back(der);
+    }
+    inputs.push_back(der);
+
+    x509_certificate::X509Certificate cert =
+        random_inputs::RandomCertificate(rng);
+    // The length of an INTEGER is encoded as at most 1.
+    cert.mutable_tbs_certificate()
+        ->mutable_value()
+        ->mutable_serial_number()
+        ->mutable_value()
+        ->set_val(random_inputs::RandomBytes(rng, 1));
+    der = x509_certificate::X509CertificateToDER(cert);
+    if (IsConsistent(der.data(), der.size(), index)) {
+      inputs.push_back(der);
+    }
+  }
+
+  // Retagging can make a primitive value constructed, whose bytes then don't
+  // parse as TLVs, unless there are none.
+  DERMutator mutator;
+  mutator.set_mutations(DERMutator::kAllMutations &
+                        ~(DERMutator::kBreakLength | DERMutator::kRetagTLV));
+  DERMutator retag_mutator;
+  retag_mutator.set_mutations(DERMutator::kRetagTLV);
+  DERMutator all_mutator;
+  all_mutator.set_mutations(DERMutator::kAllMutations);
+  test_checker::Checker checker("mutations and inputs");
+  for (size_t i = 0; i < inputs.size(); ++i) {
+    checker.Expect(IsConsistent(inputs[i].data(), inputs[i].size(), index),
+                   "input %zu inconsistent", i);
+    const std::vector<uint8_t>& donor = inputs[(i + 1) % inputs.size()];
+    CheckMutations(mutator, inputs[i], donor, true, checker);
+    CheckMutations(all_mutator, inputs[i], donor, false, checker);
+  }
+  for (size_t i = 0; i < empty_primitive_inputs.size(); ++i) {
+    CheckMutations(
+        retag_mutator, empty_primitive_inputs[i],
+        empty_primitive_inputs[(i + 1) % empty_primitive_inputs.size()], true,
+        checker);
+  }
+
+  return checker.Finish();
+}
@@ -0,0 +1,213 @@
+// Copyright 2020 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include "der_to_asn1_pdu.h"
+
+#include <algorithm>
+#include <string>
+
+#include "asn1_pdu_to_der.h"
+
+namespace asn1_pdu {
+
+bool DERToASN1PDU::DecodeIdentifier(size_t end, Header* header) {
+  uint8_t id = data_[pos_];
+  // The class comprises the 7th and 8th bit of the identifier, and the
+  // encoding the 6th bit (X.690 (2015), 8.1.2).
+  header->id_class = static_cast<Class>(id >> 6);
+  header->encoding = static_cast<Encoding>((id >> 5) & 0x01);
+  header->tag_num = id & 0x1F;
+  if (header->tag_num != 0x1F) {
+    ++pos_;
+    return true;
+  }
+
+  // The high-tag-number form base 128 encodes the tag number in the
+  // subsequent octets (X.690 (2015), 8.1.2.4.2). |ASN1PDUToDER| only encodes
+  // tag numbers from 31 to 2^32 - 1 this way, without leading zeros.
+  size_t pos = pos_ + 1;
+  if (pos == end || data_[pos] == 0x80) {
+    return false;
+  }
+  uint64_t tag_num = 0;
+  for (; pos != end && tag_num <= UINT32_MAX; ++pos) {
+    tag_num = (tag_num << 7) | (data_[pos] & 0x7F);
+    if (!(data_[pos] & 0x80)) {
+      if (tag_num < 31 || tag_num > UINT32_MAX) {
+        return false;
+      }
+      header->tag_num = tag_num;
+      pos_ = pos + 1;
+      return true;
+    }
+  }
+  return false;
+}
+
+void DERToASN1PDU::DecodeValue(size_t end, bool constructed, PDU* pdu) {
+  // The elements of |pdu| are nested one deeper than the PDUs on |stack_|.
+  // Those nested deeper than |ASN1PDUToDER| encodes are kept as bytes.
+  if (constructed && stack_.size() + 1 < ASN1PDUToDER::kDefaultDepthLimit) {
+    stack_.push_back({pdu, end, false});
+    return;
+  }
+  if (pos_ != end) {
+    pdu->mutable_val()->add_val_array()->set_val_bits(data_ + pos_,
+                                                      end - pos_);
+  }
+  pos_ = end;
+}
+
+bool DERToASN1PDU::DecodePDU(size_t end, PDU* pdu) {
+  Header header;
+  if (!DecodeIdentifier(end, &header)) {
+    return false;
+  }
+  Identifier* id = pdu->mutable_id();
+  id->set_id_class(header.id_class);
+  id->set_encoding(header.encoding);
+  if (header.tag_num < 31) {
+    id->mutable_tag_num()->set_low_tag_num(
+        static_cast<LowTagNumber>(header.tag_num));
+  } else {
+    id->mutable_tag_num()->set_low_tag_num(VAL0);
+    id->mutable_tag_num()->set_high_tag_num(header.tag_num);
+  }
+  bool constructed = header.encoding == Constructed;
+
+  Length* len = pdu->mutable_len();
+  pdu->mutable_val();
+  len_start_ = pos_;
+  if (pos_ == end) {
+    // There is no length, and hence no value.
+    len->set_length_override(std::string());
+    len_end_ = pos_;
+    return true;
+  }
+
+  uint8_t first = data_[pos_++];
+  if (first == 0x80) {
+    len_end_ = pos_;
+    if (stack_.size() + 1 >= ASN1PDUToDER::kDefaultDepthLimit) {
+      len->set_length_override("\x80", 1);
+      DecodeValue(end, false, pdu);
+      return true;
+    }
+    // The indefinite form (X.690 (2015), 8.1.3.6). The value is decoded up to
+    // the EOC marker.
+    len->set_indefinite_form(true);
+    stack_.push_back({pdu, end, true});
+    return true;
+  }
+
+  // The definite form (X.690 (2015), 8.1.3.3-8.1.3.5). If it's not the
+  // minimal encoding of the length (X.690 (2015), 10.1), or is invalid, its
+  // raw bytes are kept to encode it.
+  bool valid = true;
+  bool minimal = true;
+  size_t value_len = first;
+  if (first & 0x80) {
+    size_t num_bytes = first & 0x7F;
+    // 0xFF is reserved (X.690 (2015), 8.1.3.5 c).
+    if (first == 0xFF) {
+      valid = false;
+    } else if (num_bytes > end - pos_ || num_bytes > sizeof(value_len)) {
+      valid = false;
+      pos_ += std::min(num_bytes, end - pos_);
+    } else {
+      minimal = data_[pos_] != 0;
+      value_len = 0;
+      for (size_t i = 0; i < num_bytes; ++i) {
+        value_len = (value_len << 8) | data_[pos_++];
+      }
+      minimal = minimal && value_len > 127;
+    }
+  }
+  len_end_ = pos_;
+  if (!valid || value_len > end - pos_) {
+    // The value runs to |end|, regardless of the length.
+    len->set_length_override(data_ + len_start_, len_end_ - len_start_);
+    DecodeValue(end, constructed, pdu);
+    return true;
+  }
+  if (!minimal) {
+    len->set_length_override(data_ + len_start_, len_end_ - len_start_);
+  }
+  DecodeValue(pos_ + value_len, constructed, pdu);
+  return true;
+}
+
+bool DERToASN1PDU::Decode(const uint8_t* data, size_t size, PDU* pdu) {
+  pdu->Clear();
+  data_ = data;
+  pos_ = 0;
+  stack_.clear();
+  if (size == 0 || !DecodePDU(size, pdu)) {
+    return false;
+  }
+  size_t root_len_start = len_start_;
+  size_t root_len_end = len_end_;
+
+  while (!stack_.empty()) {
+    Frame& frame = stack_.back();
+    if (frame.indefinite && frame.end - pos_ >= 2 && data_[pos_] == 0x00 &&
+        data_[pos_ + 1] == 0x00) {
+      // The EOC marker ends the value (X.690 (2015), 8.1.5).
+      pos_ += 2;
+      stack_.pop_back();
+      continue;
+    }
+    if (pos_ == frame.end) {
+      if (frame.indefinite) {
+        // Without an EOC marker, the value runs to |frame.end|.
+        frame.pdu->mutable_len()->set_length_override("\x80", 1);
+      }
+      stack_.pop_back();
+      continue;
+    }
+
+    Value* val = frame.pdu->mutable_val();
+    size_t end = frame.end;
+    // |frame| is invalidated if a frame is pushed for the element.
+    ValueElement* element = val->add_val_array();
+    if (!DecodePDU(end, element->mutable_pdu())) {
+      // The rest of the value isn't a PDU, so keep it as bytes.
+      element->clear_pdu();
+      element->set_val_bits(data_ + pos_, end - pos_);
+      pos_ = end;
+    }
+  }
+
+  if (pos_ != size) {
+    // Anything following the PDU is appended to its value, and the raw length
+    // is kept, so that it still encodes the length of the PDU alone.
+    Length* len = pdu->mutable_len();
+    std::string trailing;
+    if (len->indefinite_form()) {
+      // The EOC marker, which is encoded as part of the indefinite form.
+      trailing.append(2, '\0');
+    }
+    trailing.append(reinterpret_cast<const char*>(data_ + pos_), size - pos_);
+    if (!len->has_length_override()) {
+      len->set_length_override(data_ + root_len_start,
+                               root_len_end - root_len_start);
+    }
+    pdu->mutable_val()->add_val_array()->set_val_bits(trailing);
+  }
+  return true;
+}
+
+}  // namespace asn1_pdu
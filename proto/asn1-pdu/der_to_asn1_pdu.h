@@ -0,0 +1,91 @@
+// Copyright 2020 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef PROTO_ASN1_PDU_DER_TO_ASN1_PDU_H_
+#define PROTO_ASN1_PDU_DER_TO_ASN1_PDU_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include "asn1_pdu.pb.h"
+
+namespace asn1_pdu {
+
+// Decodes DER, or BER, into PDUs that |ASN1PDUToDER| encodes back to exactly
+// the same bytes, e.g. to seed a corpus with real-world inputs.
+// Decoding is structural: a constructed value is decoded into the PDUs it
+// contains, and a primitive value is kept as bytes. Bytes that aren't valid
+// DER are represented with the |Length| and |ValueElement| fields meant for
+// them, so that they still round-trip.
+// A |DERToASN1PDU| must not be used by more than one thread at a time.
+class DERToASN1PDU {
+ public:
+  // Decodes the |size| bytes at |data| into |pdu|, replacing its contents.
+  // If |pdu| is allocated on a |google::protobuf::Arena|, so are all of the
+  // PDUs it is decoded into.
+  // Returns false if the bytes can't be represented by a PDU, which is the
+  // case if they are empty, or start with a high tag number that doesn't fit
+  // 32 bits or isn't minimally encoded. |pdu| is unspecified then.
+  bool Decode(const uint8_t* data, size_t size, PDU* pdu);
+
+ private:
+  // The identifier of a PDU, as read by |DecodeIdentifier|.
+  struct Header {
+    Class id_class;
+    Encoding encoding;
+    uint32_t tag_num;
+  };
+
+  // A constructed PDU whose value is being decoded from
+  // |data_[pos_, end)|. If |indefinite| is set, the value ends at an
+  // End-of-Contents (EOC) marker, or at |end| if there is none.
+  struct Frame {
+    PDU* pdu;
+    size_t end;
+    bool indefinite;
+  };
+
+  // Reads the identifier at |pos_| into |header|, and advances |pos_| past it,
+  // unless it can't be represented by an |Identifier| (X.690 (2015), 8.1.2).
+  bool DecodeIdentifier(size_t end, Header* header);
+
+  // Decodes the PDU at |pos_|, which ends by |end|, into |pdu|. Its length is
+  // decoded, and so is its value, unless it's constructed, in which case a
+  // frame is pushed onto |stack_| to decode it.
+  // Returns false, without advancing |pos_|, if the PDU can't be represented.
+  bool DecodePDU(size_t end, PDU* pdu);
+
+  // Decodes the value of the PDU in |data_[pos_, end)| into |pdu|.
+  void DecodeValue(size_t end, bool constructed, PDU* pdu);
+
+  const uint8_t* data_;
+  size_t pos_;
+
+  // The raw length of the PDU decoded last by |DecodePDU|.
+  size_t len_start_;
+  size_t len_end_;
+
+  // The constructed PDUs being decoded, outermost first. It replaces
+  // recursion, so that deeply nested inputs can't overflow the stack, and
+  // keeps its memory between calls.
+  std::vector<Frame> stack_;
+};
+
+}  // namespace asn1_pdu
+
+#endif  // PROTO_ASN1_PDU_DER_TO_ASN1_PDU_H_
@@ -0,0 +1,137 @@
+// Copyright 2020 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+// Checks that |DERToASN1PDU| and |DERToX509Certificate| decode bytes into
+// protobufs that encode back to exactly the same bytes: the encodings of
+// random PDUs and certificates, with non-minimal and invalid lengths, missing
+// EOC markers and high tag numbers, and those encodings truncated and with
+// bits flipped.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <random>
+#include <vector>
+
+#include "asn1_pdu.pb.h"
+#include "asn1_pdu_to_der.h"
+#include "der_to_asn1_pdu.h"
+#include "der_to_x509_certificate.h"
+#include "random_inputs.h"
+#include "test_checker.h"
+#include "x509_certificate.pb.h"
+#include "x509_certificate_to_der.h"
+
+namespace {
+
+constexpr size_t kNumInputs = 256;
+// The number of random single bit flips of every input.
+constexpr size_t kNumBitFlips = 32;
+
+// Decodes |der| with both decoders, and compares their encodings with it.
+void CheckRoundTrip(const std::vector<uint8_t>& der,
+                    test_checker::Checker& checker) {
+  static asn1_pdu::DERToASN1PDU decoder;
+  static asn1_pdu::ASN1PDUToDER encoder;
+  static asn1_pdu::PDU pdu;
+  static x509_certificate::X509Certificate certificate;
+  checker.Check();
+  if (!decoder.Decode(der.data(), der.size(), &pdu)) {
+    // Only empty inputs, and those that start with a high tag number that
+    // can't be represented, aren't decoded.
+    if (!der.empty() && (der[0] & 0x1F) != 0x1F) {
+      checker.Mismatch("not decoded: %s", test_checker::Hex(der).c_str());
+    }
+    checker.Tally("not decoded");
+  } else if (encoder.PDUToDER(pdu) != der) {
+    checker.Mismatch("PDU mismatch: %s", test_checker::Hex(der).c_str());
+  }
+
+  if (x509_certificate::DERToX509Certificate(der.data(), der.size(),
+                                             &certificate)) {
+    checker.Tally("decoded as certificates");
+    if (x509_certificate::X509CertificateToDER(certificate) != der) {
+      checker.Mismatch("certificate mismatch: %s",
+                       test_checker::Hex(der).c_str());
+    }
+  }
+}
+
+// Checks |der|, every prefix of it, and |kNumBitFlips| copies of it with a
+// random bit flipped.
+void CheckMutations(std::mt19937& rng,
+                    const std::vector<uint8_t>& der,
+                    test_checker::Checker& checker) {
+  CheckRoundTrip(der, checker);
+  // Every prefix of the headers and short values, and then a few of the rest.
+  size_t step = der.size() <= 256 ? 1 : der.size() / 64;
+  for (size_t len = 0; len < der.size(); len += step) {
+    CheckRoundTrip(std::vector<uint8_t>(der.begin(), der.begin() + len),
+                   checker);
+  }
+  if (der.empty()) {
+    return;
+  }
+  for (size_t i = 0; i < kNumBitFlips; ++i) {
+    std::vector<uint8_t> flipped = der;
+    flipped[rng() % flipped.size()] ^= 1 << (rng() % 8);
+    CheckRoundTrip(flipped, checker);
+  }
+}
+
+}  // namespace
+
+int main() {
+  test_checker::Checker checker("encodings");
+  // Lengths that aren't minimal, the reserved length, indefinite lengths
+  // without an EOC marker, trailing bytes, and high tag numbers that are and
+  // aren't minimally encoded.
+  const std::vector<std::vector<uint8_t>> kEdgeCases = {
+      {0x30, 0x81, 0x03, 0x02, 0x01, 0x00},
+      {0x30, 0x82, 0x00, 0x03, 0x02, 0x01, 0x00},
+      {0x04, 0x81, 0x7F},
+      {0x30, 0xFF, 0x02, 0x01, 0x00},
+      {0x30, 0x80, 0x02, 0x01, 0x00},
+      {0x30, 0x80, 0x30, 0x80, 0x00, 0x00},
+      {0x30, 0x80, 0x02, 0x01, 0x00, 0x00, 0x00, 0x01, 0x02},
+      {0x02, 0x01, 0x00, 0x02, 0x01, 0x00},
+      {0x30},
+      {0x1F, 0x1F, 0x00},
+      {0x1F, 0x80, 0x1F, 0x00},
+      {0x3F, 0x8F, 0xFF, 0xFF, 0xFF, 0x7F, 0x00},
+      {0x3F, 0x90, 0x80, 0x80, 0x80, 0x00, 0x00},
+      {0x00, 0x00},
+  };
+  std::mt19937 rng;
+  for (const std::vector<uint8_t>& der : kEdgeCases) {
+    CheckMutations(rng, der, checker);
+  }
+
+  asn1_pdu::ASN1PDUToDER encoder;
+  asn1_pdu::PDU pdu;
+  for (size_t i = 0; i < kNumInputs; ++i) {
+    pdu.Clear();
+    random_inputs::SetRandomPDU(rng, 1 + i % 8, &pdu,
+                                /*length_overrides=*/i % 2 == 0);
+    CheckMutations(rng, encoder.PDUToDER(pdu), checker);
+    CheckMutations(rng,
+                   x509_certificate::X509CertificateToDER(
+                       random_inputs::RandomCertificate(rng)),
+                   checker);
+  }
+
+  return checker.Finish();
+}
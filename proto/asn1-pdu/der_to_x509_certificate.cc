@@ -0,0 +1,498 @@
+// Copyright 2020 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include "der_to_x509_certificate.h"
+
+#include <string.h>
+
+#include "common.h"
+#include "der_to_asn1_pdu.h"
+#include "x509_certificate_to_der.h"
+
+namespace x509_certificate {
+
+namespace {
+
+using asn1_universal_types::BitString;
+using asn1_universal_types::Boolean;
+using asn1_universal_types::Integer;
+using asn1_universal_types::ObjectIdentifier;
+using asn1_universal_types::OctetString;
+
+// A TLV in the input, i.e. the |size| bytes at |data|, whose value is the
+// |value_len| bytes at |value|.
+// Parts of the input that aren't a single TLV have a |tag| of zero, which none
+// of the decoders below accept, and an empty value.
+struct TLV {
+  uint8_t tag;
+  const uint8_t* value;
+  size_t value_len;
+  const uint8_t* data;
+  size_t size;
+};
+
+// Reads the TLV at the start of the |size| bytes at |data|, and advances
+// |data| and |size| past it. Only TLVs as |X509CertificateToDER| encodes the
+// structures of certificates are read, i.e. with a single byte tag and a
+// minimal definite-form length (X.690 (2015), 10.1).
+bool ReadTLV(const uint8_t*& data, size_t& size, TLV* tlv) {
+  if (size < 2) {
+    return false;
+  }
+  tlv->tag = data[0];
+  if ((tlv->tag & 0x1F) == 0x1F) {
+    return false;
+  }
+  size_t header_len = 2;
+  size_t value_len = data[1];
+  if (value_len & 0x80) {
+    size_t num_bytes = value_len & 0x7F;
+    if (num_bytes == 0 || num_bytes > sizeof(value_len) ||
+        num_bytes > size - 2 || data[2] == 0) {
+      return false;
+    }
+    value_len = 0;
+    for (size_t i = 0; i < num_bytes; ++i) {
+      value_len = (value_len << 8) | data[2 + i];
+    }
+    if (value_len <= 127) {
+      return false;
+    }
+    header_len += num_bytes;
+  }
+  if (value_len > size - header_len) {
+    return false;
+  }
+  tlv->value = data + header_len;
+  tlv->value_len = value_len;
+  tlv->data = data;
+  tlv->size = header_len + value_len;
+  data += tlv->size;
+  size -= tlv->size;
+  return true;
+}
+
+// Returns the |size| bytes at |data| as a TLV, which has a |tag| of zero
+// unless they are exactly one TLV.
+TLV ToTLV(const uint8_t* data, size_t size) {
+  TLV tlv;
+  const uint8_t* rest = data;
+  size_t rest_size = size;
+  if (!ReadTLV(rest, rest_size, &tlv) || rest_size != 0) {
+    tlv = {0, data, 0, data, size};
+  }
+  return tlv;
+}
+
+// Whether |Encode| encodes |t| to exactly the bytes of |tlv|, after its tag
+// is replaced with |replaced_tag|, unless that is zero.
+template <typename T>
+bool EncodesTo(const T& t, const TLV& tlv, uint8_t replaced_tag) {
+  static thread_local DERWriter der;
+  der.Clear();
+  Encode(t, der);
+  if (replaced_tag != 0) {
+    der.ReplaceTag(replaced_tag, 0);
+  }
+  return der.size() == tlv.size &&
+         (tlv.size == 0 || memcmp(der.data(), tlv.data, tlv.size) == 0);
+}
+
+bool DecodePDU(const TLV& tlv, asn1_pdu::PDU* pdu) {
+  static thread_local asn1_pdu::DERToASN1PDU pdu_decoder;
+  return pdu_decoder.Decode(tlv.data, tlv.size, pdu);
+}
+
+// Decodes |tlv| into |field|, whose |value| is decoded by |decode_value|, if
+// that encodes |tlv| exactly, or whose |pdu| is decoded otherwise.
+// |replaced_tag| is the tag that the encoder of the structure containing
+// |field| replaces its tag with, or zero. Then, |decode_value| is passed |tlv|
+// with the tag |field| is encoded with, |value_tag|.
+template <typename T, typename DecodeValueFn>
+bool DecodeField(const TLV& tlv,
+                 DecodeValueFn decode_value,
+                 T* field,
+                 uint8_t replaced_tag = 0,
+                 uint8_t value_tag = 0) {
+  TLV value_tlv = tlv;
+  if (replaced_tag != 0) {
+    value_tlv.tag = value_tag;
+  }
+  if (decode_value(value_tlv, field->mutable_value()) &&
+      EncodesTo(*field, tlv, replaced_tag)) {
+    return true;
+  }
+  field->Clear();
+  return DecodePDU(tlv, field->mutable_pdu());
+}
+
+bool DecodeBoolean(const TLV& tlv, Boolean* boolean) {
+  if (tlv.tag != kAsn1Boolean || tlv.value_len != 1) {
+    return false;
+  }
+  boolean->set_val(tlv.value[0] != 0x00);
+  return true;
+}
+
+bool DecodeInteger(const TLV& tlv, Integer* integer) {
+  if (tlv.tag != kAsn1Integer) {
+    return false;
+  }
+  integer->set_val(tlv.value, tlv.value_len);
+  return true;
+}
+
+bool DecodeBitString(const TLV& tlv, BitString* bit_string) {
+  // The initial octet holds the number of unused bits in the final octet
+  // (X.690 (2015), 8.6.2.2).
+  if (tlv.tag != kAsn1BitString || tlv.value_len == 0 || tlv.value[0] > 7) {
+    return false;
+  }
+  bit_string->set_unused_bits(
+      static_cast<asn1_universal_types::UnusedBits>(tlv.value[0]));
+  bit_string->set_val(tlv.value + 1, tlv.value_len - 1);
+  return true;
+}
+
+bool DecodeOctetString(const TLV& tlv, OctetString* octet_string) {
+  if (tlv.tag != kAsn1OctetString) {
+    return false;
+  }
+  octet_string->set_val(tlv.value, tlv.value_len);
+  return true;
+}
+
+bool DecodeObjectIdentifier(const TLV& tlv, ObjectIdentifier* oid) {
+  if (tlv.tag != kAsn1ObjectIdentifier || tlv.value_len == 0) {
+    return false;
+  }
+  // Each subidentifier is base 128 encoded (X.690 (2015), 8.19.2), and the
+  // first one combines the first two arcs (X.690 (2015), 8.19.4).
+  uint64_t first_subidentifier = 0;
+  uint64_t subidentifier = 0;
+  bool first = true;
+  for (size_t i = 0; i < tlv.value_len; ++i) {
+    subidentifier = (subidentifier << 7) | (tlv.value[i] & 0x7F);
+    if (subidentifier > UINT32_MAX + uint64_t{80}) {
+      return false;
+    }
+    if (tlv.value[i] & 0x80) {
+      continue;
+    }
+    if (first) {
+      first_subidentifier = subidentifier;
+      first = false;
+    } else if (subidentifier > UINT32_MAX) {
+      return false;
+    } else {
+      oid->add_subidentifier(subidentifier);
+    }
+    subidentifier = 0;
+  }
+  if (tlv.value[tlv.value_len - 1] & 0x80) {
+    return false;
+  }
+
+  // |Encode| combines |root| and |small_identifier| into the first
+  // subidentifier, adding the last subidentifier for |RN_VAL_1|. The first
+  // subidentifier is at least 40 then, so arcs under {0} can't be represented.
+  if (first_subidentifier < 40) {
+    return false;
+  }
+  if (first_subidentifier < 80) {
+    oid->set_root(asn1_universal_types::RN_VAL_0);
+    oid->set_small_identifier(
+        static_cast<asn1_universal_types::SmallIdentifier>(
+            first_subidentifier - 40));
+  } else {
+    oid->set_root(asn1_universal_types::RN_VAL_1);
+    oid->set_small_identifier(asn1_universal_types::SI_VAL_0);
+    oid->add_subidentifier(first_subidentifier - 80);
+  }
+  return true;
+}
+
+// Returns the value of the |num_digits| decimal digits at |digits|, or -1 if
+// they aren't all digits.
+int DecodeDigits(const uint8_t* digits, size_t num_digits) {
+  int value = 0;
+  for (size_t i = 0; i < num_digits; ++i) {
+    if (digits[i] < '0' || digits[i] > '9') {
+      return -1;
+    }
+    value = value * 10 + (digits[i] - '0');
+  }
+  return value;
+}
+
+// Decodes the time in |time|, which starts with a year of |year_len| digits,
+// as encoded by |asn1_universal_types::EncodeTimestamp|.
+bool DecodeTimestamp(const TLV& tlv,
+                     size_t year_len,
+                     google::protobuf::Timestamp* timestamp) {
+  if (tlv.value_len != year_len + 11 || tlv.value[year_len + 10] != 'Z') {
+    return false;
+  }
+  int64_t year = DecodeDigits(tlv.value, year_len);
+  const uint8_t* time = tlv.value + year_len;
+  int64_t month = DecodeDigits(time, 2);
+  int64_t day = DecodeDigits(time + 2, 2);
+  int64_t hour = DecodeDigits(time + 4, 2);
+  int64_t minute = DecodeDigits(time + 6, 2);
+  int64_t second = DecodeDigits(time + 8, 2);
+  if (year < 0 || month < 1 || month > 12 || day < 1 || day > 31 ||
+      hour < 0 || hour > 23 || minute < 0 || minute > 59 || second < 0 ||
+      second > 59) {
+    return false;
+  }
+  if (year_len == 2) {
+    // Only the last two digits of the year are encoded, so use those of RFC
+    // 5280, 4.1.2.5.1.
+    year += year < 50 ? 2000 : 1900;
+  }
+
+  // Converts the date in the proleptic Gregorian calendar to days since
+  // 1970-01-01, counting 400 year eras from 0000-03-01. Invalid days of the
+  // month are caught by re-encoding.
+  if (month <= 2) {
+    --year;
+  }
+  int64_t era = (year >= 0 ? year : year - 399) / 400;
+  int64_t year_of_era = year - era * 400;
+  int64_t day_of_year =
+      (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+  int64_t day_of_era =
+      year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+  int64_t days = era * 146097 + day_of_era - 719468;
+  timestamp->set_seconds(days * 86400 + hour * 3600 + minute * 60 + second);
+  // Only timestamps with a fraction that isn't a whole number of milliseconds
+  // are encoded, but the fraction itself is not.
+  timestamp->set_nanos(1);
+  return true;
+}
+
+bool DecodeTime(const TLV& tlv, TimeChoice* time) {
+  if (tlv.tag == kAsn1UTCTime) {
+    return DecodeTimestamp(tlv, 2,
+                           time->mutable_utc_time()->mutable_time_stamp());
+  }
+  if (tlv.tag == kAsn1Generalizedtime) {
+    return DecodeTimestamp(
+        tlv, 4, time->mutable_generalized_time()->mutable_time_stamp());
+  }
+  return false;
+}
+
+bool DecodeAlgorithmIdentifier(const TLV& tlv,
+                               AlgorithmIdentifierSequence* algorithm) {
+  const uint8_t* data = tlv.value;
+  size_t size = tlv.value_len;
+  TLV object_identifier;
+  if (tlv.tag != kAsn1Sequence || !ReadTLV(data, size, &object_identifier) ||
+      size == 0) {
+    return false;
+  }
+  return DecodePDU(object_identifier, algorithm->mutable_object_identifier()) &&
+         DecodePDU(ToTLV(data, size), algorithm->mutable_parameters());
+}
+
+bool DecodeValidity(const TLV& tlv, ValiditySequence* validity) {
+  const uint8_t* data = tlv.value;
+  size_t size = tlv.value_len;
+  TLV not_before;
+  TLV not_after;
+  return tlv.tag == kAsn1Sequence && ReadTLV(data, size, &not_before) &&
+         ReadTLV(data, size, &not_after) && size == 0 &&
+         DecodeTime(not_before,
+                    validity->mutable_not_before()->mutable_value()) &&
+         DecodeTime(not_after, validity->mutable_not_after()->mutable_value());
+}
+
+bool DecodeSubjectPublicKeyInfo(const TLV& tlv,
+                                SubjectPublicKeyInfoSequence* info) {
+  const uint8_t* data = tlv.value;
+  size_t size = tlv.value_len;
+  TLV algorithm;
+  TLV subject_public_key;
+  return tlv.tag == kAsn1Sequence && ReadTLV(data, size, &algorithm) &&
+         ReadTLV(data, size, &subject_public_key) && size == 0 &&
+         DecodeAlgorithmIdentifier(algorithm,
+                                   info->mutable_algorithm_identifier()) &&
+         DecodeField(subject_public_key, DecodeBitString,
+                     info->mutable_subject_public_key());
+}
+
+bool DecodeExtension(const TLV& tlv, Extension* extension) {
+  const uint8_t* data = tlv.value;
+  size_t size = tlv.value_len;
+  TLV extn_id;
+  TLV element;
+  if (tlv.tag != kAsn1Sequence || !ReadTLV(data, size, &extn_id) ||
+      !DecodeObjectIdentifier(extn_id, extension->mutable_extn_id()) ||
+      !ReadTLV(data, size, &element)) {
+    return false;
+  }
+  // RFC 5280, 4.1: |critical| is DEFAULT false, so it's only encoded if true.
+  if (element.tag == kAsn1Boolean) {
+    if (!DecodeBoolean(element, extension->mutable_critical()) ||
+        !ReadTLV(data, size, &element)) {
+      return false;
+    }
+  }
+  return size == 0 &&
+         DecodeOctetString(element, extension->mutable_raw_extension()
+                                        ->mutable_extn_value());
+}
+
+bool DecodeExtensions(const TLV& tlv, ExtensionSequence* extensions) {
+  const uint8_t* data = tlv.value;
+  size_t size = tlv.value_len;
+  TLV extension;
+  if (tlv.tag != kAsn1Sequence || !ReadTLV(data, size, &extension) ||
+      !DecodeExtension(extension, extensions->mutable_extension())) {
+    return false;
+  }
+  while (size != 0) {
+    if (!ReadTLV(data, size, &extension) ||
+        !DecodeExtension(extension, extensions->add_extensions())) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool DecodeVersion(const TLV& tlv, Version* version) {
+  // RFC 5280, 4.1 & 4.1.2.1: version [0] EXPLICIT INTEGER, which is only
+  // encoded if it isn't v1.
+  const uint8_t der_version[] = {
+      kAsn1ContextSpecific | kAsn1Constructed | 0x00, 0x03, kAsn1Integer, 0x01};
+  if (tlv.size == sizeof(der_version) + 1 &&
+      memcmp(tlv.data, der_version, sizeof(der_version)) == 0 &&
+      (tlv.data[4] == v2 || tlv.data[4] == v3)) {
+    version->set_value(static_cast<VersionNumber>(tlv.data[4]));
+    return true;
+  }
+  return DecodePDU(tlv, version->mutable_pdu());
+}
+
+// Decodes the optional field of |tbs| returned by |mutable_field|, whose tag
+// is |context_tag|, if |tlv| is it, and then advances |tlv| to the following
+// element, if any. The field is left unset otherwise.
+// Returns false if decoding the field fails.
+template <typename T, typename DecodeValueFn>
+bool DecodeOptionalField(const uint8_t*& data,
+                         size_t& size,
+                         TLV& tlv,
+                         bool& has_tlv,
+                         uint8_t context_tag,
+                         uint8_t value_tag,
+                         DecodeValueFn decode_value,
+                         T* (TBSCertificateSequence::*mutable_field)(),
+                         TBSCertificateSequence* tbs) {
+  if (!has_tlv || tlv.tag != context_tag) {
+    return true;
+  }
+  if (!DecodeField(tlv, decode_value, (tbs->*mutable_field)(), context_tag,
+                   value_tag)) {
+    return false;
+  }
+  has_tlv = size != 0;
+  return !has_tlv || ReadTLV(data, size, &tlv);
+}
+
+bool DecodeTBSCertificate(const TLV& tlv, TBSCertificateSequence* tbs) {
+  const uint8_t* data = tlv.value;
+  size_t size = tlv.value_len;
+  TLV element;
+  if (tlv.tag != kAsn1Sequence || !ReadTLV(data, size, &element)) {
+    return false;
+  }
+  if (element.tag == (kAsn1ContextSpecific | kAsn1Constructed | 0x00)) {
+    if (!DecodeVersion(element, tbs->mutable_version()) ||
+        !ReadTLV(data, size, &element)) {
+      return false;
+    }
+  } else {
+    tbs->mutable_version()->set_value(v1);
+  }
+  if (!DecodeField(element, DecodeInteger, tbs->mutable_serial_number()) ||
+      !ReadTLV(data, size, &element) ||
+      !DecodeField(element, DecodeAlgorithmIdentifier,
+                   tbs->mutable_signature_algorithm()) ||
+      !ReadTLV(data, size, &element) ||
+      !DecodeField(element, DecodePDU, tbs->mutable_issuer()) ||
+      !ReadTLV(data, size, &element) ||
+      !DecodeField(element, DecodeValidity, tbs->mutable_validity()) ||
+      !ReadTLV(data, size, &element) ||
+      !DecodeField(element, DecodePDU, tbs->mutable_subject()) ||
+      !ReadTLV(data, size, &element) ||
+      !DecodeField(element, DecodeSubjectPublicKeyInfo,
+                   tbs->mutable_subject_public_key_info())) {
+    return false;
+  }
+
+  // |TBSCertificateSequence| replaces the tags of the optional fields with
+  // their context-specific tags.
+  bool has_element = size != 0 && ReadTLV(data, size, &element);
+  if (size != 0 && !has_element) {
+    return false;
+  }
+  return DecodeOptionalField(data, size, element, has_element,
+                             kAsn1ContextSpecific | 0x01, kAsn1BitString,
+                             DecodeBitString,
+                             &TBSCertificateSequence::mutable_issuer_unique_id,
+                             tbs) &&
+         DecodeOptionalField(data, size, element, has_element,
+                             kAsn1ContextSpecific | 0x02, kAsn1BitString,
+                             DecodeBitString,
+                             &TBSCertificateSequence::mutable_subject_unique_id,
+                             tbs) &&
+         DecodeOptionalField(data, size, element, has_element,
+                             kAsn1ContextSpecific | 0x03, kAsn1Sequence,
+                             DecodeExtensions,
+                             &TBSCertificateSequence::mutable_extensions,
+                             tbs) &&
+         !has_element;
+}
+
+}  // namespace
+
+bool DERToX509Certificate(const uint8_t* data,
+                          size_t size,
+                          X509Certificate* certificate) {
+  certificate->Clear();
+  TLV sequence;
+  if (!ReadTLV(data, size, &sequence) || sequence.tag != kAsn1Sequence ||
+      size != 0) {
+    return false;
+  }
+  data = sequence.value;
+  size = sequence.value_len;
+  TLV tbs_certificate;
+  TLV signature_algorithm;
+  if (!ReadTLV(data, size, &tbs_certificate) ||
+      !ReadTLV(data, size, &signature_algorithm) || size == 0) {
+    return false;
+  }
+  return DecodeField(tbs_certificate, DecodeTBSCertificate,
+                     certificate->mutable_tbs_certificate()) &&
+         DecodeField(signature_algorithm, DecodeAlgorithmIdentifier,
+                     certificate->mutable_signature_algorithm()) &&
+         DecodeField(ToTLV(data, size), DecodeBitString,
+                     certificate->mutable_signature_value());
+}
+
+}  // namespace x509_certificate
@@ -0,0 +1,45 @@
+// Copyright 2020 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef PROTO_ASN1_PDU_DER_TO_X509_CERTIFICATE_H_
+#define PROTO_ASN1_PDU_DER_TO_X509_CERTIFICATE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "x509_certificate.pb.h"
+
+namespace x509_certificate {
+
+// Decodes the DER-encoded X.509 certificate in the |size| bytes at |data| into
+// |certificate|, replacing its contents, so that |X509CertificateToDER|
+// encodes it back to exactly the same bytes.
+// Each part of the certificate is decoded into the fields for its structure,
+// if they encode it exactly; otherwise, it is decoded into the |pdu| field of
+// the part, with |asn1_pdu::DERToASN1PDU|.
+// If |certificate| is allocated on a |google::protobuf::Arena|, so are all of
+// the messages it is decoded into.
+// This is thread-safe, since its scratch memory is kept per thread.
+// Returns false if the bytes aren't a SEQUENCE of three elements, which is
+// what |X509CertificateToDER| always encodes. |certificate| is unspecified
+// then, but |asn1_pdu::DERToASN1PDU| can still decode the bytes.
+bool DERToX509Certificate(const uint8_t* data,
+                          size_t size,
+                          X509Certificate* certificate);
+
+}  // namespace x509_certificate
+
+#endif  // PROTO_ASN1_PDU_DER_TO_X509_CERTIFICATE_H_
@@ -0,0 +1,265 @@
+// Copyright 2020 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+// Checks that a |DERWriter| that references values writes the same bytes as
+// one that copies them: repetitions of patterns smaller and larger than a
+// tile, with counts that aren't multiples of a tile, and at the
+// |kMaxRepeatedLen| cap of the encoders, and encodings cut back with
+// |Truncate|, or whose tags are replaced with |ReplaceTag|, around references.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/uio.h>
+
+#include <algorithm>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "asn1_pdu.pb.h"
+#include "asn1_pdu_to_der.h"
+#include "common.h"
+#include "random_inputs.h"
+#include "test_checker.h"
+
+namespace {
+
+// Returns the encoding of |der|, from the segments of |AppendSegmentsTo|, after
+// checking that |AppendTo| and |size()| agree with them.
+std::vector<uint8_t> GetEncoding(const DERWriter& der, bool* consistent) {
+  std::vector<struct iovec> segments;
+  der.AppendSegmentsTo(segments);
+  std::vector<uint8_t> bytes = random_inputs::Concatenate(segments);
+  std::vector<uint8_t> appended;
+  der.AppendTo(appended);
+  *consistent = bytes == appended && bytes.size() == der.size();
+  return bytes;
+}
+
+// Returns |count| repetitions of |pattern|, copied in doubling runs.
+std::vector<uint8_t> Expand(const std::string& pattern, size_t count) {
+  std::vector<uint8_t> bytes(pattern.size() * count);
+  if (bytes.empty()) {
+    return bytes;
+  }
+  memcpy(bytes.data(), pattern.data(), pattern.size());
+  for (size_t done = pattern.size(); done < bytes.size(); done *= 2) {
+    memcpy(bytes.data() + done, bytes.data(),
+           std::min(done, bytes.size() - done));
+  }
+  return bytes;
+}
+
+// Prepends |bytes| to |model|, the expected encoding.
+void PrependToModel(const std::string& bytes, std::vector<uint8_t>& model) {
+  model.insert(model.begin(), bytes.begin(), bytes.end());
+}
+
+// Checks that the encoding of |der| is |expected|.
+void CheckEncoding(const DERWriter& der,
+                   const std::vector<uint8_t>& expected,
+                   const char* what,
+                   test_checker::Checker& checker) {
+  bool consistent;
+  std::vector<uint8_t> actual = GetEncoding(der, &consistent);
+  checker.Check();
+  if (!consistent) {
+    checker.Mismatch("%s: segments don't match AppendTo or size()", what);
+  } else if (actual != expected) {
+    checker.Mismatch("%s: wrong encoding", what);
+  }
+}
+
+// Writes |count| repetitions of |pattern|, between a few copied bytes, to a
+// writer that references values and to one that doesn't, and compares both
+// with the repetitions written out one by one.
+void CheckRepeated(const std::string& pattern,
+                   size_t count,
+                   test_checker::Checker& checker) {
+  std::vector<uint8_t> expected = Expand(pattern, count);
+  expected.insert(expected.begin(), 0x03);
+  expected.push_back(0x01);
+  expected.push_back(0x02);
+  for (bool reference_values : {false, true}) {
+    DERWriter der;
+    der.set_reference_values(reference_values);
+    der.Prepend(reinterpret_cast<const uint8_t*>("\x01\x02"), 2);
+    der.PrependRepeated(reinterpret_cast<const uint8_t*>(pattern.data()),
+                        pattern.size(), count);
+    der.Prepend(0x03);
+    CheckEncoding(der, expected, "PrependRepeated", checker);
+  }
+}
+
+// Writes |repeated| with |asn1_pdu::PrependRepeated|, which writes only as
+// many repetitions as fit in |kMaxRepeatedLen| bytes.
+void CheckRepeatedCap(const asn1_pdu::RepeatedBytes& repeated,
+                      test_checker::Checker& checker) {
+  size_t count = std::min<size_t>(
+      repeated.count(), asn1_pdu::kMaxRepeatedLen / repeated.pattern().size());
+  std::vector<uint8_t> expected = Expand(repeated.pattern(), count);
+  for (bool reference_values : {false, true}) {
+    DERWriter der;
+    der.set_reference_values(reference_values);
+    asn1_pdu::PrependRepeated(repeated, der);
+    CheckEncoding(der, expected, "kMaxRepeatedLen", checker);
+  }
+}
+
+// Writes a mix of copied bytes, references and repetitions to a writer that
+// references values, recording |size()| before each write, then truncates
+// such writers to each of those sizes, writes to them again, and compares
+// them with the bytes written up to those sizes.
+void CheckTruncate(std::mt19937& rng, test_checker::Checker& checker) {
+  const std::string small = random_inputs::RandomBytes(rng, 5);
+  const std::string value = random_inputs::RandomBytes(
+      rng, DERWriter::kMinReferenceLen + rng() % 100);
+  const std::string pattern = random_inputs::RandomBytes(rng, 1 + rng() % 9);
+  const size_t count = kRepeatTileSize + rng() % kRepeatTileSize;
+  const size_t num_writes = 8;
+
+  // Writes the |i|th write to |der|.
+  auto write = [&](size_t i, DERWriter& der) {
+    switch (i % 3) {
+      case 0:
+        der.Prepend(small);
+        break;
+      case 1:
+        der.PrependReference(value);
+        break;
+      default:
+        der.PrependRepeated(reinterpret_cast<const uint8_t*>(pattern.data()),
+                            pattern.size(), count);
+        break;
+    }
+  };
+  std::vector<size_t> sizes;
+  DERWriter der;
+  der.set_reference_values(true);
+  for (size_t i = 0; i < num_writes; ++i) {
+    sizes.push_back(der.size());
+    write(i, der);
+  }
+  std::vector<uint8_t> full;
+  der.AppendTo(full);
+
+  for (size_t i = 0; i < num_writes; ++i) {
+    DERWriter truncated;
+    truncated.set_reference_values(true);
+    for (size_t j = 0; j < num_writes; ++j) {
+      write(j, truncated);
+    }
+    truncated.Truncate(sizes[i]);
+    std::vector<uint8_t> expected(full.end() - sizes[i], full.end());
+    CheckEncoding(truncated, expected, "Truncate", checker);
+    // Writing after truncating continues from there.
+    write(i + 1, truncated);
+    DERWriter rewritten;
+    rewritten.set_reference_values(true);
+    for (size_t j = 0; j < i; ++j) {
+      write(j, rewritten);
+    }
+    write(i + 1, rewritten);
+    expected.clear();
+    rewritten.AppendTo(expected);
+    CheckEncoding(truncated, expected, "write after Truncate", checker);
+  }
+}
+
+// Replaces the tags of TLVs whose values are references, with a high tag
+// number or not, and checks that nothing is replaced if the value was written
+// last.
+void CheckReplaceTag(std::mt19937& rng, test_checker::Checker& checker) {
+  const std::string value = random_inputs::RandomBytes(
+      rng, DERWriter::kMinReferenceLen + rng() % 100);
+  const std::string after = random_inputs::RandomBytes(rng, 3);
+  for (bool high_tag_num : {false, true}) {
+    DERWriter der;
+    der.set_reference_values(true);
+    der.Prepend(after);
+    der.PrependReference(value);
+    der.PrependDefiniteLength(value.size());
+    size_t size = der.size();
+    if (high_tag_num) {
+      der.PrependVariableIntBase128(1000);
+      der.Prepend(0xBF);
+    } else {
+      der.Prepend(0xA0);
+    }
+    der.ReplaceTag(0x04, size);
+
+    std::vector<uint8_t> expected;
+    PrependToModel(after, expected);
+    PrependToModel(value, expected);
+    DERWriter length;
+    length.PrependDefiniteLength(value.size());
+    expected.insert(expected.begin(), length.data(),
+                    length.data() + length.size());
+    expected.insert(expected.begin(), 0x04);
+    CheckEncoding(der, expected, "ReplaceTag", checker);
+  }
+
+  // The bytes written last are referenced, so there is no tag to replace.
+  DERWriter der;
+  der.set_reference_values(true);
+  der.Prepend(after);
+  size_t size = der.size();
+  der.PrependReference(value);
+  der.ReplaceTag(0x04, size);
+  std::vector<uint8_t> expected;
+  PrependToModel(after, expected);
+  PrependToModel(value, expected);
+  CheckEncoding(der, expected, "ReplaceTag after a reference", checker);
+}
+
+}  // namespace
+
+int main() {
+  std::mt19937 rng;
+  test_checker::Checker checker("encodings");
+
+  for (size_t pattern_len :
+       {size_t{1}, size_t{3}, size_t{7}, size_t{100}, kRepeatTileSize - 1,
+        kRepeatTileSize, kRepeatTileSize + 5}) {
+    std::string pattern = random_inputs::RandomBytes(rng, pattern_len);
+    size_t per_tile = GetRepeatsPerTile(pattern_len);
+    for (size_t count :
+         {size_t{0}, size_t{1}, per_tile - 1, per_tile, per_tile + 1,
+          3 * per_tile + 1, 5 * per_tile + per_tile / 2}) {
+      CheckRepeated(pattern, count, checker);
+    }
+  }
+
+  asn1_pdu::RepeatedBytes repeated;
+  for (size_t pattern_len : {size_t{1}, size_t{3}, size_t{4096 + 3}}) {
+    repeated.set_pattern(random_inputs::RandomBytes(rng, pattern_len));
+    for (uint32_t count :
+         {static_cast<uint32_t>(asn1_pdu::kMaxRepeatedLen / pattern_len),
+          static_cast<uint32_t>(asn1_pdu::kMaxRepeatedLen / pattern_len + 1),
+          UINT32_MAX}) {
+      repeated.set_count(count);
+      CheckRepeatedCap(repeated, checker);
+    }
+  }
+
+  for (int i = 0; i < 16; ++i) {
+    CheckTruncate(rng, checker);
+    CheckReplaceTag(rng, checker);
+  }
+
+  return checker.Finish();
+}
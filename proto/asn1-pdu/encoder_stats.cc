@@ -0,0 +1,160 @@
+// Copyright 2020 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include "encoder_stats.h"
+
+#include <string.h>
+
+#include <mutex>
+#include <vector>
+
+namespace {
+
+const char* const kPhaseNames[ASN1_PDU_NUM_PHASES] = {
+    "pdu",
+    "certificate",
+    "tbs_certificate",
+    "validity",
+    "subject_public_key_info",
+    "extensions",
+    "algorithm_identifier",
+};
+
+}  // namespace
+
+#ifdef ASN1_PDU_ENCODER_STATS
+
+namespace encoder_stats {
+
+namespace {
+
+// The counters of all threads that encoded, which are added once per thread.
+// Never destroyed, so that they can be read while the process exits.
+std::mutex thread_counters_mutex;
+std::vector<Counters*>& thread_counters = *new std::vector<Counters*>();
+
+Counters* NewThreadCounters() {
+  // Value-initialized, so the counters start at 0.
+  Counters* counters = new Counters();
+  std::lock_guard<std::mutex> lock(thread_counters_mutex);
+  thread_counters.push_back(counters);
+  return counters;
+}
+
+void Reset(Counters& counters) {
+  counters.pdus_encoded = 0;
+  counters.max_depth = 0;
+  counters.depth_limit_aborts = 0;
+  counters.length_overrides = 0;
+  counters.indefinite_lengths = 0;
+  counters.bytes_moved = 0;
+  counters.allocations = 0;
+  for (int phase = 0; phase < ASN1_PDU_NUM_PHASES; ++phase) {
+    counters.phase_calls[phase] = 0;
+    counters.phase_cycles[phase] = 0;
+  }
+}
+
+}  // namespace
+
+Counters& ThreadCounters() {
+  // Never destroyed, since the counters may be read after the thread exits.
+  static thread_local Counters* counters = NewThreadCounters();
+  return *counters;
+}
+
+}  // namespace encoder_stats
+
+int ASN1PDUEncoderStatsEnabled(void) {
+  return 1;
+}
+
+void ASN1PDUGetEncoderStats(ASN1PDUEncoderStats* stats) {
+  memset(stats, 0, sizeof(*stats));
+  std::lock_guard<std::mutex> lock(encoder_stats::thread_counters_mutex);
+  for (const encoder_stats::Counters* counters :
+       encoder_stats::thread_counters) {
+    stats->pdus_encoded += counters->pdus_encoded;
+    if (counters->max_depth > stats->max_depth) {
+      stats->max_depth = counters->max_depth;
+    }
+    stats->depth_limit_aborts += counters->depth_limit_aborts;
+    stats->length_overrides += counters->length_overrides;
+    stats->indefinite_lengths += counters->indefinite_lengths;
+    stats->bytes_moved += counters->bytes_moved;
+    stats->allocations += counters->allocations;
+    for (int phase = 0; phase < ASN1_PDU_NUM_PHASES; ++phase) {
+      stats->phase_calls[phase] += counters->phase_calls[phase];
+      stats->phase_cycles[phase] += counters->phase_cycles[phase];
+    }
+  }
+}
+
+void ASN1PDUResetEncoderStats(void) {
+  std::lock_guard<std::mutex> lock(encoder_stats::thread_counters_mutex);
+  for (encoder_stats::Counters* counters : encoder_stats::thread_counters) {
+    encoder_stats::Reset(*counters);
+  }
+}
+
+#else  // ASN1_PDU_ENCODER_STATS
+
+int ASN1PDUEncoderStatsEnabled(void) {
+  return 0;
+}
+
+void ASN1PDUGetEncoderStats(ASN1PDUEncoderStats* stats) {
+  memset(stats, 0, sizeof(*stats));
+}
+
+void ASN1PDUResetEncoderStats(void) {}
+
+#endif  // ASN1_PDU_ENCODER_STATS
+
+const char* ASN1PDUEncoderPhaseName(int phase) {
+  if (phase < 0 || phase >= ASN1_PDU_NUM_PHASES) {
+    return nullptr;
+  }
+  return kPhaseNames[phase];
+}
+
+void ASN1PDUPrintEncoderStats(FILE* out) {
+  ASN1PDUEncoderStats stats;
+  ASN1PDUGetEncoderStats(&stats);
+  fprintf(out,
+          "encoder: %llu pdus, max depth %llu, %llu depth limit aborts, "
+          "%llu length overrides, %llu indefinite lengths, %llu bytes moved, "
+          "%llu allocations\n",
+          static_cast<unsigned long long>(stats.pdus_encoded),
+          static_cast<unsigned long long>(stats.max_depth),
+          static_cast<unsigned long long>(stats.depth_limit_aborts),
+          static_cast<unsigned long long>(stats.length_overrides),
+          static_cast<unsigned long long>(stats.indefinite_lengths),
+          static_cast<unsigned long long>(stats.bytes_moved),
+          static_cast<unsigned long long>(stats.allocations));
+  fprintf(out, "encoder phases:");
+  const char* separator = " ";
+  for (int phase = 0; phase < ASN1_PDU_NUM_PHASES; ++phase) {
+    if (stats.phase_calls[phase] != 0) {
+      fprintf(out, "%s%s %llu x %.0f cycles", separator, kPhaseNames[phase],
+              static_cast<unsigned long long>(stats.phase_calls[phase]),
+              static_cast<double>(stats.phase_cycles[phase]) /
+                  stats.phase_calls[phase]);
+      separator = ", ";
+    }
+  }
+  fprintf(out, "\n");
+}
@@ -0,0 +1,199 @@
+// Copyright 2020 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef PROTO_ASN1_PDU_ENCODER_STATS_H_
+#define PROTO_ASN1_PDU_ENCODER_STATS_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Counters of what the encoders do, and timers of their phases, for watching
+// the encoders of a fuzzing fleet. The encoders only count if they are built
+// with ASN1_PDU_ENCODER_STATS; otherwise the hooks below compile to nothing,
+// and the functions of the C API report zeros.
+// Every thread counts into its own counters, which are summed when read.
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// The phases of encoding that are timed. Phases nest, e.g. a certificate is
+// encoded in |ASN1_PDU_PHASE_CERTIFICATE|, which includes the time of
+// |ASN1_PDU_PHASE_TBS_CERTIFICATE|, which includes that of the PDUs in it.
+enum ASN1PDUEncoderPhase {
+  // |asn1_pdu::ASN1PDUToDER::Encode|, for every PDU that isn't nested in
+  // another, including those of the fields of certificates.
+  ASN1_PDU_PHASE_PDU,
+  // The |x509_certificate::Encode| specializations of the parts of a
+  // certificate.
+  ASN1_PDU_PHASE_CERTIFICATE,
+  ASN1_PDU_PHASE_TBS_CERTIFICATE,
+  ASN1_PDU_PHASE_VALIDITY,
+  ASN1_PDU_PHASE_SUBJECT_PUBLIC_KEY_INFO,
+  ASN1_PDU_PHASE_EXTENSIONS,
+  ASN1_PDU_PHASE_ALGORITHM_IDENTIFIER,
+  ASN1_PDU_NUM_PHASES,
+};
+
+typedef struct {
+  // The PDUs encoded by |asn1_pdu::ASN1PDUToDER|, including nested ones.
+  uint64_t pdus_encoded;
+  // The deepest PDU encoded, counting the outermost PDU as depth 1.
+  uint64_t max_depth;
+  // The encodings that left out PDUs nested deeper than the depth limit.
+  uint64_t depth_limit_aborts;
+  // The PDUs encoded with a |length_override|, and with the indefinite form.
+  uint64_t length_overrides;
+  uint64_t indefinite_lengths;
+  // The bytes moved after they were written: by a |DERWriter| that grew, to
+  // the new end of its memory, and by |EncodeToBuffer|, to the start of the
+  // buffer.
+  uint64_t bytes_moved;
+  // The memory allocated by growing |DERWriter|s.
+  uint64_t allocations;
+  // The number of times each phase ran, and the cycles spent in it, in the
+  // units of the cycle counter of the CPU (the time stamp counter on x86-64,
+  // the virtual counter on AArch64), or nanoseconds on other CPUs.
+  uint64_t phase_calls[ASN1_PDU_NUM_PHASES];
+  uint64_t phase_cycles[ASN1_PDU_NUM_PHASES];
+} ASN1PDUEncoderStats;
+
+// Returns 1 if the encoders were built with ASN1_PDU_ENCODER_STATS, and 0
+// otherwise.
+int ASN1PDUEncoderStatsEnabled(void);
+
+// Sets |*stats| to the sum of the counters of all threads, and the largest of
+// their depths.
+void ASN1PDUGetEncoderStats(ASN1PDUEncoderStats* stats);
+
+// Resets the counters of all threads to 0. Counts of threads that encode at
+// the same time may be kept.
+void ASN1PDUResetEncoderStats(void);
+
+// Returns the name of |phase|, e.g. "tbs_certificate", or NULL if it isn't
+// one.
+const char* ASN1PDUEncoderPhaseName(int phase);
+
+// Prints the counters of |ASN1PDUGetEncoderStats| to |out| on one line, and the
+// phases that ran on another, with the average cycles per run.
+void ASN1PDUPrintEncoderStats(FILE* out);
+
+#ifdef __cplusplus
+}  // extern "C"
+
+#ifdef ASN1_PDU_ENCODER_STATS
+
+#include <atomic>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <chrono>
+#endif
+
+namespace encoder_stats {
+
+// The counters of one thread. Only that thread writes them, so they are
+// updated without atomic read-modify-writes, but they are atomic so that other
+// threads can read them.
+struct Counters {
+  std::atomic<uint64_t> pdus_encoded;
+  std::atomic<uint64_t> max_depth;
+  std::atomic<uint64_t> depth_limit_aborts;
+  std::atomic<uint64_t> length_overrides;
+  std::atomic<uint64_t> indefinite_lengths;
+  std::atomic<uint64_t> bytes_moved;
+  std::atomic<uint64_t> allocations;
+  std::atomic<uint64_t> phase_calls[ASN1_PDU_NUM_PHASES];
+  std::atomic<uint64_t> phase_cycles[ASN1_PDU_NUM_PHASES];
+};
+
+// Returns the counters of the calling thread, which are never destroyed, so
+// that they can be read after the thread exits.
+Counters& ThreadCounters();
+
+inline void Add(std::atomic<uint64_t>& counter, uint64_t n) {
+  counter.store(counter.load(std::memory_order_relaxed) + n,
+                std::memory_order_relaxed);
+}
+
+inline void Max(std::atomic<uint64_t>& counter, uint64_t n) {
+  if (n > counter.load(std::memory_order_relaxed)) {
+    counter.store(n, std::memory_order_relaxed);
+  }
+}
+
+inline uint64_t ReadCycleCounter() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#elif defined(__aarch64__)
+  uint64_t cycles;
+  asm volatile("mrs %0, cntvct_el0" : "=r"(cycles));
+  return cycles;
+#else
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+#endif
+}
+
+// Adds the cycles from its construction to its destruction to a phase.
+class PhaseTimer {
+ public:
+  explicit PhaseTimer(ASN1PDUEncoderPhase phase)
+      : phase_(phase), start_(ReadCycleCounter()) {}
+  ~PhaseTimer() {
+    Counters& counters = ThreadCounters();
+    Add(counters.phase_calls[phase_], 1);
+    Add(counters.phase_cycles[phase_], ReadCycleCounter() - start_);
+  }
+
+  PhaseTimer(const PhaseTimer&) = delete;
+  PhaseTimer& operator=(const PhaseTimer&) = delete;
+
+ private:
+  const ASN1PDUEncoderPhase phase_;
+  const uint64_t start_;
+};
+
+}  // namespace encoder_stats
+
+// The hooks of the encoders: adds |n| to |counter|, raises |counter| to |n|,
+// and times the rest of the enclosing scope as |phase|.
+#define ASN1_PDU_STATS_ADD(counter, n) \
+  ::encoder_stats::Add(::encoder_stats::ThreadCounters().counter, (n))
+#define ASN1_PDU_STATS_MAX(counter, n) \
+  ::encoder_stats::Max(::encoder_stats::ThreadCounters().counter, (n))
+#define ASN1_PDU_STATS_TIME_PHASE(phase) \
+  ::encoder_stats::PhaseTimer asn1_pdu_phase_timer(phase)
+
+#else  // ASN1_PDU_ENCODER_STATS
+
+#define ASN1_PDU_STATS_ADD(counter, n) \
+  do {                                 \
+  } while (0)
+#define ASN1_PDU_STATS_MAX(counter, n) \
+  do {                                 \
+  } while (0)
+#define ASN1_PDU_STATS_TIME_PHASE(phase) \
+  do {                                   \
+  } while (0)
+
+#endif  // ASN1_PDU_ENCODER_STATS
+
+#endif  // __cplusplus
+
+#endif  // PROTO_ASN1_PDU_ENCODER_STATS_H_
@@ -0,0 +1,163 @@
+// Copyright 2020 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+// Checks that the thread-safe encoders and decoders give every thread the same
+// results as a single thread, when many threads call them at once on inputs
+// generated from fixed seeds. Built with -fsanitize=thread, it also checks
+// that they don't race.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include <algorithm>
+#include <functional>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "asn1_pdu.pb.h"
+#include "asn1_pdu_to_der.h"
+#include "common.h"
+#include "der_to_asn1_pdu.h"
+#include "der_to_x509_certificate.h"
+#include "random_inputs.h"
+#include "test_checker.h"
+#include "x509_certificate.pb.h"
+#include "x509_certificate_to_der.h"
+
+namespace {
+
+using asn1_pdu::PDU;
+using random_inputs::Concatenate;
+using random_inputs::RandomCertificate;
+using random_inputs::SetRandomPDU;
+using x509_certificate::X509Certificate;
+
+constexpr size_t kNumThreads = 8;
+constexpr size_t kNumInputs = 64;
+// Every thread encodes and decodes every input this many times.
+constexpr size_t kNumRounds = 4;
+
+bool Equals(const DERWriter& der, const std::vector<uint8_t>& expected) {
+  return der.size() == expected.size() &&
+         std::equal(expected.begin(), expected.end(), der.data());
+}
+
+// The inputs, and their encodings by a single thread.
+struct Inputs {
+  std::vector<PDU> pdus;
+  std::vector<std::vector<uint8_t>> pdu_encodings;
+  std::vector<X509Certificate> certificates;
+  std::vector<std::vector<uint8_t>> certificate_encodings;
+};
+
+// Encodes and decodes all |inputs| with every thread-safe function, as
+// |worker| of |kNumThreads|, and compares the results with those of a single
+// thread.
+void CheckInputs(const Inputs& inputs,
+                 size_t worker,
+                 test_checker::Checker* checker) {
+  // The encoders reuse the memory of their outputs, so they are kept between
+  // inputs, like a fuzz target does.
+  DERWriter der;
+  std::vector<uint8_t> buffer(1 << 16);
+  std::vector<struct iovec> segments;
+  asn1_pdu::DERToASN1PDU decoder;
+  PDU pdu;
+  X509Certificate certificate;
+  for (size_t round = 0; round < kNumRounds; ++round) {
+    // Workers start at different inputs, so that they encode different
+    // inputs at the same time as well as the same ones.
+    for (size_t j = 0; j < kNumInputs; ++j) {
+      size_t i = (j + worker * kNumInputs / kNumThreads) % kNumInputs;
+      const std::vector<uint8_t>& pdu_encoding = inputs.pdu_encodings[i];
+      checker->Expect(asn1_pdu::PDUToDER(inputs.pdus[i]) == pdu_encoding,
+                      "PDU %zu: PDUToDER to a vector", i);
+      asn1_pdu::PDUToDER(inputs.pdus[i], der);
+      checker->Expect(Equals(der, pdu_encoding), "PDU %zu: PDUToDER", i);
+      size_t size =
+          asn1_pdu::PDUToDER(inputs.pdus[i], buffer.data(), buffer.size());
+      checker->Expect(size == pdu_encoding.size() &&
+                          std::equal(pdu_encoding.begin(), pdu_encoding.end(),
+                                     buffer.begin()),
+                      "PDU %zu: PDUToDER to a buffer", i);
+      asn1_pdu::PDUToSegments(inputs.pdus[i], segments);
+      checker->Expect(Concatenate(segments) == pdu_encoding,
+                      "PDU %zu: PDUToSegments", i);
+      checker->Expect(
+          decoder.Decode(pdu_encoding.data(), pdu_encoding.size(), &pdu) &&
+              asn1_pdu::PDUToDER(pdu) == pdu_encoding,
+          "PDU %zu: DERToASN1PDU", i);
+
+      const std::vector<uint8_t>& certificate_encoding =
+          inputs.certificate_encodings[i];
+      checker->Expect(x509_certificate::X509CertificateToDER(
+                          inputs.certificates[i]) == certificate_encoding,
+                      "certificate %zu: X509CertificateToDER to a vector", i);
+      x509_certificate::X509CertificateToDER(inputs.certificates[i], der);
+      checker->Expect(Equals(der, certificate_encoding),
+                      "certificate %zu: X509CertificateToDER", i);
+      size = x509_certificate::X509CertificateToDER(
+          inputs.certificates[i], buffer.data(), buffer.size());
+      checker->Expect(size == certificate_encoding.size() &&
+                          std::equal(certificate_encoding.begin(),
+                                     certificate_encoding.end(),
+                                     buffer.begin()),
+                      "certificate %zu: X509CertificateToDER to a buffer", i);
+      x509_certificate::X509CertificateToSegments(inputs.certificates[i],
+                                                  segments);
+      checker->Expect(Concatenate(segments) == certificate_encoding,
+                      "certificate %zu: X509CertificateToSegments", i);
+      checker->Expect(x509_certificate::DERToX509Certificate(
+                          certificate_encoding.data(),
+                          certificate_encoding.size(), &certificate) &&
+                          x509_certificate::X509CertificateToDER(
+                              certificate) == certificate_encoding,
+                      "certificate %zu: DERToX509Certificate", i);
+    }
+  }
+}
+
+}  // namespace
+
+int main() {
+  std::mt19937 rng;
+  Inputs inputs;
+  for (size_t i = 0; i < kNumInputs; ++i) {
+    inputs.pdus.emplace_back();
+    SetRandomPDU(rng, 1 + i % 8, &inputs.pdus.back());
+    inputs.pdu_encodings.push_back(asn1_pdu::PDUToDER(inputs.pdus.back()));
+    inputs.certificates.push_back(RandomCertificate(rng));
+    inputs.certificate_encodings.push_back(
+        x509_certificate::X509CertificateToDER(inputs.certificates.back()));
+  }
+
+  // Every thread counts its own checks, which are added up once it is done.
+  std::vector<test_checker::Checker> checkers(
+      kNumThreads, test_checker::Checker("results"));
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < kNumThreads; ++i) {
+    threads.emplace_back(CheckInputs, std::cref(inputs), i, &checkers[i]);
+  }
+  test_checker::Checker checker("results");
+  for (size_t i = 0; i < kNumThreads; ++i) {
+    threads[i].join();
+    checker.Merge(checkers[i]);
+  }
+  return checker.Finish();
+}
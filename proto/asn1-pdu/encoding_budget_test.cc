@@ -0,0 +1,224 @@
+// Copyright 2020 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+// Checks what is left of encodings that hit a cap of an |EncodingBudget|, for
+// every size cap and node cap of a PDU with a wide |val_array|: nothing with
+// |kEmpty|, and with |kTruncate|, the encoding of the PDU with only the last
+// elements that fit, since the encoders write back to front, and the element
+// whose value didn't fit without its value. Also checks that
+// |budget_exceeded()| reports the cap that was hit, that a PDU whose EOC
+// marker doesn't fit is left out, and that certificates truncated by either
+// cap are still well-formed TLVs.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "asn1_pdu.pb.h"
+#include "asn1_pdu_to_der.h"
+#include "common.h"
+#include "random_inputs.h"
+#include "test_checker.h"
+#include "x509_certificate.pb.h"
+#include "x509_certificate_to_der.h"
+
+namespace {
+
+using asn1_pdu::PDU;
+
+constexpr size_t kNumElements = 10;
+// Every element is a primitive PDU with a value of |kValueLen| bytes, which
+// encodes to |kElementLen| bytes.
+constexpr size_t kValueLen = 8;
+constexpr size_t kElementLen = kValueLen + 2;
+constexpr size_t kNumCertificates = 64;
+
+// Returns a SEQUENCE of the last |num_elements| of |kNumElements| OCTET
+// STRINGs, which are all different.
+PDU WidePDU(size_t num_elements) {
+  PDU pdu;
+  pdu.mutable_id()->set_id_class(asn1_pdu::Universal);
+  pdu.mutable_id()->mutable_tag_num()->set_low_tag_num(
+      static_cast<asn1_pdu::LowTagNumber>(16));
+  pdu.mutable_id()->set_encoding(asn1_pdu::Constructed);
+  pdu.mutable_len();
+  for (size_t i = kNumElements - num_elements; i < kNumElements; ++i) {
+    PDU* element = pdu.mutable_val()->add_val_array()->mutable_pdu();
+    element->mutable_id()->set_id_class(asn1_pdu::Universal);
+    element->mutable_id()->mutable_tag_num()->set_low_tag_num(
+        static_cast<asn1_pdu::LowTagNumber>(4));
+    element->mutable_id()->set_encoding(asn1_pdu::Primitive);
+    element->mutable_len();
+    element->mutable_val()->add_val_array()->set_val_bits(
+        std::string(kValueLen, static_cast<char>('a' + i)));
+  }
+  return pdu;
+}
+
+// Returns the caps and the policy of |budget|, to report mismatches.
+std::string Describe(const EncodingBudget& budget) {
+  return "max_size " + std::to_string(budget.max_size) + ", max_nodes " +
+         std::to_string(budget.max_nodes) +
+         (budget.policy == EncodingBudget::kEmpty ? ", kEmpty" : ", kTruncate");
+}
+
+// Encodes |pdu| with |budget|, and checks that the budget reports |exceeded|,
+// and that the encoding is |expected|.
+void CheckPDU(const PDU& pdu,
+              const EncodingBudget& budget,
+              EncodingBudget::Exceeded exceeded,
+              const std::vector<uint8_t>& expected,
+              test_checker::Checker& checker) {
+  static asn1_pdu::ASN1PDUToDER encoder;
+  static DERWriter der;
+  der.set_budget(budget);
+  encoder.PDUToDER(pdu, der);
+  checker.Check();
+  if (der.budget_exceeded() != exceeded) {
+    checker.Mismatch("PDU, %s: wrong cap reported", Describe(budget).c_str());
+  } else if (std::vector<uint8_t>(der.data(), der.data() + der.size()) !=
+             expected) {
+    checker.Mismatch("PDU, %s: wrong encoding", Describe(budget).c_str());
+  }
+}
+
+// Encodes |cert| with |budget|, which must be exceeded, and checks that the
+// budget reports |exceeded|, and that the encoding is empty with |kEmpty|, and
+// a single TLV, whose length matches, with |kTruncate|.
+void CheckCertificate(const x509_certificate::X509Certificate& cert,
+                      const EncodingBudget& budget,
+                      EncodingBudget::Exceeded exceeded,
+                      test_checker::Checker& checker) {
+  static DERWriter der;
+  der.set_budget(budget);
+  x509_certificate::X509CertificateToDER(cert, der);
+  TLVHeader header;
+  checker.Check();
+  if (der.budget_exceeded() != exceeded) {
+    checker.Mismatch("certificate, %s: wrong cap reported",
+                     Describe(budget).c_str());
+  } else if (budget.policy == EncodingBudget::kEmpty) {
+    if (der.size() != 0) {
+      checker.Mismatch("certificate, %s: not empty", Describe(budget).c_str());
+    }
+  } else if (!ParseTLVHeader(der.data(), der.size(), header) ||
+             header.identifier_len + header.length_len + header.value_len !=
+                 der.size()) {
+    checker.Mismatch("certificate, %s: length mismatch",
+                     Describe(budget).c_str());
+  }
+}
+
+}  // namespace
+
+int main() {
+  test_checker::Checker checker("encodings");
+  const PDU pdu = WidePDU(kNumElements);
+  const std::vector<uint8_t> full = asn1_pdu::ASN1PDUToDER().PDUToDER(pdu);
+  const std::vector<uint8_t> empty;
+
+  for (EncodingBudget::Policy policy :
+       {EncodingBudget::kEmpty, EncodingBudget::kTruncate}) {
+    // A value fits if the bytes written before it, and it, fit, so with
+    // |max_size|, the last |(max_size + 2) / kElementLen| elements fit. The
+    // header of the SEQUENCE can still take the encoding over |max_size|.
+    for (size_t max_size = 0; max_size <= full.size() + 1; ++max_size) {
+      EncodingBudget budget;
+      budget.max_size = max_size;
+      budget.policy = policy;
+      if (max_size >= full.size()) {
+        CheckPDU(pdu, budget, EncodingBudget::kNone, full, checker);
+        continue;
+      }
+      size_t num_fit =
+          std::min(kNumElements, (max_size + kElementLen - kValueLen) /
+                                     kElementLen);
+      if (policy == EncodingBudget::kEmpty) {
+        CheckPDU(pdu, budget, EncodingBudget::kSize, empty, checker);
+        continue;
+      }
+      // The element whose value didn't fit is left without it.
+      PDU truncated = WidePDU(std::min(kNumElements, num_fit + 1));
+      if (num_fit < kNumElements) {
+        truncated.mutable_val()
+            ->mutable_val_array(0)
+            ->mutable_pdu()
+            ->mutable_val()
+            ->clear_val_array();
+      }
+      CheckPDU(pdu, budget, EncodingBudget::kSize,
+               asn1_pdu::ASN1PDUToDER().PDUToDER(truncated), checker);
+    }
+
+    // The SEQUENCE takes a node, and every element one more.
+    for (size_t max_nodes = 0; max_nodes <= kNumElements + 1; ++max_nodes) {
+      EncodingBudget budget;
+      budget.max_nodes = max_nodes;
+      budget.policy = policy;
+      if (max_nodes == kNumElements + 1) {
+        CheckPDU(pdu, budget, EncodingBudget::kNone, full, checker);
+      } else if (policy == EncodingBudget::kEmpty || max_nodes == 0) {
+        CheckPDU(pdu, budget, EncodingBudget::kNodes, empty, checker);
+      } else {
+        CheckPDU(pdu, budget, EncodingBudget::kNodes,
+                 asn1_pdu::ASN1PDUToDER().PDUToDER(WidePDU(max_nodes - 1)),
+                 checker);
+      }
+    }
+  }
+
+  // A SEQUENCE holding an empty SEQUENCE with an indefinite length, whose EOC
+  // marker is charged before its value, and is left out with it if it
+  // doesn't fit.
+  PDU nested = WidePDU(0);
+  PDU* inner = nested.mutable_val()->add_val_array()->mutable_pdu();
+  *inner = WidePDU(0);
+  inner->mutable_len()->set_indefinite_form(true);
+  const std::vector<uint8_t> nested_full = {0x30, 0x04, 0x30, 0x80, 0x00, 0x00};
+  const std::vector<uint8_t> outer_only = {0x30, 0x00};
+  for (size_t max_size = 0; max_size <= nested_full.size(); ++max_size) {
+    EncodingBudget budget;
+    budget.max_size = max_size;
+    budget.policy = EncodingBudget::kTruncate;
+    CheckPDU(nested, budget,
+             max_size < nested_full.size() ? EncodingBudget::kSize
+                                           : EncodingBudget::kNone,
+             max_size < 2 ? outer_only : nested_full, checker);
+  }
+
+  std::mt19937 rng;
+  for (size_t i = 0; i < kNumCertificates; ++i) {
+    x509_certificate::X509Certificate cert =
+        random_inputs::RandomCertificate(rng);
+    size_t size = x509_certificate::X509CertificateToDER(cert).size();
+    for (EncodingBudget::Policy policy :
+         {EncodingBudget::kEmpty, EncodingBudget::kTruncate}) {
+      EncodingBudget budget;
+      budget.policy = policy;
+      budget.max_size = rng() % size;
+      CheckCertificate(cert, budget, EncodingBudget::kSize, checker);
+      budget.max_size = SIZE_MAX;
+      budget.max_nodes = 1 + rng() % 8;
+      CheckCertificate(cert, budget, EncodingBudget::kNodes, checker);
+    }
+  }
+
+  return checker.Finish();
+}
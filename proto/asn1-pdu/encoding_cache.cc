@@ -0,0 +1,207 @@
+// Copyright 2020 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include "encoding_cache.h"
+
+#include <string.h>
+
+#include <string>
+
+#include "asn1_pdu_to_der.h"
+
+namespace {
+
+// Hashes a sequence of integers and byte strings into 128 bits, in two lanes
+// that are mixed with different multipliers. It is not cryptographic, but
+// makes accidental collisions between PDUs negligible.
+class Hasher {
+ public:
+  explicit Hasher(uint64_t seed)
+      : a_(seed ^ 0x243f6a8885a308d3), b_(seed ^ 0x13198a2e03707344) {}
+
+  void Add(uint64_t value) {
+    AddToA(value);
+    AddToB(value);
+  }
+
+  // Adds the |size| bytes at |data|, 16 at a time, 8 to each lane, so that
+  // long values hash at close to the speed they are copied. The caller adds
+  // |size| itself.
+  void Add(const char* data, size_t size) {
+    for (; size >= 16; data += 16, size -= 16) {
+      uint64_t words[2];
+      memcpy(words, data, sizeof(words));
+      AddToA(words[0]);
+      AddToB(words[1]);
+    }
+    if (size != 0) {
+      uint64_t words[2] = {0, 0};
+      memcpy(words, data, size);
+      AddToA(words[0]);
+      AddToB(words[1]);
+    }
+  }
+
+  EncodingCache::Key Finish() const {
+    return {{Mix(a_ ^ (b_ >> 1)), Mix(b_ + a_)}};
+  }
+
+ private:
+  static uint64_t Rotate(uint64_t value, int shift) {
+    return (value << shift) | (value >> (64 - shift));
+  }
+
+  void AddToA(uint64_t value) {
+    a_ = (a_ ^ value) * 0x9e3779b97f4a7c15;
+    a_ ^= a_ >> 32;
+  }
+
+  void AddToB(uint64_t value) {
+    b_ = Rotate(b_ + value, 29) * 0xbf58476d1ce4e5b9;
+  }
+
+  uint64_t a_;
+  uint64_t b_;
+};
+
+// Adds the fields of |pdu|, and of the PDUs nested in it, that |ASN1PDUToDER|
+// encodes to |hasher|, in depth-first order. Every PDU adds one word for its
+// identifier, length form and number of elements, and one word for each
+// element, which tells a nested PDU from a value and holds the value's size,
+// and whether repetitions follow it, so that no two PDUs add the same
+// sequence.
+void AddPDU(const asn1_pdu::PDU& pdu, Hasher& hasher) {
+  // Kept per thread, so that it keeps its memory between calls.
+  static thread_local std::vector<const asn1_pdu::PDU*> stack;
+  stack.clear();
+  stack.push_back(&pdu);
+  while (!stack.empty()) {
+    const asn1_pdu::PDU* current = stack.back();
+    stack.pop_back();
+
+    const asn1_pdu::Identifier& id = current->id();
+    const asn1_pdu::Length& len = current->len();
+    const auto& val_array = current->val().val_array();
+    bool high_tag_num = id.tag_num().has_high_tag_num();
+    uint64_t length_form = len.has_length_override()
+                               ? 1
+                               : len.has_indefinite_form() &&
+                                         len.indefinite_form()
+                                     ? 2
+                                     : 0;
+    // The tag number takes 32 bits, the number of elements 26, and the rest 6.
+    hasher.Add(static_cast<uint64_t>(
+                   high_tag_num
+                       ? id.tag_num().high_tag_num()
+                       : static_cast<uint32_t>(id.tag_num().low_tag_num())) |
+               static_cast<uint64_t>(id.id_class()) << 32 |
+               static_cast<uint64_t>(id.encoding()) << 34 |
+               static_cast<uint64_t>(high_tag_num) << 35 |
+               length_form << 36 |
+               static_cast<uint64_t>(val_array.size()) << 38);
+    if (length_form == 1) {
+      const std::string& length_override = len.length_override();
+      hasher.Add(length_override.size());
+      hasher.Add(length_override.data(), length_override.size());
+    }
+
+    for (const asn1_pdu::ValueElement& element : val_array) {
+      if (element.has_pdu()) {
+        hasher.Add(0);
+      } else {
+        const std::string& val_bits = element.val_bits();
+        bool repeated = element.has_repeated_bits();
+        hasher.Add(static_cast<uint64_t>(val_bits.size()) << 2 |
+                   static_cast<uint64_t>(repeated) << 1 | 1);
+        hasher.Add(val_bits.data(), val_bits.size());
+        if (repeated) {
+          // The repetitions are hashed as the pattern and their number.
+          const std::string& pattern = element.repeated_bits().pattern();
+          hasher.Add(pattern.size());
+          hasher.Add(pattern.data(), pattern.size());
+          hasher.Add(asn1_pdu::GetRepeatCount(element.repeated_bits()));
+        }
+      }
+    }
+    // Pushed last to first, so that they are hashed first to last.
+    for (auto it = val_array.rbegin(); it != val_array.rend(); ++it) {
+      if (it->has_pdu()) {
+        stack.push_back(&it->pdu());
+      }
+    }
+  }
+}
+
+}  // namespace
+
+constexpr size_t EncodingCache::kDefaultNumEntries;
+constexpr size_t EncodingCache::kDefaultMaxEncodingSize;
+
+EncodingCache::EncodingCache(size_t num_entries, size_t max_encoding_size)
+    : entries_(RoundUpToPowerOfTwo(num_entries)),
+      max_encoding_size_(max_encoding_size) {}
+
+EncodingCache::Key EncodingCache::KeyOf(const asn1_pdu::PDU& pdu) {
+  Hasher hasher(0);
+  AddPDU(pdu, hasher);
+  return hasher.Finish();
+}
+
+bool EncodingCache::Lookup(const Key& key, DERWriter& der) {
+  lookups_.Increment();
+  const Entry& entry = EntryFor(key);
+  if (!entry.valid || entry.key.hash[0] != key.hash[0] ||
+      entry.key.hash[1] != key.hash[1]) {
+    return false;
+  }
+  hits_.Increment();
+  der.Prepend(entry.encoding.data(), entry.encoding.size());
+  return true;
+}
+
+void EncodingCache::Insert(const Key& key,
+                           const uint8_t* encoding,
+                           size_t size) {
+  if (size > max_encoding_size_) {
+    oversized_.Increment();
+    return;
+  }
+  Entry& entry = EntryFor(key);
+  if (entry.valid && (entry.key.hash[0] != key.hash[0] ||
+                      entry.key.hash[1] != key.hash[1])) {
+    evictions_.Increment();
+  }
+  entry.key = key;
+  entry.valid = true;
+  entry.encoding.assign(encoding, encoding + size);
+  insertions_.Increment();
+}
+
+void EncodingCache::Clear() {
+  for (Entry& entry : entries_) {
+    entry.valid = false;
+  }
+}
+
+EncodingCache::Stats EncodingCache::stats() const {
+  return {lookups_.value(), hits_.value(), insertions_.value(),
+          evictions_.value(), oversized_.value()};
+}
+
+double EncodingCache::hit_rate() const {
+  uint64_t lookups = lookups_.value();
+  return lookups == 0 ? 0 : static_cast<double>(hits_.value()) / lookups;
+}
@@ -0,0 +1,124 @@
+// Copyright 2020 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef PROTO_ASN1_PDU_ENCODING_CACHE_H_
+#define PROTO_ASN1_PDU_ENCODING_CACHE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <vector>
+
+#include "asn1_pdu.pb.h"
+#include "common.h"
+
+// A bounded cache of the encodings of PDUs, keyed by a hash of their contents.
+// Mutators usually change one field of an input at a time, so most of the PDUs
+// of the next input are encoded to the same bytes as before, and can be copied
+// from the cache instead of being encoded again.
+// The cache is direct-mapped: a key can only be stored in one of its entries,
+// and replaces whatever that entry held. Its memory is bounded by the number
+// of entries, rounded up to a power of two, times the maximum size of an
+// encoding it stores.
+// An |EncodingCache| must not be used by more than one thread at a time, but
+// its |stats()| can be read from any thread.
+class EncodingCache {
+ public:
+  static constexpr size_t kDefaultNumEntries = 1 << 12;
+  static constexpr size_t kDefaultMaxEncodingSize = 1 << 12;
+
+  // A 128-bit hash of the contents of a PDU.
+  struct Key {
+    uint64_t hash[2];
+  };
+
+  // Counters of the lookups and insertions of a cache.
+  struct Stats {
+    uint64_t lookups;
+    uint64_t hits;
+    uint64_t insertions;
+    // Insertions that replaced the encoding of another key.
+    uint64_t evictions;
+    // Encodings that weren't inserted, since they were larger than the
+    // maximum size.
+    uint64_t oversized;
+  };
+
+  explicit EncodingCache(size_t num_entries = kDefaultNumEntries,
+                         size_t max_encoding_size = kDefaultMaxEncodingSize);
+
+  EncodingCache(const EncodingCache&) = delete;
+  EncodingCache& operator=(const EncodingCache&) = delete;
+
+  // Returns the key of |pdu|. Only the fields that |ASN1PDUToDER| encodes are
+  // hashed, without recursion, so that deeply nested PDUs can't overflow the
+  // stack. Hashing is a walk of |pdu| like encoding it, but does less work
+  // per node.
+  static Key KeyOf(const asn1_pdu::PDU& pdu);
+
+  // If the cache holds an encoding for |key|, prepends it to |der| and returns
+  // true.
+  bool Lookup(const Key& key, DERWriter& der);
+
+  // Stores the |size| bytes at |encoding| as the encoding for |key|, unless
+  // they are larger than the maximum size.
+  void Insert(const Key& key, const uint8_t* encoding, size_t size);
+
+  // Discards all encodings, but keeps the memory for reuse, and the counters.
+  void Clear();
+
+  Stats stats() const;
+
+  // Returns the fraction of lookups that were hits, or 0 if there were none.
+  double hit_rate() const;
+
+ private:
+  struct Entry {
+    Key key;
+    bool valid = false;
+    std::vector<uint8_t> encoding;
+  };
+
+  // A counter that only its cache's thread increments, and that other threads
+  // can read without a data race, at the cost of a plain store.
+  class Counter {
+   public:
+    void Increment() {
+      value_.store(value_.load(std::memory_order_relaxed) + 1,
+                   std::memory_order_relaxed);
+    }
+    uint64_t value() const { return value_.load(std::memory_order_relaxed); }
+
+   private:
+    std::atomic<uint64_t> value_{0};
+  };
+
+  Entry& EntryFor(const Key& key) {
+    return entries_[key.hash[0] & (entries_.size() - 1)];
+  }
+
+  std::vector<Entry> entries_;
+  const size_t max_encoding_size_;
+
+  Counter lookups_;
+  Counter hits_;
+  Counter insertions_;
+  Counter evictions_;
+  Counter oversized_;
+};
+
+#endif  // PROTO_ASN1_PDU_ENCODING_CACHE_H_
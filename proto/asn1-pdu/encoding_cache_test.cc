@@ -0,0 +1,185 @@
+// Copyright 2020 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+// Checks that the X.509 encoders encode the same bytes with an
+// |EncodingCache| as without one, for random certificates that are mutated
+// one field at a time, like a mutator does, so that most PDUs are found in the
+// cache, and a missed change to a key would show, and with a budget that
+// discards encodings over a size, which the cache is used with. The check runs
+// with the default cache, and with a cache of 4 entries that evicts
+// constantly.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <random>
+#include <vector>
+
+#include "asn1_pdu.pb.h"
+#include "common.h"
+#include "encoding_cache.h"
+#include "random_inputs.h"
+#include "test_checker.h"
+#include "x509_certificate.pb.h"
+#include "x509_certificate_to_der.h"
+
+namespace {
+
+using asn1_pdu::PDU;
+using random_inputs::RandomBytes;
+using random_inputs::SetRandomPDU;
+using x509_certificate::X509Certificate;
+
+constexpr size_t kNumCertificates = 128;
+// Every certificate is mutated, and encoded again, this many times.
+constexpr size_t kNumMutations = 20;
+
+// Returns a random PDU of the tree of |pdu|.
+PDU* RandomNode(std::mt19937& rng, PDU* pdu) {
+  while (rng() % 4 != 0) {
+    std::vector<PDU*> children;
+    for (asn1_pdu::ValueElement& element :
+         *pdu->mutable_val()->mutable_val_array()) {
+      if (element.has_pdu()) {
+        children.push_back(element.mutable_pdu());
+      }
+    }
+    if (children.empty()) {
+      break;
+    }
+    pdu = children[rng() % children.size()];
+  }
+  return pdu;
+}
+
+// Changes one field of |cert|: a field of a PDU nested in a name, or in the
+// PDU of a part of the certificate, or one of the other fields.
+void Mutate(std::mt19937& rng, X509Certificate* cert) {
+  x509_certificate::TBSCertificateSequence* tbs =
+      cert->mutable_tbs_certificate()->mutable_value();
+  PDU* name = rng() % 2 == 0 ? tbs->mutable_issuer()->mutable_value()
+                             : tbs->mutable_subject()->mutable_value();
+  if (cert->tbs_certificate().has_pdu() && rng() % 2 == 0) {
+    name = cert->mutable_tbs_certificate()->mutable_pdu();
+  }
+  PDU* node = RandomNode(rng, name);
+  switch (rng() % 8) {
+    case 0:
+      node->mutable_id()->mutable_tag_num()->set_low_tag_num(
+          static_cast<asn1_pdu::LowTagNumber>(rng() % 31));
+      break;
+    case 1:
+      node->mutable_id()->set_id_class(static_cast<asn1_pdu::Class>(rng() % 4));
+      break;
+    case 2:
+      if (node->len().has_indefinite_form()) {
+        node->mutable_len()->clear_indefinite_form();
+      } else {
+        node->mutable_len()->set_indefinite_form(true);
+      }
+      break;
+    case 3:
+      node->mutable_len()->set_length_override(RandomBytes(rng, rng() % 3));
+      break;
+    case 4:
+      node->mutable_val()->add_val_array()->set_val_bits(
+          RandomBytes(rng, rng() % 8));
+      break;
+    case 5:
+      node->Clear();
+      SetRandomPDU(rng, 3, node, /*length_overrides=*/true);
+      break;
+    case 6:
+      tbs->mutable_serial_number()->mutable_value()->set_val(
+          RandomBytes(rng, 1 + rng() % 20));
+      break;
+    default:
+      SetRandomPDU(rng, 4, cert->mutable_tbs_certificate()->mutable_pdu());
+      break;
+  }
+}
+
+// Returns the encoding of |cert| with a budget that discards encodings of
+// more than |max_size| bytes, which the cache is used with.
+std::vector<uint8_t> EncodeWithBudget(const X509Certificate& cert,
+                                      size_t max_size) {
+  DERWriter der;
+  EncodingBudget budget;
+  budget.max_size = max_size;
+  budget.policy = EncodingBudget::kEmpty;
+  der.set_budget(budget);
+  x509_certificate::X509CertificateToDER(cert, der);
+  return std::vector<uint8_t>(der.data(), der.data() + der.size());
+}
+
+// Encodes |cert| without and with |cache|, into a vector, into a buffer that
+// is too small, and with a budget that it fits and ones that it doesn't, and
+// compares the results.
+void CheckCache(const X509Certificate& cert,
+                EncodingCache* cache,
+                test_checker::Checker& checker) {
+  x509_certificate::SetEncodingCache(nullptr);
+  std::vector<uint8_t> expected = x509_certificate::X509CertificateToDER(cert);
+  std::vector<uint8_t> buffer(expected.size() / 2);
+  size_t expected_truncated_size = x509_certificate::X509CertificateToDER(
+      cert, buffer.data(), buffer.size());
+
+  x509_certificate::SetEncodingCache(cache);
+  bool ok = x509_certificate::X509CertificateToDER(cert) == expected &&
+            x509_certificate::X509CertificateToDER(
+                cert, buffer.data(), buffer.size()) == expected_truncated_size &&
+            EncodeWithBudget(cert, expected.size()) == expected &&
+            EncodeWithBudget(cert, expected.size() - 1).empty() &&
+            EncodeWithBudget(cert, expected.size() / 2).empty();
+  x509_certificate::SetEncodingCache(nullptr);
+  checker.Check();
+  if (!ok) {
+    checker.Mismatch("mismatch: %s", cert.ShortDebugString().c_str());
+  }
+}
+
+}  // namespace
+
+int main() {
+  EncodingCache default_cache;
+  EncodingCache small_cache(4);
+  test_checker::Checker checker("encodings");
+
+  std::mt19937 rng;
+  for (size_t i = 0; i < kNumCertificates; ++i) {
+    X509Certificate cert = random_inputs::RandomCertificate(rng);
+    if (i % 4 == 0) {
+      SetRandomPDU(rng, 4, cert.mutable_tbs_certificate()->mutable_pdu(),
+                   /*length_overrides=*/true);
+    }
+    for (size_t j = 0; j <= kNumMutations; ++j) {
+      CheckCache(cert, &default_cache, checker);
+      CheckCache(cert, &small_cache, checker);
+      Mutate(rng, &cert);
+    }
+  }
+
+  for (const EncodingCache* cache : {&default_cache, &small_cache}) {
+    EncodingCache::Stats stats = cache->stats();
+    checker.Tally("lookups", stats.lookups);
+    checker.Tally("hits", stats.hits);
+    checker.Tally("evictions", stats.evictions);
+    // Without hits, the encodings of the cache weren't checked.
+    checker.Expect(stats.hits != 0, "no hits in the %s cache",
+                   cache == &small_cache ? "small" : "default");
+  }
+  return checker.Finish();
+}
@@ -0,0 +1,233 @@
+// Copyright 2020 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include "flat_der_tree.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+#include "x509_certificate_to_der.h"
+
+void FlatDERTree::Clear() {
+  nodes_.clear();
+  tokens_.clear();
+  build_stack_.clear();
+  node_stack_.clear();
+  value_ends_.clear();
+  num_tiles_ = 0;
+}
+
+void FlatDERTree::BeginNode(uint8_t identifier,
+                            uint32_t tag_num,
+                            LengthForm length_form,
+                            const uint8_t* raw_length,
+                            size_t raw_length_len) {
+  uint32_t node = nodes_.size();
+  nodes_.push_back({tag_num, identifier, length_form,
+                    static_cast<uint32_t>(raw_length_len), raw_length,
+                    static_cast<uint32_t>(tokens_.size()), 0});
+  tokens_.push_back({Token::kBegin, node, nullptr});
+}
+
+void FlatDERTree::EndNode(uint32_t node) {
+  nodes_[node].end_token = tokens_.size();
+  tokens_.push_back({Token::kEnd, node, nullptr});
+}
+
+void FlatDERTree::AddBytes(const uint8_t* data, size_t size) {
+  if (size != 0) {
+    tokens_.push_back({Token::kBytes, static_cast<uint32_t>(size), data});
+  }
+}
+
+void FlatDERTree::AddRepeated(const asn1_pdu::RepeatedBytes& repeated) {
+  size_t count = asn1_pdu::GetRepeatCount(repeated);
+  if (count == 0) {
+    return;
+  }
+  const uint8_t* pattern =
+      reinterpret_cast<const uint8_t*>(repeated.pattern().data());
+  size_t pattern_len = repeated.pattern().size();
+  size_t repeats_per_tile = std::min(count, GetRepeatsPerTile(pattern_len));
+  const uint8_t* tile = pattern;
+  if (repeats_per_tile != 1) {
+    if (num_tiles_ == tiles_.size()) {
+      tiles_.emplace_back(new uint8_t[kRepeatTileSize]);
+    }
+    uint8_t* new_tile = tiles_[num_tiles_++].get();
+    WriteRepeated(pattern, pattern_len, repeats_per_tile, new_tile);
+    tile = new_tile;
+  }
+  for (size_t i = count / repeats_per_tile; i != 0; --i) {
+    AddBytes(tile, repeats_per_tile * pattern_len);
+  }
+  AddBytes(tile, count % repeats_per_tile * pattern_len);
+}
+
+void FlatDERTree::Build(const asn1_pdu::PDU& pdu, size_t depth_limit) {
+  Clear();
+  if (depth_limit == 0) {
+    return;
+  }
+  // Walks the PDUs like |ASN1PDUToDER|, but first to last, which is the order
+  // of the tokens.
+  const asn1_pdu::PDU* next = &pdu;
+  while (true) {
+    if (next) {
+      const asn1_pdu::Length& len = next->len();
+      if (len.has_length_override()) {
+        BeginNode(asn1_pdu::GetFirstIdentifierByte(next->id()),
+                  asn1_pdu::GetTagNum(next->id()), kRawLength,
+                  reinterpret_cast<const uint8_t*>(
+                      len.length_override().data()),
+                  len.length_override().size());
+      } else {
+        BeginNode(asn1_pdu::GetFirstIdentifierByte(next->id()),
+                  asn1_pdu::GetTagNum(next->id()),
+                  asn1_pdu::HasIndefiniteLength(len) ? kIndefinite
+                                                     : kDefinite,
+                  nullptr, 0);
+      }
+      build_stack_.push_back(
+          {next, static_cast<uint32_t>(nodes_.size() - 1), 0});
+      next = nullptr;
+    }
+    if (build_stack_.empty()) {
+      break;
+    }
+
+    BuildFrame& frame = build_stack_.back();
+    if (frame.next_element == frame.pdu->val().val_array_size()) {
+      EndNode(frame.node);
+      build_stack_.pop_back();
+      continue;
+    }
+    const auto& val_ele = frame.pdu->val().val_array(frame.next_element++);
+    if (!val_ele.has_pdu()) {
+      AddBytes(reinterpret_cast<const uint8_t*>(val_ele.val_bits().data()),
+               val_ele.val_bits().size());
+      if (val_ele.has_repeated_bits()) {
+        AddRepeated(val_ele.repeated_bits());
+      }
+    } else if (build_stack_.size() < depth_limit) {
+      next = &val_ele.pdu();
+    }
+  }
+}
+
+void FlatDERTree::Build(const x509_certificate::X509Certificate& certificate) {
+  Clear();
+  // The X.509 encoders compute most values, such as times and object
+  // identifiers, so the values are taken from the encoding, which the TLV
+  // index splits into nodes.
+  storage_.set_tlv_index(&storage_index_);
+  x509_certificate::X509CertificateToDER(certificate, storage_);
+  storage_index_.Finish(storage_.size());
+  const uint8_t* der = storage_.data();
+
+  // The bytes up to |pos| have tokens. |value_ends_| holds the ends of the
+  // values of the nodes on |node_stack_|.
+  size_t pos = 0;
+  for (const TLV& tlv : storage_index_.tlvs()) {
+    while (!node_stack_.empty() && value_ends_.back() <= tlv.offset) {
+      AddBytes(der + pos, value_ends_.back() - pos);
+      pos = value_ends_.back();
+      EndNode(node_stack_.back());
+      node_stack_.pop_back();
+      value_ends_.pop_back();
+    }
+    AddBytes(der + pos, tlv.offset - pos);
+
+    // The encoders only write tag numbers from 31 in the high-tag-number
+    // form, without leading zeros.
+    size_t identifier_len = (tlv.identifier & 0x1F) == 0x1F
+                                ? 1 + GetVariableIntLen(tlv.tag_num, 128)
+                                : 1;
+    const uint8_t* length = der + tlv.offset + identifier_len;
+    size_t length_len = tlv.header_len - identifier_len;
+    // Lengths other than the definite-form length of the value, such as
+    // length overrides and indefinite lengths, are kept as they are, and so
+    // are the EOC markers of the values.
+    uint8_t definite_length[1 + sizeof(size_t)];
+    WriteDefiniteLength(tlv.value_len, definite_length);
+    bool definite = length_len == GetDefiniteLengthLen(tlv.value_len) &&
+                    memcmp(length, definite_length, length_len) == 0;
+    BeginNode(tlv.identifier, tlv.tag_num,
+              definite ? kDefinite : kRawLength, length, length_len);
+    node_stack_.push_back(nodes_.size() - 1);
+    pos = tlv.offset + tlv.header_len;
+    value_ends_.push_back(pos + tlv.value_len);
+  }
+  while (!node_stack_.empty()) {
+    AddBytes(der + pos, value_ends_.back() - pos);
+    pos = value_ends_.back();
+    EndNode(node_stack_.back());
+    node_stack_.pop_back();
+    value_ends_.pop_back();
+  }
+  AddBytes(der + pos, storage_.size() - pos);
+}
+
+void FlatDERTree::Encode(DERWriter& der) {
+  // DER is written back to front, so the tokens are too: the end token of a
+  // node starts its value, and the begin token writes its length and
+  // identifier in front of it.
+  value_ends_.clear();
+  for (size_t i = tokens_.size(); i-- != 0;) {
+    const Token& token = tokens_[i];
+    switch (token.kind) {
+      case Token::kBytes:
+        der.PrependReference(token.data, token.node_or_size);
+        break;
+      case Token::kEnd:
+        if (nodes_[token.node_or_size].length_form == kIndefinite) {
+          // The EOC marker after the value.
+          der.Prepend(0x00);
+          der.Prepend(0x00);
+        }
+        value_ends_.push_back(der.size());
+        break;
+      case Token::kBegin: {
+        const Node& node = nodes_[token.node_or_size];
+        size_t value_start = der.size();
+        size_t value_len = value_start - value_ends_.back();
+        value_ends_.pop_back();
+        switch (node.length_form) {
+          case kDefinite:
+            der.PrependDefiniteLength(value_len);
+            break;
+          case kIndefinite:
+            der.Prepend(0x80);
+            break;
+          case kRawLength:
+            der.Prepend(node.raw_length, node.raw_length_len);
+            break;
+        }
+        if ((node.identifier & 0x1F) == 0x1F) {
+          der.PrependVariableIntBase128(node.tag_num);
+        }
+        der.Prepend(node.identifier);
+        if (TLVIndex* index = der.tlv_index()) {
+          size_t eoc_len = node.length_form == kIndefinite ? 2 : 0;
+          index->Add(der.size(), der.size() - value_start, value_len + eoc_len,
+                     node.identifier, node.tag_num);
+        }
+        break;
+      }
+    }
+  }
+}
@@ -0,0 +1,143 @@
+// Copyright 2020 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef PROTO_ASN1_PDU_FLAT_DER_TREE_H_
+#define PROTO_ASN1_PDU_FLAT_DER_TREE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <memory>
+#include <vector>
+
+#include "asn1_pdu.pb.h"
+#include "asn1_pdu_to_der.h"
+#include "common.h"
+#include "x509_certificate.pb.h"
+
+// A tree of TLVs to encode, in flat arrays: a node per TLV, and the tokens of
+// the values of all nodes in the order they are encoded, where the value of a
+// node is the tokens between its begin and end tokens. Primitive values are
+// tokens that point to bytes owned by the input the tree was built from, or
+// for repeated patterns, to a tile of repetitions owned by the tree.
+// Building the tree walks the protobuf once, and encoding it is a single loop
+// over the tokens, without the pointer chasing of the protobuf accessors, so
+// a tree pays off when it is encoded more than once.
+// A |FlatDERTree| must not be used by more than one thread at a time.
+class FlatDERTree {
+ public:
+  // How the length of a node is encoded.
+  enum LengthForm : uint8_t {
+    // The definite-form length of the value (X.690 (2015), 8.1.3.3-8.1.3.5).
+    kDefinite,
+    // The indefinite-length indicator, with an EOC marker after the value
+    // (X.690 (2015), 8.1.3.6).
+    kIndefinite,
+    // The bytes at |raw_length|, regardless of the value.
+    kRawLength,
+  };
+
+  struct Node {
+    uint32_t tag_num;
+    // The first byte of the identifier, which holds the class and whether the
+    // encoding is constructed (X.690 (2015), 8.1.2).
+    uint8_t identifier;
+    LengthForm length_form;
+    uint32_t raw_length_len;
+    const uint8_t* raw_length;
+    // The indices of the begin and end tokens of the node.
+    uint32_t begin_token;
+    uint32_t end_token;
+  };
+
+  struct Token {
+    enum Kind : uint8_t {
+      kBytes,
+      kBegin,
+      kEnd,
+    };
+    Kind kind;
+    // The node that begins or ends, or the size of the bytes.
+    uint32_t node_or_size;
+    const uint8_t* data;
+  };
+
+  FlatDERTree() = default;
+  FlatDERTree(const FlatDERTree&) = delete;
+  FlatDERTree& operator=(const FlatDERTree&) = delete;
+
+  // Replaces the tree with one that encodes like |ASN1PDUToDER| with
+  // |depth_limit|. The tree points to the bytes of |pdu|, which must outlive
+  // it and not change.
+  void Build(const asn1_pdu::PDU& pdu,
+             size_t depth_limit = asn1_pdu::ASN1PDUToDER::kDefaultDepthLimit);
+
+  // Replaces the tree with one that encodes like |X509CertificateToDER|. The
+  // certificate is encoded once, with a |TLVIndex|, into memory of the tree,
+  // which the tree points to.
+  void Build(const x509_certificate::X509Certificate& certificate);
+
+  // Encodes the tree to DER in front of the bytes already written to |der|.
+  // Records the TLVs in the |TLVIndex| of |der|, if it has one. If |der|
+  // references values, it references the bytes the tree points to.
+  void Encode(DERWriter& der);
+
+  const std::vector<Node>& nodes() const { return nodes_; }
+  const std::vector<Token>& tokens() const { return tokens_; }
+
+ private:
+  // Adds a node, and its begin token.
+  void BeginNode(uint8_t identifier,
+                 uint32_t tag_num,
+                 LengthForm length_form,
+                 const uint8_t* raw_length,
+                 size_t raw_length_len);
+
+  // Adds the end token of |node|.
+  void EndNode(uint32_t node);
+
+  void AddBytes(const uint8_t* data, size_t size);
+
+  // Adds the repetitions of |repeated|, as tokens that point to a tile of as
+  // many repetitions as fit in |kRepeatTileSize| bytes.
+  void AddRepeated(const asn1_pdu::RepeatedBytes& repeated);
+
+  void Clear();
+
+  std::vector<Node> nodes_;
+  std::vector<Token> tokens_;
+
+  // The encoding of a certificate that the tree points to.
+  DERWriter storage_;
+  TLVIndex storage_index_;
+
+  // The tiles of |AddRepeated|, of which the first |num_tiles_| are in use.
+  std::vector<std::unique_ptr<uint8_t[]>> tiles_;
+  size_t num_tiles_ = 0;
+
+  // Scratch memory, kept between calls: the PDUs being built, or the ends of
+  // the values being encoded.
+  struct BuildFrame {
+    const asn1_pdu::PDU* pdu;
+    uint32_t node;
+    int next_element;
+  };
+  std::vector<BuildFrame> build_stack_;
+  std::vector<uint32_t> node_stack_;
+  std::vector<size_t> value_ends_;
+};
+
+#endif  // PROTO_ASN1_PDU_FLAT_DER_TREE_H_
@@ -0,0 +1,173 @@
+// Copyright 2020 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+// Checks that a |FlatDERTree| built from a PDU or a certificate encodes to the
+// same bytes, with the same |TLVIndex|, as |ASN1PDUToDER| and
+// |X509CertificateToDER|: for random PDUs with length overrides, indefinite
+// lengths, high tag numbers and repeated values, deeply nested PDUs, PDUs
+// beyond a depth limit, and random certificates.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <random>
+#include <string>
+#include <vector>
+
+#include "asn1_pdu.pb.h"
+#include "asn1_pdu_to_der.h"
+#include "common.h"
+#include "flat_der_tree.h"
+#include "random_inputs.h"
+#include "test_checker.h"
+#include "x509_certificate.pb.h"
+#include "x509_certificate_to_der.h"
+
+namespace {
+
+using asn1_pdu::PDU;
+
+constexpr size_t kNumInputs = 512;
+// The depth of the deeply nested PDUs, which is more than a recursive walk
+// would get through on a small stack.
+constexpr size_t kDeepPDUDepth = 5000;
+
+// Adds repeated patterns to some of the values of |pdu| and the PDUs nested in
+// it.
+void AddRepeats(std::mt19937& rng, PDU* pdu) {
+  for (asn1_pdu::ValueElement& element :
+       *pdu->mutable_val()->mutable_val_array()) {
+    if (element.has_pdu()) {
+      AddRepeats(rng, element.mutable_pdu());
+    } else if (rng() % 4 == 0) {
+      asn1_pdu::RepeatedBytes* repeated = element.mutable_repeated_bits();
+      repeated->set_pattern(random_inputs::RandomBytes(rng, rng() % 8));
+      repeated->set_count(rng() % 5000);
+    }
+  }
+}
+
+bool Equals(const TLV& a, const TLV& b) {
+  return a.offset == b.offset && a.header_len == b.header_len &&
+         a.value_len == b.value_len && a.depth == b.depth &&
+         a.tag_num == b.tag_num && a.identifier == b.identifier;
+}
+
+bool Equals(const DERWriter& a, const DERWriter& b) {
+  return a.size() == b.size() && memcmp(a.data(), b.data(), a.size()) == 0;
+}
+
+bool Equals(const TLVIndex& a, const TLVIndex& b) {
+  if (a.tlvs().size() != b.tlvs().size()) {
+    return false;
+  }
+  for (size_t i = 0; i < a.tlvs().size(); ++i) {
+    if (!Equals(a.tlvs()[i], b.tlvs()[i])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Encodes |input| with |encode|, a callable taking the input and a
+// |DERWriter&|, and as a tree built from it by |build|, a callable taking the
+// input and a |FlatDERTree&|, and compares the encodings and their indexes.
+// The tree is encoded twice, to check that encoding doesn't change it.
+template <typename Input, typename EncodeFn, typename BuildFn>
+void CheckTree(const Input& input,
+               EncodeFn encode,
+               BuildFn build,
+               test_checker::Checker& checker) {
+  DERWriter expected;
+  TLVIndex expected_index;
+  expected.set_tlv_index(&expected_index);
+  encode(input, expected);
+  expected_index.Finish(expected.size());
+
+  FlatDERTree tree;
+  build(input, tree);
+  checker.Check();
+  for (int i = 0; i < 2; ++i) {
+    DERWriter actual;
+    TLVIndex actual_index;
+    actual.set_tlv_index(&actual_index);
+    tree.Encode(actual);
+    actual_index.Finish(actual.size());
+    if (!Equals(expected, actual)) {
+      checker.Mismatch("encoding mismatch: %zu bytes expected, %zu encoded",
+                       expected.size(), actual.size());
+    } else if (!Equals(expected_index, actual_index)) {
+      checker.Mismatch("index mismatch: %zu TLVs expected, %zu indexed",
+                       expected_index.tlvs().size(),
+                       actual_index.tlvs().size());
+    }
+  }
+}
+
+}  // namespace
+
+int main() {
+  std::mt19937 rng;
+  test_checker::Checker checker("inputs");
+  asn1_pdu::ASN1PDUToDER limited_encoder(3);
+  auto encode_pdu = [](const PDU& pdu, DERWriter& der) {
+    asn1_pdu::EncodePDU(pdu, der);
+  };
+  auto build_pdu = [](const PDU& pdu, FlatDERTree& tree) { tree.Build(pdu); };
+  auto encode_limited = [&limited_encoder](const PDU& pdu, DERWriter& der) {
+    limited_encoder.Encode(pdu, der);
+  };
+  auto build_limited = [](const PDU& pdu, FlatDERTree& tree) {
+    tree.Build(pdu, 3);
+  };
+  auto encode_cert = [](const x509_certificate::X509Certificate& cert,
+                        DERWriter& der) {
+    x509_certificate::Encode(cert, der);
+  };
+  auto build_cert = [](const x509_certificate::X509Certificate& cert,
+                       FlatDERTree& tree) { tree.Build(cert); };
+
+  PDU pdu;
+  for (size_t i = 0; i < kNumInputs; ++i) {
+    pdu.Clear();
+    random_inputs::SetRandomPDU(rng, 1 + i % 8, &pdu,
+                                /*length_overrides=*/i % 2 == 0);
+    if (i % 4 == 0) {
+      AddRepeats(rng, &pdu);
+    }
+    CheckTree(pdu, encode_pdu, build_pdu, checker);
+    CheckTree(pdu, encode_limited, build_limited, checker);
+    CheckTree(random_inputs::RandomCertificate(rng), encode_cert, build_cert,
+              checker);
+  }
+
+  // A chain of constructed PDUs, with a value at the bottom.
+  pdu.Clear();
+  PDU* current = &pdu;
+  for (size_t depth = 1; depth < kDeepPDUDepth; ++depth) {
+    current->mutable_id()->set_encoding(asn1_pdu::Constructed);
+    current->mutable_len()->set_indefinite_form(depth % 3 == 0);
+    asn1_pdu::ValueElement* element = current->mutable_val()->add_val_array();
+    element->set_val_bits(std::string());
+    current = element->mutable_pdu();
+  }
+  current->mutable_val()->add_val_array()->set_val_bits("leaf");
+  CheckTree(pdu, encode_pdu, build_pdu, checker);
+  CheckTree(pdu, encode_limited, build_limited, checker);
+
+  return checker.Finish();
+}
@@ -0,0 +1,231 @@
+// Copyright 2020 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include "incremental_pdu_to_der.h"
+
+#include <limits.h>
+#include <string.h>
+
+namespace asn1_pdu {
+
+constexpr uint32_t IncrementalPDUToDER::kNoNode;
+
+IncrementalPDUToDER::IncrementalPDUToDER(size_t depth_limit)
+    : depth_limit_(depth_limit) {}
+
+void IncrementalPDUToDER::PDUToDER(const PDU& pdu) {
+  der_.clear();
+  nodes_.clear();
+  elements_.clear();
+  root_ = kNoNode;
+  if (depth_limit_ == 0) {
+    return;
+  }
+  root_ = EncodeSubtree(pdu, kNoNode, 1);
+  nodes_[root_].offset = 0;
+  der_.assign(scratch_.data(), scratch_.data() + scratch_.size());
+}
+
+bool IncrementalPDUToDER::Update(const PDU& pdu,
+                                 const size_t* path,
+                                 size_t path_len) {
+  if (root_ == kNoNode) {
+    PDUToDER(pdu);
+    return false;
+  }
+
+  // Finds the node of the changed PDU, and where it is encoded.
+  ancestors_.clear();
+  const PDU* changed = &pdu;
+  uint32_t node = root_;
+  size_t offset = 0;
+  for (size_t i = 0; i < path_len; ++i) {
+    const Node& current = nodes_[node];
+    size_t element = path[i];
+    if (element >= current.num_elements ||
+        elements_[current.first_element + element] == kNoNode ||
+        !changed->val().val_array(element).has_pdu()) {
+      PDUToDER(pdu);
+      return false;
+    }
+    ancestors_.push_back({node, element, offset});
+    node = elements_[current.first_element + element];
+    offset += current.identifier_size + current.length_size +
+              nodes_[node].offset;
+    changed = &changed->val().val_array(element).pdu();
+  }
+
+  // Encodes the changed PDU, and replaces its bytes and its node.
+  const Node old_node = nodes_[node];
+  uint32_t new_node = EncodeSubtree(*changed, old_node.parent, path_len + 1);
+  nodes_[new_node].offset = old_node.offset;
+  Splice(offset, EncodedSize(old_node), scratch_.data(), scratch_.size());
+  if (ancestors_.empty()) {
+    root_ = new_node;
+  } else {
+    const Ancestor& parent = ancestors_.back();
+    elements_[nodes_[parent.node].first_element + parent.element] = new_node;
+  }
+
+  // Moves the PDUs after the changed one, and patches the lengths around it,
+  // innermost first. Lengths before the changed PDU are patched last, so the
+  // offsets of the ancestors that are still to be patched don't change.
+  ptrdiff_t size_change = static_cast<ptrdiff_t>(scratch_.size()) -
+                          static_cast<ptrdiff_t>(EncodedSize(old_node));
+  ptrdiff_t num_nodes_change =
+      static_cast<ptrdiff_t>(nodes_[new_node].num_nodes) -
+      static_cast<ptrdiff_t>(old_node.num_nodes);
+  for (auto it = ancestors_.rbegin(); it != ancestors_.rend(); ++it) {
+    Node& ancestor = nodes_[it->node];
+    ancestor.num_nodes += num_nodes_change;
+    if (size_change == 0) {
+      continue;
+    }
+    for (size_t i = it->element + 1; i < ancestor.num_elements; ++i) {
+      uint32_t sibling = elements_[ancestor.first_element + i];
+      if (sibling != kNoNode) {
+        nodes_[sibling].offset += size_change;
+      }
+    }
+    ancestor.value_size += size_change;
+    if (!ancestor.definite_length) {
+      // Length overrides and indefinite lengths don't depend on the value.
+      continue;
+    }
+    size_t length_pos = it->offset + ancestor.identifier_size;
+    uint32_t length_size = GetDefiniteLengthLen(ancestor.value_size);
+    if (length_size == ancestor.length_size) {
+      WriteDefiniteLength(ancestor.value_size, der_.data() + length_pos);
+      continue;
+    }
+    uint8_t length[GetDefiniteLengthLen(SIZE_MAX)];
+    WriteDefiniteLength(ancestor.value_size, length);
+    Splice(length_pos, ancestor.length_size, length, length_size);
+    size_change += static_cast<ptrdiff_t>(length_size) -
+                   static_cast<ptrdiff_t>(ancestor.length_size);
+    ancestor.length_size = length_size;
+  }
+
+  // Nodes of replaced PDUs are only reclaimed by encoding everything again,
+  // which takes as long as the updates that replaced as many nodes.
+  if (nodes_.size() > 4 * nodes_[root_].num_nodes + 1024) {
+    PDUToDER(pdu);
+  }
+  return true;
+}
+
+uint32_t IncrementalPDUToDER::EncodeSubtree(const PDU& pdu,
+                                            uint32_t parent,
+                                            size_t depth) {
+  scratch_.Clear();
+  stack_.clear();
+  uint32_t first_node = nodes_.size();
+  BeginPDU(pdu, parent);
+  while (!stack_.empty()) {
+    Frame& frame = stack_.back();
+    if (frame.num_elements_left == 0) {
+      EndPDU();
+      continue;
+    }
+    int element = --frame.num_elements_left;
+    const auto& val_ele = frame.pdu->val().val_array(element);
+    if (!val_ele.has_pdu()) {
+      PrependValueBits(val_ele, scratch_);
+    } else if (depth - 1 + stack_.size() < depth_limit_) {
+      // |frame| is invalidated by pushing the next one.
+      uint32_t frame_node = frame.node;
+      elements_[nodes_[frame_node].first_element + element] = nodes_.size();
+      BeginPDU(val_ele.pdu(), frame_node);
+    }
+  }
+
+  // Converts the offsets from the end of |scratch_|, which |EndPDU| left in
+  // the nodes, to offsets from the start of the value of the parent. Nodes are
+  // added before the nodes of the PDUs nested in them, so every parent is
+  // converted after its children.
+  for (uint32_t i = nodes_.size() - 1; i > first_node; --i) {
+    Node& current = nodes_[i];
+    const Node& parent_node = nodes_[current.parent];
+    current.offset = parent_node.offset - current.offset -
+                     parent_node.identifier_size - parent_node.length_size;
+  }
+  return first_node;
+}
+
+void IncrementalPDUToDER::BeginPDU(const PDU& pdu, uint32_t parent) {
+  Node node;
+  node.offset = 0;
+  node.value_size = 0;
+  node.num_nodes = 1;
+  node.parent = parent;
+  node.first_element = elements_.size();
+  node.num_elements = pdu.val().val_array_size();
+  node.identifier_size = 0;
+  node.length_size = 0;
+  node.definite_length = false;
+  elements_.resize(elements_.size() + node.num_elements, kNoNode);
+
+  size_t end_pos = scratch_.size();
+  if (HasIndefiniteLength(pdu.len())) {
+    // The PDU's value ends with an EOC marker, so write it before the value.
+    scratch_.Prepend(0x00);
+    scratch_.Prepend(0x00);
+  }
+  stack_.push_back({&pdu, static_cast<uint32_t>(nodes_.size()),
+                    pdu.val().val_array_size(), end_pos});
+  nodes_.push_back(node);
+}
+
+void IncrementalPDUToDER::EndPDU() {
+  const Frame frame = stack_.back();
+  stack_.pop_back();
+  Node& node = nodes_[frame.node];
+  const Length& len = frame.pdu->len();
+
+  size_t value_pos = scratch_.size();
+  node.value_size = value_pos - frame.end_pos;
+  // The EOC marker of an indefinite length is not part of the value for the
+  // length, but that length doesn't depend on it.
+  PrependLength(len, node.value_size, scratch_);
+  size_t length_pos = scratch_.size();
+  PrependIdentifier(frame.pdu->id(), scratch_);
+  node.length_size = length_pos - value_pos;
+  node.identifier_size = scratch_.size() - length_pos;
+  node.definite_length =
+      !len.has_length_override() && !HasIndefiniteLength(len);
+  // The offset from the end of |scratch_| for now (see |EncodeSubtree|).
+  node.offset = scratch_.size();
+
+  if (!stack_.empty()) {
+    nodes_[stack_.back().node].num_nodes += node.num_nodes;
+  }
+}
+
+void IncrementalPDUToDER::Splice(size_t pos,
+                                 size_t old_size,
+                                 const uint8_t* bytes,
+                                 size_t new_size) {
+  if (new_size > old_size) {
+    der_.insert(der_.begin() + pos + old_size, new_size - old_size, 0);
+  } else if (new_size < old_size) {
+    der_.erase(der_.begin() + pos + new_size, der_.begin() + pos + old_size);
+  }
+  if (new_size != 0) {
+    memcpy(der_.data() + pos, bytes, new_size);
+  }
+}
+
+}  // namespace asn1_pdu
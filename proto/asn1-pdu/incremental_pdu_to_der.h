@@ -0,0 +1,155 @@
+// Copyright 2020 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef PROTO_ASN1_PDU_INCREMENTAL_PDU_TO_DER_H_
+#define PROTO_ASN1_PDU_INCREMENTAL_PDU_TO_DER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include "asn1_pdu.pb.h"
+#include "asn1_pdu_to_der.h"
+#include "common.h"
+
+namespace asn1_pdu {
+
+// Encodes a PDU to DER like |ASN1PDUToDER|, and keeps the encoding and where
+// each nested PDU was encoded in it, so that after a change to one nested PDU,
+// only that PDU has to be encoded again. Its bytes are replaced in the
+// encoding, and the lengths of the PDUs around it are patched in place; the
+// bytes after a length only have to be shifted when the number of bytes of the
+// length changes. This suits mutators that change one PDU of an input at a
+// time, and encode it after every change.
+// An |IncrementalPDUToDER| must not be used by more than one thread at a time.
+class IncrementalPDUToDER {
+ public:
+  // PDUs nested more than |depth_limit| deep are left out, like by
+  // |ASN1PDUToDER|.
+  explicit IncrementalPDUToDER(
+      size_t depth_limit = ASN1PDUToDER::kDefaultDepthLimit);
+
+  IncrementalPDUToDER(const IncrementalPDUToDER&) = delete;
+  IncrementalPDUToDER& operator=(const IncrementalPDUToDER&) = delete;
+
+  // Encodes all of |pdu| to DER, replacing the encoding.
+  void PDUToDER(const PDU& pdu);
+
+  // Updates the encoding of |pdu|, which was encoded by the last call, after
+  // the PDU at |path| changed, and nothing else: the first |path_len| indices
+  // at |path| select an element of the value of |pdu|, then of the PDU of that
+  // element, and so on. The PDU at |path| may have changed in any way, along
+  // with the PDUs nested in it; an empty |path| selects |pdu| itself.
+  // Returns false if |path| doesn't select an encoded PDU, because an element
+  // doesn't exist, holds bytes instead of a PDU, or is nested deeper than the
+  // depth limit. In that case, all of |pdu| is encoded again.
+  bool Update(const PDU& pdu, const size_t* path, size_t path_len);
+
+  const uint8_t* data() const { return der_.data(); }
+  size_t size() const { return der_.size(); }
+
+ private:
+  // Marks an element of a value that holds bytes, or a PDU that was left out.
+  static constexpr uint32_t kNoNode = UINT32_MAX;
+
+  // Where a PDU was encoded. |der_| holds its identifier, length and value,
+  // back to back.
+  struct Node {
+    // The offset of the identifier from the start of the value of the parent,
+    // or from the start of |der_| for the outermost PDU. Relative offsets
+    // only change for the PDUs after a changed PDU in the same value.
+    size_t offset;
+    // The size of the value, including the EOC marker of an indefinite
+    // length.
+    size_t value_size;
+    // The number of PDUs encoded in this one, including itself.
+    size_t num_nodes;
+    uint32_t parent;
+    // The elements of the value are |elements_[first_element, first_element +
+    // num_elements)|, each of which is the index of the node of its PDU, or
+    // |kNoNode|.
+    uint32_t first_element;
+    uint32_t num_elements;
+    // A length override can be longer than any definite-form length.
+    uint32_t length_size;
+    uint8_t identifier_size;
+    // Whether the length is the definite-form length of the value, which has
+    // to be patched when the value changes.
+    bool definite_length;
+  };
+
+  // A PDU whose encoding is written to |scratch_|.
+  struct Frame {
+    const PDU* pdu;
+    uint32_t node;
+    // The number of elements of the value that are left to encode.
+    int num_elements_left;
+    // The size of |scratch_| before the value was encoded.
+    size_t end_pos;
+  };
+
+  // An ancestor of the PDU being updated, and where it is encoded.
+  struct Ancestor {
+    uint32_t node;
+    // The element of its value that holds the next PDU on the path.
+    size_t element;
+    size_t offset;
+  };
+
+  size_t EncodedSize(const Node& node) const {
+    return node.identifier_size + node.length_size + node.value_size;
+  }
+
+  // Encodes |pdu| into |scratch_|, where it is nested |depth| deep, and adds
+  // nodes for it and the PDUs nested in it. Returns the index of its node,
+  // whose offset is left for the caller to set.
+  uint32_t EncodeSubtree(const PDU& pdu, uint32_t parent, size_t depth);
+
+  // Pushes a frame and adds a node for |pdu| to encode its value next.
+  void BeginPDU(const PDU& pdu, uint32_t parent);
+
+  // Encodes the length and identifier of the PDU of the frame on top of
+  // |stack_|, whose value has been encoded, and pops the frame.
+  void EndPDU();
+
+  // Replaces the |old_size| bytes at |pos| of |der_| with the |new_size| bytes
+  // at |bytes|, shifting the bytes after them.
+  void Splice(size_t pos,
+              size_t old_size,
+              const uint8_t* bytes,
+              size_t new_size);
+
+  const size_t depth_limit_;
+
+  std::vector<uint8_t> der_;
+
+  // The nodes of the encoded PDUs, and of PDUs that were replaced, which are
+  // only removed by encoding all of the PDU again, once they outnumber the
+  // others.
+  std::vector<Node> nodes_;
+  std::vector<uint32_t> elements_;
+  uint32_t root_ = kNoNode;
+
+  // Scratch memory, kept between calls.
+  DERWriter scratch_;
+  std::vector<Frame> stack_;
+  std::vector<Ancestor> ancestors_;
+};
+
+}  // namespace asn1_pdu
+
+#endif  // PROTO_ASN1_PDU_INCREMENTAL_PDU_TO_DER_H_
@@ -0,0 +1,235 @@
+// Copyright 2020 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+// Checks that |IncrementalPDUToDER::Update| leaves the same bytes as encoding
+// the whole PDU with |ASN1PDUToDER|, after random changes to one nested PDU at
+// a time. Values are resized so that the lengths of the PDUs around them cross
+// the sizes where their long form takes another byte, both ways, and lengths
+// are overridden, made indefinite, and changed on paths that go past the depth
+// limit.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <random>
+#include <string>
+#include <vector>
+
+#include "asn1_pdu.pb.h"
+#include "asn1_pdu_to_der.h"
+#include "incremental_pdu_to_der.h"
+#include "random_inputs.h"
+#include "test_checker.h"
+
+namespace {
+
+using asn1_pdu::PDU;
+using random_inputs::RandomBytes;
+using random_inputs::SetRandomPDU;
+
+constexpr size_t kNumPDUs = 48;
+constexpr size_t kNumUpdates = 64;
+
+// The sizes of values around which a definite length takes another byte
+// (X.690 (2015), 8.1.3.5).
+constexpr size_t kLengthBoundaries[] = {127, 128, 255, 256, 65535, 65536};
+
+// Returns the size of the encoding of the value of |pdu|, without the EOC
+// marker of an indefinite length.
+size_t ValueSize(const PDU& pdu) {
+  size_t size = 0;
+  for (const asn1_pdu::ValueElement& element : pdu.val().val_array()) {
+    size += element.has_pdu() ? asn1_pdu::PDUToDER(element.pdu()).size()
+                              : asn1_pdu::GetValueBitsLen(element);
+  }
+  return size;
+}
+
+// Returns the first element of the value of |pdu| that holds bytes, adding one
+// if there is none.
+asn1_pdu::ValueElement* BytesElement(PDU* pdu) {
+  for (asn1_pdu::ValueElement& element :
+       *pdu->mutable_val()->mutable_val_array()) {
+    if (!element.has_pdu()) {
+      return &element;
+    }
+  }
+  asn1_pdu::ValueElement* element = pdu->mutable_val()->add_val_array();
+  element->set_val_bits(std::string());
+  return element;
+}
+
+// Resizes the bytes of |pdu| so that the value of |target|, which is |pdu| or
+// a PDU around it, is |size| bytes, if it can be. Returns whether it is.
+bool ResizeValue(const PDU& target, size_t size, PDU* pdu) {
+  asn1_pdu::ValueElement* element = BytesElement(pdu);
+  // Changing the bytes can change lengths between them and |target|, so the
+  // size is adjusted until it is right.
+  for (int i = 0; i < 4; ++i) {
+    size_t value_size = ValueSize(target);
+    size_t bytes_size = element->val_bits().size();
+    if (value_size == size) {
+      return true;
+    }
+    if (bytes_size + size < value_size) {
+      return false;
+    }
+    element->mutable_val_bits()->resize(bytes_size + size - value_size, 'v');
+  }
+  return false;
+}
+
+// Changes the PDU at the end of |nodes|, the PDUs on the path to it from the
+// outermost one, in one of the ways a mutator would. Returns whether the value
+// of one of |nodes| was resized to the size of a length boundary.
+bool Mutate(std::mt19937& rng, const std::vector<PDU*>& nodes) {
+  PDU* pdu = nodes.back();
+  switch (rng() % 8) {
+    case 0:
+    case 1:
+    case 2: {
+      // Makes the value of the PDU, or of one around it, cross a boundary,
+      // either way.
+      const PDU& target = *nodes[rng() % nodes.size()];
+      size_t boundary = kLengthBoundaries[rng() % 6];
+      return ResizeValue(target, boundary - 1 + rng() % 3, pdu);
+    }
+    case 3:
+      pdu->mutable_len()->set_length_override(RandomBytes(rng, rng() % 4));
+      break;
+    case 4:
+      if (pdu->len().has_indefinite_form()) {
+        pdu->mutable_len()->clear_indefinite_form();
+      } else {
+        pdu->mutable_len()->set_indefinite_form(true);
+      }
+      break;
+    case 5:
+      // Changes the size of the identifier.
+      if (pdu->id().tag_num().has_high_tag_num()) {
+        pdu->mutable_id()->mutable_tag_num()->clear_high_tag_num();
+      } else {
+        pdu->mutable_id()->mutable_tag_num()->set_high_tag_num(31 +
+                                                               rng() % 100000);
+      }
+      break;
+    case 6:
+      if (pdu->val().val_array_size() != 0) {
+        pdu->mutable_val()->mutable_val_array()->RemoveLast();
+        break;
+      }
+      BytesElement(pdu)->set_val_bits(RandomBytes(rng, rng() % 200));
+      break;
+    default:
+      pdu->Clear();
+      SetRandomPDU(rng, 1 + rng() % 4, pdu, /*length_overrides=*/true);
+      break;
+  }
+  return false;
+}
+
+// Returns |path| and |depth_limit|, to report mismatches.
+std::string Describe(const std::vector<size_t>& path, size_t depth_limit) {
+  std::string description = "depth limit " + std::to_string(depth_limit);
+  description += ", path";
+  for (size_t element : path) {
+    description += " " + std::to_string(element);
+  }
+  return description;
+}
+
+// Checks that |incremental| encodes |pdu| like |encoder|.
+void Compare(const asn1_pdu::IncrementalPDUToDER& incremental,
+             asn1_pdu::ASN1PDUToDER& encoder,
+             const PDU& pdu,
+             const std::vector<size_t>& path,
+             size_t depth_limit,
+             test_checker::Checker& checker) {
+  static DERWriter expected;
+  encoder.PDUToDER(pdu, expected);
+  checker.Check();
+  if (incremental.size() != expected.size() ||
+      memcmp(incremental.data(), expected.data(), expected.size()) != 0) {
+    checker.Mismatch("encoding mismatch: %s",
+                     Describe(path, depth_limit).c_str());
+  }
+}
+
+// Encodes |pdu| with |depth_limit|, incrementally and as a whole, and then
+// changes it |kNumUpdates| times at random paths, updating and comparing the
+// incremental encoding every time.
+void CheckUpdates(std::mt19937& rng,
+                  size_t depth_limit,
+                  PDU* pdu,
+                  test_checker::Checker& checker) {
+  asn1_pdu::IncrementalPDUToDER incremental(depth_limit);
+  asn1_pdu::ASN1PDUToDER encoder(depth_limit);
+  incremental.PDUToDER(*pdu);
+  Compare(incremental, encoder, *pdu, {}, depth_limit, checker);
+  for (size_t i = 0; i < kNumUpdates; ++i) {
+    // A random path, which can go past the depth limit.
+    std::vector<size_t> path;
+    std::vector<PDU*> nodes = {pdu};
+    for (size_t len = rng() % 8; path.size() < len;) {
+      std::vector<size_t> elements;
+      for (int j = 0; j < nodes.back()->val().val_array_size(); ++j) {
+        if (nodes.back()->val().val_array(j).has_pdu()) {
+          elements.push_back(j);
+        }
+      }
+      if (elements.empty()) {
+        break;
+      }
+      path.push_back(elements[rng() % elements.size()]);
+      nodes.push_back(nodes.back()
+                          ->mutable_val()
+                          ->mutable_val_array(path.back())
+                          ->mutable_pdu());
+    }
+
+    checker.Tally("to a length boundary", Mutate(rng, nodes));
+    bool updated = incremental.Update(*pdu, path.data(), path.size());
+    checker.Tally("past the depth limit", !updated);
+    // Only paths past the depth limit encode all of the PDU again.
+    checker.Expect(updated == (path.size() < depth_limit),
+                   "wrong return value: %s",
+                   Describe(path, depth_limit).c_str());
+    Compare(incremental, encoder, *pdu, path, depth_limit, checker);
+  }
+}
+
+}  // namespace
+
+int main() {
+  std::mt19937 rng;
+  test_checker::Checker checker("updates");
+  PDU pdu;
+  for (size_t i = 0; i < kNumPDUs; ++i) {
+    pdu.Clear();
+    SetRandomPDU(rng, 2 + i % 7, &pdu, /*length_overrides=*/i % 2 == 0);
+    CheckUpdates(rng,
+                 i % 2 == 0 ? asn1_pdu::ASN1PDUToDER::kDefaultDepthLimit : 4,
+                 &pdu, checker);
+  }
+
+  // Without those updates, the patching of lengths wasn't checked.
+  checker.Expect(checker.tally("to a length boundary") != 0,
+                 "no update to a length boundary");
+  checker.Expect(checker.tally("past the depth limit") != 0,
+                 "no update past the depth limit");
+  return checker.Finish();
+}
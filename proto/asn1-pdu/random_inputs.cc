@@ -0,0 +1,158 @@
+// Copyright 2020 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include "random_inputs.h"
+
+#include <google/protobuf/timestamp.pb.h>
+
+namespace random_inputs {
+
+using asn1_pdu::PDU;
+using x509_certificate::X509Certificate;
+
+std::string RandomBytes(std::mt19937& rng, size_t len) {
+  std::string bytes(len, '\0');
+  for (char& byte : bytes) {
+    byte = static_cast<char>(rng());
+  }
+  return bytes;
+}
+
+void SetRandomPDU(std::mt19937& rng,
+                  size_t depth,
+                  PDU* pdu,
+                  bool length_overrides) {
+  asn1_pdu::Identifier* id = pdu->mutable_id();
+  id->set_id_class(static_cast<asn1_pdu::Class>(rng() % 4));
+  id->mutable_tag_num()->set_low_tag_num(
+      static_cast<asn1_pdu::LowTagNumber>(rng() % 31));
+  if (rng() % 8 == 0) {
+    id->mutable_tag_num()->set_high_tag_num(31 + rng() % 100000);
+  }
+  bool constructed = depth > 1 && rng() % 2 == 0;
+  id->set_encoding(constructed ? asn1_pdu::Constructed : asn1_pdu::Primitive);
+  if (length_overrides && rng() % 8 == 0) {
+    // Long forms, which may not be minimal, of random lengths, and random
+    // bytes.
+    std::string len = RandomBytes(rng, rng() % 4);
+    if (!len.empty() && rng() % 2 == 0) {
+      len[0] = static_cast<char>(0x80 | (len.size() - 1));
+    }
+    pdu->mutable_len()->set_length_override(len);
+  } else if (rng() % 8 == 0) {
+    pdu->mutable_len()->set_indefinite_form(true);
+  } else {
+    pdu->mutable_len();
+  }
+  if (!constructed) {
+    pdu->mutable_val()->add_val_array()->set_val_bits(
+        RandomBytes(rng, rng() % 64));
+    return;
+  }
+  for (size_t i = 1 + rng() % 4; i != 0; --i) {
+    asn1_pdu::ValueElement* element = pdu->mutable_val()->add_val_array();
+    element->set_val_bits(std::string());
+    SetRandomPDU(rng, depth - 1, element->mutable_pdu(), length_overrides);
+  }
+}
+
+namespace {
+
+void SetTimestamp(std::mt19937& rng, google::protobuf::Timestamp* timestamp) {
+  // Between 1950 and 2050, with a fraction that is encoded (see
+  // |EncodeTimestamp|).
+  timestamp->set_seconds(-631152000 + static_cast<int64_t>(rng() % 3155760000));
+  timestamp->set_nanos(1 + rng() % 999999);
+}
+
+}  // namespace
+
+X509Certificate RandomCertificate(std::mt19937& rng) {
+  X509Certificate cert;
+  x509_certificate::TBSCertificateSequence* tbs =
+      cert.mutable_tbs_certificate()->mutable_value();
+  tbs->mutable_version()->set_value(x509_certificate::v3);
+  tbs->mutable_serial_number()->mutable_value()->set_val(RandomBytes(rng, 20));
+  SetRandomPDU(rng, 2, tbs->mutable_signature_algorithm()
+                           ->mutable_value()
+                           ->mutable_object_identifier());
+  SetRandomPDU(rng, 4, tbs->mutable_issuer()->mutable_value());
+  SetRandomPDU(rng, 4, tbs->mutable_subject()->mutable_value());
+  SetTimestamp(rng, tbs->mutable_validity()
+                        ->mutable_value()
+                        ->mutable_not_before()
+                        ->mutable_value()
+                        ->mutable_utc_time()
+                        ->mutable_time_stamp());
+  SetTimestamp(rng, tbs->mutable_validity()
+                        ->mutable_value()
+                        ->mutable_not_after()
+                        ->mutable_value()
+                        ->mutable_generalized_time()
+                        ->mutable_time_stamp());
+  x509_certificate::SubjectPublicKeyInfoSequence* spki =
+      tbs->mutable_subject_public_key_info()->mutable_value();
+  SetRandomPDU(
+      rng, 2,
+      spki->mutable_algorithm_identifier()->mutable_object_identifier());
+  spki->mutable_subject_public_key()->mutable_value()->set_val(
+      RandomBytes(rng, 1 + rng() % 256));
+
+  x509_certificate::ExtensionSequence* extensions =
+      tbs->mutable_extensions()->mutable_value();
+  size_t num_extensions = 1 + rng() % 8;
+  for (size_t i = 0; i < num_extensions; ++i) {
+    x509_certificate::Extension* extension =
+        i == 0 ? extensions->mutable_extension() : extensions->add_extensions();
+    extension->mutable_critical()->set_val(rng() % 2);
+    extension->mutable_raw_extension()->mutable_extn_value()->set_val(
+        RandomBytes(rng, rng() % 32));
+    switch (rng() % 4) {
+      case 0:
+        extension->mutable_subject_key_identifier()
+            ->mutable_key_identifier()
+            ->set_val(RandomBytes(rng, 20));
+        break;
+      case 1:
+        extension->mutable_key_usage()->set_digital_signature(true);
+        break;
+      case 2:
+        extension->mutable_basic_constraints()->mutable_ca()->set_val(true);
+        break;
+      default:
+        // Leaves the raw extension.
+        break;
+    }
+  }
+
+  SetRandomPDU(rng, 2, cert.mutable_signature_algorithm()
+                           ->mutable_value()
+                           ->mutable_object_identifier());
+  cert.mutable_signature_value()->mutable_value()->set_val(
+      RandomBytes(rng, 1 + rng() % 256));
+  return cert;
+}
+
+std::vector<uint8_t> Concatenate(const std::vector<struct iovec>& segments) {
+  std::vector<uint8_t> bytes;
+  for (const struct iovec& segment : segments) {
+    const uint8_t* base = static_cast<const uint8_t*>(segment.iov_base);
+    bytes.insert(bytes.end(), base, base + segment.iov_len);
+  }
+  return bytes;
+}
+
+}  // namespace random_inputs
@@ -0,0 +1,57 @@
+// Copyright 2020 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+// Random inputs for the checks of the encoders, generated from the seed of a
+// |std::mt19937|, so that every run checks the same inputs.
+
+#ifndef PROTO_ASN1_PDU_RANDOM_INPUTS_H_
+#define PROTO_ASN1_PDU_RANDOM_INPUTS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include <random>
+#include <string>
+#include <vector>
+
+#include "asn1_pdu.pb.h"
+#include "x509_certificate.pb.h"
+
+namespace random_inputs {
+
+// Returns |len| random bytes.
+std::string RandomBytes(std::mt19937& rng, size_t len);
+
+// Sets |pdu| to a random tree of PDUs at most |depth| levels deep, with
+// random identifiers and length forms, and primitive values of up to 64
+// bytes. If |length_overrides| is set, some lengths are overridden with up to
+// 3 random bytes, or a non-minimal encoding of the correct length.
+void SetRandomPDU(std::mt19937& rng,
+                  size_t depth,
+                  asn1_pdu::PDU* pdu,
+                  bool length_overrides = false);
+
+// Returns a certificate with random values in the fields that have their own
+// encoders, and random PDUs in the others.
+x509_certificate::X509Certificate RandomCertificate(std::mt19937& rng);
+
+// Returns the bytes of |segments|, first to last.
+std::vector<uint8_t> Concatenate(const std::vector<struct iovec>& segments);
+
+}  // namespace random_inputs
+
+#endif  // PROTO_ASN1_PDU_RANDOM_INPUTS_H_
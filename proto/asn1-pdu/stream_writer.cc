@@ -0,0 +1,572 @@
+// Copyright 2020 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include "stream_writer.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "common.h"
+#include "x509_certificate_to_der.h"
+
+namespace {
+
+// CER splits strings into segments of 1000 bytes (X.690 (2015), 9.2).
+constexpr size_t kCERSegmentLen = 1000;
+
+// The longest identifier the encoders write: a high tag number of 32 bits takes
+// five base 128 digits after the first byte.
+constexpr size_t kMaxIdentifierLen = 6;
+
+// Whether |identifier| is that of a primitive string, which CER splits into
+// segments. These are the universal types that X.680 (2015) defines as
+// strings (8.6, Table 1), besides the time types, which are never that long.
+bool IsCERString(uint8_t identifier) {
+  // Universal and primitive.
+  if ((identifier & 0xE0) != kAsn1Universal) {
+    return false;
+  }
+  switch (identifier & 0x1F) {
+    case 3:   // BIT STRING
+    case 4:   // OCTET STRING
+    case 12:  // UTF8String
+    case 18:  // NumericString
+    case 19:  // PrintableString
+    case 20:  // TeletexString
+    case 21:  // VideotexString
+    case 22:  // IA5String
+    case 25:  // GraphicString
+    case 26:  // VisibleString
+    case 27:  // GeneralString
+    case 28:  // UniversalString
+    case 30:  // BMPString
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Writes the bytes of spans to a |StreamWriter| a part at a time.
+class SpanReader {
+ public:
+  SpanReader(const StreamWriter::Span* spans, size_t num_spans)
+      : span_(spans), end_(spans + num_spans) {}
+
+  // Returns the next byte, which must exist.
+  uint8_t ReadByte() {
+    SkipEmptySpans();
+    return span_->data[pos_++ % span_->size];
+  }
+
+  // Writes the next |len| bytes, which must exist, to |out|.
+  void WriteTo(size_t len, StreamWriter& out) {
+    while (len != 0) {
+      SkipEmptySpans();
+      size_t n = std::min(len, span_->size * span_->count - pos_);
+      pos_ += n;
+      len -= n;
+      // The rest of the current repetition, the whole repetitions after it,
+      // and the start of the last one.
+      size_t offset = (pos_ - n) % span_->size;
+      if (offset != 0) {
+        size_t head = std::min(n, span_->size - offset);
+        out.Write(span_->data + offset, head);
+        n -= head;
+      }
+      out.WriteRepeated(span_->data, span_->size, n / span_->size);
+      out.Write(span_->data, n % span_->size);
+    }
+  }
+
+ private:
+  void SkipEmptySpans() {
+    while (span_ != end_ && pos_ == span_->size * span_->count) {
+      ++span_;
+      pos_ = 0;
+    }
+  }
+
+  const StreamWriter::Span* span_;
+  const StreamWriter::Span* const end_;
+  size_t pos_ = 0;
+};
+
+}  // namespace
+
+constexpr size_t StreamWriter::kDefaultBufferSize;
+
+StreamWriter::StreamWriter(Form form,
+                           WriteFn write,
+                           void* context,
+                           size_t buffer_size)
+    : form_(form),
+      write_(write),
+      context_(context),
+      buffer_(new uint8_t[std::max<size_t>(buffer_size, 1)]),
+      capacity_(std::max<size_t>(buffer_size, 1)) {}
+
+void StreamWriter::Write(uint8_t byte) {
+  ++size_;
+  if (buffered_ == capacity_ && !Flush()) {
+    return;
+  }
+  if (ok_) {
+    buffer_[buffered_++] = byte;
+  }
+}
+
+void StreamWriter::Write(const uint8_t* data, size_t size) {
+  size_ += size;
+  if (!ok_ || size == 0) {
+    return;
+  }
+  if (size <= capacity_ - buffered_) {
+    memcpy(buffer_.get() + buffered_, data, size);
+    buffered_ += size;
+    return;
+  }
+  if (!Flush()) {
+    return;
+  }
+  if (size >= capacity_) {
+    ok_ = write_(context_, data, size);
+    return;
+  }
+  memcpy(buffer_.get(), data, size);
+  buffered_ = size;
+}
+
+void StreamWriter::WriteRepeated(const uint8_t* pattern,
+                                 size_t pattern_len,
+                                 size_t count) {
+  if (pattern_len == 0) {
+    return;
+  }
+  if (pattern_len >= capacity_) {
+    for (; count != 0; --count) {
+      Write(pattern, pattern_len);
+    }
+    return;
+  }
+  size_ += pattern_len * count;
+  while (count != 0 && ok_) {
+    size_t n = std::min(count, (capacity_ - buffered_) / pattern_len);
+    if (n == 0) {
+      Flush();
+      continue;
+    }
+    ::WriteRepeated(pattern, pattern_len, n, buffer_.get() + buffered_);
+    buffered_ += pattern_len * n;
+    count -= n;
+  }
+}
+
+void StreamWriter::BeginConstructed(const uint8_t* identifier,
+                                    size_t identifier_len) {
+  Write(identifier, identifier_len);
+  // The indefinite-length indicator (X.690 (2015), 8.1.3.6).
+  Write(0x80);
+}
+
+void StreamWriter::EndConstructed() {
+  // The EOC marker (X.690 (2015), 8.1.5).
+  Write(0x00);
+  Write(0x00);
+}
+
+void StreamWriter::WriteHeader(const uint8_t* identifier,
+                               size_t identifier_len,
+                               size_t value_len) {
+  Write(identifier, identifier_len);
+  if (identifier_len == 1 && identifier[0] == 0x00 && value_len == 0) {
+    // Written as 00 00, the TLV would be read as the EOC marker of the
+    // constructed TLV around it, so its length takes the long form, which BER
+    // allows for any length (X.690 (2015), 8.1.3.2).
+    static constexpr uint8_t kLongFormZero[] = {0x81, 0x00};
+    Write(kLongFormZero, sizeof(kLongFormZero));
+    return;
+  }
+  uint8_t length[GetDefiniteLengthLen(SIZE_MAX)];
+  WriteDefiniteLength(value_len, length);
+  Write(length, GetDefiniteLengthLen(value_len));
+}
+
+void StreamWriter::WritePrimitive(const uint8_t* identifier,
+                                  size_t identifier_len,
+                                  const Span* spans,
+                                  size_t num_spans) {
+  size_t value_len = 0;
+  for (size_t i = 0; i < num_spans; ++i) {
+    value_len += spans[i].size * spans[i].count;
+  }
+  SpanReader reader(spans, num_spans);
+  if (form_ != kCER || identifier_len != 1 || value_len <= kCERSegmentLen ||
+      !IsCERString(identifier[0])) {
+    WriteHeader(identifier, identifier_len, value_len);
+    reader.WriteTo(value_len, *this);
+    return;
+  }
+
+  // The segments are primitive strings of the same type, in a constructed
+  // string (X.690 (2015), 9.2).
+  uint8_t constructed = identifier[0] | kAsn1Constructed;
+  BeginConstructed(&constructed, 1);
+  if (identifier[0] == kAsn1BitString) {
+    // Every segment of a bit string starts with its own number of unused
+    // bits, which is 0 but for the last one (X.690 (2015), 8.6.4).
+    uint8_t unused_bits = reader.ReadByte();
+    size_t bits_len = value_len - 1;
+    while (bits_len != 0) {
+      size_t segment_len = std::min(bits_len, kCERSegmentLen - 1);
+      bits_len -= segment_len;
+      WriteHeader(identifier, 1, segment_len + 1);
+      Write(bits_len == 0 ? unused_bits : 0x00);
+      reader.WriteTo(segment_len, *this);
+    }
+  } else {
+    while (value_len != 0) {
+      size_t segment_len = std::min(value_len, kCERSegmentLen);
+      value_len -= segment_len;
+      WriteHeader(identifier, 1, segment_len);
+      reader.WriteTo(segment_len, *this);
+    }
+  }
+  EndConstructed();
+}
+
+bool StreamWriter::Flush() {
+  if (ok_ && buffered_ != 0) {
+    ok_ = write_(context_, buffer_.get(), buffered_);
+  }
+  buffered_ = 0;
+  return ok_;
+}
+
+bool WriteToFileDescriptor(void* fd, const uint8_t* data, size_t size) {
+  while (size != 0) {
+    ssize_t written = write(*static_cast<int*>(fd), data, size);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    data += written;
+    size -= written;
+  }
+  return true;
+}
+
+void StreamDER(const uint8_t* data, size_t size, StreamWriter& out) {
+  // Kept between calls, per thread.
+  static thread_local TLVIndex index;
+  struct OpenTLV {
+    // The end of the value, and whether it had an indefinite length.
+    size_t end;
+    bool indefinite;
+  };
+  static thread_local std::vector<OpenTLV> open;
+  index.Parse(data, size);
+  open.clear();
+
+  const std::vector<TLV>& tlvs = index.tlvs();
+  // The bytes up to |pos| were written.
+  size_t pos = 0;
+  size_t i = 0;
+  while (true) {
+    size_t next = i == tlvs.size() ? size : tlvs[i].offset;
+    while (!open.empty() && open.back().end <= next) {
+      // The bytes of the value after the last nested TLV, which end with the
+      // EOC marker that ended an indefinite length, if there was one.
+      size_t end = open.back().end;
+      if (open.back().indefinite && end - pos >= 2 && data[end - 2] == 0x00 &&
+          data[end - 1] == 0x00) {
+        end -= 2;
+      }
+      out.Write(data + pos, end - pos);
+      out.EndConstructed();
+      pos = open.back().end;
+      open.pop_back();
+    }
+    out.Write(data + pos, next - pos);
+    pos = next;
+    if (i == tlvs.size()) {
+      break;
+    }
+
+    const TLV& tlv = tlvs[i++];
+    TLVHeader header;
+    ParseTLVHeader(data + tlv.offset, tlv.header_len, header);
+    size_t value_pos = tlv.offset + tlv.header_len;
+    if (tlv.identifier & kAsn1Constructed) {
+      out.BeginConstructed(data + tlv.offset, header.identifier_len);
+      open.push_back({value_pos + tlv.value_len, header.indefinite});
+      pos = value_pos;
+    } else {
+      // The value of an indefinite length includes the EOC marker that ended
+      // it, if there was one.
+      size_t content_len = tlv.value_len;
+      if (header.indefinite && content_len >= 2 &&
+          data[value_pos + content_len - 2] == 0x00 &&
+          data[value_pos + content_len - 1] == 0x00) {
+        content_len -= 2;
+      }
+      // The value of a primitive TLV is written as it is, including what was
+      // parsed as TLVs in a primitive TLV with an indefinite length.
+      StreamWriter::Span value = {data + value_pos, content_len, 1};
+      out.WritePrimitive(data + tlv.offset, header.identifier_len, &value, 1);
+      pos = value_pos + tlv.value_len;
+      while (i != tlvs.size() && tlvs[i].offset < pos) {
+        ++i;
+      }
+    }
+  }
+}
+
+namespace asn1_pdu {
+
+namespace {
+
+// Writes the primitive |pdu|, |depth| deep, to |out|.
+void StreamPrimitivePDU(const PDU& pdu,
+                        const uint8_t* identifier,
+                        size_t identifier_len,
+                        size_t depth,
+                        size_t depth_limit,
+                        StreamWriter& out) {
+  // Kept between calls, per thread.
+  static thread_local std::vector<StreamWriter::Span> spans;
+  static thread_local DERWriter scratch;
+  static thread_local ASN1PDUToDER encoder;
+  spans.clear();
+  bool has_nested_pdus = false;
+  for (const ValueElement& element : pdu.val().val_array()) {
+    if (element.has_pdu()) {
+      has_nested_pdus = true;
+      break;
+    }
+    spans.push_back(
+        {reinterpret_cast<const uint8_t*>(element.val_bits().data()),
+         element.val_bits().size(), 1});
+    if (element.has_repeated_bits()) {
+      const RepeatedBytes& repeated = element.repeated_bits();
+      spans.push_back(
+          {reinterpret_cast<const uint8_t*>(repeated.pattern().data()),
+           repeated.pattern().size(), GetRepeatCount(repeated)});
+    }
+  }
+  if (has_nested_pdus) {
+    // The length of the value depends on the encodings of the nested PDUs, so
+    // they are encoded before it is written.
+    encoder.set_depth_limit(depth_limit - depth);
+    scratch.Clear();
+    const auto& val_array = pdu.val().val_array();
+    for (auto it = val_array.rbegin(); it != val_array.rend(); ++it) {
+      if (it->has_pdu()) {
+        encoder.Encode(it->pdu(), scratch);
+      } else {
+        PrependValueBits(*it, scratch);
+      }
+    }
+    spans.assign(1, {scratch.data(), scratch.size(), 1});
+  }
+  out.WritePrimitive(identifier, identifier_len, spans.data(), spans.size());
+}
+
+}  // namespace
+
+void StreamPDU(const PDU& pdu, StreamWriter& out, size_t depth_limit) {
+  if (depth_limit == 0) {
+    return;
+  }
+  // The constructed PDUs being written, outermost first, and the index of the
+  // next element of each. Kept between calls, per thread.
+  struct Frame {
+    const PDU* pdu;
+    int next_element;
+  };
+  static thread_local std::vector<Frame> stack;
+  stack.clear();
+
+  const PDU* next = &pdu;
+  while (true) {
+    if (next) {
+      uint8_t buffer[kMaxIdentifierLen];
+      DERWriter identifier(buffer, sizeof(buffer));
+      PrependIdentifier(next->id(), identifier);
+      if (identifier.data()[0] & kAsn1Constructed) {
+        out.BeginConstructed(identifier.data(), identifier.size());
+        stack.push_back({next, 0});
+      } else {
+        StreamPrimitivePDU(*next, identifier.data(), identifier.size(),
+                           stack.size() + 1, depth_limit, out);
+      }
+      next = nullptr;
+    }
+    if (stack.empty() || !out.ok()) {
+      break;
+    }
+
+    Frame& frame = stack.back();
+    if (frame.next_element == frame.pdu->val().val_array_size()) {
+      out.EndConstructed();
+      stack.pop_back();
+      continue;
+    }
+    const auto& val_ele = frame.pdu->val().val_array(frame.next_element++);
+    if (!val_ele.has_pdu()) {
+      out.Write(reinterpret_cast<const uint8_t*>(val_ele.val_bits().data()),
+                val_ele.val_bits().size());
+      if (val_ele.has_repeated_bits()) {
+        const RepeatedBytes& repeated = val_ele.repeated_bits();
+        out.WriteRepeated(
+            reinterpret_cast<const uint8_t*>(repeated.pattern().data()),
+            repeated.pattern().size(), GetRepeatCount(repeated));
+      }
+    } else if (stack.size() < depth_limit) {
+      next = &val_ele.pdu();
+    }
+  }
+}
+
+}  // namespace asn1_pdu
+
+namespace x509_certificate {
+
+namespace {
+
+// The identifier of the SEQUENCEs of a certificate, which are written with the
+// indefinite length.
+constexpr uint8_t kSequenceIdentifier = kAsn1Sequence;
+
+// Memory of the calling thread for the DER of one field at a time, kept
+// between calls.
+DERWriter& FieldWriter() {
+  static thread_local DERWriter der;
+  return der;
+}
+
+// Encodes |value| to DER, with its tag replaced by |tag_byte| unless it is 0,
+// and writes it to |out| with |StreamDER|.
+template <typename T>
+void StreamEncoded(const T& value, StreamWriter& out, uint8_t tag_byte = 0) {
+  DERWriter& der = FieldWriter();
+  der.Clear();
+  Encode(value, der);
+  if (tag_byte != 0) {
+    der.ReplaceTag(tag_byte, 0);
+  }
+  StreamDER(der.data(), der.size(), out);
+}
+
+template <typename T>
+void StreamValue(const T& value, StreamWriter& out) {
+  StreamEncoded(value, out);
+}
+
+void StreamValue(const asn1_pdu::PDU& pdu, StreamWriter& out) {
+  asn1_pdu::StreamPDU(pdu, out);
+}
+
+void StreamValue(const TBSCertificateSequence& tbs, StreamWriter& out);
+
+// Writes |field|, a part of a certificate, like |Encode| encodes it: its
+// |pdu| if it has one, and its |value| otherwise.
+template <typename T>
+void StreamField(const T& field, StreamWriter& out) {
+  if (field.has_pdu()) {
+    asn1_pdu::StreamPDU(field.pdu(), out);
+    return;
+  }
+  StreamValue(field.value(), out);
+}
+
+// Writes |extensions| as |Encode<TBSCertificateSequence>| encodes them: a
+// SEQUENCE whose tag is replaced by a primitive [3], with the DER of the
+// extensions as its value. Its length is needed before the extensions are
+// written, so they are encoded twice, one at a time: to add up their sizes,
+// and to write them.
+void StreamExtensions(const ExtensionSequence& extensions, StreamWriter& out) {
+  DERWriter& der = FieldWriter();
+  size_t extensions_len = 0;
+  der.Clear();
+  Encode(extensions.extension(), der);
+  extensions_len += der.size();
+  for (const Extension& extension : extensions.extensions()) {
+    der.Clear();
+    Encode(extension, der);
+    extensions_len += der.size();
+  }
+
+  // [3] is not a universal string, so it isn't split into segments in |kCER|.
+  uint8_t header[1 + GetDefiniteLengthLen(SIZE_MAX)];
+  header[0] = kAsn1ContextSpecific | 0x03;
+  WriteDefiniteLength(extensions_len, header + 1);
+  out.Write(header, 1 + GetDefiniteLengthLen(extensions_len));
+
+  der.Clear();
+  Encode(extensions.extension(), der);
+  out.Write(der.data(), der.size());
+  for (const Extension& extension : extensions.extensions()) {
+    der.Clear();
+    Encode(extension, der);
+    out.Write(der.data(), der.size());
+  }
+}
+
+void StreamValue(const TBSCertificateSequence& tbs, StreamWriter& out) {
+  out.BeginConstructed(&kSequenceIdentifier, 1);
+  StreamField(tbs.version(), out);
+  StreamField(tbs.serial_number(), out);
+  StreamField(tbs.signature_algorithm(), out);
+  StreamField(tbs.issuer(), out);
+  StreamField(tbs.validity(), out);
+  StreamField(tbs.subject(), out);
+  StreamField(tbs.subject_public_key_info(), out);
+  // The fields that |Encode<TBSCertificateSequence>| gives context-specific
+  // tags (RFC 5280, 4.1 & 4.1.2.8).
+  if (tbs.has_issuer_unique_id()) {
+    StreamEncoded(tbs.issuer_unique_id(), out, kAsn1ContextSpecific | 0x01);
+  }
+  if (tbs.has_subject_unique_id()) {
+    StreamEncoded(tbs.subject_unique_id(), out, kAsn1ContextSpecific | 0x02);
+  }
+  if (tbs.has_extensions()) {
+    if (tbs.extensions().has_pdu()) {
+      StreamEncoded(tbs.extensions(), out, kAsn1ContextSpecific | 0x03);
+    } else {
+      StreamExtensions(tbs.extensions().value(), out);
+    }
+  }
+  out.EndConstructed();
+}
+
+}  // namespace
+
+void StreamX509Certificate(const X509Certificate& X509_certificate,
+                           StreamWriter& out) {
+  out.BeginConstructed(&kSequenceIdentifier, 1);
+  StreamField(X509_certificate.tbs_certificate(), out);
+  StreamField(X509_certificate.signature_algorithm(), out);
+  StreamField(X509_certificate.signature_value(), out);
+  out.EndConstructed();
+}
+
+}  // namespace x509_certificate
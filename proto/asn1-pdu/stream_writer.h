@@ -0,0 +1,174 @@
+// Copyright 2020 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef PROTO_ASN1_PDU_STREAM_WRITER_H_
+#define PROTO_ASN1_PDU_STREAM_WRITER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <memory>
+
+#include "asn1_pdu.pb.h"
+#include "asn1_pdu_to_der.h"
+#include "x509_certificate.pb.h"
+
+// Writes BER or CER front to back, through a buffer of fixed size, to a sink
+// such as a pipe or a socket. Unlike |DERWriter|, which needs the length of
+// every value before the identifier in front of it, the writer gives every
+// constructed TLV the indefinite length, followed by an End-of-Contents (EOC)
+// marker (X.690 (2015), 8.1.3.6), so nothing is written twice or patched, and
+// the encoding doesn't have to fit in memory. Primitive TLVs keep the
+// definite length of their values, which the encoders know up front.
+// A |StreamWriter| must not be used by more than one thread at a time.
+class StreamWriter {
+ public:
+  enum Form : uint8_t {
+    // Every constructed TLV has the indefinite length.
+    kBER,
+    // Like |kBER|, and strings longer than 1000 bytes are also split into
+    // segments of 1000 bytes, in a constructed TLV (X.690 (2015), 9.2).
+    kCER,
+  };
+
+  // Writes the |size| bytes at |data| to the sink, and returns false if the
+  // sink can't take them, after which nothing more is written.
+  using WriteFn = bool (*)(void* context, const uint8_t* data, size_t size);
+
+  // Bytes that are part of a value, which need not be contiguous: |count|
+  // repetitions of the |size| bytes at |data|.
+  struct Span {
+    const uint8_t* data;
+    size_t size;
+    size_t count;
+  };
+
+  static constexpr size_t kDefaultBufferSize = 1 << 16;
+
+  // Writes to |write| with |context|, in |form|, in pieces of up to
+  // |buffer_size| bytes. Values at least as large as the buffer are passed to
+  // |write| without being copied.
+  StreamWriter(Form form,
+               WriteFn write,
+               void* context,
+               size_t buffer_size = kDefaultBufferSize);
+
+  StreamWriter(const StreamWriter&) = delete;
+  StreamWriter& operator=(const StreamWriter&) = delete;
+
+  Form form() const { return form_; }
+
+  // Whether the sink took everything written so far, or the part of it that
+  // was passed to it.
+  bool ok() const { return ok_; }
+
+  // Returns the number of bytes written so far, including those that are
+  // still buffered.
+  uint64_t size() const { return size_; }
+
+  void Write(uint8_t byte);
+  void Write(const uint8_t* data, size_t size);
+
+  // Writes |count| repetitions of the |pattern_len| bytes at |pattern|,
+  // copying as many as fit to the buffer at a time.
+  void WriteRepeated(const uint8_t* pattern, size_t pattern_len, size_t count);
+
+  // Writes the |identifier_len| bytes of the identifier of a constructed TLV at
+  // |identifier|, and the indefinite-length indicator.
+  void BeginConstructed(const uint8_t* identifier, size_t identifier_len);
+
+  // Writes the EOC marker that ends the value of the last constructed TLV
+  // begun.
+  void EndConstructed();
+
+  // Writes a primitive TLV with the |identifier_len| bytes of the identifier at
+  // |identifier|, and the concatenation of the |num_spans| spans at |spans| as
+  // its value. In |kCER|, universal strings of more than 1000 bytes are
+  // written as constructed strings of segments instead.
+  void WritePrimitive(const uint8_t* identifier,
+                      size_t identifier_len,
+                      const Span* spans,
+                      size_t num_spans);
+
+  // Passes the buffered bytes to the sink, and returns |ok()|.
+  bool Flush();
+
+ private:
+  // Writes a primitive header with |identifier| and the definite length of a
+  // value of |value_len| bytes.
+  void WriteHeader(const uint8_t* identifier,
+                   size_t identifier_len,
+                   size_t value_len);
+
+  const Form form_;
+  const WriteFn write_;
+  void* const context_;
+
+  std::unique_ptr<uint8_t[]> buffer_;
+  const size_t capacity_;
+  size_t buffered_ = 0;
+
+  uint64_t size_ = 0;
+  bool ok_ = true;
+};
+
+// A |StreamWriter::WriteFn| that writes to the file descriptor |*fd|, an
+// |int*|, such as a pipe or a socket, retrying partial and interrupted writes.
+bool WriteToFileDescriptor(void* fd, const uint8_t* data, size_t size);
+
+// Writes the DER, or BER, of |size| bytes at |data| to |out| again in the form
+// of |out|, as |TLVIndex::Parse| splits it into TLVs: constructed TLVs get the
+// indefinite length, and primitive TLVs the definite length of their values.
+// Bytes that don't parse as TLVs are written as they are. The encoding is
+// needed in memory, but its TLVs are written as they are parsed.
+void StreamDER(const uint8_t* data, size_t size, StreamWriter& out);
+
+namespace asn1_pdu {
+
+// Writes |pdu| to |out| in the form of |out|, in one pass over the protobuf,
+// keeping only the PDUs that contain the one being written in memory. PDUs
+// with a constructed identifier get the indefinite length, and primitive ones
+// the definite length of their values, whatever their |len| says, so that the
+// output is valid BER or CER around the values. The value of a primitive PDU
+// that contains nested PDUs is their DER, as |ASN1PDUToDER| encodes them. PDUs
+// nested more than |depth_limit| deep are left out, like |ASN1PDUToDER| does.
+// This is thread-safe, like |PDUToDER|.
+void StreamPDU(const PDU& pdu,
+               StreamWriter& out,
+               size_t depth_limit = ASN1PDUToDER::kDefaultDepthLimit);
+
+}  // namespace asn1_pdu
+
+namespace x509_certificate {
+
+// Writes |X509_certificate| to |out| in the form of |out|, front to back: its
+// SEQUENCE and that of its TBSCertificate get the indefinite length, fields
+// that are PDUs are written with |StreamPDU|, and every other field is
+// encoded to DER on its own, in memory of the calling thread, and written with
+// |StreamDER|. The X.509 encoders compute values, such as times, and write
+// back to front, so unlike |StreamPDU| this needs memory for the largest such
+// field, such as a public key or an extension, though not for the whole
+// certificate. The extensions are the value of a primitive [3], whose length
+// is written first, so each is encoded twice. Fields are parsed into TLVs
+// separately, so an encoding that is not DER may be split differently than
+// |StreamDER| splits the whole certificate. This is thread-safe, like
+// |X509CertificateToDER|.
+void StreamX509Certificate(const X509Certificate& X509_certificate,
+                           StreamWriter& out);
+
+}  // namespace x509_certificate
+
+#endif  // PROTO_ASN1_PDU_STREAM_WRITER_H_
@@ -0,0 +1,140 @@
+// Copyright 2020 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+// Checks that |StreamPDU| writes random PDUs, in BER and in CER, through
+// buffers of different sizes, to encodings that |DERToASN1PDU| decodes to the
+// same tree as their DER: the same identifiers and values, with any lengths.
+// Some of the PDUs are primitive with nested PDUs, whose DER is their value,
+// and some are deeper than the depth limit.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <random>
+#include <string>
+#include <vector>
+
+#include "asn1_pdu.pb.h"
+#include "asn1_pdu_to_der.h"
+#include "der_to_asn1_pdu.h"
+#include "random_inputs.h"
+#include "stream_writer.h"
+#include "test_checker.h"
+
+namespace {
+
+using asn1_pdu::PDU;
+
+constexpr size_t kNumInputs = 512;
+
+// Makes some of the constructed PDUs of |pdu| primitive, keeping the PDUs
+// nested in them, and gives primitive PDUs the definite length. The value of a
+// primitive PDU with the indefinite length runs to an EOC marker, so it is
+// decoded as TLVs, while |StreamPDU| gives it the definite length, whose value
+// is decoded as bytes.
+void MakeSomePrimitive(std::mt19937& rng, PDU* pdu) {
+  if (pdu->id().encoding() == asn1_pdu::Constructed && rng() % 4 == 0) {
+    pdu->mutable_id()->set_encoding(asn1_pdu::Primitive);
+  }
+  if (pdu->id().encoding() == asn1_pdu::Primitive) {
+    pdu->mutable_len()->Clear();
+  }
+  for (asn1_pdu::ValueElement& element :
+       *pdu->mutable_val()->mutable_val_array()) {
+    if (element.has_pdu()) {
+      MakeSomePrimitive(rng, element.mutable_pdu());
+    }
+  }
+}
+
+// Resets the lengths of |pdu| and the PDUs nested in it to the definite
+// length.
+void ClearLengths(PDU* pdu) {
+  pdu->mutable_len()->Clear();
+  for (asn1_pdu::ValueElement& element :
+       *pdu->mutable_val()->mutable_val_array()) {
+    if (element.has_pdu()) {
+      ClearLengths(element.mutable_pdu());
+    }
+  }
+}
+
+bool AppendToVector(void* bytes, const uint8_t* data, size_t size) {
+  std::vector<uint8_t>* out = static_cast<std::vector<uint8_t>*>(bytes);
+  out->insert(out->end(), data, data + size);
+  return true;
+}
+
+// Writes |pdu| with |depth_limit| to DER, and in |form| through a buffer of
+// |buffer_size| bytes, and compares the trees they decode to.
+void CheckStream(const PDU& pdu,
+                 size_t depth_limit,
+                 StreamWriter::Form form,
+                 size_t buffer_size,
+                 test_checker::Checker& checker) {
+  static asn1_pdu::DERToASN1PDU decoder;
+  static PDU expected;
+  static PDU actual;
+  std::vector<uint8_t> der = asn1_pdu::ASN1PDUToDER(depth_limit).PDUToDER(pdu);
+  std::vector<uint8_t> streamed;
+  StreamWriter out(form, AppendToVector, &streamed, buffer_size);
+  asn1_pdu::StreamPDU(pdu, out, depth_limit);
+  checker.Check();
+  const char* problem = nullptr;
+  if (!out.Flush()) {
+    problem = "write failed";
+  } else if (der.empty() || streamed.empty()) {
+    if (der.size() != streamed.size()) {
+      problem = "size mismatch";
+    }
+  } else if (!decoder.Decode(der.data(), der.size(), &expected) ||
+             !decoder.Decode(streamed.data(), streamed.size(), &actual)) {
+    problem = "decoding failed";
+  } else {
+    ClearLengths(&expected);
+    ClearLengths(&actual);
+    if (expected.SerializePartialAsString() !=
+        actual.SerializePartialAsString()) {
+      problem = "tree mismatch";
+    }
+  }
+  if (problem) {
+    checker.Mismatch("%s: %zu bytes of DER, %zu streamed", problem, der.size(),
+                     streamed.size());
+  }
+}
+
+}  // namespace
+
+int main() {
+  std::mt19937 rng;
+  test_checker::Checker checker("encodings");
+  PDU pdu;
+  for (size_t i = 0; i < kNumInputs; ++i) {
+    pdu.Clear();
+    random_inputs::SetRandomPDU(rng, 1 + i % 8, &pdu);
+    MakeSomePrimitive(rng, &pdu);
+    size_t depth_limit =
+        i % 4 == 0 ? 1 + rng() % 4 : asn1_pdu::ASN1PDUToDER::kDefaultDepthLimit;
+    for (StreamWriter::Form form : {StreamWriter::kBER, StreamWriter::kCER}) {
+      CheckStream(pdu, depth_limit, form, 1 + rng() % 64, checker);
+      CheckStream(pdu, depth_limit, form, StreamWriter::kDefaultBufferSize,
+                  checker);
+    }
+  }
+
+  return checker.Finish();
+}
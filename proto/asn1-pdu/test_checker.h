@@ -0,0 +1,155 @@
+// Copyright 2020 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+// The counting and reporting shared by the checks of the encoders, so that
+// each test only makes its checks: a |Checker| counts the checks and their
+// mismatches, reports the first mismatches to stderr, and prints the summary
+// of the test.
+
+#ifndef PROTO_ASN1_PDU_TEST_CHECKER_H_
+#define PROTO_ASN1_PDU_TEST_CHECKER_H_
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace test_checker {
+
+class Checker {
+ public:
+  // |what| names the things that are checked in the summary, such as
+  // "encodings".
+  explicit Checker(const char* what) : what_(what) {}
+
+  // Counts a check, whose mismatches are counted with |Mismatch|.
+  void Check() { ++num_checked_; }
+
+  // Counts a check, which mismatches unless |ok|, and reports a mismatch like
+  // |printf| formats |format|. Returns |ok|.
+  bool Expect(bool ok, const char* format, ...)
+      __attribute__((format(printf, 3, 4))) {
+    ++num_checked_;
+    if (!ok) {
+      va_list args;
+      va_start(args, format);
+      Report(format, args);
+      va_end(args);
+    }
+    return ok;
+  }
+
+  // Counts a mismatch of the last check, and reports it like |printf| formats
+  // |format|.
+  void Mismatch(const char* format, ...) __attribute__((format(printf, 2, 3))) {
+    va_list args;
+    va_start(args, format);
+    Report(format, args);
+    va_end(args);
+  }
+
+  // Adds |count| to the tally of |name|, which the summary prints after the
+  // number of checks, such as the number of inputs that took a rare path.
+  void Tally(const char* name, uint64_t count = 1) {
+    for (std::pair<const char*, uint64_t>& tally : tallies_) {
+      if (strcmp(tally.first, name) == 0) {
+        tally.second += count;
+        return;
+      }
+    }
+    tallies_.emplace_back(name, count);
+  }
+
+  // Returns the tally of |name|, or 0 if nothing was tallied as |name|.
+  uint64_t tally(const char* name) const {
+    for (const std::pair<const char*, uint64_t>& tally : tallies_) {
+      if (strcmp(tally.first, name) == 0) {
+        return tally.second;
+      }
+    }
+    return 0;
+  }
+
+  // Adds the checks, mismatches and tallies of |other|, such as those made on
+  // another thread.
+  void Merge(const Checker& other) {
+    num_checked_ += other.num_checked_;
+    num_mismatches_ += other.num_mismatches_;
+    for (const std::pair<const char*, uint64_t>& tally : other.tallies_) {
+      Tally(tally.first, tally.second);
+    }
+  }
+
+  uint64_t num_checked() const { return num_checked_; }
+  uint64_t num_mismatches() const { return num_mismatches_; }
+
+  // Prints the summary, and returns the exit status of the test, which is 0
+  // only if nothing mismatched.
+  int Finish() const {
+    printf("%llu %s checked, ", static_cast<unsigned long long>(num_checked_),
+           what_);
+    for (const std::pair<const char*, uint64_t>& tally : tallies_) {
+      printf("%llu %s, ", static_cast<unsigned long long>(tally.second),
+             tally.first);
+    }
+    printf("%llu mismatches\n",
+           static_cast<unsigned long long>(num_mismatches_));
+    return num_mismatches_ == 0 ? 0 : 1;
+  }
+
+ private:
+  static constexpr uint64_t kMaxReportedMismatches = 10;
+
+  void Report(const char* format, va_list args) {
+    if (num_mismatches_++ < kMaxReportedMismatches) {
+      vfprintf(stderr, format, args);
+      fputc('\n', stderr);
+    }
+  }
+
+  const char* what_;
+  std::vector<std::pair<const char*, uint64_t>> tallies_;
+  uint64_t num_checked_ = 0;
+  uint64_t num_mismatches_ = 0;
+};
+
+// Returns the first 32 of the |size| bytes at |data| in hex, and their number,
+// to report the input of a mismatch.
+inline std::string Hex(const uint8_t* data, size_t size) {
+  std::string hex;
+  char byte[4];
+  for (size_t i = 0; i < size && i < 32; ++i) {
+    snprintf(byte, sizeof(byte), "%02x ", data[i]);
+    hex += byte;
+  }
+  if (size > 32) {
+    hex += "... ";
+  }
+  return hex + "(" + std::to_string(size) + " bytes)";
+}
+
+inline std::string Hex(const std::vector<uint8_t>& bytes) {
+  return Hex(bytes.data(), bytes.size());
+}
+
+}  // namespace test_checker
+
+#endif  // PROTO_ASN1_PDU_TEST_CHECKER_H_
@@ -0,0 +1,234 @@
+// Copyright 2020 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+// Checks that the TLVs the encoders record in a |TLVIndex| are those that
+// |TLVIndex::Parse| finds in the encoding, for random PDUs, with and without a
+// depth limit, and random certificates. The TLVs of PDUs with length
+// overrides, which |Parse| can't find, are checked to nest in each other, and
+// the versions of certificates to be recorded.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <random>
+#include <vector>
+
+#include "asn1_pdu.pb.h"
+#include "asn1_pdu_to_der.h"
+#include "common.h"
+#include "random_inputs.h"
+#include "test_checker.h"
+#include "x509_certificate.pb.h"
+#include "x509_certificate_to_der.h"
+
+namespace {
+
+using asn1_pdu::PDU;
+
+constexpr size_t kNumInputs = 512;
+
+// Clears the indefinite lengths of the primitive PDUs of |pdu|. |Parse| looks
+// for the EOC marker in the values of indefinite lengths, which may start
+// with one if they are random bytes.
+void ClearPrimitiveIndefiniteLengths(PDU* pdu) {
+  if (pdu->id().encoding() == asn1_pdu::Primitive) {
+    pdu->mutable_len()->clear_indefinite_form();
+  }
+  for (asn1_pdu::ValueElement& element :
+       *pdu->mutable_val()->mutable_val_array()) {
+    if (element.has_pdu()) {
+      ClearPrimitiveIndefiniteLengths(element.mutable_pdu());
+    }
+  }
+}
+
+bool Equals(const TLV& a, const TLV& b) {
+  return a.offset == b.offset && a.header_len == b.header_len &&
+         a.value_len == b.value_len && a.depth == b.depth &&
+         a.tag_num == b.tag_num && a.identifier == b.identifier;
+}
+
+// Copies the TLVs of |tlvs| that |Parse| would find to |parsable|: those that
+// aren't in the value of a primitive TLV, such as the extensions in the
+// primitive [3] of a certificate. Returns false if one of them is a primitive
+// TLV with an indefinite length.
+bool GetParsableTLVs(const DERWriter& der,
+                     const std::vector<TLV>& tlvs,
+                     std::vector<TLV>& parsable) {
+  parsable.clear();
+  size_t primitive_end = 0;
+  for (const TLV& tlv : tlvs) {
+    if (tlv.offset < primitive_end) {
+      continue;
+    }
+    parsable.push_back(tlv);
+    if (!(tlv.identifier & kAsn1Constructed)) {
+      TLVHeader header;
+      if (ParseTLVHeader(der.data() + tlv.offset, der.size() - tlv.offset,
+                         header) &&
+          header.indefinite) {
+        return false;
+      }
+      primitive_end = size_t{tlv.offset} + tlv.header_len + tlv.value_len;
+    }
+  }
+  return true;
+}
+
+// Encodes with |encode|, a callable taking a |DERWriter&|, into |der|,
+// recording the TLVs in |recorded|.
+template <typename EncodeFn>
+void Record(EncodeFn encode, DERWriter& der, TLVIndex& recorded) {
+  der.set_tlv_index(&recorded);
+  encode(der);
+  recorded.Finish(der.size());
+}
+
+// Encodes with |encode|, recording a |TLVIndex|, and compares the TLVs that
+// |Parse| can find with those it finds.
+template <typename EncodeFn>
+void CheckParse(EncodeFn encode, test_checker::Checker& checker) {
+  DERWriter der;
+  TLVIndex recorded;
+  Record(encode, der, recorded);
+  checker.Check();
+  std::vector<TLV> parsable;
+  if (!GetParsableTLVs(der, recorded.tlvs(), parsable)) {
+    return;
+  }
+  checker.Tally("against Parse");
+  TLVIndex parsed;
+  parsed.Parse(der.data(), der.size());
+  bool equal = parsable.size() == parsed.tlvs().size();
+  for (size_t i = 0; equal && i < parsable.size(); ++i) {
+    equal = Equals(parsable[i], parsed.tlvs()[i]);
+  }
+  if (!equal) {
+    checker.Mismatch("recorded and parsed TLVs differ: %s",
+                     test_checker::Hex(der.data(), der.size()).c_str());
+  }
+}
+
+// Encodes with |encode|, recording a |TLVIndex|, and checks that the TLVs are
+// ordered, within the encoding, and within the TLVs they are nested in by
+// their depth.
+template <typename EncodeFn>
+void CheckNesting(EncodeFn encode, test_checker::Checker& checker) {
+  DERWriter der;
+  TLVIndex recorded;
+  Record(encode, der, recorded);
+  checker.Check();
+  const std::vector<TLV>& tlvs = recorded.tlvs();
+  // The ends of the TLVs that contain the current one, outermost first.
+  std::vector<size_t> ends;
+  size_t previous_offset = 0;
+  for (size_t i = 0; i < tlvs.size(); ++i) {
+    const TLV& tlv = tlvs[i];
+    size_t end = size_t{tlv.offset} + tlv.header_len + tlv.value_len;
+    while (!ends.empty() && ends.back() <= tlv.offset) {
+      ends.pop_back();
+    }
+    if ((i != 0 && tlv.offset <= previous_offset) || tlv.header_len == 0 ||
+        end > der.size() || tlv.depth != ends.size() ||
+        (!ends.empty() && end > ends.back()) ||
+        der.data()[tlv.offset] != tlv.identifier) {
+      checker.Mismatch("TLVs don't nest: %s",
+                       test_checker::Hex(der.data(), der.size()).c_str());
+      return;
+    }
+    ends.push_back(end);
+    previous_offset = tlv.offset;
+  }
+}
+
+// Encodes |cert|, a v3 certificate, recording a |TLVIndex|, and checks that
+// the first TLVs in the TBSCertificate are the [0] of the version and the
+// INTEGER in it, which are written as fixed bytes.
+void CheckVersion(const x509_certificate::X509Certificate& cert,
+                  test_checker::Checker& checker) {
+  DERWriter der;
+  TLVIndex recorded;
+  Record(
+      [&cert](DERWriter& der) {
+        x509_certificate::X509CertificateToDER(cert, der);
+      },
+      der, recorded);
+  const std::vector<TLV>& tlvs = recorded.tlvs();
+  checker.Expect(tlvs.size() >= 4 && tlvs[2].depth == 2 &&
+                     tlvs[2].identifier ==
+                         (kAsn1ContextSpecific | kAsn1Constructed) &&
+                     tlvs[3].depth == 3 && tlvs[3].identifier == kAsn1Integer &&
+                     tlvs[3].offset == tlvs[2].offset + 2,
+                 "version not recorded: %s",
+                 test_checker::Hex(der.data(), der.size()).c_str());
+}
+
+}  // namespace
+
+int main() {
+  std::mt19937 rng;
+  test_checker::Checker checker("encodings");
+  asn1_pdu::ASN1PDUToDER limited_encoder(3);
+  std::vector<uint8_t> buffer;
+  PDU pdu;
+  for (size_t i = 0; i < kNumInputs; ++i) {
+    pdu.Clear();
+    random_inputs::SetRandomPDU(rng, 1 + i % 8, &pdu);
+    ClearPrimitiveIndefiniteLengths(&pdu);
+    auto encode_pdu = [&pdu](DERWriter& der) { asn1_pdu::PDUToDER(pdu, der); };
+    auto encode_limited = [&pdu, &limited_encoder](DERWriter& der) {
+      limited_encoder.PDUToDER(pdu, der);
+    };
+    CheckParse(encode_pdu, checker);
+    CheckParse(encode_limited, checker);
+    CheckNesting(encode_pdu, checker);
+
+    pdu.Clear();
+    random_inputs::SetRandomPDU(rng, 1 + i % 8, &pdu,
+                                /*length_overrides=*/true);
+    CheckNesting(encode_pdu, checker);
+    CheckNesting(encode_limited, checker);
+
+    x509_certificate::X509Certificate cert =
+        random_inputs::RandomCertificate(rng);
+    // The length of an INTEGER is encoded as at most 1, so the rest of a
+    // longer serial number parses as TLVs that the encoder didn't write.
+    cert.mutable_tbs_certificate()
+        ->mutable_value()
+        ->mutable_serial_number()
+        ->mutable_value()
+        ->set_val(random_inputs::RandomBytes(rng, 1));
+    auto encode_cert = [&cert](DERWriter& der) {
+      x509_certificate::X509CertificateToDER(cert, der);
+    };
+    CheckParse(encode_cert, checker);
+    CheckNesting(encode_cert, checker);
+    CheckVersion(cert, checker);
+
+    // Encoding into a buffer that is too small drops TLVs, which must not
+    // write out of bounds.
+    DERWriter der(buffer.data(), buffer.size());
+    TLVIndex index;
+    der.set_tlv_index(&index);
+    x509_certificate::X509CertificateToDER(cert, der);
+    index.Finish(der.size());
+    buffer.resize(der.size() / 2);
+  }
+
+  checker.Expect(checker.tally("against Parse") != 0,
+                 "no encoding checked against Parse");
+  return checker.Finish();
+}
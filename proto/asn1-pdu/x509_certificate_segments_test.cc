@@ -0,0 +1,138 @@
+// Copyright 2020 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+// Checks that the segments of |X509CertificateToSegments| join to the bytes of
+// |X509CertificateToDER|, for certificates with values shorter and longer
+// than |DERWriter::kMinReferenceLen|, and repetitions longer than a tile, and
+// that a writer that references values bypasses the |EncodingCache|, even one
+// that holds a wrong encoding for a name.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include <random>
+#include <vector>
+
+#include "asn1_pdu.pb.h"
+#include "common.h"
+#include "encoding_cache.h"
+#include "random_inputs.h"
+#include "test_checker.h"
+#include "x509_certificate.pb.h"
+#include "x509_certificate_to_der.h"
+
+namespace {
+
+using random_inputs::RandomBytes;
+using x509_certificate::X509Certificate;
+
+constexpr size_t kNumCertificates = 256;
+
+// Returns a length just below, at, or just above |kMinReferenceLen|, or a
+// small or large one.
+size_t RandomLen(std::mt19937& rng) {
+  static const size_t kLens[] = {0,
+                                 1,
+                                 DERWriter::kMinReferenceLen - 1,
+                                 DERWriter::kMinReferenceLen,
+                                 DERWriter::kMinReferenceLen + 1,
+                                 1000};
+  return kLens[rng() % (sizeof(kLens) / sizeof(kLens[0]))];
+}
+
+// Gives the fields of |cert| that are referenced, if long enough, lengths
+// around |kMinReferenceLen|, and the issuer a long repetition.
+void SetLengths(std::mt19937& rng, X509Certificate* cert) {
+  x509_certificate::TBSCertificateSequence* tbs =
+      cert->mutable_tbs_certificate()->mutable_value();
+  tbs->mutable_serial_number()->mutable_value()->set_val(
+      RandomBytes(rng, RandomLen(rng)));
+  tbs->mutable_subject_public_key_info()
+      ->mutable_value()
+      ->mutable_subject_public_key()
+      ->mutable_value()
+      ->set_val(RandomBytes(rng, RandomLen(rng)));
+  x509_certificate::ExtensionSequence* extensions =
+      tbs->mutable_extensions()->mutable_value();
+  extensions->mutable_extension()
+      ->mutable_raw_extension()
+      ->mutable_extn_value()
+      ->set_val(RandomBytes(rng, RandomLen(rng)));
+  for (x509_certificate::Extension& extension :
+       *extensions->mutable_extensions()) {
+    extension.mutable_raw_extension()->mutable_extn_value()->set_val(
+        RandomBytes(rng, RandomLen(rng)));
+  }
+  asn1_pdu::ValueElement* element =
+      tbs->mutable_issuer()->mutable_value()->mutable_val()->add_val_array();
+  element->set_val_bits(RandomBytes(rng, RandomLen(rng)));
+  if (rng() % 2 == 0) {
+    asn1_pdu::RepeatedBytes* repeated = element->mutable_repeated_bits();
+    repeated->set_pattern(RandomBytes(rng, 1 + rng() % 5));
+    repeated->set_count(kRepeatTileSize + rng() % (4 * kRepeatTileSize));
+  }
+  cert->mutable_signature_value()->mutable_value()->set_val(
+      RandomBytes(rng, RandomLen(rng)));
+}
+
+// Compares the segments of |cert| with its DER, and tallies whether they
+// referenced anything.
+void CheckSegments(const X509Certificate& cert,
+                   test_checker::Checker& checker) {
+  std::vector<uint8_t> expected = x509_certificate::X509CertificateToDER(cert);
+  std::vector<struct iovec> segments;
+  x509_certificate::X509CertificateToSegments(cert, segments);
+  checker.Expect(random_inputs::Concatenate(segments) == expected,
+                 "mismatch: %zu bytes, %zu segments", expected.size(),
+                 segments.size());
+  checker.Tally("with references", segments.size() > 1);
+}
+
+}  // namespace
+
+int main() {
+  std::mt19937 rng;
+  test_checker::Checker checker("certificates");
+  EncodingCache cache;
+  for (size_t i = 0; i < kNumCertificates; ++i) {
+    X509Certificate cert = random_inputs::RandomCertificate(rng);
+    SetLengths(rng, &cert);
+    CheckSegments(cert, checker);
+
+    // Fills the cache with the encodings of |cert|, and replaces that of the
+    // issuer with a wrong one, which the segments must not use.
+    x509_certificate::SetEncodingCache(&cache);
+    x509_certificate::X509CertificateToDER(cert);
+    const asn1_pdu::PDU& issuer =
+        cert.tbs_certificate().value().issuer().value();
+    const uint8_t wrong[] = {0x05, 0x00};
+    cache.Insert(EncodingCache::KeyOf(issuer), wrong, sizeof(wrong));
+    uint64_t lookups = cache.stats().lookups;
+    std::vector<struct iovec> segments;
+    x509_certificate::X509CertificateToSegments(cert, segments);
+    checker.Expect(cache.stats().lookups == lookups, "cache used");
+    x509_certificate::SetEncodingCache(nullptr);
+    CheckSegments(cert, checker);
+    checker.Expect(random_inputs::Concatenate(segments) ==
+                       x509_certificate::X509CertificateToDER(cert),
+                   "wrong encoding from the cache");
+  }
+
+  checker.Expect(checker.tally("with references") != 0,
+                 "no certificate with references");
+  return checker.Finish();
+}
@@ -18,29 +18,85 @@
 
 #include "asn1_pdu_to_der.h"
 #include "common.h"
+#include "encoder_stats.h"
+#include "encoding_cache.h"
 
 namespace x509_certificate {
 
+namespace {
+
+// The cache of the calling thread (see |SetEncodingCache|).
+thread_local EncodingCache* encoding_cache = nullptr;
+
+// Returns true if |pdu| holds nested PDUs. Others are encoded with one copy of
+// their value, which is cheaper than hashing it.
+bool HasNestedPDUs(const asn1_pdu::PDU& pdu) {
+  for (const asn1_pdu::ValueElement& element : pdu.val().val_array()) {
+    if (element.has_pdu()) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Whether copying encodings from the cache leaves the same encoding under the
+// budget of |der| as encoding the PDUs. Copies aren't counted as they are
+// written, so only a budget that caps the size, and discards an encoding over
+// it, which |FinishBudget| finds all the same, allows them.
+bool CacheKeepsBudget(const DERWriter& der) {
+  const EncodingBudget& budget = der.budget();
+  return !der.has_budget() || (budget.max_nodes == SIZE_MAX &&
+                               budget.policy == EncodingBudget::kEmpty);
+}
+
+}  // namespace
+
+EncodingCache* SetEncodingCache(EncodingCache* cache) {
+  EncodingCache* previous = encoding_cache;
+  encoding_cache = cache;
+  return previous;
+}
+
 DECLARE_ENCODE_FUNCTION(asn1_pdu::PDU) {
-  // Used to encode PDU for fields that contain them.
-  asn1_pdu::ASN1PDUToDER pdu_to_der;
-  std::vector<uint8_t> der_pdu = pdu_to_der.PDUToDER(val);
-  der.insert(der.end(), der_pdu.begin(), der_pdu.end());
+  EncodingCache* cache = encoding_cache;
+  // Cached encodings don't record their TLVs in a |TLVIndex|, or count them
+  // against an |EncodingBudget| as they are written, and are copied, not
+  // referenced.
+  if (cache == nullptr || der.tlv_index() || !CacheKeepsBudget(der) ||
+      der.reference_values() || !HasNestedPDUs(val)) {
+    // Encodes PDUs for fields that contain them with the encoder of the
+    // calling thread, which keeps the X.509 encoders thread-safe.
+    asn1_pdu::EncodePDU(val, der);
+    return;
+  }
+
+  EncodingCache::Key key = EncodingCache::KeyOf(val);
+  if (cache->Lookup(key, der)) {
+    return;
+  }
+  size_t pos = der.size();
+  asn1_pdu::EncodePDU(val, der);
+  // A truncated writer didn't keep all of the encoding, and one over its
+  // budget left values out.
+  if (!der.truncated() && !der.over_budget()) {
+    cache->Insert(key, der.data(), der.size() - pos);
+  }
 }
 
 DECLARE_ENCODE_FUNCTION(AlgorithmIdentifierSequence) {
+  ASN1_PDU_STATS_TIME_PHASE(ASN1_PDU_PHASE_ALGORITHM_IDENTIFIER);
   // Save the current size in |tag_len_pos| to place sequence tag and length
   // after the value is encoded.
   size_t tag_len_pos = der.size();
 
-  Encode(val.object_identifier(), der);
   Encode(val.parameters(), der);
+  Encode(val.object_identifier(), der);
 
   // The fields of |algorithm_identifier| are wrapped around a sequence (RFC
   // 5280, 4.1.1.2).
   // The current size of |der| subtracted by |tag_len_pos|
   // equates to the size of the value of |algorithm_identifier|.
-  EncodeTagAndLength(kAsn1Sequence, der.size() - tag_len_pos, tag_len_pos, der);
+  der.PrependTagAndLength(kAsn1Sequence, der.size() - tag_len_pos);
 }
 
 DECLARE_ENCODE_FUNCTION(ExtendedKeyUsage) {
@@ -50,16 +106,17 @@ DECLARE_ENCODE_FUNCTION(ExtendedKeyUsage) {
   // tag and length after the values are encoded.
   size_t tag_len_pos = der.size();
 
+  const auto& key_purpose_ids = val.key_purpose_ids();
+  for (auto it = key_purpose_ids.rbegin(); it != key_purpose_ids.rend(); ++it) {
+    Encode(*it, der);
+  }
   // First |key_purpose_id| is set by protobuf and always encoded to comply
   // with spec.
   Encode(val.key_purpose_id(), der);
-  for (const auto& key_purpose_id : val.key_purpose_ids()) {
-    Encode(key_purpose_id, der);
-  }
 
   // The current size of |der| subtracted by |tag_len_pos|
   // equates to the size of the sequence |ExtendedKeyUsage|.
-  EncodeTagAndLength(kAsn1Sequence, der.size() - tag_len_pos, tag_len_pos, der);
+  der.PrependTagAndLength(kAsn1Sequence, der.size() - tag_len_pos);
 }
 
 DECLARE_ENCODE_FUNCTION(BasicConstraints) {
@@ -69,21 +126,21 @@ DECLARE_ENCODE_FUNCTION(BasicConstraints) {
   // after the values are encoded.
   size_t tag_len_pos = der.size();
 
-  // RFC 5280, 4.2.1.9: |ca| is BOOLEAN DEFAULT FALSE.
-  // (X.690 (2015), 11.5): DEFAULT value in a sequence field is not encoded.
-  if (val.ca().val()) {
-    Encode(val.ca(), der);
-  }
-
   // RFC 5280, 4.2.1.9: |path_len_constrant| is OPTIONAL. Encode only if
   // present.
   if (val.has_path_len_constraint()) {
     Encode(val.path_len_constraint(), der);
   }
 
+  // RFC 5280, 4.2.1.9: |ca| is BOOLEAN DEFAULT FALSE.
+  // (X.690 (2015), 11.5): DEFAULT value in a sequence field is not encoded.
+  if (val.ca().val()) {
+    Encode(val.ca(), der);
+  }
+
   // The current size of |der| subtracted by |tag_len_pos|
   // equates to the size of the sequence |BasicConstraints|.
-  EncodeTagAndLength(kAsn1Sequence, der.size() - tag_len_pos, tag_len_pos, der);
+  der.PrependTagAndLength(kAsn1Sequence, der.size() - tag_len_pos);
 }
 
 DECLARE_ENCODE_FUNCTION(KeyUsage) {
@@ -112,9 +169,8 @@ DECLARE_ENCODE_FUNCTION(KeyUsage) {
   // Save the current size in |tag_len_pos| to place BitString tag and length
   // after |key_usage| is encoded.
   size_t tag_len_pos = der.size();
-  InsertVariableIntBase256(key_usage, der.size(), der);
-  EncodeTagAndLength(kAsn1BitString, der.size() - tag_len_pos, tag_len_pos,
-                     der);
+  der.PrependVariableIntBase256(key_usage);
+  der.PrependTagAndLength(kAsn1BitString, der.size() - tag_len_pos);
 }
 
 DECLARE_ENCODE_FUNCTION(SubjectKeyIdentifier) {
@@ -129,31 +185,31 @@ DECLARE_ENCODE_FUNCTION(AuthorityKeyIdentifier) {
   // after the value is encoded.
   size_t tag_len_pos = der.size();
 
-  if (val.has_key_identifier()) {
+  if (val.has_authority_cert_serial_number()) {
     size_t pos_of_tag = der.size();
-    Encode(val.key_identifier(), der);
-    // |key_identifier| is Context-specific with tag number 0 (RFC
+    Encode(val.authority_cert_serial_number(), der);
+    // |authority_cert_serial_number| is Context-specific with tag number 2 (RFC
     // 5280, 4.2.1.1).
-    ReplaceTag(kAsn1ContextSpecific | 0x00, pos_of_tag, der);
+    der.ReplaceTag(kAsn1ContextSpecific | 0x02, pos_of_tag);
   }
   if (val.has_authority_cert_issuer()) {
     size_t pos_of_tag = der.size();
     Encode(val.authority_cert_issuer(), der);
     // |authority_cert_issuer| is Context-specific with tag number 1 (RFC
     // 5280, 4.2.1.1).
-    ReplaceTag(kAsn1ContextSpecific | 0x01, pos_of_tag, der);
+    der.ReplaceTag(kAsn1ContextSpecific | 0x01, pos_of_tag);
   }
-  if (val.has_authority_cert_serial_number()) {
+  if (val.has_key_identifier()) {
     size_t pos_of_tag = der.size();
-    Encode(val.authority_cert_serial_number(), der);
-    // |authority_cert_serial_number| is Context-specific with tag number 2 (RFC
+    Encode(val.key_identifier(), der);
+    // |key_identifier| is Context-specific with tag number 0 (RFC
     // 5280, 4.2.1.1).
-    ReplaceTag(kAsn1ContextSpecific | 0x02, pos_of_tag, der);
+    der.ReplaceTag(kAsn1ContextSpecific | 0x00, pos_of_tag);
   }
 
   // The current size of |der| subtracted by |tag_len_pos|
   // equates to the size of the |AuthorityKeyIdentifier|.
-  EncodeTagAndLength(kAsn1Sequence, der.size() - tag_len_pos, tag_len_pos, der);
+  der.PrependTagAndLength(kAsn1Sequence, der.size() - tag_len_pos);
 }
 
 DECLARE_ENCODE_FUNCTION(RawExtension) {
@@ -162,14 +218,13 @@ DECLARE_ENCODE_FUNCTION(RawExtension) {
     // length after the value is encoded.
     size_t tag_len_pos = der.size();
     Encode(val.pdu(), der);
-    EncodeTagAndLength(kAsn1OctetString, der.size() - tag_len_pos, tag_len_pos,
-                       der);
+    der.PrependTagAndLength(kAsn1OctetString, der.size() - tag_len_pos);
   } else {
     Encode(val.extn_value(), der);
   }
 }
 
-void EncodeExtensionValue(const Extension& val, std::vector<uint8_t>& der) {
+void EncodeExtensionValue(const Extension& val, DERWriter& der) {
   switch (val.types_case()) {
     case Extension::TypesCase::kAuthorityKeyIdentifier:
       Encode(val.authority_key_identifier(), der);
@@ -192,40 +247,42 @@ void EncodeExtensionValue(const Extension& val, std::vector<uint8_t>& der) {
   }
 }
 
-void EncodeExtensionID(const Extension& val, std::vector<uint8_t>& der) {
+void EncodeExtensionID(const Extension& val, DERWriter& der) {
   if (val.has_extn_id()) {
     Encode(val.extn_id(), der);
     return;
   }
 
-  std::vector<uint8_t> encoded_oid;
+  // The OIDs of the supported extensions are {2 5 29 |last_arc|}.
+  uint8_t last_arc = 0;
   switch (val.types_case()) {
     case Extension::TypesCase::kAuthorityKeyIdentifier:
       // RFC 5280, 4.2.1.1: |AuthorityKeyIdentifier| OID is {2 5 29 35}.
-      encoded_oid = {(2 * 40) + 5, 29, 35};
+      last_arc = 35;
       break;
     case Extension::TypesCase::kSubjectKeyIdentifier:
       // RFC 5280, 4.2.1.2: |SubjectKeyIdentifier| OID is {2 5 29 14}.
-      encoded_oid = {(2 * 40) + 5, 29, 14};
+      last_arc = 14;
       break;
     case Extension::TypesCase::kKeyUsage:
       // RFC 5280, 4.2.1.3: |KeyUsage| OID is {2 5 29 15}.
-      encoded_oid = {(2 * 40) + 5, 29, 15};
+      last_arc = 15;
       break;
     case Extension::TypesCase::kBasicConstraints:
       // RFC 5280, 4.2.1.9: |BasicConstraints| OID is {2 5 29 14}.
-      encoded_oid = {(2 * 40) + 5, 29, 19};
+      last_arc = 19;
       break;
     case Extension::TypesCase::kExtendedKeyUsage:
       // RFC 5280, 4.2.1.12: |ExtendedKeyUsage| OID is {2 5 29 37}.
-      encoded_oid = {(2 * 40) + 5, 29, 37};
+      last_arc = 37;
       break;
     case Extension::TypesCase::TYPES_NOT_SET:
       Encode(val.raw_extension().extn_id(), der);
       return;
   }
 
-  der.insert(der.end(), encoded_oid.begin(), encoded_oid.end());
+  const uint8_t encoded_oid[] = {(2 * 40) + 5, 29, last_arc};
+  der.Prepend(encoded_oid, sizeof(encoded_oid));
 }
 
 DECLARE_ENCODE_FUNCTION(Extension) {
@@ -233,7 +290,7 @@ DECLARE_ENCODE_FUNCTION(Extension) {
   // after the value is encoded.
   size_t tag_len_pos = der.size();
 
-  EncodeExtensionID(val, der);
+  EncodeExtensionValue(val, der);
 
   // RFC 5280, 4.1: |critical| is DEFAULT false. Furthermore,
   // (X.690 (2015), 11.5): DEFAULT value in a sequence field is not encoded.
@@ -241,45 +298,48 @@ DECLARE_ENCODE_FUNCTION(Extension) {
     Encode(val.critical(), der);
   }
 
-  EncodeExtensionValue(val, der);
+  EncodeExtensionID(val, der);
 
   // The fields of an |Extension| are wrapped around a sequence (RFC 5280, 4.1).
   // The current size of |der| subtracted by |tag_len_pos|
   // equates to the size of the |Extension|.
-  EncodeTagAndLength(kAsn1Sequence, der.size() - tag_len_pos, tag_len_pos, der);
+  der.PrependTagAndLength(kAsn1Sequence, der.size() - tag_len_pos);
 }
 
 DECLARE_ENCODE_FUNCTION(ExtensionSequence) {
+  ASN1_PDU_STATS_TIME_PHASE(ASN1_PDU_PHASE_EXTENSIONS);
   // RFC 5280, 4.2.1.9: |ExtensionSequence| is a sequence of (1..MAX) Extension.
   // Save the current size in |tag_len_pos| to place sequence tag and length
   // after the value is encoded.
   size_t tag_len_pos = der.size();
 
+  const auto& extensions = val.extensions();
+  for (auto it = extensions.rbegin(); it != extensions.rend(); ++it) {
+    Encode(*it, der);
+  }
   // First |extension| is set by protobuf and always encoded to comply
   // with spec.
   Encode(val.extension(), der);
-  for (const auto& extension : val.extensions()) {
-    Encode(extension, der);
-  }
 
   // The current size of |der| subtracted by |tag_len_pos|
   // equates to the size of the |ExtensionSequence|.
-  EncodeTagAndLength(kAsn1Sequence, der.size() - tag_len_pos, tag_len_pos, der);
+  der.PrependTagAndLength(kAsn1Sequence, der.size() - tag_len_pos);
 }
 
 DECLARE_ENCODE_FUNCTION(SubjectPublicKeyInfoSequence) {
+  ASN1_PDU_STATS_TIME_PHASE(ASN1_PDU_PHASE_SUBJECT_PUBLIC_KEY_INFO);
   // Save the current size in |tag_len_pos| to place sequence tag and length
   // after the value is encoded.
   size_t tag_len_pos = der.size();
 
-  Encode(val.algorithm_identifier(), der);
   Encode(val.subject_public_key(), der);
+  Encode(val.algorithm_identifier(), der);
 
   // The fields of |subject_public_key_info| are wrapped around a sequence (RFC
   // 5280, 4.1 & 4.1.2.5).
   // The current size of |der| subtracted by |tag_len_pos|
   // equates to the size of the value of |subject_public_key_info|.
-  EncodeTagAndLength(kAsn1Sequence, der.size() - tag_len_pos, tag_len_pos, der);
+  der.PrependTagAndLength(kAsn1Sequence, der.size() - tag_len_pos);
 }
 
 DECLARE_ENCODE_FUNCTION(TimeChoice) {
@@ -292,18 +352,19 @@ DECLARE_ENCODE_FUNCTION(TimeChoice) {
 }
 
 DECLARE_ENCODE_FUNCTION(ValiditySequence) {
+  ASN1_PDU_STATS_TIME_PHASE(ASN1_PDU_PHASE_VALIDITY);
   // Save the current size in |tag_len_pos| to place sequence tag and length
   // after the value is encoded.
   size_t tag_len_pos = der.size();
 
-  Encode(val.not_before().value(), der);
   Encode(val.not_after().value(), der);
+  Encode(val.not_before().value(), der);
 
   // The fields of |Validity| are wrapped around a sequence (RFC
   // 5280, 4.1 & 4.1.2.5).
   // The current size of |der| subtracted by |tag_len_pos|
   // equates to the size of the value of |validity|.
-  EncodeTagAndLength(kAsn1Sequence, der.size() - tag_len_pos, tag_len_pos, der);
+  der.PrependTagAndLength(kAsn1Sequence, der.size() - tag_len_pos);
 }
 
 DECLARE_ENCODE_FUNCTION(VersionNumber) {
@@ -315,78 +376,127 @@ DECLARE_ENCODE_FUNCTION(VersionNumber) {
   if (val != 0) {
     // Use a fixed buffer for the EXPLICIT encoding, since the version is always
     // a one byte INTEGER.
-    std::vector<uint8_t> der_version = {
+    const uint8_t der_version[] = {
         kAsn1ContextSpecific | kAsn1Constructed | 0x00, 0x03, kAsn1Integer,
         0x01, static_cast<uint8_t>(val)};
-    der.insert(der.end(), der_version.begin(), der_version.end());
+    der.Prepend(der_version, sizeof(der_version));
+    if (TLVIndex* index = der.tlv_index()) {
+      // The INTEGER was written before the [0] around it.
+      index->Add(der.size() - 2, 2, 1, kAsn1Integer, kAsn1Integer);
+      index->Add(der.size(), 2, 3, der_version[0], 0x00);
+    }
   }
 }
 
 DECLARE_ENCODE_FUNCTION(TBSCertificateSequence) {
+  ASN1_PDU_STATS_TIME_PHASE(ASN1_PDU_PHASE_TBS_CERTIFICATE);
   // Save the current size in |tag_len_pos| to place sequence tag and length
   // after the value is encoded.
   size_t tag_len_pos = der.size();
 
-  Encode(val.version(), der);
-  Encode(val.serial_number(), der);
-  Encode(val.signature_algorithm(), der);
-  Encode(val.issuer(), der);
-  Encode(val.validity(), der);
-  Encode(val.subject(), der);
-  Encode(val.subject_public_key_info(), der);
-
   // RFC 5280, 4.1: |issuer_unique_id| and |subject_unique_id|
   // are only set for v2 and v3 and |extensions| only set for v3.
   // However, set |issuer_unique_id|, |subject_unique_id|, and |extensions|
   // independently of the version number for interesting inputs.
-  if (val.has_issuer_unique_id()) {
+  if (val.has_extensions()) {
     size_t pos_of_tag = der.size();
-    Encode(val.issuer_unique_id(), der);
-    // |issuer_unqiue_id| is Context-specific with tag number 1 (RFC 5280, 4.1
+    Encode(val.extensions(), der);
+    // |extensions| is Context-specific with tag number 3 (RFC 5280, 4.1
     // & 4.1.2.8).
-    ReplaceTag(kAsn1ContextSpecific | 0x01, pos_of_tag, der);
+    der.ReplaceTag(kAsn1ContextSpecific | 0x03, pos_of_tag);
   }
   if (val.has_subject_unique_id()) {
     size_t pos_of_tag = der.size();
     Encode(val.subject_unique_id(), der);
     // |subject_unqiue_id| is Context-specific with tag number 2 (RFC
     // 5280, 4.1 & 4.1.2.8).
-    ReplaceTag(kAsn1ContextSpecific | 0x02, pos_of_tag, der);
+    der.ReplaceTag(kAsn1ContextSpecific | 0x02, pos_of_tag);
   }
-  if (val.has_extensions()) {
+  if (val.has_issuer_unique_id()) {
     size_t pos_of_tag = der.size();
-    Encode(val.extensions(), der);
-    // |extensions| is Context-specific with tag number 3 (RFC 5280, 4.1
+    Encode(val.issuer_unique_id(), der);
+    // |issuer_unqiue_id| is Context-specific with tag number 1 (RFC 5280, 4.1
     // & 4.1.2.8).
-    ReplaceTag(kAsn1ContextSpecific | 0x03, pos_of_tag, der);
+    der.ReplaceTag(kAsn1ContextSpecific | 0x01, pos_of_tag);
   }
 
+  Encode(val.subject_public_key_info(), der);
+  Encode(val.subject(), der);
+  Encode(val.validity(), der);
+  Encode(val.issuer(), der);
+  Encode(val.signature_algorithm(), der);
+  Encode(val.serial_number(), der);
+  Encode(val.version(), der);
+
   // The fields of |tbs_certificate| are wrapped around a sequence (RFC
   // 5280, 4.1 & 4.1.2.5).
   // The current size of |der| subtracted by |tag_len_pos|
   // equates to the size of the value of |tbs_certificate|.
-  EncodeTagAndLength(kAsn1Sequence, der.size() - tag_len_pos, tag_len_pos, der);
+  der.PrependTagAndLength(kAsn1Sequence, der.size() - tag_len_pos);
 }
 
-std::vector<uint8_t> X509CertificateToDER(
-    const X509Certificate& X509_certificate) {
-  // Contains DER encoded X509 Certificate.
-  std::vector<uint8_t> der;
-
+DECLARE_ENCODE_FUNCTION(X509Certificate) {
+  ASN1_PDU_STATS_TIME_PHASE(ASN1_PDU_PHASE_CERTIFICATE);
   // Save the current size in |tag_len_pos| to place sequence tag and length
   // after the value is encoded.
   size_t tag_len_pos = der.size();
 
-  Encode(X509_certificate.tbs_certificate(), der);
-  Encode(X509_certificate.signature_algorithm(), der);
-  Encode(X509_certificate.signature_value(), der);
+  Encode(val.signature_value(), der);
+  Encode(val.signature_algorithm(), der);
+  Encode(val.tbs_certificate(), der);
 
-  // The fields of |X509_certificate| are wrapped around a sequence (RFC
+  // The fields of the certificate are wrapped around a sequence (RFC
   // 5280, 4.1 & 4.1.2.5).
   // The current size of |der| subtracted by |tag_len_pos|
-  // equates to the size of the value of |X509_certificate|.
-  EncodeTagAndLength(kAsn1Sequence, der.size() - tag_len_pos, tag_len_pos, der);
-  return der;
+  // equates to the size of the value of the certificate.
+  der.PrependTagAndLength(kAsn1Sequence, der.size() - tag_len_pos);
+}
+
+void X509CertificateToDER(const X509Certificate& X509_certificate,
+                          DERWriter& der) {
+  der.Clear();
+  Encode(X509_certificate, der);
+  der.FinishBudget();
+}
+
+size_t X509CertificateToDER(const X509Certificate& X509_certificate,
+                            uint8_t* buffer,
+                            size_t capacity) {
+  return EncodeToBuffer(
+      [&X509_certificate](DERWriter& der) {
+        X509CertificateToDER(X509_certificate, der);
+      },
+      buffer, capacity);
+}
+
+std::vector<uint8_t> X509CertificateToDER(
+    const X509Certificate& X509_certificate) {
+  // Contains DER encoded X509 Certificate.
+  DERWriter der;
+  X509CertificateToDER(X509_certificate, der);
+  return std::vector<uint8_t>(der.data(), der.data() + der.size());
+}
+
+void X509CertificateToSegments(const X509Certificate& X509_certificate,
+                               std::vector<struct iovec>& segments) {
+  static thread_local DERWriter der;
+  der.set_reference_values(true);
+  X509CertificateToDER(X509_certificate, der);
+  segments.clear();
+  der.AppendSegmentsTo(segments);
+}
+
+void EncodeBatch(const X509Certificate* const* certificates,
+                 size_t num_certificates,
+                 DERBatch& batch) {
+  batch.Encode(num_certificates, [certificates](size_t i, DERWriter& der) {
+    // The certificates are encoded last to first, so start loading the one
+    // encoded next while this one is encoded.
+    if (i != 0) {
+      __builtin_prefetch(certificates[i - 1]);
+    }
+    Encode(*certificates[i], der);
+  });
 }
 
-}  // namespace x509_certificate
\ No newline at end of file
+}  // namespace x509_certificate
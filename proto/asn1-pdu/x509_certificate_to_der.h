@@ -22,18 +22,78 @@
 #include <vector>
 
 #include "asn1_universal_types_to_der.h"
+#include "common.h"
+#include "encoding_cache.h"
 #include "x509_certificate.pb.h"
 
 namespace x509_certificate {
 
+// The encoders of X.509 certificates are thread-safe: any number of threads can
+// call them concurrently, as long as each call writes to its own |der| or
+// |buffer|. PDUs are encoded with |asn1_pdu::EncodePDU|, which keeps its
+// scratch memory per thread.
+
 // Encodes |X509_certificate| to DER, returning the encoded bytes in |der_|.
 std::vector<uint8_t> X509CertificateToDER(
     const X509Certificate& X509_certificate);
 
+// Encodes |X509_certificate| to DER into |der|, replacing its contents.
+// |der| keeps its memory between calls, so a fuzz target that keeps one
+// |DERWriter| for the whole process stops allocating to encode once |der| has
+// grown to fit its inputs. If |der| has an |EncodingBudget|, encoding stops
+// once it is exceeded, which |der.budget_exceeded()| reports, and the encoding
+// is left as its policy says.
+void X509CertificateToDER(const X509Certificate& X509_certificate,
+                          DERWriter& der);
+
+// Encodes |X509_certificate| to DER into the start of |buffer|, which can hold
+// |capacity| bytes, and returns the encoded size. If the returned size is
+// larger than |capacity|, the encoding didn't fit, and the contents of |buffer|
+// are unspecified (see |EncodeToBuffer|).
+size_t X509CertificateToDER(const X509Certificate& X509_certificate,
+                            uint8_t* buffer,
+                            size_t capacity);
+
+// Encodes the |num_certificates| certificates at |certificates| to DER into
+// |batch|, replacing its contents, so that the |i|th encoding of |batch| is
+// that of |certificates[i]|. Encoding many certificates at once avoids the
+// setup and the output vector of a call per certificate.
+void EncodeBatch(const X509Certificate* const* certificates,
+                 size_t num_certificates,
+                 DERBatch& batch);
+
+// Encodes |X509_certificate| to DER into memory of the calling thread that
+// references the bytes fields of |X509_certificate|, such as the values of
+// integers, strings and extensions, instead of copying them, and replaces
+// |segments| with the encoding (see |DERWriter::set_reference_values|). The
+// segments are valid until the next call on the same thread, as long as
+// |X509_certificate| doesn't change.
+void X509CertificateToSegments(const X509Certificate& X509_certificate,
+                               std::vector<struct iovec>& segments);
+
+// Makes the encoders on the calling thread copy the encodings of the PDUs they
+// encode from |cache|, if it holds them, and store them there otherwise.
+// Returns the cache the thread used before, or nullptr if it didn't use one,
+// which is the default; passing nullptr stops using the cache.
+// Only PDUs with nested PDUs are cached, such as names and PDUs that replace
+// a whole part of a certificate; the other fields are cheaper to encode again
+// than to hash. Hashing a PDU costs a walk of it, so the cache only pays off
+// for inputs that mostly repeat the PDUs of recent inputs, like those of a
+// mutator (see |EncodingCache|). The cache is not used to encode into a
+// |DERWriter| with a |TLVIndex|, which needs the TLVs of every PDU, with an
+// |EncodingBudget| that counts them or keeps truncated encodings, or that
+// references values. A budget that only caps the size with |kEmpty|, like
+// that of the fuzz harnesses, leaves the same encodings with the cache.
+EncodingCache* SetEncodingCache(EncodingCache* cache);
+
 // Encodes a |pdu| if |t| contains one; otherwise, encodes the value belonging
-// to |t|.
+// to |t|. Encodes nothing once the |EncodingBudget| of |der| is exceeded, so
+// the fields left are left out.
 template <typename T>
-void Encode(const T& t, std::vector<uint8_t>& der) {
+void Encode(const T& t, DERWriter& der) {
+  if (der.over_budget()) {
+    return;
+  }
   if (t.has_pdu()) {
     Encode(t.pdu(), der);
     return;
@@ -41,12 +101,14 @@ void Encode(const T& t, std::vector<uint8_t>& der) {
   Encode(t.value(), der);
 }
 
-// Encodes the |TYPE| found in X509 Certificates and writes the results to
-// |der|.
+// Encodes the |TYPE| found in X509 Certificates in front of the bytes already
+// written to |der|. Since |der| is written back to front, the fields of a
+// |TYPE| are encoded last to first.
 #define DECLARE_ENCODE_FUNCTION(TYPE) \
   template <>                         \
-  void Encode<TYPE>(const TYPE& val, std::vector<uint8_t>& der)
+  void Encode<TYPE>(const TYPE& val, DERWriter& der)
 
+DECLARE_ENCODE_FUNCTION(X509Certificate);
 DECLARE_ENCODE_FUNCTION(TBSCertificateSequence);
 DECLARE_ENCODE_FUNCTION(VersionNumber);
 DECLARE_ENCODE_FUNCTION(ValiditySequence);